@@ -4,6 +4,7 @@
 //
 
 // matrices
+// for instanced drawing these are worldToProjection and worldToCamera
 uniform mat4 modelToProjection;
 uniform mat4 modelToCamera;
 
@@ -13,6 +14,9 @@ attribute vec2 uv;
 attribute vec3 normal;
 attribute vec4 color;
 
+// per-instance matrix; the identity when not drawing instances
+attribute mat4 modelToWorld;
+
 // outputs
 varying vec3 normal_;
 varying vec2 uv_;
@@ -21,9 +25,10 @@ varying vec3 model_pos_;
 varying vec3 camera_pos_;
 
 void main() {
-  gl_Position = modelToProjection * pos;
-  vec3 tnormal = (modelToCamera * vec4(normal, 0.0)).xyz;
-  vec3 tpos = (modelToCamera * pos).xyz;
+  vec4 wpos = modelToWorld * pos;
+  gl_Position = modelToProjection * wpos;
+  vec3 tnormal = (modelToCamera * (modelToWorld * vec4(normal, 0.0))).xyz;
+  vec3 tpos = (modelToCamera * wpos).xyz;
   normal_ = tnormal;
   uv_ = uv;
   color_ = color;
@@ -6,7 +6,6 @@
 //
 // game-style memory allocator
 //
-// this is a placeholder for a game-style memory allocator
 // using malloc and free is frowned upon in grown-up circles.
 //
 // these functions are poor for the following reasons:
@@ -14,6 +13,9 @@
 // 1) free() has to compute the size of the block to free
 // 2) these functions use heavy weight locks to guard the heap.
 // 3) implementations are quite variable
+//
+// so small blocks come from per-thread size class pools and only
+// large blocks go to the system heap.
 
 // this is a dummy class used to customise the placement new and delete
 struct dynarray_dummy_t {};
@@ -49,10 +51,111 @@ void operator delete(void *ptr, void *place, dynarray_dummy_t x) {}
 
 
 namespace octet { namespace containers {
+  /// Snapshot of the allocator counters; see allocator::get_stats()
+  ///
+  /// Each thread adds its small block counts to these every allocator::publish_interval calls,
+  /// so they can be a little behind and the high water marks can miss short peaks.
+  struct allocator_stats {
+    enum { max_classes = 32 };
+
+    /// number of small block size classes
+    unsigned num_classes;
+
+    /// size in bytes of the blocks in each class
+    unsigned class_size[max_classes];
+
+    /// number of malloc() calls served by each class
+    uint64_t num_allocs[max_classes];
+
+    /// number of free() calls returned to each class
+    uint64_t num_frees[max_classes];
+
+    /// number of blocks currently in use in each class
+    int64_t live_blocks[max_classes];
+
+    /// largest number of blocks ever in use at once in each class
+    int64_t high_water_blocks[max_classes];
+
+    /// blocks too big for the pool go to the system heap
+    uint64_t num_large_allocs;
+    uint64_t num_large_frees;
+
+    /// bytes requested by callers and the largest this has been
+    int64_t num_bytes;
+    int64_t high_water_bytes;
+
+    /// bytes taken from the system to carve into small blocks
+    uint64_t pool_bytes;
+  };
+
+  /// Game-style allocator used by all the containers and resources.
+  ///
+  /// Small blocks (up to max_small_size bytes) come from size-class pools.
+  /// Each thread keeps a short free list per class, so most calls take no lock;
+  /// blocks move to and from the shared pool in batches. The counters are batched per thread too.
+  ///
+  /// Larger blocks go to the system heap, 16 byte aligned.
+  ///
+  /// Unlike ::free(), free() takes the size of the block, which is how we find the size class
+  /// without a block header. Pool memory is never returned to the system.
   class allocator {
+  public:
+    enum {
+      num_classes = 20,
+      max_small_size = 1024,
+      chunk_size = 65536,
+      batch_size = 32,
+      publish_interval = 256,
+    };
+
+  private:
+    // free blocks are linked through their first word
+    struct free_block {
+      free_block *next;
+    };
+
+    // per-thread cache of free blocks; plain data so that it works with __declspec(thread)
+    struct thread_cache_t {
+      free_block *head[num_classes];
+      unsigned count[num_classes];
+
+      // counts not yet added to the shared ones
+      unsigned num_allocs[num_classes];
+      unsigned num_frees[num_classes];
+      int64_t num_bytes;
+      unsigned num_calls;
+    };
+
     // singleton state, a bit like an old-world global variable
     struct state_t {
-      size_t num_bytes;
+      // guards head[] and pool_bytes
+      std::mutex lock;
+      free_block *head[num_classes];
+
+      std::atomic<uint64_t> num_allocs[num_classes];
+      std::atomic<uint64_t> num_frees[num_classes];
+      std::atomic<int64_t> live_blocks[num_classes];
+      std::atomic<int64_t> high_water_blocks[num_classes];
+      std::atomic<uint64_t> num_large_allocs;
+      std::atomic<uint64_t> num_large_frees;
+      std::atomic<int64_t> num_bytes;
+      std::atomic<int64_t> high_water_bytes;
+      std::atomic<uint64_t> pool_bytes;
+
+      state_t() {
+        for (unsigned i = 0; i != num_classes; ++i) {
+          head[i] = 0;
+          num_allocs[i] = 0;
+          num_frees[i] = 0;
+          live_blocks[i] = 0;
+          high_water_blocks[i] = 0;
+        }
+        num_large_allocs = 0;
+        num_large_frees = 0;
+        num_bytes = 0;
+        high_water_bytes = 0;
+        pool_bytes = 0;
+      }
     };
 
     static state_t &state() {
@@ -60,49 +163,264 @@ namespace octet { namespace containers {
       return instance;
     }
 
-  public:
-    // todo: implement this from scratch using a pool allocator
-    static void *malloc(size_t size) {
-      state().num_bytes += size;
+    static thread_cache_t &thread_cache() {
+      static OCTET_THREAD_LOCAL thread_cache_t instance;
+      return instance;
+    }
+
+    // 16 byte steps up to 128, then four classes per power of two.
+    static unsigned class_size(unsigned cls) {
+      static const unsigned short sizes[num_classes] = {
+        16, 32, 48, 64, 80, 96, 112, 128,
+        160, 192, 224, 256, 320, 384, 448, 512,
+        640, 768, 896, 1024
+      };
+      return sizes[cls];
+    }
+
+    static unsigned size_to_class(size_t size) {
+      if (size <= 128) {
+        return size == 0 ? 0 : (unsigned)((size + 15) >> 4) - 1;
+      }
+      unsigned s = (unsigned)size - 1;
+      unsigned p = 7;
+      while ((s >> (p + 1)) != 0) ++p;
+      return 8 + (p - 7) * 4 + ((s >> (p - 2)) & 3);
+    }
+
+    // raise a high water mark if value exceeds it.
+    static void update_max(std::atomic<int64_t> &high_water, int64_t value) {
+      int64_t old_value = high_water.load(std::memory_order_relaxed);
+      while (value > old_value && !high_water.compare_exchange_weak(old_value, value, std::memory_order_relaxed)) {
+      }
+    }
+
+    static void add_bytes(int64_t delta) {
+      state_t &s = state();
+      int64_t total = s.num_bytes.fetch_add(delta, std::memory_order_relaxed) + delta;
+      if (delta > 0) update_max(s.high_water_bytes, total);
+    }
+
+    // aligned memory from the operating system
+    static void *system_malloc(size_t size) {
       #if OCTET_MAC
         void *res = 0;
         posix_memalign(&res, 16, size);
       #elif OCTET_SSE
         void *res = ::_aligned_malloc(size, 16);
       #elif OCTET_VITA
-        void *res = ::memalign(size, 16);
+        void *res = ::memalign(16, size);
       #else
         void *res = ::malloc(size);
       #endif
-      //printf("malloc %p[%d] -> %d\n", res, size, state().num_bytes);
       return res;
     }
 
-    static void free(void *ptr, size_t size) {
-      state().num_bytes -= size;
-      //printf("free %p[%d] -> %d\n", ptr, size, state().num_bytes);
-      #if OCTET_MAC
-        return ::free(ptr);
-      #elif OCTET_SSE
-        return ::_aligned_free(ptr);
+    static void system_free(void *ptr) {
+      #if OCTET_SSE && !OCTET_MAC
+        ::_aligned_free(ptr);
       #else
-        return ::free(ptr);
+        ::free(ptr);
       #endif
     }
 
-    static void *realloc(void *ptr, size_t old_size, size_t size) {
-      state().num_bytes += size - old_size;
-      #if OCTET_MAC
-        void *res = ::realloc(ptr, size);
-      #elif OCTET_SSE
-        void *res = ::_aligned_realloc(ptr, size, 16);
+    static void *system_realloc(void *ptr, size_t size) {
+      #if OCTET_SSE && !OCTET_MAC
+        return ::_aligned_realloc(ptr, size, 16);
       #else
-        void *res = ::realloc(ptr, size);
+        return ::realloc(ptr, size);
       #endif
-      //printf("realloc %p[%d] -> %p[%d] %d\n", ptr, old_size, res, size, state().num_bytes);
+    }
+
+    // move a batch of blocks from the shared pool to this thread.
+    static void refill(thread_cache_t &tc, unsigned cls) {
+      state_t &s = state();
+      std::lock_guard<std::mutex> lock(s.lock);
+      if (!s.head[cls]) {
+        // carve a new chunk into blocks of this class
+        unsigned size = class_size(cls);
+        unsigned num_blocks = chunk_size / size;
+        uint8_t *chunk = (uint8_t*)system_malloc(chunk_size);
+        if (!chunk) return;
+        s.pool_bytes += chunk_size;
+        free_block *head = 0;
+        for (unsigned i = num_blocks; i != 0; --i) {
+          free_block *blk = (free_block*)(chunk + (i - 1) * size);
+          blk->next = head;
+          head = blk;
+        }
+        s.head[cls] = head;
+      }
+
+      for (unsigned i = 0; i != batch_size && s.head[cls]; ++i) {
+        free_block *blk = s.head[cls];
+        s.head[cls] = blk->next;
+        blk->next = tc.head[cls];
+        tc.head[cls] = blk;
+        tc.count[cls]++;
+      }
+    }
+
+    // move up to max_blocks blocks from this thread to the shared pool.
+    static void flush(thread_cache_t &tc, unsigned cls, unsigned max_blocks) {
+      state_t &s = state();
+      std::lock_guard<std::mutex> lock(s.lock);
+      for (unsigned i = 0; i != max_blocks && tc.head[cls]; ++i) {
+        free_block *blk = tc.head[cls];
+        tc.head[cls] = blk->next;
+        tc.count[cls]--;
+        blk->next = s.head[cls];
+        s.head[cls] = blk;
+      }
+    }
+
+    // add this thread's counts to the shared ones.
+    static void publish(thread_cache_t &tc) {
+      state_t &s = state();
+      for (unsigned cls = 0; cls != num_classes; ++cls) {
+        if ((tc.num_allocs[cls] | tc.num_frees[cls]) == 0) continue;
+        s.num_allocs[cls].fetch_add(tc.num_allocs[cls], std::memory_order_relaxed);
+        s.num_frees[cls].fetch_add(tc.num_frees[cls], std::memory_order_relaxed);
+        int64_t delta = (int64_t)tc.num_allocs[cls] - (int64_t)tc.num_frees[cls];
+        int64_t live = s.live_blocks[cls].fetch_add(delta, std::memory_order_relaxed) + delta;
+        update_max(s.high_water_blocks[cls], live);
+        tc.num_allocs[cls] = tc.num_frees[cls] = 0;
+      }
+      add_bytes(tc.num_bytes);
+      tc.num_bytes = 0;
+      tc.num_calls = 0;
+    }
+
+  public:
+    /// Allocate size bytes, 16 byte aligned.
+    static void *malloc(size_t size) {
+      if (size > max_small_size) {
+        add_bytes((int64_t)size);
+        state().num_large_allocs.fetch_add(1, std::memory_order_relaxed);
+        return system_malloc(size);
+      }
+
+      unsigned cls = size_to_class(size);
+      thread_cache_t &tc = thread_cache();
+      if (!tc.head[cls]) {
+        refill(tc, cls);
+        if (!tc.head[cls]) return 0;
+      }
+
+      free_block *blk = tc.head[cls];
+      tc.head[cls] = blk->next;
+      tc.count[cls]--;
+
+      tc.num_allocs[cls]++;
+      tc.num_bytes += size;
+      if (++tc.num_calls == publish_interval) {
+        publish(tc);
+      }
+
+      //printf("malloc %p[%d]\n", blk, size);
+      return blk;
+    }
+
+    /// Free a block; size must be the size passed to malloc() or realloc().
+    static void free(void *ptr, size_t size) {
+      if (!ptr) return;
+
+      //printf("free %p[%d]\n", ptr, size);
+      if (size > max_small_size) {
+        add_bytes(-(int64_t)size);
+        state().num_large_frees.fetch_add(1, std::memory_order_relaxed);
+        return system_free(ptr);
+      }
+
+      unsigned cls = size_to_class(size);
+      thread_cache_t &tc = thread_cache();
+      tc.num_frees[cls]++;
+      tc.num_bytes -= size;
+      if (++tc.num_calls == publish_interval) {
+        publish(tc);
+      }
+
+      free_block *blk = (free_block*)ptr;
+      blk->next = tc.head[cls];
+      tc.head[cls] = blk;
+      if (++tc.count[cls] > batch_size * 2) {
+        flush(tc, cls, batch_size);
+      }
+    }
+
+    /// Resize a block, keeping its contents.
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      if (!ptr) {
+        return malloc(size);
+      }
+
+      if (old_size > max_small_size && size > max_small_size) {
+        add_bytes((int64_t)size - (int64_t)old_size);
+        return system_realloc(ptr, size);
+      }
+
+      if (old_size <= max_small_size && size <= max_small_size && size_to_class(old_size) == size_to_class(size)) {
+        // the block is already big enough
+        add_bytes((int64_t)size - (int64_t)old_size);
+        return ptr;
+      }
+
+      void *res = malloc(size);
+      if (res) {
+        memcpy(res, ptr, old_size < size ? old_size : size);
+      }
+      free(ptr, old_size);
+      //printf("realloc %p[%d] -> %p[%d]\n", ptr, old_size, res, size);
       return res;
     }
 
+    /// Return this thread's cached blocks to the shared pool and add its counts to get_stats().
+    /// Worker threads should call this before they exit.
+    static void flush_thread_cache() {
+      thread_cache_t &tc = thread_cache();
+      publish(tc);
+      for (unsigned cls = 0; cls != num_classes; ++cls) {
+        flush(tc, cls, tc.count[cls]);
+      }
+    }
+
+    /// Get a snapshot of the allocator counters.
+    static void get_stats(allocator_stats &stats) {
+      state_t &s = state();
+      stats.num_classes = num_classes;
+      for (unsigned cls = 0; cls != num_classes; ++cls) {
+        stats.class_size[cls] = class_size(cls);
+        stats.num_allocs[cls] = s.num_allocs[cls];
+        stats.num_frees[cls] = s.num_frees[cls];
+        stats.live_blocks[cls] = s.live_blocks[cls];
+        stats.high_water_blocks[cls] = s.high_water_blocks[cls];
+      }
+      stats.num_large_allocs = s.num_large_allocs;
+      stats.num_large_frees = s.num_large_frees;
+      stats.num_bytes = s.num_bytes;
+      stats.high_water_bytes = s.high_water_bytes;
+      stats.pool_bytes = s.pool_bytes;
+    }
+
+    /// Print the allocator counters, eg. dump_stats(stdout) or dump_stats(log(""))
+    static void dump_stats(FILE *file) {
+      allocator_stats stats;
+      get_stats(stats);
+      fprintf(file, "allocator: %lld bytes in use, %lld high water, %llu pool bytes\n",
+        (long long)stats.num_bytes, (long long)stats.high_water_bytes, (unsigned long long)stats.pool_bytes
+      );
+      for (unsigned cls = 0; cls != stats.num_classes; ++cls) {
+        if (stats.num_allocs[cls] == 0) continue;
+        fprintf(file, "  %5d bytes: %10llu allocs %10llu frees %8lld live %8lld high water\n",
+          stats.class_size[cls], (unsigned long long)stats.num_allocs[cls], (unsigned long long)stats.num_frees[cls],
+          (long long)stats.live_blocks[cls], (long long)stats.high_water_blocks[cls]
+        );
+      }
+      fprintf(file, "  large: %llu allocs %llu frees\n",
+        (unsigned long long)stats.num_large_allocs, (unsigned long long)stats.num_large_frees
+      );
+    }
+
     // crude check of stack integrity
     static void test(const char *label) {
       printf("test %s\n", label);
@@ -111,4 +429,3 @@ namespace octet { namespace containers {
     }
   };
 } }
-
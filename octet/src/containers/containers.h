@@ -26,6 +26,8 @@
 #define OCTET_CONTAINERS_INCLUDED
 
 #include "../containers/allocator.h"
+#include "../containers/frame_allocator.h"
+#include "../containers/hash_table.h"
 #include "../containers/dictionary.h"
 #include "../containers/hash_map.h"
 #include "../containers/double_list.h"
@@ -7,6 +7,23 @@
 
 
 namespace octet { namespace containers {
+  /// Trait for types that can be moved in memory with memcpy.
+  ///
+  /// dynarray uses this to grow with realloc() and to insert and erase with memmove()
+  /// instead of constructing, copying and destroying every element.
+  ///
+  /// Most classes in octet qualify as they do not keep pointers to themselves.
+  /// Specialize this for your own classes to make arrays of them faster:
+  ///
+  ///     template <> struct is_relocatable<my_class> { enum { value = 1 }; };
+  template <class item_t> struct is_relocatable {
+    #if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 5
+      enum { value = __has_trivial_copy(item_t) && __has_trivial_destructor(item_t) };
+    #else
+      enum { value = std::is_trivially_copyable<item_t>::value };
+    #endif
+  };
+
   /// Dynamic array class similar to std::vector.
   ///
   /// Example
@@ -33,6 +50,87 @@ namespace octet { namespace containers {
     int_size_t capacity_;
     enum { min_capacity = 8 };
 
+    // without constructors, elements are just bytes.
+    enum { relocatable = !use_new_delete || is_relocatable<item_t>::value };
+
+    // elements that can be copied with memcpy.
+    #if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 5
+      enum { trivial = !use_new_delete || (__has_trivial_copy(item_t) && __has_trivial_destructor(item_t)) };
+    #else
+      enum { trivial = !use_new_delete || std::is_trivially_copyable<item_t>::value };
+    #endif
+
+    // capacity to grow to when we need room for min_size elements.
+    // doubling keeps push_back, append and resize at amortised constant time.
+    int_size_t grow_capacity(size_t min_size) const {
+      int_size_t new_capacity = capacity_ < min_capacity ? (int_size_t)min_capacity : capacity_ * 2;
+      return new_capacity < min_size ? (int_size_t)min_size : new_capacity;
+    }
+
+    // move num elements to uninitialised memory, leaving the source uninitialised.
+    static void relocate(item_t *dest, item_t *src, int_size_t num) {
+      if (relocatable) {
+        if (num) memcpy((void*)dest, (void*)src, num * sizeof(item_t));
+      } else {
+        dynarray_dummy_t x;
+        for (int_size_t i = 0; i != num; ++i) {
+          new (dest + i, x) item_t(std::move(src[i]));
+          src[i].~item_t();
+        }
+      }
+    }
+
+    // open an uninitialised gap of num elements at pos.
+    // the caller must have reserved the space.
+    void open_gap(int_size_t pos, int_size_t num) {
+      if (relocatable) {
+        memmove((void*)(data_ + pos + num), (void*)(data_ + pos), (size_ - pos) * sizeof(item_t));
+      } else {
+        dynarray_dummy_t x;
+        for (int_size_t i = size_; i != pos; --i) {
+          new (data_ + i - 1 + num, x) item_t(std::move(data_[i - 1]));
+          data_[i - 1].~item_t();
+        }
+      }
+      size_ += num;
+    }
+
+    // insert a new element at pos, constructed from the arguments.
+    template <class... args_t> void construct_at(int_size_t pos, args_t&&... args) {
+      dynarray_dummy_t x;
+      if (pos == size_ && size_ != capacity_) {
+        new (data_ + pos, x) item_t(std::forward<args_t>(args)...);
+        size_++;
+      } else {
+        // the arguments may refer to elements of this array, so build the item before we move them.
+        item_t tmp(std::forward<args_t>(args)...);
+        if (size_ == capacity_) {
+          reserve(grow_capacity(size_ + 1));
+        }
+        open_gap(pos, 1);
+        new (data_ + pos, x) item_t(std::move(tmp));
+      }
+    }
+
+    // remove num elements at pos, moving the rest down.
+    void close_gap(int_size_t pos, int_size_t num) {
+      if (use_new_delete) {
+        for (int_size_t i = pos; i != pos + num; ++i) {
+          data_[i].~item_t();
+        }
+      }
+      if (relocatable) {
+        memmove((void*)(data_ + pos), (void*)(data_ + pos + num), (size_ - pos - num) * sizeof(item_t));
+      } else {
+        dynarray_dummy_t x;
+        for (int_size_t i = pos + num; i != size_; ++i) {
+          new (data_ + i - num, x) item_t(std::move(data_[i]));
+          data_[i].~item_t();
+        }
+      }
+      size_ -= num;
+    }
+
   public:
     /// Create a new, empty, dynamic array
     dynarray() {
@@ -43,7 +141,7 @@ namespace octet { namespace containers {
 
     /// Create a new dynamic array of a certain size.
     dynarray(int_size_t size) {
-      data_ = (item_t*)allocator::malloc(size * sizeof(item_t));
+      data_ = (item_t*)allocator_t::malloc(size * sizeof(item_t));
       size_ = capacity_ = size;
       if (use_new_delete) {
         dynarray_dummy_t x;
@@ -57,18 +155,60 @@ namespace octet { namespace containers {
     ///
     /// Note: this is very slow and will happen frequently in naive code.
     dynarray(const dynarray &rhs) {
-      data_ = (item_t*)allocator::malloc(rhs.size_ * sizeof(item_t));
+      data_ = (item_t*)allocator_t::malloc(rhs.size_ * sizeof(item_t));
       size_ = capacity_ = rhs.size_;
-      if (use_new_delete) {
+      if (!trivial) {
         dynarray_dummy_t x;
         for (int_size_t i = 0; i != size_; ++i) {
           new (data_ + i, x)item_t(rhs.data_[i]);
         }
-      } else {
+      } else if (size_) {
         memcpy(data_, rhs.data_, rhs.size_ * sizeof(item_t));
       }
     }
 
+    /// Take the contents of a temporary array without copying.
+    dynarray(dynarray &&rhs) {
+      data_ = rhs.data_;
+      size_ = rhs.size_;
+      capacity_ = rhs.capacity_;
+      rhs.data_ = 0;
+      rhs.size_ = rhs.capacity_ = 0;
+    }
+
+    /// Replace the contents with a copy of another array.
+    dynarray &operator=(const dynarray &rhs) {
+      if (this != &rhs) {
+        resize(0);
+        if (rhs.size_ > capacity_) {
+          reserve(rhs.size_);
+        }
+        if (!trivial) {
+          dynarray_dummy_t x;
+          for (int_size_t i = 0; i != rhs.size_; ++i) {
+            new (data_ + i, x)item_t(rhs.data_[i]);
+          }
+        } else if (rhs.size_) {
+          memcpy(data_, rhs.data_, rhs.size_ * sizeof(item_t));
+        }
+        size_ = rhs.size_;
+      }
+      return *this;
+    }
+
+    /// Replace the contents with those of a temporary array without copying.
+    dynarray &operator=(dynarray &&rhs) {
+      if (this != &rhs) {
+        reset();
+        data_ = rhs.data_;
+        size_ = rhs.size_;
+        capacity_ = rhs.capacity_;
+        rhs.data_ = 0;
+        rhs.size_ = rhs.capacity_ = 0;
+      }
+      return *this;
+    }
+
     /// Destroy the array and its contents.
     ~dynarray() {
       reset();
@@ -108,37 +248,81 @@ namespace octet { namespace containers {
   
     /// iterator insert for STL compatibility
     iterator insert(iterator it, const item_t &new_item) {
-      int_size_t old_length = size_;
-      resize(size_+1);
-      for (int_size_t i = old_length; i != it.elem; --i) {
-        data_[i] = data_[i-1];
-      }
-      data_[it.elem] = new_item;
+      construct_at(it.elem, new_item);
+      return it;
+    }
+
+    /// iterator insert for STL compatibility
+    iterator insert(iterator it, item_t &&new_item) {
+      construct_at(it.elem, std::move(new_item));
       return it;
     }
 
     /// iterator erase for STL compatibility
     iterator erase(iterator it) {
-      for (int_size_t i = it.elem; i < size_-1; ++i) {
-        data_[i] = data_[i+1];
-      }
-      resize(size_-1);
+      close_gap(it.elem, 1);
       return it;
     }
   
     /// Erase an item; move subsequent items down to fill the gap.
     void erase(unsigned elem) {
-      for (int_size_t i = elem; i < size_-1; ++i) {
-        data_[i] = data_[i+1];
+      close_gap(elem, 1);
+    }
+
+    /// Erase an item by moving the last item into its place.
+    /// Faster than erase() if you do not care about the order.
+    void erase_unordered(unsigned elem) {
+      assert(elem < size_);
+      if (elem != size_ - 1) {
+        data_[elem] = std::move(data_[size_ - 1]);
       }
-      resize(size_-1);
+      pop_back();
     }
 
     /// Add an item at the back of the array.
     void push_back(const item_t &new_item) {
-      int_size_t old_length = size_;
-      resize(size_+1);
-      data_[old_length] = new_item;
+      construct_at(size_, new_item);
+    }
+
+    /// Add an item at the back of the array, moving it if we can.
+    void push_back(item_t &&new_item) {
+      construct_at(size_, std::move(new_item));
+    }
+
+    /// Construct an item at the back of the array from constructor arguments.
+    ///
+    ///     dynarray<vec4> positions;
+    ///     positions.emplace_back(x, y, z, 1.0f);
+    template <class... args_t> item_t &emplace_back(args_t&&... args) {
+      construct_at(size_, std::forward<args_t>(args)...);
+      return data_[size_-1];
+    }
+
+    /// Add a number of items at the back of the array.
+    /// The items must not be in this array.
+    void append(const item_t *items, int_size_t num_items) {
+      if (size_ + num_items > capacity_) {
+        reserve(grow_capacity(size_ + num_items));
+      }
+      if (!trivial) {
+        dynarray_dummy_t x;
+        for (int_size_t i = 0; i != num_items; ++i) {
+          new (data_ + size_ + i, x)item_t(items[i]);
+        }
+      } else if (num_items) {
+        memcpy(data_ + size_, items, num_items * sizeof(item_t));
+      }
+      size_ += num_items;
+    }
+
+    /// Add all the items of another array at the back of this one.
+    void append(const dynarray &rhs) {
+      if (&rhs == this) {
+        dynarray tmp(rhs);
+        append(tmp.data_, tmp.size_);
+      } else {
+        append(rhs.data_, rhs.size_);
+      }
     }
 
     /// Get the last element in the array.
@@ -171,75 +355,47 @@ namespace octet { namespace containers {
     item_t *data() { return data_; }
   
     /// Resize the array to make it bigger or smaller.
+    ///
+    /// Growing beyond the capacity at least doubles it, so calling this in a loop is ok.
     void resize(size_t new_length) {
-      bool trace = false; // hack this for detailed traces
       dynarray_dummy_t x;
-      if (new_length >= size_ && new_length <= capacity_) {
-        if (trace) printf("case 1: growing dynarray up to capacity_\n");
-        if (use_new_delete) {
-          int_size_t len = size_; // avoid aliases
-          while (len < new_length) {
-            new (data_ + len, x)item_t;
-            ++len;
-          }
-        }
-        size_ = (int_size_t)new_length;
-      } else if (new_length > capacity_) {
-        if (trace) printf("case 2: growing dynarray beyond capacity_\n");
-        int_size_t new_capacity = ((int_size_t)new_length < size_ ? size_ : (int_size_t)new_length);
-
-        if (new_length == size_ + 1) {
-          // growing array by 1: round up to power of two.
-          new_capacity = capacity_ == 0 ? min_capacity : capacity_ * 2;
-          while (new_capacity < new_length) new_capacity *= 2;
-        }
-
-        reserve(new_capacity);
+      if (new_length > capacity_) {
+        reserve(grow_capacity(new_length));
+      }
 
-        if (use_new_delete) {
+      if (use_new_delete) {
+        int_size_t len = size_; // avoid aliases
+        while (len < new_length) {
           // initialize the rest to default
-          for (int_size_t i = size_; i < new_length; ++i) {
-            new (data_ + i, x) item_t;
-          }
+          new (data_ + len, x)item_t;
+          ++len;
         }
-
-        size_ = (int_size_t)new_length;
-      } else {
-        if (trace) printf("case 3: shrinking dynarray\n");
-
-        if (use_new_delete) {
-          int_size_t len = size_; // avoid aliases
-          while (len > new_length) {
-            --len;
-            data_[len].~item_t();
-          }
+        while (len > new_length) {
+          --len;
+          data_[len].~item_t();
         }
-        size_ = (int_size_t)new_length;
-        //if (size_ == 0) reset();
       }
+      size_ = (int_size_t)new_length;
     }
 
     /// Reserve an amount of memory to use with this array.
     /// Use this before you start a loop with push_back calls, for example.
+    ///
+    /// Arrays of relocatable items are grown with allocator_t::realloc() which may not need to copy.
     void reserve(int_size_t new_capacity) {
-      if (new_capacity >= size_) {
-        dynarray_dummy_t x;
-        item_t *new_data = (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity);
-      
-        if (use_new_delete) {
-          // initialize new data_ elements from old ones
-          for (int_size_t i = 0; i != size_; ++i) {
-            new (new_data + i, x) item_t(data_[i]);
-            data_[i].~item_t();
-          }
-        }
+      if (new_capacity >= size_ && new_capacity != capacity_) {
+        if (relocatable) {
+          data_ = (item_t *)allocator_t::realloc(data_, capacity_ * sizeof(item_t), new_capacity * sizeof(item_t));
+        } else {
+          item_t *new_data = (item_t *)allocator_t::malloc(sizeof(item_t) * new_capacity);
+          relocate(new_data, data_, size_);
 
-        // free up data_
-        if (data_) {
-          allocator_t::free(data_, capacity_ * sizeof(item_t));
+          // free up data_
+          if (data_) {
+            allocator_t::free(data_, capacity_ * sizeof(item_t));
+          }
+          data_ = new_data;
         }
-
-        data_ = new_data;
         capacity_ = new_capacity;
       }
     }
@@ -248,6 +404,9 @@ namespace octet { namespace containers {
     void pop_back() {
       assert(size_ != 0);
       size_--;
+      if (use_new_delete) {
+        data_[size_].~item_t();
+      }
     }
 
     /// Reset the array to zero size, freeing up the data.
@@ -267,6 +426,10 @@ namespace octet { namespace containers {
     }
   };
 
+  /// dynarrays only point to their heap data so can be moved with memcpy.
+  template <class item_t, class allocator_t, bool use_new_delete>
+  struct is_relocatable<dynarray<item_t, allocator_t, use_new_delete> > { enum { value = 1 }; };
+
   inline void vformat(dynarray <char> &ary, const char *fmt, va_list v) {
     unsigned old_size = ary.size();
     #ifdef WIN32
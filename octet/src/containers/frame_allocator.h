@@ -0,0 +1,156 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// linear (arena) allocator for data that only lives for one frame.
+//
+
+namespace octet { namespace containers {
+  /// Linear allocator for temporary data that lives for one frame.
+  ///
+  /// Allocation just bumps a pointer, free() does nothing unless the block was the
+  /// last one allocated. All the memory is recycled by reset(), which
+  /// app_common::end_frame() calls.
+  ///
+  /// Use it as the allocator_t argument of the containers.
+  ///
+  /// Example:
+  ///
+  ///     dynarray<vec3p, frame_allocator> temp_positions;
+  ///     temp_positions.reserve(num_particles);
+  ///
+  /// Note: only use this from the thread that calls end_frame() and do not keep the
+  /// containers beyond the end of the frame.
+  class frame_allocator {
+    enum { default_block_size = 1 << 20, alignment = 16 };
+
+    // blocks are chained so that we can grow during a frame.
+    struct block_t {
+      block_t *next;
+      size_t size;
+    };
+
+    enum { header_size = (sizeof(block_t) + alignment - 1) & ~(alignment - 1) };
+
+    struct state_t {
+      block_t *blocks;
+      uint8_t *ptr;
+      uint8_t *end;
+      uint8_t *last;
+      size_t bytes_used;
+      size_t high_water;
+      size_t frame_bytes;
+
+      state_t() {
+        blocks = 0;
+        ptr = end = last = 0;
+        bytes_used = high_water = frame_bytes = 0;
+      }
+
+      void free_blocks() {
+        while (blocks) {
+          block_t *next = blocks->next;
+          allocator::free(blocks, blocks->size);
+          blocks = next;
+        }
+        ptr = end = last = 0;
+      }
+
+      void add_block(size_t min_size) {
+        size_t size = default_block_size;
+        while (size < min_size + header_size) size *= 2;
+        block_t *blk = (block_t*)allocator::malloc(size);
+        blk->next = blocks;
+        blk->size = size;
+        blocks = blk;
+        ptr = (uint8_t*)blk + header_size;
+        end = (uint8_t*)blk + size;
+      }
+    };
+
+    static state_t &state() {
+      static state_t instance;
+      return instance;
+    }
+
+    static size_t align(size_t size) {
+      return (size + alignment - 1) & ~(size_t)(alignment - 1);
+    }
+
+  public:
+    /// Allocate size bytes until the next reset().
+    static void *malloc(size_t size) {
+      state_t &s = state();
+      size = align(size);
+      if ((size_t)(s.end - s.ptr) < size) {
+        s.add_block(size);
+      }
+      s.last = s.ptr;
+      s.ptr += size;
+      s.bytes_used += size;
+      if (s.bytes_used > s.high_water) s.high_water = s.bytes_used;
+      return s.last;
+    }
+
+    /// Free only has an effect on the most recent block.
+    static void free(void *ptr, size_t size) {
+      state_t &s = state();
+      if (ptr && ptr == s.last) {
+        s.bytes_used -= s.ptr - s.last;
+        s.ptr = s.last;
+        s.last = 0;
+      }
+    }
+
+    /// Grow the most recent block in place if we can, otherwise copy.
+    static void *realloc(void *ptr, size_t old_size, size_t size) {
+      state_t &s = state();
+      if (ptr && ptr == s.last && (size_t)(s.end - s.last) >= align(size)) {
+        size_t old_bytes = s.ptr - s.last;
+        s.ptr = s.last + align(size);
+        s.bytes_used += (s.ptr - s.last) - old_bytes;
+        if (s.bytes_used > s.high_water) s.high_water = s.bytes_used;
+        return ptr;
+      }
+      void *res = malloc(size);
+      if (ptr) memcpy(res, ptr, old_size < size ? old_size : size);
+      return res;
+    }
+
+    /// Recycle all the memory allocated this frame.
+    /// If we needed more than one block, replace them with one big enough for the whole frame.
+    static void reset() {
+      state_t &s = state();
+      s.frame_bytes = s.bytes_used;
+      if (s.blocks && s.blocks->next) {
+        size_t total = 0;
+        for (block_t *blk = s.blocks; blk; blk = blk->next) {
+          total += blk->size;
+        }
+        s.free_blocks();
+        s.add_block(total);
+      } else if (s.blocks) {
+        s.ptr = (uint8_t*)s.blocks + header_size;
+      }
+      s.last = 0;
+      s.bytes_used = 0;
+    }
+
+    /// Bytes allocated since the last reset().
+    static size_t get_bytes_used() {
+      return state().bytes_used;
+    }
+
+    /// Bytes that were allocated in the previous frame.
+    static size_t get_frame_bytes() {
+      return state().frame_bytes;
+    }
+
+    /// The most bytes ever allocated in one frame.
+    static size_t get_high_water() {
+      return state().high_water;
+    }
+  };
+} }
@@ -0,0 +1,452 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// open addressing hash table used by hash_map and dictionary.
+//
+// Each slot has a control byte: empty, deleted or the top seven bits of the hash.
+// We compare sixteen control bytes at a time (with SSE2 if we have it) and only
+// look at the keys when the seven bits match.
+//
+
+namespace octet { namespace containers {
+  /// Hash functions for the hash tables.
+  class hash_function {
+    // read little-endian values from unaligned memory
+    static uint64_t r8(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+    static uint64_t r4(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+    static uint64_t r3(const uint8_t *p, size_t k) { return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1]; }
+
+  public:
+    /// 64x64 -> 128 bit multiply, returning the low part in a and the high part in b.
+    static void mum(uint64_t &a, uint64_t &b) {
+      #if defined(__SIZEOF_INT128__)
+        __uint128_t r = (__uint128_t)a * b;
+        a = (uint64_t)r;
+        b = (uint64_t)(r >> 64);
+      #elif defined(_MSC_VER) && defined(_M_X64)
+        a = _umul128(a, b, &b);
+      #else
+        uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        uint64_t t = rl + (rm0 << 32), c = t < rl;
+        uint64_t lo = t + (rm1 << 32);
+        c += lo < t;
+        a = lo;
+        b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+      #endif
+    }
+
+    /// fold a 128 bit product to 64 bits.
+    static uint64_t mix(uint64_t a, uint64_t b) {
+      mum(a, b);
+      return a ^ b;
+    }
+
+    /// Scramble the bits of a weak hash (eg. an integer key) so that every bit depends on every other.
+    static uint64_t scramble(uint64_t h) {
+      return mix(h ^ 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull);
+    }
+
+    /// Hash a block of bytes (wyhash).
+    static uint64_t bytes(const void *key, size_t len, uint64_t seed = 0) {
+      static const uint64_t s0 = 0xa0761d6478bd642full, s1 = 0xe7037ed1a0b428dbull;
+      static const uint64_t s2 = 0x8ebc6af09c88c6e3ull, s3 = 0x589965cc75374cc3ull;
+      const uint8_t *p = (const uint8_t*)key;
+      seed ^= mix(seed ^ s0, s1);
+      uint64_t a, b;
+      if (len <= 16) {
+        if (len >= 4) {
+          a = (r4(p) << 32) | r4(p + ((len >> 3) << 2));
+          b = (r4(p + len - 4) << 32) | r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+          a = r3(p, len);
+          b = 0;
+        } else {
+          a = b = 0;
+        }
+      } else {
+        size_t i = len;
+        if (i > 48) {
+          uint64_t see1 = seed, see2 = seed;
+          do {
+            seed = mix(r8(p) ^ s1, r8(p + 8) ^ seed);
+            see1 = mix(r8(p + 16) ^ s2, r8(p + 24) ^ see1);
+            see2 = mix(r8(p + 32) ^ s3, r8(p + 40) ^ see2);
+            p += 48;
+            i -= 48;
+          } while (i > 48);
+          seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+          seed = mix(r8(p) ^ s1, r8(p + 8) ^ seed);
+          i -= 16;
+          p += 16;
+        }
+        a = r8(p + i - 16);
+        b = r8(p + i - 8);
+      }
+      a ^= s1;
+      b ^= seed;
+      mum(a, b);
+      return mix(a ^ s0 ^ len, b ^ s1);
+    }
+
+    /// Hash a zero terminated string.
+    static uint64_t string(const char *key) {
+      return bytes(key, strlen(key));
+    }
+  };
+
+  /// Operations on a group of sixteen control bytes.
+  class hash_table_group {
+  public:
+    enum {
+      width = 16,
+      ctrl_empty = 0x80,
+      ctrl_deleted = 0xfe,
+    };
+
+    /// bit mask of slots whose control byte is h2.
+    static unsigned match(const uint8_t *ctrl, unsigned h2) {
+      #if OCTET_SSE2
+        __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+        return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8((char)h2), group));
+      #else
+        unsigned mask = 0;
+        for (unsigned i = 0; i != width; ++i) {
+          mask |= (unsigned)(ctrl[i] == h2) << i;
+        }
+        return mask;
+      #endif
+    }
+
+    /// bit mask of empty slots.
+    static unsigned match_empty(const uint8_t *ctrl) {
+      return match(ctrl, ctrl_empty);
+    }
+
+    /// bit mask of empty or deleted slots (the ones with the top bit set).
+    static unsigned match_empty_or_deleted(const uint8_t *ctrl) {
+      #if OCTET_SSE2
+        return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+      #else
+        unsigned mask = 0;
+        for (unsigned i = 0; i != width; ++i) {
+          mask |= (unsigned)(ctrl[i] >> 7) << i;
+        }
+        return mask;
+      #endif
+    }
+
+    /// index of the lowest set bit; mask must not be zero.
+    static unsigned first_bit(unsigned mask) {
+      #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (unsigned)index;
+      #else
+        return (unsigned)__builtin_ctz(mask);
+      #endif
+    }
+  };
+
+  /// Open addressing hash table with tombstone erase.
+  ///
+  /// traits_t defines get_hash(key), equals(stored_key, key), copy_key(dest, key) and free_key(key).
+  ///
+  /// Empty slots have zero bytes for the key and value, so get_key() on an
+  /// unused index returns a zero key.
+  ///
+  /// Keys and values are moved with memcpy when the table grows, like dynarray.
+  template <typename key_t, typename value_t, class traits_t, class allocator_t> class hash_table {
+    struct entry_t { key_t key; unsigned hash; value_t value; };
+    typedef hash_table_group group;
+
+    // control bytes; there are width extra bytes at the end that mirror the first width bytes.
+    uint8_t *ctrl;
+    entry_t *entries;
+    unsigned num_entries;
+    unsigned num_deleted;
+    unsigned capacity;
+    unsigned max_load_percent;
+
+    static unsigned get_h2(uint64_t h) { return (unsigned)(h >> 57); }
+
+    // set a control byte and its mirror.
+    void set_ctrl(unsigned index, unsigned value) {
+      ctrl[index] = (uint8_t)value;
+      ctrl[((index - group::width) & (capacity - 1)) + group::width] = (uint8_t)value;
+    }
+
+    // find an existing key, or -1
+    int find(const key_t &key, unsigned hash) const {
+      if (!capacity) return -1;
+      uint64_t h = hash_function::scramble(hash);
+      unsigned h2 = get_h2(h);
+      unsigned mask = capacity - 1;
+      unsigned pos = (unsigned)h & mask;
+      for (unsigned step = 0; ; ) {
+        for (unsigned m = group::match(ctrl + pos, h2); m; m &= m - 1) {
+          unsigned index = (pos + group::first_bit(m)) & mask;
+          const entry_t &e = entries[index];
+          if (e.hash == hash && traits_t::equals(e.key, key)) {
+            return (int)index;
+          }
+        }
+        if (group::match_empty(ctrl + pos)) {
+          return -1;
+        }
+        step += group::width;
+        pos = (pos + step) & mask;
+      }
+    }
+
+    // find a free slot in the probe sequence of a hash.
+    unsigned find_free(unsigned hash) const {
+      uint64_t h = hash_function::scramble(hash);
+      unsigned mask = capacity - 1;
+      unsigned pos = (unsigned)h & mask;
+      for (unsigned step = 0; ; ) {
+        unsigned m = group::match_empty_or_deleted(ctrl + pos);
+        if (m) {
+          return (pos + group::first_bit(m)) & mask;
+        }
+        step += group::width;
+        pos = (pos + step) & mask;
+      }
+    }
+
+    // rebuild the table with a new capacity (also clears tombstones).
+    void rehash(unsigned new_capacity) {
+      uint8_t *old_ctrl = ctrl;
+      entry_t *old_entries = entries;
+      unsigned old_capacity = capacity;
+
+      capacity = new_capacity;
+      ctrl = (uint8_t*)allocator_t::malloc(capacity + group::width);
+      memset(ctrl, group::ctrl_empty, capacity + group::width);
+      entries = (entry_t*)allocator_t::malloc(sizeof(entry_t) * capacity);
+      memset((void*)entries, 0, sizeof(entry_t) * capacity);
+      num_deleted = 0;
+
+      for (unsigned i = 0; i != old_capacity; ++i) {
+        if (old_ctrl[i] < group::ctrl_empty) {
+          entry_t &old_entry = old_entries[i];
+          unsigned index = find_free(old_entry.hash);
+          set_ctrl(index, get_h2(hash_function::scramble(old_entry.hash)));
+          memcpy((void*)&entries[index], (void*)&old_entry, sizeof(entry_t));
+        }
+      }
+
+      if (old_capacity) {
+        allocator_t::free(old_ctrl, old_capacity + group::width);
+        allocator_t::free(old_entries, sizeof(entry_t) * old_capacity);
+      }
+    }
+
+    // make room for one more entry.
+    void grow() {
+      if (!capacity) {
+        rehash(group::width);
+      } else if ((num_entries + 1) * 100 > capacity * max_load_percent / 2) {
+        rehash(capacity * 2);
+      } else {
+        // mostly tombstones: clean up in place
+        rehash(capacity);
+      }
+    }
+
+    void destroy_entry(entry_t &e) {
+      traits_t::free_key(e.key);
+      e.value.~value_t();
+      memset((void*)&e, 0, sizeof(e));
+    }
+
+    void release() {
+      for (unsigned i = 0; i != capacity; ++i) {
+        if (ctrl[i] < group::ctrl_empty) {
+          destroy_entry(entries[i]);
+        }
+      }
+      if (capacity) {
+        allocator_t::free(ctrl, capacity + group::width);
+        allocator_t::free(entries, sizeof(entry_t) * capacity);
+      }
+      init();
+    }
+
+    void init() {
+      ctrl = 0;
+      entries = 0;
+      num_entries = 0;
+      num_deleted = 0;
+      capacity = 0;
+    }
+
+  public:
+    /// Create an empty table; no memory is allocated until we add something.
+    hash_table() {
+      init();
+      max_load_percent = 87;
+    }
+
+    /// destroy the keys and values.
+    ~hash_table() {
+      release();
+    }
+
+    /// Remove all keys and values and free the memory.
+    void clear() {
+      release();
+    }
+
+    /// Access the table by key, adding a zero value if the key is not there.
+    value_t &operator[](const key_t &key) {
+      unsigned hash = traits_t::get_hash(key);
+      int index = find(key, hash);
+      if (index >= 0) {
+        return entries[index].value;
+      }
+
+      // reducing this ratio decreases hot search time at the
+      // expense of size (cold search time).
+      if ((num_entries + num_deleted + 1) * 100 > capacity * max_load_percent) {
+        grow();
+      }
+
+      unsigned new_index = find_free(hash);
+      if (ctrl[new_index] == group::ctrl_deleted) {
+        num_deleted--;
+      }
+      set_ctrl(new_index, get_h2(hash_function::scramble(hash)));
+      num_entries++;
+
+      entry_t &e = entries[new_index];
+      traits_t::copy_key(e.key, key);
+      e.hash = hash;
+      dynarray_dummy_t x;
+      new (&e.value, x) value_t();
+      return e.value;
+    }
+
+    /// Does the table have this key?
+    bool contains(const key_t &key) const {
+      return find(key, traits_t::get_hash(key)) >= 0;
+    }
+
+    /// Get the index of a key for get_key() and get_value(), or -1 if it is not there.
+    ///
+    /// Note: only valid until the table is changed.
+    int get_index(const key_t &key) const {
+      return find(key, traits_t::get_hash(key));
+    }
+
+    /// Remove a key and its value. Returns false if the key was not there.
+    bool erase(const key_t &key) {
+      int index = find(key, traits_t::get_hash(key));
+      if (index < 0) {
+        return false;
+      }
+      destroy_entry(entries[index]);
+      set_ctrl((unsigned)index, group::ctrl_deleted);
+      num_entries--;
+      num_deleted++;
+      return true;
+    }
+
+    /// Make space for this many keys without growing.
+    void reserve(unsigned new_size) {
+      unsigned new_capacity = group::width;
+      while (new_size * 100 > new_capacity * max_load_percent) {
+        new_capacity *= 2;
+      }
+      if (new_capacity > capacity) {
+        rehash(new_capacity);
+      }
+    }
+
+    /// Set the fraction of slots that may be used before we grow (0.25 to 0.875).
+    /// Lower values make searches faster at the expense of memory.
+    void set_max_load_factor(float value) {
+      value = value < 0.25f ? 0.25f : value > 0.875f ? 0.875f : value;
+      max_load_percent = (unsigned)(value * 100);
+    }
+
+    /// Number of keys in the table.
+    unsigned size() const {
+      return num_entries;
+    }
+
+    /// True if there are no keys.
+    bool empty() const {
+      return num_entries == 0;
+    }
+
+    /// Number of slots; use with is_used(), get_key() and get_value() to iterate.
+    unsigned get_num_indices() const {
+      return capacity;
+    }
+
+    /// Is there a key at this index?
+    bool is_used(unsigned index) const {
+      return index < capacity && ctrl[index] < group::ctrl_empty;
+    }
+
+    /// For a specific index, get the key.
+    const key_t &get_key(unsigned index) const {
+      assert(index < capacity);
+      return entries[index].key;
+    }
+
+    /// For a specific index, get the value.
+    value_t &get_value(unsigned index) {
+      assert(index < capacity);
+      return entries[index].value;
+    }
+
+    /// For a specific index, read the value.
+    const value_t &get_value(unsigned index) const {
+      assert(index < capacity);
+      return entries[index].value;
+    }
+
+    /// iterator over the used slots.
+    ///
+    /// Example:
+    ///
+    ///     for (auto it = my_map.begin(); it != my_map.end(); ++it) {
+    ///       printf("%d %d\n", it.key(), it.value());
+    ///     }
+    class iterator {
+      hash_table *table;
+      unsigned index;
+      friend class hash_table;
+
+      void skip() {
+        while (index < table->capacity && table->ctrl[index] >= group::ctrl_empty) ++index;
+      }
+    public:
+      iterator(hash_table *table_, unsigned index_) : table(table_), index(index_) { skip(); }
+      const key_t &key() const { return table->entries[index].key; }
+      value_t &value() const { return table->entries[index].value; }
+      unsigned get_index() const { return index; }
+      bool operator != (const iterator &rhs) const { return index != rhs.index; }
+      bool operator == (const iterator &rhs) const { return index == rhs.index; }
+      void operator++() { ++index; skip(); }
+      void operator++(int) { ++index; skip(); }
+    };
+
+    /// first used slot.
+    iterator begin() {
+      return iterator(this, 0);
+    }
+
+    /// one past the last slot.
+    iterator end() {
+      return iterator(this, capacity);
+    }
+  };
+} }
@@ -90,4 +90,7 @@ namespace octet { namespace containers {
       item = 0;
     }
   };
+
+  /// refs are just pointers so dynarray can move them with memcpy.
+  template <class item_t, class allocator_t> struct is_relocatable<ref<item_t, allocator_t> > { enum { value = 1 }; };
 } }
@@ -13,6 +13,11 @@
 //
 
 namespace octet { namespace containers {
+  class string;
+
+  /// strings only point to heap data (or a shared empty string) so dynarray can move them with memcpy.
+  template <> struct is_relocatable<string> { enum { value = 1 }; };
+
   /// The string class is used to hold persistant text strings.
   ///
   /// Only use this class as a data member in another class. Do not pass strings as parameters
@@ -24,13 +29,28 @@ namespace octet { namespace containers {
   class string {
     char *data_;
 
+    // bytes allocated for data_, zero for the shared empty string.
+    // strings may contain zeros (see set()), so we can't use strlen() to free them.
+    size_t alloc_size_;
+
     static char *null_string() { static char c; return &c; }
 
     void release() {
       if (data_ != null_string()) {
-        allocator::free((void*)data_, size() + 1);
+        allocator::free((void*)data_, alloc_size_);
         data_ = null_string();
+        alloc_size_ = 0;
+      }
+    }
+
+    // allocate or resize data_ to hold size bytes.
+    void reallocate(size_t size) {
+      if (data_ == null_string()) {
+        data_ = (char*)allocator::malloc(size);
+      } else {
+        data_ = (char*)allocator::realloc((void*)data_, alloc_size_, size);
       }
+      alloc_size_ = size;
     }
 
     // When dealing with windows or java, we will come across the less popular
@@ -145,19 +165,19 @@ namespace octet { namespace containers {
     }
   public:
     /// Default constructor: empty string.
-    string() { data_ = null_string(); }
+    string() { data_ = null_string(); alloc_size_ = 0; }
 
     /// Copy a UTF8 C string
-    string(const char *value) { data_ = null_string(); *this = value; }
+    string(const char *value) { data_ = null_string(); alloc_size_ = 0; *this = value; }
     
     /// Copy of a UFT16 C string
-    string(const wchar_t *value) { data_ = null_string(); *this = value; }
+    string(const wchar_t *value) { data_ = null_string(); alloc_size_ = 0; *this = value; }
     
     /// Copy of another string
-    string(const string& rhs) { data_ = null_string(); *this = rhs.c_str(); }
+    string(const string& rhs) { data_ = null_string(); alloc_size_ = 0; *this = rhs.c_str(); }
     
     /// Copy of a substring
-    string(const char *value, unsigned size) { data_ = null_string(); set(value, size); }
+    string(const char *value, unsigned size) { data_ = null_string(); alloc_size_ = 0; set(value, size); }
 
     /// Free up memory used by the string.
     ~string() { release(); }
@@ -190,13 +210,8 @@ namespace octet { namespace containers {
         size_t cur_len = strlen(data_);
         int len = _vscprintf(fmt, v);
         if (len) {
-          if (cur_len) {
-            data_ = (char*)allocator::realloc(data_, cur_len+1, cur_len + len + 1);
-            vsprintf_s(data_ + cur_len, len+1, fmt, v);
-          } else {
-            data_ = (char*)allocator::malloc(len+1);
-            vsprintf_s(data_, len+1, fmt, v);
-          }
+          reallocate(cur_len + len + 1);
+          vsprintf_s(data_ + cur_len, len+1, fmt, v);
         }
       #else
         char tmp[1024];
@@ -211,7 +226,7 @@ namespace octet { namespace containers {
       if (value) {
         unsigned size = urldecode_impl(0, value);
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          reallocate(size+1);
           urldecode_impl(data_, value);
         }
       }
@@ -224,7 +239,7 @@ namespace octet { namespace containers {
       if (value) {
         unsigned size = urlencode_impl(0, value);
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          reallocate(size+1);
           urlencode_impl(data_, value);
         }
       }
@@ -237,7 +252,7 @@ namespace octet { namespace containers {
       if (value) {
         size_t size = strlen(value);
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          reallocate(size+1);
           memcpy((char*)data_, value, size+1);
         }
       }
@@ -250,7 +265,7 @@ namespace octet { namespace containers {
       if (value) {
         unsigned size = utf16_to_utf8(0, value);
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          reallocate(size+1);
           utf16_to_utf8(data_, value);
         }
       }
@@ -258,14 +273,14 @@ namespace octet { namespace containers {
     }
 
     /// copy another string
-    string &operator=(const string& rhs) { data_ = null_string(); *this = rhs.c_str(); return *this; }
+    string &operator=(const string& rhs) { if (this != &rhs) *this = rhs.c_str(); return *this; }
 
     /// copy a substring
     string &set(const char *value, unsigned size) {
       release();
       if (value) {
         if (size) {
-          data_ = (char*)allocator::malloc(size+1);
+          reallocate(size+1);
           memcpy((char*)data_, value, size);
           data_[size] = 0;
         }
@@ -277,11 +292,7 @@ namespace octet { namespace containers {
     string &truncate(int new_len) {
       int size = (int)strlen(data_);
       if (new_len < size) {
-        if (data_ == null_string()) {
-          data_ = (char*)allocator::malloc(new_len+1);
-        } else {
-          data_ = (char*)allocator::realloc((void*)data_, size+1, new_len+1);
-        }
+        reallocate(new_len+1);
         data_[new_len] = 0;
       }
       return *this;
@@ -301,11 +312,7 @@ namespace octet { namespace containers {
       if (rhs) {
         size_t data_size = strlen(data_);
         size_t rhs_size = strlen(rhs);
-        if (data_ == null_string()) {
-          data_ = (char*)allocator::malloc(data_size+rhs_size+1);
-        } else {
-          data_ = (char*)allocator::realloc(data_, data_size + 1, data_size+rhs_size+1);
-        }
+        reallocate(data_size+rhs_size+1);
         memcpy(data_ + data_size, rhs, rhs_size+1);
       }
       return *this;
@@ -322,6 +329,7 @@ namespace octet { namespace containers {
         memcpy(new_data + pos + rhs_size, data_, data_size - pos + 1);
         release();
         data_ = new_data;
+        alloc_size_ = data_size+rhs_size+1;
       }
       return *this;
     }
@@ -0,0 +1,954 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+namespace octet {
+  /// Measures the codecs on the assets and prints the results.
+  ///
+  /// Texture compression: PSNR and Mpix/s of dxt_encoder for each block format and quality.
+  ///
+  /// Inflate: MB/s of zip_decoder, a round trip of every file through zip_file (which checks the
+  /// size and CRC-32), and bit-flipped and truncated streams, which must be rejected or decoded
+  /// without writing past the output. Run a build with -fsanitize=address,undefined to check the fuzzing.
+  /// The corpus, assets/zip_corpus.zip, has text, binary and synthetic files (zeros, random bytes and
+  /// short repeats) deflated by zlib at levels 0, 1, 6 and 9 and, at level 6, with the filtered,
+  /// huffman only, rle and fixed strategies. The files are named after the source and the setting.
+  ///
+  /// Animation compression: a 30 second, 60 Hz clip of a 31 bone skeleton with noisy, mocap-like
+  /// motion. The size and decode time of the raw and compressed clips, and how far the joints
+  /// are from the raw clip in world space at every source key.
+  ///
+  /// Allocators: ns per malloc and free of the system heap, allocator's pools and frame_allocator,
+  /// for a churning live set of mostly small blocks, the same on every pool thread, and a frame of temporaries.
+  ///
+  /// Hash tables: dictionary and hash_map against std::unordered_map, replaying the lookups that
+  /// collada_builder makes for the ids, urls and atoms of the COLLADA assets.
+  ///
+  /// Arrays: ns per item to push_back and copy, and us to insert or erase at the front of 100000 items,
+  /// for dynarray and std::vector of ints, ref<>s and strings.
+  ///
+  /// JPEG decoding: Mpix/s of jpeg_decoder on the asset JPEGs, and a checksum of each decoded image
+  /// so that changes to the output are caught.
+  ///
+  /// JPEG encoding: MB/s of jpeg_encoder, the file size and the PSNR after decoding with jpeg_decoder,
+  /// for several qualities and subsamplings.
+  ///
+  /// OBJ loading: MB/s and triangles/s of obj_loader on one thread and on the job pool. The file is
+  /// a generated --obj_mb= megabyte (default 64) grid of quads with positions, uvs and normals,
+  /// or a file of your own with --obj=.
+  ///
+  /// The work is done in app_init, so build with OCTET_HEADLESS and run with --frames=1.
+  /// --run=dxt,zip,animation,allocator,hash,dynarray,jpeg,jpeg_encode,obj picks some of the benchmarks; by default they all run.
+  class example_codecs : public app {
+    // comma separated benchmark names from --run=, or NULL for all of them.
+    const char *run_names;
+
+    // OBJ file to load from --obj=, or NULL to make one of obj_megabytes.
+    const char *obj_url;
+    unsigned obj_megabytes;
+
+    bool should_run(const char *name) const {
+      if (!run_names) return true;
+      size_t length = strlen(name);
+      for (const char *p = run_names; ; ) {
+        const char *comma = strchr(p, ',');
+        size_t n = comma ? (size_t)(comma - p) : strlen(p);
+        if (n == length && !memcmp(p, name, length)) return true;
+        if (!comma) return false;
+        p = comma + 1;
+      }
+    }
+
+    // call fn until at least min_seconds have gone and return the seconds for one call.
+    template <class fn_t> static double time_calls(fn_t fn, double min_seconds = 0.3) {
+      double start = frame_timer::now();
+      unsigned calls = 0;
+      double seconds;
+      do {
+        fn();
+        ++calls;
+        seconds = frame_timer::now() - start;
+      } while (seconds < min_seconds);
+      return seconds / calls;
+    }
+
+    // publish a pointer so that the compiler can't drop the work that made it.
+    static void keep(const void *ptr) {
+      static const void *volatile kept;
+      kept = ptr;
+    }
+
+    // decode a jpeg or gif to RGB or RGBA pixels.
+    static bool load_pixels(dynarray<uint8_t> &pixels, unsigned &width, unsigned &height, unsigned &bpp, const char *url) {
+      byte_span file;
+      app_utils::get_url(file, url);
+      if (file.size() < 4) return false;
+
+      uint16_t format = 0, w = 0, h = 0;
+      if (file[0] == 0xff && file[1] == 0xd8) {
+        jpeg_decoder dec;
+        dec.get_image(pixels, format, w, h, file.begin(), file.end());
+      } else {
+        gif_decoder dec;
+        dec.get_image(pixels, format, w, h, file.begin(), file.end());
+      }
+      width = w;
+      height = h;
+      bpp = format == GL_RGB ? 3 : 4;
+      return pixels.size() != 0 && pixels.size() == (size_t)width * height * bpp;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Texture compression
+    //
+
+    // the colour of a 565 end point as the GPU expands it.
+    static void decode_565(int *rgb, unsigned value) {
+      unsigned r = value >> 11 & 31, g = value >> 5 & 63, b = value & 31;
+      rgb[0] = r << 3 | r >> 2;
+      rgb[1] = g << 2 | g >> 4;
+      rgb[2] = b << 3 | b >> 2;
+    }
+
+    // RGB of a BC1 block. BC3 colour blocks always have four colours.
+    static void decode_bc1(uint8_t (*pixels)[4], const uint8_t *src, bool always_four) {
+      unsigned c0 = src[0] | src[1] << 8, c1 = src[2] | src[3] << 8;
+      int palette[4][3];
+      decode_565(palette[0], c0);
+      decode_565(palette[1], c1);
+      for (int k = 0; k != 3; ++k) {
+        if (c0 > c1 || always_four) {
+          palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+          palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+        } else {
+          palette[2][k] = (palette[0][k] + palette[1][k]) / 2;
+          palette[3][k] = 0;
+        }
+      }
+      uint32_t indices = src[4] | src[5] << 8 | src[6] << 16 | (uint32_t)src[7] << 24;
+      for (int i = 0; i != 16; ++i) {
+        int *c = palette[indices >> (i * 2) & 3];
+        pixels[i][0] = (uint8_t)c[0];
+        pixels[i][1] = (uint8_t)c[1];
+        pixels[i][2] = (uint8_t)c[2];
+      }
+    }
+
+    // one channel of a BC4 block.
+    static void decode_bc4(uint8_t (*pixels)[4], unsigned channel, const uint8_t *src) {
+      int a0 = src[0], a1 = src[1];
+      int palette[8] = { a0, a1 };
+      if (a0 > a1) {
+        for (int i = 1; i != 7; ++i) palette[i + 1] = ((7 - i) * a0 + i * a1 + 3) / 7;
+      } else {
+        for (int i = 1; i != 5; ++i) palette[i + 1] = ((5 - i) * a0 + i * a1 + 2) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+      }
+      uint64_t indices = 0;
+      for (int i = 0; i != 6; ++i) indices |= (uint64_t)src[i + 2] << (i * 8);
+      for (int i = 0; i != 16; ++i) {
+        pixels[i][channel] = (uint8_t)palette[indices >> (i * 3) & 7];
+      }
+    }
+
+    // PSNR in dB over the channels that the format stores.
+    static double get_psnr(const uint8_t *blocks, dxt_encoder::format_t format, const uint8_t *src, unsigned width, unsigned height, unsigned bpp) {
+      unsigned blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+      unsigned block_bytes = dxt_encoder::get_block_bytes(format);
+      unsigned num_channels = format == dxt_encoder::bc1 ? 3 : format == dxt_encoder::bc3 ? 4 : format == dxt_encoder::bc4 ? 1 : 2;
+      double sum = 0;
+      size_t count = 0;
+      for (unsigned by = 0; by != blocks_y; ++by) {
+        for (unsigned bx = 0; bx != blocks_x; ++bx) {
+          const uint8_t *block = blocks + (by * blocks_x + bx) * block_bytes;
+          uint8_t pixels[16][4];
+          switch (format) {
+            case dxt_encoder::bc1: decode_bc1(pixels, block, false); break;
+            case dxt_encoder::bc3: decode_bc4(pixels, 3, block); decode_bc1(pixels, block + 8, true); break;
+            case dxt_encoder::bc4: decode_bc4(pixels, 0, block); break;
+            default: decode_bc4(pixels, 0, block); decode_bc4(pixels, 1, block + 8); break;
+          }
+          for (unsigned i = 0; i != 16; ++i) {
+            unsigned x = bx * 4 + i % 4, y = by * 4 + i / 4;
+            if (x >= width || y >= height) continue;
+            const uint8_t *s = src + ((size_t)y * width + x) * bpp;
+            for (unsigned c = 0; c != num_channels; ++c) {
+              int value = c == 3 && bpp == 3 ? 255 : s[c];
+              int diff = value - pixels[i][c];
+              sum += diff * diff;
+              count++;
+            }
+          }
+        }
+      }
+      double mse = sum / count;
+      return mse == 0 ? 99 : 10 * log10(255.0 * 255.0 / mse);
+    }
+
+    void benchmark_dxt() {
+      static const char *urls[] = {
+        "assets/NASA-Jupiter-512.jpg", "assets/duckCM.jpg", "assets/grass.jpg", "assets/andyt.gif", "assets/particles.gif",
+      };
+      static const char *format_names[] = { "bc1", "bc3", "bc4", "bc5" };
+
+      printf("\ntexture compression\n");
+      printf("  %-24s fmt  fast dB  Mpix/s   high dB  Mpix/s\n", "image");
+      for (unsigned i = 0; i != sizeof(urls) / sizeof(urls[0]); ++i) {
+        dynarray<uint8_t> pixels;
+        unsigned width, height, bpp;
+        if (!load_pixels(pixels, width, height, bpp, urls[i])) {
+          printf("  %s not found\n", urls[i]);
+          continue;
+        }
+
+        for (unsigned f = 0; f != 4; ++f) {
+          dxt_encoder::format_t format = (dxt_encoder::format_t)f;
+          printf("  %-24s %s", f == 0 ? urls[i] + 7 : "", format_names[f]);
+          for (unsigned q = 0; q != 2; ++q) {
+            dxt_encoder enc;
+            enc.set_quality((dxt_encoder::quality_t)q);
+            dynarray<uint8_t> blocks;
+            double seconds = time_calls([&]() {
+              blocks.resize(0);
+              enc.encode(blocks, format, width, height, width * bpp, pixels.data(), bpp);
+            });
+            double psnr = get_psnr(blocks.data(), format, pixels.data(), width, height, bpp);
+            printf("  %7.2f %7.1f", psnr, width * height / seconds * 1e-6);
+          }
+          printf("\n");
+        }
+      }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Inflate
+    //
+
+    // a deflated file in a zip archive, found from its local header.
+    struct zip_entry {
+      string name;
+      const uint8_t *src;
+      unsigned compressed_size;
+      unsigned size;
+    };
+
+    static unsigned u4(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (unsigned)p[3] << 24; }
+    static unsigned u2(const uint8_t *p) { return p[0] | p[1] << 8; }
+
+    // the deflated files of an archive written without data descriptors.
+    static void get_zip_entries(dynarray<zip_entry> &entries, const byte_span &archive) {
+      const uint8_t *p = archive.begin(), *end = archive.end();
+      while (end - p >= 30 && u4(p) == 0x04034b50) {
+        zip_entry e;
+        unsigned name_length = u2(p + 26), extra_length = u2(p + 28);
+        e.name.set((const char*)p + 30, name_length);
+        e.src = p + 30 + name_length + extra_length;
+        e.compressed_size = u4(p + 18);
+        e.size = u4(p + 22);
+        if (e.src + e.compressed_size > end) break;
+        if (u2(p + 8) == 8) entries.push_back(e);
+        p = e.src + e.compressed_size;
+      }
+    }
+
+    void benchmark_zip() {
+      const char *url = "assets/zip_corpus.zip";
+      byte_span archive;
+      app_utils::get_url(archive, url);
+      dynarray<zip_entry> entries;
+      get_zip_entries(entries, archive);
+      if (entries.size() == 0) {
+        printf("  %s not found\n", url);
+        return;
+      }
+
+      // round trip: zip_file rejects files with the wrong size or CRC.
+      ref<zip_file> zip = new zip_file(url);
+      size_t total_size = 0;
+      unsigned num_bad = 0;
+      byte_span span;
+      for (unsigned i = 0; i != entries.size(); ++i) {
+        const zip_entry &e = entries[i];
+        if (!zip->get_file(span, e.name.c_str()) || span.size() != e.size) {
+          printf("  round trip failed: %s\n", e.name.c_str());
+          num_bad++;
+        }
+        total_size += e.size;
+      }
+
+      zip_decoder dec;
+      dynarray<uint8_t> buffer;
+      double seconds = time_calls([&]() {
+        for (unsigned i = 0; i != entries.size(); ++i) {
+          const zip_entry &e = entries[i];
+          buffer.resize(e.size);
+          dec.decode(buffer.data(), buffer.data() + buffer.size(), e.src, e.src + e.compressed_size);
+        }
+      });
+
+      // fuzz: cut the streams short and flip bits. Each stream must be rejected or fit the output.
+      uint32_t seed = 0x1234;
+      unsigned num_streams = 0, num_rejected = 0;
+      dynarray<uint8_t> stream;
+      for (unsigned i = 0; i != entries.size(); ++i) {
+        const zip_entry &e = entries[i];
+        if (e.compressed_size == 0) continue;
+        for (unsigned trial = 0; trial != 64; ++trial) {
+          stream.resize(e.compressed_size);
+          memcpy(stream.data(), e.src, e.compressed_size);
+          unsigned length = e.compressed_size;
+          if (trial < 16) {
+            length = (unsigned)((uint64_t)e.compressed_size * trial / 16);
+          } else {
+            for (unsigned flips = 1 + trial % 4; flips != 0; --flips) {
+              seed = seed * 1664525 + 1013904223;
+              unsigned bit = seed % (e.compressed_size * 8);
+              stream[bit / 8] ^= 1 << (bit % 8);
+            }
+          }
+          buffer.resize(e.size);
+          bool ok = dec.decode(buffer.data(), buffer.data() + buffer.size(), stream.data(), stream.data() + length);
+          if (ok && dec.get_output_size() > buffer.size()) {
+            printf("  fuzz: output overrun in %s\n", e.name.c_str());
+            num_bad++;
+          }
+          num_rejected += !ok;
+          num_streams++;
+        }
+      }
+
+      printf("\ninflate\n");
+      printf("  %s: %d files, %.1f MB, %.1f MB/s\n", url, entries.size(), total_size * 1e-6, total_size / seconds * 1e-6);
+      printf("  fuzz: %d streams, %d rejected\n", num_streams, num_rejected);
+      printf("  %s\n", num_bad ? "FAILED" : "ok");
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Animation compression
+    //
+
+    enum { num_bones = 31, key_rate = 60, num_keys = key_rate * 30 };
+
+    // a spine with two arms and two legs.
+    static int get_bone_parent(int bone) {
+      return bone == 0 ? -1 : bone < 7 ? bone - 1 : bone == 7 || bone == 13 ? 5 : bone == 19 || bone == 25 ? 0 : bone - 1;
+    }
+
+    // the clip and the skeleton it plays on.
+    static animation *make_mocap(ref<scene_node> &skeleton) {
+      atom_t sids[num_bones];
+      scene_node *nodes[num_bones];
+      vec3 offsets[num_bones];
+      for (int b = 0; b != num_bones; ++b) {
+        char name[16];
+        sprintf(name, "bone%d", b);
+        sids[b] = app_utils::get_atom(name);
+        offsets[b] = b == 0 ? vec3(0, 1, 0) : b < 7 ? vec3(0, 0.1f, 0) : b < 19 ? vec3(b < 13 ? 0.08f : -0.08f, 0, 0) : vec3(0, -0.15f, 0);
+        mat4t m;
+        m.translate(offsets[b][0], offsets[b][1], offsets[b][2]);
+        nodes[b] = new scene_node(m, sids[b]);
+        if (b == 0) skeleton = nodes[b]; else nodes[get_bone_parent(b)]->add_child(nodes[b]);
+      }
+
+      dynarray<float> times(num_keys);
+      for (int i = 0; i != num_keys; ++i) {
+        times[i] = (float)i / key_rate;
+      }
+
+      // a few sine waves per bone, with noise of up to a third of a degree.
+      animation *anim = new animation();
+      uint32_t seed = 0x5eed;
+      dynarray<float> values(num_keys * 16);
+      for (int b = 0; b != num_bones; ++b) {
+        for (int i = 0; i != num_keys; ++i) {
+          float t = times[i], angles[3];
+          for (int a = 0; a != 3; ++a) {
+            seed = seed * 1664525 + 1013904223;
+            float noise = ((seed >> 8) & 0xffff) * (0.66f / 0xffff) - 0.33f;
+            angles[a] = sinf(t * (1.3f + b * 0.07f + a * 0.5f)) * (a == 0 ? 40.0f : 15.0f) + sinf(t * 7.1f + b) * 3 + noise;
+          }
+          mat4t m;
+          if (b == 0) {
+            m.translate(sinf(t * 0.2f) * 3, offsets[b][1] + sinf(t * 8) * 0.03f, t * 1.2f);
+          } else {
+            m.translate(offsets[b][0], offsets[b][1], offsets[b][2]);
+          }
+          m.rotateX(angles[0]);
+          m.rotateY(angles[1]);
+          m.rotateZ(angles[2]);
+          memcpy(&values[i * 16], m.transpose4x4().get(), sizeof(float) * 16);
+        }
+        anim->add_channel(NULL, sids[b], atom_transform, atom_, times, values);
+      }
+      return anim;
+    }
+
+    // world space joint positions at one time.
+    static void get_joints(vec3 *joints, const animation *anim, dynarray<float> &pose, dynarray<animation::cursor> &cursors, float time) {
+      anim->sample(pose.data(), cursors.data(), time);
+      mat4t world[num_bones];
+      for (int b = 0; b != num_bones; ++b) {
+        mat4t local;
+        local.init_transpose(&pose[anim->get_pose_offset(b)]);
+        int parent = get_bone_parent(b);
+        world[b] = parent < 0 ? local : local * world[parent];
+        joints[b] = world[b][3].xyz();
+      }
+    }
+
+    // seconds to sample every key of a clip, one after another.
+    static double time_poses(const animation *anim) {
+      dynarray<float> pose(anim->get_pose_size());
+      dynarray<animation::cursor> cursors(anim->get_num_timelines());
+      return time_calls([&]() {
+        for (int i = 0; i != num_keys; ++i) {
+          anim->sample(pose.data(), cursors.data(), (float)i / key_rate);
+        }
+      });
+    }
+
+    void benchmark_animation() {
+      ref<scene_node> skeleton;
+      ref<animation> raw = make_mocap(skeleton);
+      raw->compile();
+      double raw_seconds = time_poses(raw);
+      dynarray<float> raw_pose(raw->get_pose_size());
+      dynarray<animation::cursor> raw_cursors(raw->get_num_timelines());
+
+      printf("\nanimation compression: %d bones, %d keys\n", num_bones, num_keys);
+      printf("  tolerance  MB/raw MB   keys      ms  us/pose  local mm  world mm (mean)\n");
+      printf("  raw                %6d       - %8.2f\n", num_bones * num_keys, raw_seconds / num_keys * 1e6);
+
+      static const float tolerances[] = { 0.001f, 0.01f };
+      for (unsigned i = 0; i != sizeof(tolerances) / sizeof(tolerances[0]); ++i) {
+        ref<scene_node> unused;
+        ref<animation> anim = make_mocap(unused);
+        animation::compress_params params;
+        params.tolerance = tolerances[i];
+        animation::compress_stats stats;
+        double start = frame_timer::now();
+        anim->compress(params, skeleton, &stats);
+        double compress_seconds = frame_timer::now() - start;
+        double seconds = time_poses(anim);
+
+        dynarray<float> pose(anim->get_pose_size());
+        dynarray<animation::cursor> cursors(anim->get_num_timelines());
+        float max_error = 0;
+        double sum_error = 0;
+        for (int k = 0; k != num_keys; ++k) {
+          vec3 expected[num_bones], actual[num_bones];
+          get_joints(expected, raw, raw_pose, raw_cursors, (float)k / key_rate);
+          get_joints(actual, anim, pose, cursors, (float)k / key_rate);
+          for (int b = 0; b != num_bones; ++b) {
+            float error = (actual[b] - expected[b]).length();
+            max_error = error > max_error ? error : max_error;
+            sum_error += error;
+          }
+        }
+
+        printf(
+          "  %5.0f mm  %4.2f/%4.2f %6d %7.1f %8.2f %9.2f %9.2f (%.2f)\n",
+          tolerances[i] * 1000, stats.compressed_bytes * 1e-6, stats.raw_bytes * 1e-6, stats.compressed_keys, compress_seconds * 1000,
+          seconds / num_keys * 1e6, stats.max_error * 1000, max_error * 1000, sum_error / (num_keys * num_bones) * 1000
+        );
+      }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Allocators
+    //
+
+    // the C heap, which is what the containers used before allocator had its pools.
+    struct system_heap {
+      static void *malloc(size_t size) { return ::malloc(size); }
+      static void free(void *ptr, size_t size) { ::free(ptr); }
+    };
+
+    // mostly small blocks, like strings, ref counted resources and small arrays.
+    static unsigned get_block_size(uint32_t &seed) {
+      seed = seed * 1664525 + 1013904223;
+      unsigned bits = seed >> 24;
+      return bits < 192 ? 8 + (bits & 15) * 8 : bits < 248 ? 256 + (bits & 63) * 32 : 4096 + (bits & 7) * 1024;
+    }
+
+    // free and allocate random blocks of a live set. Returns seconds per malloc/free pair.
+    template <class heap_t> static double time_churn(unsigned num_live, unsigned num_ops) {
+      dynarray<void*> blocks(num_live);
+      dynarray<unsigned> sizes(num_live);
+      uint32_t seed = 0x5678;
+      for (unsigned i = 0; i != num_live; ++i) {
+        sizes[i] = get_block_size(seed);
+        blocks[i] = heap_t::malloc(sizes[i]);
+      }
+      double start = frame_timer::now();
+      for (unsigned i = 0; i != num_ops; ++i) {
+        seed = seed * 1664525 + 1013904223;
+        unsigned slot = (seed >> 8) % num_live;
+        heap_t::free(blocks[slot], sizes[slot]);
+        sizes[slot] = get_block_size(seed);
+        blocks[slot] = heap_t::malloc(sizes[slot]);
+      }
+      double seconds = frame_timer::now() - start;
+      for (unsigned i = 0; i != num_live; ++i) {
+        heap_t::free(blocks[i], sizes[i]);
+      }
+      return seconds / num_ops;
+    }
+
+    // allocate a frame's worth of temporaries, then free them all. Returns seconds per malloc.
+    template <class heap_t> static double time_frame(unsigned num_blocks) {
+      dynarray<void*> blocks(num_blocks);
+      dynarray<unsigned> sizes(num_blocks);
+      uint32_t seed = 0x9abc;
+      double seconds = time_calls([&]() {
+        for (unsigned i = 0; i != num_blocks; ++i) {
+          sizes[i] = get_block_size(seed);
+          blocks[i] = heap_t::malloc(sizes[i]);
+        }
+        for (unsigned i = 0; i != num_blocks; ++i) {
+          heap_t::free(blocks[i], sizes[i]);
+        }
+      });
+      return seconds / num_blocks;
+    }
+
+    // the frame allocator drops the whole frame at once.
+    static double time_frame_arena(unsigned num_blocks) {
+      uint32_t seed = 0x9abc;
+      double seconds = time_calls([&]() {
+        for (unsigned i = 0; i != num_blocks; ++i) {
+          frame_allocator::malloc(get_block_size(seed));
+        }
+        frame_allocator::reset();
+      });
+      return seconds / num_blocks;
+    }
+
+    // every pool thread churns its own live set at once.
+    template <class heap_t> static double time_threads(unsigned num_live, unsigned num_ops) {
+      job_pool &pool = job_pool::get_shared();
+      unsigned num_threads = pool.get_num_threads() ? pool.get_num_threads() : 1;
+      double start = frame_timer::now();
+      job_pool::run(&pool, num_threads, [&](unsigned i) {
+        time_churn<heap_t>(num_live, num_ops);
+      });
+      return (frame_timer::now() - start) / ((double)num_ops * num_threads);
+    }
+
+    void benchmark_allocator() {
+      enum { num_live = 4096, num_ops = 1 << 20, num_frame_blocks = 10000 };
+
+      printf("\nallocators: ns per malloc and free\n");
+      printf("  %-40s  system    pool   frame\n", "");
+      printf("  %-40s %7.1f %7.1f       -\n", "churn, 4096 live blocks",
+        time_churn<system_heap>(num_live, num_ops) * 1e9, time_churn<allocator>(num_live, num_ops) * 1e9
+      );
+      printf("  %-40s %7.1f %7.1f       -\n", "churn on every pool thread",
+        time_threads<system_heap>(num_live, num_ops / 4) * 1e9, time_threads<allocator>(num_live, num_ops / 4) * 1e9
+      );
+      printf("  %-40s %7.1f %7.1f %7.1f\n", "10000 temporaries per frame",
+        time_frame<system_heap>(num_frame_blocks) * 1e9, time_frame<allocator>(num_frame_blocks) * 1e9, time_frame_arena(num_frame_blocks) * 1e9
+      );
+
+      allocator_stats stats;
+      allocator::get_stats(stats);
+      printf("  pool: %.1f MB taken from the system, %.1f MB high water\n", stats.pool_bytes * 1e-6, stats.high_water_bytes * 1e-6);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Hash tables
+    //
+
+    // the lookups that collada_builder makes: ids it finds elements and resources by,
+    // "#id" urls that refer to them, and sids and names that become atoms.
+    struct collada_lookups {
+      dynarray<const char *> ids;
+      dynarray<const char *> urls;
+      dynarray<const char *> names;
+    };
+
+    static void get_collada_lookups(collada_lookups &lookups, const xml_reader::element *elem) {
+      for (; elem; elem = elem->NextSiblingElement()) {
+        for (unsigned i = 0; i != elem->get_num_attributes(); ++i) {
+          const xml_reader::attribute &attr = elem->get_attribute(i);
+          if (!strcmp(attr.name, "id")) {
+            lookups.ids.push_back(attr.value);
+          } else if (attr.value[0] == '#') {
+            lookups.urls.push_back(attr.value + 1);
+          } else if (!strcmp(attr.name, "sid") || !strcmp(attr.name, "name") || !strcmp(attr.name, "symbol")) {
+            lookups.names.push_back(attr.value);
+          }
+        }
+        get_collada_lookups(lookups, elem->FirstChildElement());
+      }
+    }
+
+    // store the ids, then find every url and make every name an atom. Returns a checksum of the results.
+    template <class id_map_t, class atom_map_t, class index_map_t> static unsigned replay_lookups(const collada_lookups &lookups) {
+      id_map_t ids;
+      atom_map_t atoms;
+      index_map_t indices;
+      for (unsigned i = 0; i != lookups.ids.size(); ++i) {
+        ids[lookups.ids[i]] = i + 1;
+      }
+      unsigned sum = 0;
+      for (unsigned i = 0; i != lookups.urls.size(); ++i) {
+        sum += ids[lookups.urls[i]];
+      }
+      for (unsigned i = 0; i != lookups.names.size(); ++i) {
+        unsigned &atom = atoms[lookups.names[i]];
+        if (atom == 0) atom = (unsigned)atoms.size();
+        // joints and animation targets are then found by atom.
+        unsigned &index = indices[atom];
+        if (index == 0) index = i + 1;
+        sum += index;
+      }
+      return sum;
+    }
+
+    void benchmark_hash() {
+      static const char *urls[] = {
+        "assets/duck_triangulate.dae", "assets/jenga.dae", "assets/rollercoaster.dae", "assets/Laurana50k.dae",
+      };
+      typedef std::unordered_map<std::string, unsigned> std_string_map;
+      typedef std::unordered_map<unsigned, unsigned> std_int_map;
+
+      printf("\nhash tables: COLLADA id, url and atom lookups\n");
+      printf("  %-28s    ids   urls  names  octet ns  std ns\n", "file");
+      for (unsigned i = 0; i != sizeof(urls) / sizeof(urls[0]); ++i) {
+        xml_reader doc;
+        if (!doc.LoadFile(app_utils::get_path(urls[i]))) {
+          printf("  %s not found\n", urls[i]);
+          continue;
+        }
+        collada_lookups lookups;
+        get_collada_lookups(lookups, doc.RootElement());
+        unsigned num_lookups = lookups.ids.size() + lookups.urls.size() + lookups.names.size() * 2;
+
+        unsigned octet_sum = 0, std_sum = 0;
+        double octet_seconds = time_calls([&]() {
+          octet_sum = replay_lookups<dictionary<unsigned>, dictionary<unsigned>, hash_map<unsigned, unsigned> >(lookups);
+        });
+        double std_seconds = time_calls([&]() {
+          std_sum = replay_lookups<std_string_map, std_string_map, std_int_map>(lookups);
+        });
+        printf(
+          "  %-28s %6d %6d %6d %9.1f %7.1f%s\n", urls[i] + 7, lookups.ids.size(), lookups.urls.size(), lookups.names.size(),
+          octet_seconds / num_lookups * 1e9, std_seconds / num_lookups * 1e9, octet_sum == std_sum ? "" : "  FAILED"
+        );
+      }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Arrays
+    //
+
+    // seconds per item to push_back, to insert and erase at the front of a full array, and to copy.
+    template <class array_t, class item_t> static void time_array(double *seconds, const item_t *items, unsigned num_items) {
+      seconds[0] = time_calls([&]() {
+        array_t a;
+        for (unsigned i = 0; i != num_items; ++i) {
+          a.push_back(items[i]);
+        }
+      }) / num_items;
+
+      array_t a;
+      for (unsigned i = 0; i != num_items; ++i) {
+        a.push_back(items[i]);
+      }
+      seconds[1] = time_calls([&]() {
+        for (unsigned i = 0; i != 16; ++i) {
+          a.insert(a.begin(), items[i]);
+        }
+        for (unsigned i = 0; i != 16; ++i) {
+          a.erase(a.begin());
+        }
+      }) / 32;
+
+      seconds[2] = time_calls([&]() {
+        array_t b(a);
+        keep(b.data());
+      }) / num_items;
+    }
+
+    template <class item_t> static void benchmark_array(const char *name, const dynarray<item_t> &items) {
+      double dyn[3], std[3];
+      time_array<dynarray<item_t> >(dyn, items.data(), items.size());
+      time_array<std::vector<item_t> >(std, items.data(), items.size());
+      printf("  %-8s %9.2f %6.2f %10.1f %7.1f %9.2f %6.2f\n", name, dyn[0] * 1e9, std[0] * 1e9, dyn[1] * 1e6, std[1] * 1e6, dyn[2] * 1e9, std[2] * 1e9);
+    }
+
+    void benchmark_dynarray() {
+      enum { num_items = 100000 };
+      dynarray<int> ints(num_items);
+      dynarray<ref<resource> > refs(num_items);
+      dynarray<string> strings(num_items);
+      uint32_t seed = 0x2468;
+      for (unsigned i = 0; i != num_items; ++i) {
+        seed = seed * 1664525 + 1013904223;
+        ints[i] = (int)(seed >> 1);
+        refs[i] = new resource();
+        strings[i].format("node_%d", seed >> 16);
+      }
+
+      printf("\ndynarray and std::vector, %d items\n", num_items);
+      printf("  %-8s push_back ns     insert/erase us     copy ns\n", "");
+      printf("  %-8s  dynarray    std   dynarray     std  dynarray    std\n", "payload");
+      benchmark_array("int", ints);
+      benchmark_array("ref<>", refs);
+      benchmark_array("string", strings);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // JPEG decoding
+    //
+
+    void benchmark_jpeg() {
+      // hash_function::bytes() of the RGBA pixels from jpeg_decoder, the same with and without SSE2.
+      // When these were made, every pixel was within 5 of libjpeg's (PSNR 51 to 64 dB).
+      static const struct { const char *url; uint64_t checksum; } files[] = {
+        { "assets/NASA-Jupiter-512.jpg", 0x18c03bfdee133e30ull },
+        { "assets/duckCM.jpg", 0x07ea157ee5cc8cecull },
+        { "assets/grass.jpg", 0x297fb0e5892b8dc6ull },
+        { "assets/diamonds/idea_images/IMG-20161008-WA0000.jpg", 0x6d8bde643328e24eull },
+        { "assets/reije081.home.xs4all.nl/back.jpg", 0x72c60643e5f37e87ull },
+        { "assets/reije081.home.xs4all.nl/bottom.jpg", 0xad95dc3cd25dd919ull },
+        { "assets/reije081.home.xs4all.nl/front.jpg", 0xbdf60ab4eef2aa48ull },
+        { "assets/reije081.home.xs4all.nl/left.jpg", 0x41981287c7daa9c9ull },
+        { "assets/reije081.home.xs4all.nl/right.jpg", 0x461425d9d3d56052ull },
+        { "assets/reije081.home.xs4all.nl/top.jpg", 0x86fedf1cb6c23ec2ull },
+      };
+
+      printf("\njpeg decoding\n");
+      printf("  %-52s    size     MP/s  checksum\n", "image");
+      double total_pixels = 0, total_seconds = 0;
+      unsigned num_bad = 0;
+      for (unsigned i = 0; i != sizeof(files) / sizeof(files[0]); ++i) {
+        byte_span file;
+        app_utils::get_url(file, files[i].url);
+        if (file.size() == 0) {
+          printf("  %s not found\n", files[i].url);
+          continue;
+        }
+
+        jpeg_decoder dec;
+        dynarray<uint8_t> pixels;
+        uint16_t format = 0, width = 0, height = 0;
+        double seconds = time_calls([&]() {
+          // get_image() adds to the array, so empty it (keeping the memory) each time.
+          pixels.resize(0);
+          dec.get_image(pixels, format, width, height, file.begin(), file.end());
+        });
+        uint64_t checksum = hash_function::bytes(pixels.data(), pixels.size());
+        bool ok = checksum == files[i].checksum;
+        num_bad += !ok;
+        total_pixels += (double)width * height;
+        total_seconds += seconds;
+        printf(
+          "  %-52s %4dx%-4d %7.1f  %s", files[i].url + 7, width, height, width * height / seconds * 1e-6, ok ? "ok\n" : "FAILED"
+        );
+        if (!ok) printf(" %016llx\n", (unsigned long long)checksum);
+      }
+      printf("  %-52s %9s %7.1f  %s\n", "all", "", total_seconds ? total_pixels / total_seconds * 1e-6 : 0, num_bad ? "FAILED" : "ok");
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // JPEG encoding
+    //
+
+    // PSNR in dB of the RGB channels of two images with the same size.
+    static double get_rgb_psnr(const uint8_t *a, unsigned a_bpp, const uint8_t *b, unsigned b_bpp, size_t num_pixels) {
+      double sum = 0;
+      for (size_t i = 0; i != num_pixels; ++i) {
+        for (unsigned c = 0; c != 3; ++c) {
+          int diff = a[i * a_bpp + c] - b[i * b_bpp + c];
+          sum += diff * diff;
+        }
+      }
+      double mse = sum / (num_pixels * 3);
+      return mse == 0 ? 99 : 10 * log10(255.0 * 255.0 / mse);
+    }
+
+    void benchmark_jpeg_encode() {
+      static const char *urls[] = {
+        "assets/NASA-Jupiter-512.jpg", "assets/duckCM.jpg", "assets/grass.jpg", "assets/andyt.gif", "assets/particles.gif",
+        "assets/diamonds/idea_images/IMG-20161008-WA0000.jpg",
+      };
+      static const struct { int quality; jpeg_encoder::subsampling chroma; const char *name; } settings[] = {
+        { 50, jpeg_encoder::subsample_420, "q50 420" },
+        { 75, jpeg_encoder::subsample_420, "q75 420" },
+        { 90, jpeg_encoder::subsample_420, "q90 420" },
+        { 95, jpeg_encoder::subsample_444, "q95 444" },
+      };
+
+      printf("\njpeg encoding\n");
+      printf("  %-44s setting      bytes  bits/pix    MB/s     dB\n", "image");
+      for (unsigned i = 0; i != sizeof(urls) / sizeof(urls[0]); ++i) {
+        dynarray<uint8_t> pixels;
+        unsigned width, height, bpp;
+        if (!load_pixels(pixels, width, height, bpp, urls[i])) {
+          printf("  %s not found\n", urls[i]);
+          continue;
+        }
+
+        // the decoders write the bottom line first, so start at the top line and go backwards.
+        const uint8_t *top = pixels.data() + (size_t)(height - 1) * width * bpp;
+        int stride = -(int)(width * bpp);
+        for (unsigned s = 0; s != sizeof(settings) / sizeof(settings[0]); ++s) {
+          jpeg_encoder enc;
+          enc.set_quality(settings[s].quality);
+          enc.set_subsampling(settings[s].chroma);
+          dynarray<uint8_t> file;
+          double seconds = time_calls([&]() {
+            file.resize(0);
+            enc.encode(file, width, height, stride, top, bpp);
+          });
+
+          jpeg_decoder dec;
+          dynarray<uint8_t> decoded;
+          uint16_t format = 0, w = 0, h = 0;
+          dec.get_image(decoded, format, w, h, file.data(), file.data() + file.size());
+          double psnr = w == width && h == height ? get_rgb_psnr(pixels.data(), bpp, decoded.data(), 4, (size_t)width * height) : 0;
+
+          printf(
+            "  %-44s %s %10u %9.2f %7.1f %6.2f\n", s == 0 ? urls[i] + 7 : "", settings[s].name,
+            file.size(), file.size() * 8.0 / (width * height), (double)width * height * bpp / seconds * 1e-6, psnr
+          );
+        }
+      }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // OBJ loading
+    //
+
+    // write a bumpy grid of quads in four objects, like a scanned mesh, of about megabytes in size.
+    static bool write_test_obj(const char *path, unsigned megabytes) {
+      FILE *file = fopen(path, "wb");
+      if (!file) return false;
+
+      // about 165 bytes for each point (v, vt, vn and a face).
+      unsigned n = (unsigned)sqrt(megabytes * 1e6 / 165) + 2;
+      uint32_t seed = 0x1234;
+      fprintf(file, "# %dx%d test grid\n", n, n);
+      for (unsigned y = 0; y != n; ++y) {
+        for (unsigned x = 0; x != n; ++x) {
+          seed = seed * 1664525 + 1013904223;
+          float height = sinf(x * 0.05f) * cosf(y * 0.07f) + (seed >> 8) * (0.01f / 16777216);
+          fprintf(file, "v %.6f %.6f %.6f\n", x * 0.01f, height, y * 0.01f);
+        }
+      }
+      for (unsigned y = 0; y != n; ++y) {
+        for (unsigned x = 0; x != n; ++x) {
+          fprintf(file, "vt %.6f %.6f\n", (float)x / (n - 1), (float)y / (n - 1));
+        }
+      }
+      for (unsigned y = 0; y != n; ++y) {
+        for (unsigned x = 0; x != n; ++x) {
+          vec3 normal = normalize(vec3(-cosf(x * 0.05f) * cosf(y * 0.07f) * 5, 1, sinf(x * 0.05f) * sinf(y * 0.07f) * 7));
+          fprintf(file, "vn %.6f %.6f %.6f\n", normal.x(), normal.y(), normal.z());
+        }
+      }
+      for (unsigned y = 0; y != n - 1; ++y) {
+        if (y % ((n + 2) / 4) == 0) fprintf(file, "o part%d\n", y / ((n + 2) / 4));
+        for (unsigned x = 0; x != n - 1; ++x) {
+          unsigned a = y * n + x + 1, b = a + 1, c = a + n + 1, d = a + n;
+          fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n", a, a, a, b, b, b, c, c, c, d, d, d);
+        }
+      }
+      return fclose(file) == 0;
+    }
+
+    void benchmark_obj() {
+      const char *url = obj_url ? obj_url : "obj_benchmark.obj";
+      printf("\nobj loading\n");
+      if (!obj_url) {
+        printf("  writing a %d MB test file\n", obj_megabytes);
+        if (!write_test_obj(app_utils::get_path(url), obj_megabytes)) {
+          printf("  can't write %s\n", app_utils::get_path(url));
+          return;
+        }
+      }
+
+      {
+        // read the file once so that it comes from the file cache in the timed loads.
+        byte_span file;
+        app_utils::get_url(file, url);
+        double megabytes = file.size() * 1e-6;
+        file.reset();
+
+        printf("  %-10s %8s %10s %10s %10s\n", "threads", "MB", "triangles", "MB/s", "Mtri/s");
+        job_pool *pools[] = { NULL, &job_pool::get_shared() };
+        for (unsigned i = 0; i != 2; ++i) {
+          if (i && job_pool::get_shared().get_num_threads() == 1) break;
+          unsigned num_triangles = 0;
+          double seconds = time_calls([&]() {
+            obj_loader loader;
+            loader.set_job_pool(pools[i]);
+            resource_dict dict;
+            loader.load(url, dict, NULL);
+
+            dynarray<resource*> meshes;
+            dict.find_all(meshes, atom_mesh);
+            num_triangles = 0;
+            for (unsigned j = 0; j != meshes.size(); ++j) {
+              num_triangles += meshes[j]->get_mesh()->get_num_indices() / 3;
+            }
+          }, 1.0);
+          printf(
+            "  %-10d %8.1f %10d %10.1f %10.2f\n", i ? job_pool::get_shared().get_num_threads() : 1,
+            megabytes, num_triangles, megabytes / seconds, num_triangles / seconds * 1e-6
+          );
+        }
+      }
+
+      if (!obj_url) remove(app_utils::get_path(url));
+    }
+
+  public:
+    /// this is called when we construct the class before everything is initialised.
+    example_codecs(int argc, char **argv) : app(argc, argv) {
+      run_names = NULL;
+      obj_url = NULL;
+      obj_megabytes = 64;
+      for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--run=", 6)) run_names = argv[i] + 6;
+        if (!strncmp(argv[i], "--obj=", 6)) obj_url = argv[i] + 6;
+        if (!strncmp(argv[i], "--obj_mb=", 9)) obj_megabytes = (unsigned)atoi(argv[i] + 9);
+      }
+    }
+
+    /// this is called once OpenGL is initialized
+    void app_init() {
+      printf("threads: %d\n", job_pool::get_shared().get_num_threads());
+      if (should_run("dxt")) benchmark_dxt();
+      if (should_run("zip")) benchmark_zip();
+      if (should_run("animation")) benchmark_animation();
+      if (should_run("allocator")) benchmark_allocator();
+      if (should_run("hash")) benchmark_hash();
+      if (should_run("dynarray")) benchmark_dynarray();
+      if (should_run("jpeg")) benchmark_jpeg();
+      if (should_run("jpeg_encode")) benchmark_jpeg_encode();
+      if (should_run("obj")) benchmark_obj();
+    }
+
+    /// this is called to draw the world
+    void draw_world(int x, int y, int w, int h) {
+      glViewport(x, y, w, h);
+      glClearColor(0, 0, 0, 1);
+      glClear(GL_COLOR_BUFFER_BIT);
+    }
+  };
+}
@@ -0,0 +1,27 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Text overlay
+//
+
+#include "../../octet.h"
+
+#include "example_codecs.h"
+
+/// Measure the codecs with octet
+int main(int argc, char **argv) {
+  // set up the platform.
+  octet::app::init_all(argc, argv);
+
+  // our application.
+  octet::example_codecs app(argc, argv);
+  app.init();
+
+  // open windows
+  octet::app::run_all_apps();
+}
+
+
@@ -0,0 +1,388 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+namespace octet {
+  /// A crowd of skinned characters sharing three animations in layers:
+  /// a base wiggle, a faster one on the upper body and an additive sway.
+  /// Run with OCTET_HEADLESS and --benchmark to measure the animation phase.
+  ///
+  /// --hierarchy first times the world matrices of a 100000 node tree, with the old walk up
+  /// the parent chain for every node and with visual_scene::update_transforms().
+  ///
+  /// --skinning times the crowd's matrix palettes (skeleton::calc_transforms) and skinning
+  /// every character on the CPU (mesh_instance::calc_cpu_skin), and checks the skinned positions.
+  class example_crowd : public app {
+    // scene for drawing the crowd
+    ref<visual_scene> app_scene;
+
+    // --hierarchy on the command line
+    bool hierarchy;
+
+    // --skinning on the command line
+    bool skinning;
+
+    enum {
+      num_bones = 16,
+      num_sides = 12,
+      rings_per_bone = 2,
+      num_x = 40,
+      num_z = 25,
+    };
+
+    // vertex for the skin shader. The first bone's weight is one minus the others.
+    struct skinned_vertex {
+      vec3p pos;
+      vec3p normal;
+      vec2p uv;
+      float weights[3];
+      float indices[4];
+    };
+
+    // distance between the bones of a character
+    static float bone_length() { return 0.5f; }
+
+    // the two bones that a ring of the tube follows and how much of the second one to use.
+    static void get_ring_bones(unsigned ring, unsigned &bone, unsigned &next, float &blend) {
+      float bone_pos = (float)ring / rings_per_bone;
+      bone = (unsigned)bone_pos < num_bones - 1 ? (unsigned)bone_pos : num_bones - 1;
+      blend = bone_pos - bone < 1 ? bone_pos - bone : 1;
+      next = bone + 1 < num_bones ? bone + 1 : bone;
+    }
+
+    // a tube around the bones, with each ring blended between two bones.
+    mesh *make_character_mesh(skin *skn) {
+      dynarray<skinned_vertex> vertices;
+      dynarray<uint32_t> indices;
+      unsigned num_rings = num_bones * rings_per_bone + 1;
+      for (unsigned ring = 0; ring != num_rings; ++ring) {
+        float y = ring * (bone_length() / rings_per_bone);
+        unsigned bone, next;
+        float blend;
+        get_ring_bones(ring, bone, next, blend);
+        float radius = 0.4f - y * 0.02f;
+        for (unsigned side = 0; side <= num_sides; ++side) {
+          float angle = side * (3.14159265f * 2 / num_sides);
+          skinned_vertex v;
+          v.pos = vec3p(cosf(angle) * radius, y, sinf(angle) * radius);
+          v.normal = vec3p(cosf(angle), 0, sinf(angle));
+          v.uv = vec2p((float)side / num_sides, (float)ring / (num_rings - 1));
+          v.weights[0] = blend;
+          v.weights[1] = 0;
+          v.weights[2] = 0;
+          v.indices[0] = (float)bone;
+          v.indices[1] = (float)next;
+          v.indices[2] = 0;
+          v.indices[3] = 0;
+          vertices.push_back(v);
+        }
+      }
+
+      for (unsigned ring = 0; ring + 1 < num_rings; ++ring) {
+        for (unsigned side = 0; side != num_sides; ++side) {
+          uint32_t i0 = ring * (num_sides + 1) + side;
+          uint32_t i1 = i0 + num_sides + 1;
+          indices.push_back(i0);
+          indices.push_back(i1);
+          indices.push_back(i0 + 1);
+          indices.push_back(i0 + 1);
+          indices.push_back(i1);
+          indices.push_back(i1 + 1);
+        }
+      }
+
+      mesh *msh = new mesh(skn);
+      msh->add_attribute(attribute_pos, 3, GL_FLOAT, 0);
+      msh->add_attribute(attribute_normal, 3, GL_FLOAT, 12);
+      msh->add_attribute(attribute_uv, 2, GL_FLOAT, 24);
+      msh->add_attribute(attribute_blendweight, 3, GL_FLOAT, 32);
+      msh->add_attribute(attribute_blendindices, 4, GL_FLOAT, 44);
+      msh->set_params(sizeof(skinned_vertex), indices.size(), vertices.size(), GL_TRIANGLES, GL_UNSIGNED_INT);
+      msh->allocate(sizeof(skinned_vertex) * vertices.size(), sizeof(uint32_t) * indices.size(), vertices.data(), indices.data());
+      msh->calc_aabb();
+      return msh;
+    }
+
+    // a one second wiggle of every bone, with some cycles per second.
+    animation *make_animation(atom_t *sids, int cycles, float degrees) {
+      enum { num_keys = 9 };
+      animation *anim = new animation();
+      float times[num_keys];
+      for (int i = 0; i != num_keys; ++i) {
+        times[i] = i * (1.0f / (num_keys - 1));
+      }
+
+      for (int bone = 0; bone != num_bones; ++bone) {
+        float values[num_keys * 16];
+        for (int i = 0; i != num_keys; ++i) {
+          float angle = sinf(times[i] * (3.14159265f * 2 * cycles) + bone * 0.4f) * degrees;
+          mat4t nodeToParent;
+          nodeToParent.loadIdentity();
+          if (bone != 0) nodeToParent.translate(0, bone_length(), 0);
+          nodeToParent.rotateZ(angle);
+          nodeToParent.rotateX(angle * 0.5f);
+          // channels store matrices as in collada files, which are transposed.
+          memcpy(values + i * 16, nodeToParent.transpose4x4().get(), sizeof(float) * 16);
+        }
+        anim->add_channel(NULL, sids[bone], atom_transform, atom_, times, num_keys, values, num_keys * 16);
+      }
+      return anim;
+    }
+
+    // the old calcModelToWorld(): multiply up the parent chain every time.
+    static mat4t walk_chain(scene_node *node) {
+      mat4t result = node->get_nodeToParent();
+      for (scene_node *p = node->get_parent(); p != NULL; p = p->get_parent()) {
+        result = result * p->get_nodeToParent();
+      }
+      return result;
+    }
+
+    void benchmark_hierarchy() {
+      enum { num_nodes = 100000, num_moved = num_nodes / 100, num_frames = 20 };
+      uint32_t seed = 0x4321;
+      auto random = [&seed]() {
+        seed = seed * 1664525 + 1013904223;
+        return seed >> 8;
+      };
+
+      // half the nodes carry on a chain, the rest branch off anywhere.
+      ref<visual_scene> scene = new visual_scene();
+      dynarray<scene_node*> nodes(num_nodes);
+      dynarray<unsigned> depths(num_nodes);
+      unsigned max_depth = 0;
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        unsigned parent = i == 0 ? ~0 : random() & 1 ? i - 1 : random() % i;
+        nodes[i] = new scene_node();
+        nodes[i]->translate(vec3(0.1f, 0.2f, 0));
+        nodes[i]->rotate((float)(random() % 16), vec3(0, 0, 1));
+        (parent == ~0 ? (scene_node*)scene : nodes[parent])->add_child(nodes[i]);
+        depths[i] = parent == ~0 ? 1 : depths[parent] + 1;
+        max_depth = std::max(max_depth, depths[i]);
+      }
+      scene->update_transforms();
+
+      // every frame moves some nodes and then reads every world matrix.
+      double walk_seconds = 0, update_seconds = 0, read_seconds = 0, root_seconds = 0;
+      float max_error = 0;
+      for (unsigned frame = 0; frame != num_frames; ++frame) {
+        double start = frame_timer::now();
+        for (unsigned i = 0; i != num_moved; ++i) {
+          nodes[random() % num_nodes]->translate(vec3(0, 0, 0.01f));
+        }
+        scene->update_transforms();
+        double updated = frame_timer::now();
+        vec3 sum(0, 0, 0);
+        for (unsigned i = 0; i != num_nodes; ++i) {
+          sum += nodes[i]->calcModelToWorld().w().xyz();
+        }
+        double read = frame_timer::now();
+        vec3 walk_sum(0, 0, 0);
+        for (unsigned i = 0; i != num_nodes; ++i) {
+          walk_sum += walk_chain(nodes[i]).w().xyz();
+        }
+        double walked = frame_timer::now();
+        update_seconds += updated - start;
+        read_seconds += read - updated;
+        walk_seconds += walked - read;
+
+        // moving the root makes every node dirty.
+        start = frame_timer::now();
+        nodes[0]->translate(vec3(0.01f, 0, 0));
+        scene->update_transforms();
+        root_seconds += frame_timer::now() - start;
+
+        for (unsigned i = frame; i < num_nodes; i += num_frames) {
+          vec3 error = abs(nodes[i]->calcModelToWorld().w().xyz() - walk_chain(nodes[i]).w().xyz());
+          max_error = std::max(max_error, std::max(error.x(), std::max(error.y(), error.z())));
+        }
+        keep_sums(sum, walk_sum);
+      }
+
+      printf("hierarchy: %d nodes, max depth %d, %d moved per frame\n", num_nodes, max_depth, num_moved);
+      printf("  chain walk for every node       %7.2f ms\n", walk_seconds / num_frames * 1000);
+      printf("  update_transforms               %7.2f ms\n", update_seconds / num_frames * 1000);
+      printf("  read the cached matrices        %7.2f ms\n", read_seconds / num_frames * 1000);
+      printf("  update_transforms, root moved   %7.2f ms\n", root_seconds / num_frames * 1000);
+      printf("  largest difference              %9.2e%s\n", max_error, max_error < 1e-3f ? "" : "  FAILED");
+    }
+
+    void benchmark_skinning() {
+      enum { num_frames = 20 };
+      job_pool &pool = job_pool::get_shared();
+      int num_instances = app_scene->get_num_mesh_instances();
+      dynarray<mat4t*> palettes(num_instances);
+
+      // the first pass makes the CPU skinned meshes.
+      for (int i = 0; i != num_instances; ++i) {
+        mesh_instance *mi = app_scene->get_mesh_instance(i);
+        palettes[i] = mi->get_skeleton()->calc_transforms(mi->get_node()->calcModelToWorld(), mi->get_mesh()->get_skin());
+        mi->calc_cpu_skin(palettes[i], mi->get_mesh()->get_skin()->get_num_joints(), NULL);
+      }
+
+      // every frame animates the crowd, then makes the palettes and skins every character.
+      double palette_seconds = 0, skin_seconds = 0, pool_seconds = 0;
+      unsigned num_matrices = 0, num_vertices = 0;
+      float max_error = 0;
+      for (unsigned frame = 0; frame != num_frames; ++frame) {
+        app_scene->update(1.0f/30);
+
+        double start = frame_timer::now();
+        for (int i = 0; i != num_instances; ++i) {
+          mesh_instance *mi = app_scene->get_mesh_instance(i);
+          palettes[i] = mi->get_skeleton()->calc_transforms(mi->get_node()->calcModelToWorld(), mi->get_mesh()->get_skin());
+        }
+        double made = frame_timer::now();
+        for (int i = 0; i != num_instances; ++i) {
+          mesh_instance *mi = app_scene->get_mesh_instance(i);
+          mi->calc_cpu_skin(palettes[i], mi->get_mesh()->get_skin()->get_num_joints(), NULL);
+        }
+        double skinned = frame_timer::now();
+        for (int i = 0; pool.get_num_threads() > 1 && i != num_instances; ++i) {
+          mesh_instance *mi = app_scene->get_mesh_instance(i);
+          mi->calc_cpu_skin(palettes[i], mi->get_mesh()->get_skin()->get_num_joints(), &pool);
+        }
+        double pooled = frame_timer::now();
+        palette_seconds += made - start;
+        skin_seconds += skinned - made;
+        pool_seconds += pooled - skinned;
+
+        // blend the two bones of each vertex of one character by hand.
+        int checked = frame * 37 % num_instances;
+        mesh_instance *mi = app_scene->get_mesh_instance(checked);
+        const mat4t *palette = palettes[checked];
+        mesh *skinned_mesh = mi->calc_cpu_skin(palette, mi->get_mesh()->get_skin()->get_num_joints(), NULL);
+        gl_resource::rolock src(mi->get_mesh()->get_vertices());
+        gl_resource::rolock dest(skinned_mesh->get_vertices());
+        const skinned_vertex *src_vertices = (const skinned_vertex*)src.u8();
+        const mesh::vertex *dest_vertices = (const mesh::vertex*)dest.u8();
+        unsigned num_mesh_vertices = mi->get_mesh()->get_num_vertices();
+        for (unsigned i = 0; i != num_mesh_vertices; ++i) {
+          unsigned bone, next;
+          float blend;
+          get_ring_bones(i / (num_sides + 1), bone, next, blend);
+          vec4 pos = vec4(src_vertices[i].pos, 1);
+          vec3 expected = (pos * palette[bone] * (1 - blend) + pos * palette[next] * blend).xyz();
+          vec3 error = abs(expected - vec3(dest_vertices[i].pos));
+          max_error = std::max(max_error, std::max(error.x(), std::max(error.y(), error.z())));
+        }
+
+        for (int i = 0; i != num_instances; ++i) {
+          mesh_instance *mi = app_scene->get_mesh_instance(i);
+          num_matrices += mi->get_mesh()->get_skin()->get_num_joints();
+          num_vertices += mi->get_mesh()->get_num_vertices();
+        }
+      }
+
+      printf("skinning: %d characters, %d joints and %d vertices each\n", num_instances, (int)num_bones, num_vertices / num_frames / num_instances);
+      printf("  calc_transforms                 %7.2f ms %8.2f M matrices/s\n", palette_seconds / num_frames * 1000, num_matrices / palette_seconds * 1e-6);
+      printf("  calc_cpu_skin, 1 thread         %7.2f ms %8.2f M vertices/s\n", skin_seconds / num_frames * 1000, num_vertices / skin_seconds * 1e-6);
+      if (pool.get_num_threads() > 1) {
+        printf("  calc_cpu_skin, %2d threads       %7.2f ms %8.2f M vertices/s\n", pool.get_num_threads(), pool_seconds / num_frames * 1000, num_vertices / pool_seconds * 1e-6);
+      }
+      printf("  largest difference              %9.2e%s\n", max_error, max_error < 1e-3f ? "" : "  FAILED");
+    }
+
+    // publish the sums so that the compiler can't drop the loops that made them.
+    static void keep_sums(const vec3 &a, const vec3 &b) {
+      static volatile float kept;
+      kept = a.x() + b.x();
+    }
+
+  public:
+    /// this is called when we construct the class before everything is initialised.
+    example_crowd(int argc, char **argv) : app(argc, argv) {
+      hierarchy = false;
+      skinning = false;
+      for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--hierarchy")) hierarchy = true;
+        if (!strcmp(argv[i], "--skinning")) skinning = true;
+      }
+    }
+
+    /// this is called once OpenGL is initialized
+    void app_init() {
+      if (hierarchy) {
+        benchmark_hierarchy();
+      }
+
+      app_scene =  new visual_scene();
+      app_scene->create_default_camera_and_lights();
+      app_scene->get_camera_instance(0)->set_far_plane(1000);
+      scene_node *cam_node = app_scene->get_camera_instance(0)->get_node();
+      cam_node->translate(vec3(0, 30, 100));
+      cam_node->rotate(-15, vec3(1, 0, 0));
+
+      atom_t sids[num_bones];
+      skin *skn = new skin(mat4t());
+      for (int bone = 0; bone != num_bones; ++bone) {
+        char name[32];
+        sprintf(name, "bone%d", bone);
+        sids[bone] = app_utils::get_atom(name);
+
+        // from the model to the bone in the bind pose
+        mat4t bindToModel;
+        bindToModel.loadIdentity();
+        bindToModel.translate(0, -bone * bone_length(), 0);
+        skn->add_joint(bindToModel, sids[bone]);
+      }
+
+      mesh *msh = make_character_mesh(skn);
+      material *mat = new material(vec4(0.8f, 0.6f, 0.4f, 1));
+      animation *base = make_animation(sids, 1, 10);
+      animation *upper = make_animation(sids, 2, 20);
+      animation *sway = make_animation(sids, 1, 5);
+
+      printf("generating %d skinned characters\n", num_x * num_z);
+
+      // every character has its own nodes, skeleton and place in the animation.
+      for (int x = 0; x != num_x; ++x) {
+        for (int z = 0; z != num_z; ++z) {
+          scene_node *root = new scene_node();
+          root->translate(vec3((x - num_x * 0.5f) * 3.0f, 0, -z * 3.0f));
+          app_scene->add_child(root);
+
+          skeleton *skel = new skeleton();
+          scene_node *parent = root;
+          for (int bone = 0; bone != num_bones; ++bone) {
+            mat4t nodeToParent;
+            nodeToParent.loadIdentity();
+            if (bone != 0) nodeToParent.translate(0, bone_length(), 0);
+            scene_node *node = new scene_node(nodeToParent, sids[bone]);
+            parent->add_child(node);
+            skel->add_bone(node, bone - 1);
+            parent = node;
+          }
+
+          app_scene->add_mesh_instance(new mesh_instance(root, msh, mat, skel));
+
+          // the upper body layer only moves the bones from the middle up.
+          animation_instance *inst = new animation_instance(base, root, true);
+          inst->set_time(((x * 7 + z * 13) % 16) * (1.0f / 16));
+          inst->add_layer(upper, 0.7f, animation_instance::layer_override, root->find_sid(sids[num_bones/2]));
+          inst->add_layer(sway, 0.5f, animation_instance::layer_additive);
+          app_scene->add_animation_instance(inst);
+        }
+      }
+
+      if (skinning) {
+        benchmark_skinning();
+      }
+    }
+
+    /// this is called to draw the world
+    void draw_world(int x, int y, int w, int h) {
+      int vx = 0, vy = 0;
+      get_viewport_size(vx, vy);
+      app_scene->begin_render(vx, vy);
+
+      // update matrices. assume 30 fps.
+      app_scene->update(1.0f/30);
+
+      // draw the scene
+      app_scene->render((float)vx / vy);
+    }
+  };
+}
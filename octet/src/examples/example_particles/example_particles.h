@@ -6,6 +6,8 @@
 //
 namespace octet {
   /// Scene containing a particle system
+  ///
+  /// Run with --benchmark to time animate() and update() on a million particles first.
   class example_particles : public app {
     // scene for drawing box
     ref<visual_scene> app_scene;
@@ -14,13 +16,70 @@ namespace octet {
     ref<mesh_particle_system> system;
 
     random r;
+
+    // --benchmark on the command line
+    bool benchmark;
+
+    // time the simulation and the vertices of a million particles that live for the whole run.
+    void run_benchmark() {
+      enum { num_particles = 1000000, num_frames = 10 };
+      ref<mesh_particle_system> sys = new mesh_particle_system(aabb(vec3(0, 0, 0), vec3(1, 1, 1)), num_particles, 16);
+      sys->set_job_pool(&job_pool::get_shared());
+      random rand(1);
+      for (int i = 0; i != num_particles; ++i) {
+        mesh_particle_system::billboard_particle p;
+        memset(&p, 0, sizeof(p));
+        p.pos = vec3p(rand.get(-1.0f, 1.0f), rand.get(-1.0f, 1.0f), rand.get(-1.0f, 1.0f));
+        p.size = vec2p(0.5f, 0.25f);
+        p.uv_bottom_left = vec2p(0, 1);
+        p.uv_top_right = vec2p(0.125f, 1-0.125f);
+        p.enabled = true;
+
+        mesh_particle_system::particle_animator pa;
+        memset(&pa, 0, sizeof(pa));
+        pa.link = sys->add_billboard_particle(p);
+        pa.acceleration = vec3p(0, -9.8f, 0);
+        pa.vel = vec3p(rand.get(-3.0f, 3.0f), rand.get(5.0f, 15.0f), 0.0f);
+        pa.lifetime = num_frames * 2;
+        pa.spin = 1000;
+        sys->add_particle_animator(pa);
+      }
+
+      mat4t cameraToWorld;
+      cameraToWorld.rotateY(30);
+      cameraToWorld.rotateX(10);
+      sys->set_cameraToWorld(cameraToWorld);
+
+      double best_animate = 1e9, best_update = 1e9;
+      for (int frame = 0; frame != num_frames; ++frame) {
+        double start = frame_timer::now();
+        sys->animate(1.0f/30);
+        double animated = frame_timer::now();
+        sys->update();
+        double updated = frame_timer::now();
+        best_animate = std::min(best_animate, animated - start);
+        best_update = std::min(best_update, updated - animated);
+      }
+      printf(
+        "%d particles, %d threads: simulate %.2f ms, vertices %.2f ms (best of %d frames)\n",
+        sys->get_num_billboard_particles(), job_pool::get_shared().get_num_threads(), best_animate * 1000, best_update * 1000, num_frames
+      );
+    }
   public:
     /// this is called when we construct the class before everything is initialised.
     example_particles(int argc, char **argv) : app(argc, argv) {
+      benchmark = false;
+      for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--benchmark")) benchmark = true;
+      }
     }
 
     /// this is called once OpenGL is initialized
     void app_init() {
+      if (benchmark) {
+        run_benchmark();
+      }
+
       app_scene =  new visual_scene();
       app_scene->create_default_camera_and_lights();
 
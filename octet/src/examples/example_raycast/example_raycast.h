@@ -6,6 +6,9 @@
 //
 namespace octet {
   /// Scene containing a box with octet.
+  ///
+  /// Run with --benchmark to cast a million rays at the duck and the COLLADA sample scenes first.
+  /// 3000 rays per scene are also checked against a brute force test of every triangle.
   class example_raycast : public app {
     // scene for drawing box
     ref<visual_scene> app_scene;
@@ -14,13 +17,171 @@ namespace octet {
 
     ref<param_uniform> camera_pos;
 
+    // --benchmark on the command line
+    bool benchmark;
+
+    // the triangles of a mesh instance in model space, for the brute force test.
+    struct brute_force_instance {
+      mesh_instance *mi;
+      mat4t worldToModel;
+      dynarray<vec3> corners;
+    };
+
+    static void get_brute_force_instances(dynarray<brute_force_instance> &instances, visual_scene *scene) {
+      for (int i = 0; i != scene->get_num_mesh_instances(); ++i) {
+        mesh_instance *mi = scene->get_mesh_instance(i);
+        mesh *msh = mi ? mi->get_mesh() : NULL;
+        unsigned slot = msh ? msh->get_slot(attribute_pos) : ~0;
+        if (!mi->get_node() || slot == ~0 || msh->get_mode() != GL_TRIANGLES || msh->get_kind(slot) != GL_FLOAT) continue;
+
+        instances.resize(instances.size() + 1);
+        brute_force_instance &inst = instances.back();
+        inst.mi = mi;
+        inst.worldToModel = mi->get_node()->calcModelToWorld().inverse3x4();
+        gl_resource::rolock vtx_lock(msh->get_vertices());
+        const uint8_t *pos = vtx_lock.u8() + msh->get_offset(slot);
+        auto get_pos = [&](unsigned index) {
+          const float *src = (const float*)(pos + index * msh->get_stride());
+          return vec3(src[0], src[1], src[2]);
+        };
+        unsigned num_corners = msh->get_index_type() ? msh->get_num_indices() : msh->get_num_vertices();
+        if (msh->get_index_type()) {
+          gl_resource::rolock idx_lock(msh->get_indices());
+          for (unsigned j = 0; j != num_corners / 3 * 3; ++j) {
+            inst.corners.push_back(get_pos(msh->get_index(idx_lock.u8(), j)));
+          }
+        } else {
+          for (unsigned j = 0; j != num_corners / 3 * 3; ++j) {
+            inst.corners.push_back(get_pos(j));
+          }
+        }
+      }
+    }
+
+    // nearest hit on any triangle of any instance, with the same test as mesh::ray_cast.
+    static float brute_force_cast(const dynarray<brute_force_instance> &instances, const ray &the_ray) {
+      float best_t = 2;
+      for (unsigned i = 0; i != instances.size(); ++i) {
+        const brute_force_instance &inst = instances[i];
+        ray model_ray = the_ray.get_transform(inst.worldToModel);
+        vec3 org = model_ray.get_start();
+        vec3 dir = model_ray.get_distance();
+        for (unsigned j = 0; j != inst.corners.size(); j += 3) {
+          vec3 a = inst.corners[j];
+          vec3 e1 = inst.corners[j + 1] - a;
+          vec3 e2 = inst.corners[j + 2] - a;
+          vec3 p = cross(dir, e2);
+          float det = dot(e1, p);
+          if (fabsf(det) < 1e-20f) continue;
+          float inv_det = 1.0f / det;
+          vec3 s = org - a;
+          float u = dot(s, p) * inv_det;
+          if (u < 0 || u > 1) continue;
+          vec3 q = cross(s, e1);
+          float v = dot(dir, q) * inv_det;
+          if (v < 0 || u + v > 1) continue;
+          float t = dot(e2, q) * inv_det;
+          if (t >= 0 && t <= 1 && t < best_t) best_t = t;
+        }
+      }
+      return best_t;
+    }
+
+    // rays from a sphere around the scene through random points in its bounds.
+    static void make_rays(dynarray<ray> &rays, const aabb &bounds, unsigned num_rays) {
+      uint32_t seed = 0x1357;
+      auto random = [&seed](float lo, float hi) {
+        seed = seed * 1664525 + 1013904223;
+        return lo + (hi - lo) * (seed >> 8) * (1.0f / 16777216);
+      };
+      vec3 center = bounds.get_center(), half = bounds.get_half_extent();
+      float radius = half.length() * 2;
+      rays.resize(num_rays);
+      for (unsigned i = 0; i != num_rays; ++i) {
+        vec3 dir = normalize(vec3(random(-1, 1), random(-1, 1), random(-1, 1)) + vec3(0, 0, 1e-6f));
+        vec3 start = center + dir * radius;
+        vec3 target = center + half * vec3(random(-1, 1), random(-1, 1), random(-1, 1));
+        rays[i] = ray(start, start + (target - start) * 2);
+      }
+    }
+
+    void run_benchmark() {
+      static const char *urls[] = { "assets/duck_triangulate.dae", "assets/Laurana50k.dae", "assets/jenga.dae" };
+      enum { num_rays = 1000000, num_checked = 3000, batch_size = 4096 };
+
+      printf("ray casts: %d rays per scene, %d checked against brute force\n", num_rays, num_checked);
+      printf("  %-24s instances triangles  us/ray  hits   brute us/ray  mismatches\n", "scene");
+      for (unsigned i = 0; i != sizeof(urls) / sizeof(urls[0]); ++i) {
+        collada_builder loader;
+        resource_dict dict;
+        dynarray<resource*> scenes;
+        if (loader.load_xml(urls[i])) {
+          loader.get_resources(dict);
+          dict.find_all(scenes, atom_visual_scene);
+        }
+        visual_scene *scene = scenes.size() ? scenes[0]->get_visual_scene() : NULL;
+        if (!scene || !scene->get_num_mesh_instances()) {
+          printf("  %s not found\n", urls[i]);
+          continue;
+        }
+        scene->update(0);
+
+        dynarray<brute_force_instance> instances;
+        get_brute_force_instances(instances, scene);
+        unsigned num_triangles = 0;
+        for (unsigned j = 0; j != instances.size(); ++j) {
+          num_triangles += instances[j].corners.size() / 3;
+        }
+
+        dynarray<ray> rays;
+        make_rays(rays, scene->get_world_aabb(), num_rays);
+        dynarray<visual_scene::cast_result> results(batch_size);
+
+        // the first cast builds the BVHs.
+        scene->cast_rays(results.data(), rays.data(), 1);
+        unsigned num_hits = 0;
+        double start = frame_timer::now();
+        for (unsigned j = 0; j < num_rays; j += batch_size) {
+          num_hits += scene->cast_rays(results.data(), rays.data() + j, std::min((unsigned)batch_size, num_rays - j));
+        }
+        double seconds = frame_timer::now() - start;
+
+        // check that the BVH finds the nearest triangle.
+        unsigned num_mismatches = 0;
+        start = frame_timer::now();
+        for (unsigned j = 0; j != num_checked; ++j) {
+          visual_scene::cast_result result;
+          scene->cast_ray(result, rays[j]);
+          float expected = brute_force_cast(instances, rays[j]);
+          bool hit = result.mi != NULL, expected_hit = expected <= 1;
+          if (hit != expected_hit || (hit && fabsf(result.hit.t - expected) > 1e-5f)) {
+            num_mismatches++;
+          }
+        }
+        double brute_seconds = frame_timer::now() - start;
+
+        printf(
+          "  %-24s %9d %9d %7.2f %4.0f%% %14.1f %11d%s\n", urls[i] + 7, instances.size(), num_triangles,
+          seconds / num_rays * 1e6, num_hits * 100.0 / num_rays, brute_seconds / num_checked * 1e6, num_mismatches, num_mismatches ? "  FAILED" : ""
+        );
+      }
+    }
+
   public:
     /// this is called when we construct the class before everything is initialised.
     example_raycast(int argc, char **argv) : app(argc, argv) {
+      benchmark = false;
+      for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--benchmark")) benchmark = true;
+      }
     }
 
     /// this is called once OpenGL is initialized
     void app_init() {
+      if (benchmark) {
+        run_benchmark();
+      }
+
       app_scene =  new visual_scene();
       app_scene->create_default_camera_and_lights();
 
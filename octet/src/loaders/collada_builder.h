@@ -6,7 +6,8 @@
 //
 // load a COLLADA file.
 //
-// This class uses "tiny xml" a handy little XML reader
+// This class uses xml_reader, which parses the file in place. Define OCTET_COLLADA_TINYXML
+// to use "tiny xml" a handy little XML reader instead.
 //
 // Do not read this until you have a good understanding of C++ coding, it will melt your mind.
 // It is, however, one of the smallest COLLADA readers in the Universe of its kind.
@@ -15,6 +16,9 @@
 // On the surface it looks like a GL model, but adds many unresolvable abstractions.
 // A new standard, glTF looks more tractable with a more GL-like model. Unfortunately,
 // there are very few direct exporters as yet.
+//
+// The first time we load a file, we save what we made in a binary cache (see collada_cache.h)
+// next to the file. After that we load the cache instead of the XML.
 
 // mesh builder class for standard meshes.
 namespace octet { namespace loaders {
@@ -27,24 +31,50 @@ namespace octet { namespace loaders {
     // 0 = none, 1 = summary, 2 = details
     enum { debug = 0 };
 
-    TiXmlDocument doc;
+    #ifdef OCTET_COLLADA_TINYXML
+      typedef TiXmlDocument xml_document;
+      typedef TiXmlElement xml_element;
+    #else
+      typedef xml_reader xml_document;
+      typedef xml_reader::element xml_element;
+    #endif
+
+    xml_document doc;
     string doc_path;
-    dictionary<TiXmlElement *, allocator> ids;
+    dictionary<xml_element *, allocator> ids;
     dynarray<float> temp_floats;
 
+    // binary cache of the file. If this is loaded, doc is empty.
+    collada_cache cache;
+    string cache_path;
+    uint64_t source_hash;
+    uint64_t source_size;
+    bool use_cache;
+
+    // records what we make in get_resources() to write the cache.
+    collada_cache_writer *writer;
+
     // find all the ids in an xml file
-    void find_ids(TiXmlElement *parent) {
-      for (TiXmlElement *elem = parent->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
-        const char *attrib = elem->Attribute("id");
-        if (attrib) {
-          //printf("%s %s\n", elem->Value(), attrib);
-          ids[attrib] = elem;
+    void find_ids(xml_element *parent) {
+      #ifdef OCTET_COLLADA_TINYXML
+        for (xml_element *elem = parent->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
+          const char *attrib = elem->Attribute("id");
+          if (attrib) {
+            //printf("%s %s\n", elem->Value(), attrib);
+            ids[attrib] = elem;
+          }
+          find_ids(elem);
         }
-        find_ids(elem);
-      }
+      #else
+        // xml_reader found them while parsing.
+        const dynarray<xml_element *> &with_ids = doc.get_elements_with_ids();
+        for (unsigned i = 0; i != with_ids.size(); ++i) {
+          ids[with_ids[i]->Attribute("id")] = with_ids[i];
+        }
+      #endif
     }
 
-    TiXmlElement *find_id(const char *source) {
+    xml_element *find_id(const char *source) {
       if (source) {
         if (source[0] == '#') source++;
         return ids[source];
@@ -52,23 +82,23 @@ namespace octet { namespace loaders {
       return 0;
     }
 
-    TiXmlElement *child(TiXmlElement *parent, const char *value) {
+    xml_element *child(xml_element *parent, const char *value) {
       return parent ? parent->FirstChildElement(value) : NULL;
     }
 
-    TiXmlElement *sibling(TiXmlElement *element, const char *value) {
+    xml_element *sibling(xml_element *element, const char *value) {
       return element ? element->NextSiblingElement(value) : NULL;
     }
 
-    const char *attr(TiXmlElement *parent, const char *value) {
+    const char *attr(xml_element *parent, const char *value) {
       return parent ? parent->Attribute(value) : NULL;
     }
 
-    const char *text(TiXmlElement *parent) {
+    const char *text(xml_element *parent) {
       return parent ? parent->GetText() : NULL;
     }
 
-    const char *value(TiXmlElement *parent) {
+    const char *value(xml_element *parent) {
       return parent ? parent->Value() : NULL;
     }
 
@@ -101,49 +131,15 @@ namespace octet { namespace loaders {
     }
 
     // convert a string like "1.2 3.4 43.12" into an array of float values
-    void atofv(dynarray<float> &values, const char *src) {  
+    void atofv(dynarray<float> &values, const char *src) {
       values.resize(0);
-      if (!src) return;
-
-      while (*src > 0 && *src <= ' ') ++src;
-      while(*src != 0) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
-        }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
-        }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
-      }
+      xml_reader::parse_floats(values, src);
     }
 
     // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, const char *src) {  
+    void atoiv(dynarray<int> &values, const char *src) {
       //values.resize(0);
-      if (!src) return;
-
-      while (*src > 0 && *src <= ' ') ++src;
-      while(*src != 0) {
-        int whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (*src > 0 && *src <= ' ') ++src;
-      }
+      xml_reader::parse_ints(values, src);
     }
 
     // convert an ascii sequence of integers like "fred bert harry" into an array of strings
@@ -157,7 +153,7 @@ namespace octet { namespace loaders {
         values.resize(index + 1);
         char tmp[128];
         int i = 0;
-        while (*src != 0 && *src != ' ') {
+        while (*src < 0 || *src > ' ') {
           if (i < sizeof(tmp)-1) tmp[i++] = *src;
           src++;
         }
@@ -200,7 +196,7 @@ namespace octet { namespace loaders {
     };
 
     // parse and <input> tag
-    void parse_input(parse_input_state &state, TiXmlElement *input) {
+    void parse_input(parse_input_state &state, xml_element *input) {
       const char *source = input->Attribute("source");
       const char *semantic = input->Attribute("semantic");
       const char *set = input->Attribute("set");
@@ -210,13 +206,13 @@ namespace octet { namespace loaders {
         return;
       }
 
-      TiXmlElement *source_elem = source ? find_id(source) : 0;
+      xml_element *source_elem = source ? find_id(source) : 0;
       if (!source_elem) {
         printf("warning: source not found\n");
         return;
       }
 
-      TiXmlElement *input2 = child(source_elem, "input");
+      xml_element *input2 = child(source_elem, "input");
       if (input2) {
         // recursive <input> tag:; includes other inputs
         for (;input2 != 0; input2 = input2->NextSiblingElement("input")) {
@@ -230,13 +226,13 @@ namespace octet { namespace loaders {
         return;
       }
 
-      TiXmlElement *tc = child(source_elem, "technique_common");
+      xml_element *tc = child(source_elem, "technique_common");
       if (!tc) {
         printf("warning: no technique_common\n");
         return;
       }
 
-      TiXmlElement *accessor = child(tc, "accessor");
+      xml_element *accessor = child(tc, "accessor");
       if (!accessor) {
         printf("warning: no accessor\n");
         return;
@@ -247,7 +243,7 @@ namespace octet { namespace loaders {
       const char *accessor_stride = accessor->Attribute("stride");
       int accessor_offset_int = accessor_offset ? atoi(accessor_offset) : 0;
       int accessor_stride_int = accessor_stride ? atoi(accessor_stride) : 0;
-      TiXmlElement *accessor_source_elem = accessor_source ? find_id(accessor_source) : 0;
+      xml_element *accessor_source_elem = accessor_source ? find_id(accessor_source) : 0;
 
       if (!accessor_source_elem || accessor_stride_int == 0) {
         printf("warning: bad or no accessor source\n");
@@ -257,7 +253,7 @@ namespace octet { namespace loaders {
       unsigned size = 0;
       const char *param_type = 0;
       for (
-        TiXmlElement *param = child(accessor, "param");
+        xml_element *param = child(accessor, "param");
         param != 0;
         param = param->NextSiblingElement("param")
       ) {
@@ -350,11 +346,11 @@ namespace octet { namespace loaders {
     }
 
     // effects use "newparam" tags to store samplers and textures
-    TiXmlElement *find_param(TiXmlElement *profile_COMMON, const char *sid, const char *child_name) {
+    xml_element *find_param(xml_element *profile_COMMON, const char *sid, const char *child_name) {
       if (!sid) return NULL;
 
       for (
-        TiXmlElement *new_param = child(profile_COMMON, "newparam");
+        xml_element *new_param = child(profile_COMMON, "newparam");
         new_param; new_param = new_param->NextSiblingElement("newparam")
       ) {
         const char *sid_param = new_param->Attribute("sid");
@@ -366,16 +362,22 @@ namespace octet { namespace loaders {
     }
 
     // get a texture or a solid colour
-    param *get_param(param_buffer_info &pbi, GLint &texture_slot, resource_dict &dict, TiXmlElement *shader, TiXmlElement *profile_COMMON, const char *value, const vec4 &deflt) {
-      TiXmlElement *section = child(shader, value);
-      TiXmlElement *color = child(section, "color");
-      TiXmlElement *texture = child(section, "texture");
+    // rec gets the same thing for the cache.
+    param *get_param(param_buffer_info &pbi, GLint &texture_slot, resource_dict &dict, xml_element *shader, xml_element *profile_COMMON, const char *value, const vec4 &deflt, collada_cache::param_rec &rec) {
+      xml_element *section = child(shader, value);
+      xml_element *color = child(section, "color");
+      xml_element *texture = child(section, "texture");
+      rec.is_texture = 0;
+      rec.image = collada_cache::no_string;
+      for (unsigned i = 0; i != 4; ++i) rec.color[i] = deflt[i];
       if (color) {
         atofv(temp_floats, color->GetText());
         if (temp_floats.size() == 3) {
           temp_floats.push_back(1);
         }
-        return new param_color(pbi, vec4(temp_floats[0], temp_floats[1], temp_floats[2], temp_floats[3]), app_utils::get_atom(value), param::stage_fragment);
+        vec4 result(temp_floats[0], temp_floats[1], temp_floats[2], temp_floats[3]);
+        for (unsigned i = 0; i != 4; ++i) rec.color[i] = result[i];
+        return new param_color(pbi, result, app_utils::get_atom(value), param::stage_fragment);
 
         /*if (temp_floats.size() >= 4) {
           char name[16];
@@ -389,15 +391,17 @@ namespace octet { namespace loaders {
       } else if (texture) {
         // todo: handle multiple texcoords
         const char *texture_name = attr(texture, "texture");
-        TiXmlElement *sampler2D = find_param(profile_COMMON, texture_name, "sampler2D");
-        TiXmlElement *source = child(sampler2D, "source");
+        xml_element *sampler2D = find_param(profile_COMMON, texture_name, "sampler2D");
+        xml_element *source = child(sampler2D, "source");
         const char *surface_name = text(source);
-        TiXmlElement *surface = find_param(profile_COMMON, surface_name, "surface");
-        TiXmlElement *init_from = child(surface, "init_from");
+        xml_element *surface = find_param(profile_COMMON, surface_name, "surface");
+        xml_element *init_from = child(surface, "init_from");
         const char *image_name = text(init_from);
+        rec.is_texture = 1;
+        rec.image = writer ? writer->add_string(image_name) : collada_cache::no_string;
         image *img = dict.get_image(image_name);
         if (img) return new param_sampler(pbi, app_utils::get_atom(value), img, new sampler(), param::stage_fragment);
-        /*TiXmlElement *image = find_id(image_name);
+        /*xml_element *image = find_id(image_name);
         const char *url_attr = text(child(image, "init_from"));
         if (url_attr) {
           string new_path;
@@ -410,21 +414,22 @@ namespace octet { namespace loaders {
     }
 
     // get a floating point number (or the default)
-    param_color *get_float(param_buffer_info &pbi, TiXmlElement *shader, const char *value, float deflt) {
-      TiXmlElement *section = child(shader, value);
-      TiXmlElement *float_ = child(section, "float");
+    param_color *get_float(param_buffer_info &pbi, xml_element *shader, const char *value, float deflt, float &result) {
+      xml_element *section = child(shader, value);
+      xml_element *float_ = child(section, "float");
+      result = deflt;
       if (float_) {
         atofv(temp_floats, float_->GetText());
         if (temp_floats.size() >= 1) {
-          return new param_color(pbi, vec4(temp_floats[0], 0, 0, 0), app_utils::get_atom(value), param::stage_fragment);
+          result = temp_floats[0];
         }
       }
-      return new param_color(pbi, vec4(deflt, 0, 0, 0), app_utils::get_atom(value), param::stage_fragment);
+      return new param_color(pbi, vec4(result, 0, 0, 0), app_utils::get_atom(value), param::stage_fragment);
     }
 
     // add all the materials from the collada file to the resources collection
     void add_materials(resource_dict &dict) {
-      TiXmlElement *lib_mat = child(doc.RootElement(), "library_materials");
+      xml_element *lib_mat = child(doc.RootElement(), "library_materials");
 
       if (!dict.has_resource("default_material")) {
         material *defmat = new material(vec4(0.5, 0.5, 0.5, 1));
@@ -433,27 +438,31 @@ namespace octet { namespace loaders {
 
       if (!lib_mat) return;
 
-      for (TiXmlElement *mat_elem = lib_mat->FirstChildElement(); mat_elem != NULL; mat_elem = mat_elem->NextSiblingElement()) {
-        TiXmlElement *ieffect = child(mat_elem, "instance_effect");
+      for (xml_element *mat_elem = lib_mat->FirstChildElement(); mat_elem != NULL; mat_elem = mat_elem->NextSiblingElement()) {
+        xml_element *ieffect = child(mat_elem, "instance_effect");
         const char *url = attr(ieffect, "url");
-        TiXmlElement *effect = find_id(url);
-        TiXmlElement *profile_COMMON = child(effect, "profile_COMMON");
-        TiXmlElement *technique = child(profile_COMMON, "technique");
-        TiXmlElement *phong = child(technique, "phong");
-        TiXmlElement *blinn = child(technique, "blinn");
-        TiXmlElement *lambert = child(technique, "lambert");
-        TiXmlElement *shader = phong ? phong : blinn ? blinn : lambert;
+        xml_element *effect = find_id(url);
+        xml_element *profile_COMMON = child(effect, "profile_COMMON");
+        xml_element *technique = child(profile_COMMON, "technique");
+        xml_element *phong = child(technique, "phong");
+        xml_element *blinn = child(technique, "blinn");
+        xml_element *lambert = child(technique, "lambert");
+        xml_element *shader = phong ? phong : blinn ? blinn : lambert;
         dynarray<uint8_t> static_buffer(256);
         param_buffer_info pbi(static_buffer);
         GLint texture_slot = 0;
+        collada_cache::material_rec rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.has_shader = shader != NULL;
         if (shader) {
           url += url[0] == '#';
-          param *emission = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "emission", vec4(0, 0, 0, 0));
-          param *ambient = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "ambient", vec4(0, 0, 0, 1));
-          param *diffuse = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "diffuse", vec4(0.5f, 0.5f, 0.5f, 0));
-          param *specular = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "specular", vec4(0, 0, 0, 0));
-          param *bump = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "bump", vec4(0.5f, 0.5f, 1.0f, 0));
-          param_color *shininess = get_float(pbi, shader, "shininess", 0);
+          collada_cache::param_rec *recs = rec.params;
+          param *emission = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "emission", vec4(0, 0, 0, 0), recs[collada_cache::param_emission]);
+          param *ambient = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "ambient", vec4(0, 0, 0, 1), recs[collada_cache::param_ambient]);
+          param *diffuse = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "diffuse", vec4(0.5f, 0.5f, 0.5f, 0), recs[collada_cache::param_diffuse]);
+          param *specular = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "specular", vec4(0, 0, 0, 0), recs[collada_cache::param_specular]);
+          param *bump = get_param(pbi, texture_slot, dict, shader, profile_COMMON, "bump", vec4(0.5f, 0.5f, 1.0f, 0), recs[collada_cache::param_bump]);
+          param_color *shininess = get_float(pbi, shader, "shininess", 0, rec.shininess);
           // this is not strictly correct, but fixes some issues
           //if (shininess->get_value(buffer.data()).x() >= 1) shininess->set_value(buffer.data(), vec4(shininess->get_value(buffer.data()) * 0.01f));
           material *mat = new material(diffuse, ambient, emission, specular, bump, shininess);
@@ -463,14 +472,15 @@ namespace octet { namespace loaders {
           material *mat = new material(vec4(0.5, 0.5, 0.5, 0));
           dict.set_resource(attr(mat_elem, "id"), mat);
         }
+        if (writer) writer->add_material(attr(mat_elem, "id"), rec);
       }
     }
 
     // add geometry and skins from the collada file to the resources collection
-    void add_mesh_instances(TiXmlElement *technique_common, const char *url, scene_node *node, skeleton *skel, resource_dict &dict, visual_scene &s) {
+    void add_mesh_instances(xml_element *technique_common, const char *url, scene_node *node, skeleton *skel, resource_dict &dict, visual_scene &s) {
       if (!url) return;
 
-      TiXmlElement *instance = child(technique_common, "instance_material");
+      xml_element *instance = child(technique_common, "instance_material");
       if (instance) {
         for (; instance != NULL; instance = instance->NextSiblingElement("instance_material")) {
           const char *symbol = instance->Attribute("symbol");
@@ -490,6 +500,8 @@ namespace octet { namespace loaders {
             log("add mesh instance %s\n", mesh_url);
           }
 
+          if (writer) writer->add_mesh_instance(node, mesh_url, target, skel, true);
+
           mesh *msh = dict.get_mesh(mesh_url);
           if (msh) {
             mesh_instance *mi = new mesh_instance(node, msh, mat, skel);
@@ -499,6 +511,7 @@ namespace octet { namespace loaders {
           }
         }
       } else {
+        if (writer) writer->add_mesh_instance(node, url, NULL, skel, false);
         mesh *mesh = dict.get_mesh(url);
         material *mat = dict.get_material("default_material");
         if (mesh) {
@@ -509,23 +522,23 @@ namespace octet { namespace loaders {
     }
 
     // add an <instance_geometry> mesh instance
-    void add_instance_geometry(TiXmlElement *element, scene_node *node, resource_dict &dict, visual_scene &s) {
+    void add_instance_geometry(xml_element *element, scene_node *node, resource_dict &dict, visual_scene &s) {
       const char *url = element->Attribute("url");
       url += url[0] == '#';
-      TiXmlElement *bind_material = child(element, "bind_material");
-      TiXmlElement *technique_common = child(bind_material, "technique_common");
+      xml_element *bind_material = child(element, "bind_material");
+      xml_element *technique_common = child(bind_material, "technique_common");
 
       add_mesh_instances(technique_common, url, node, 0, dict, s);
     }
 
     // add an <instance_controller> skin instance
-    void add_instance_controller(TiXmlElement *element, scene_node *node, resource_dict &dict, visual_scene &s) {
+    void add_instance_controller(xml_element *element, scene_node *node, resource_dict &dict, visual_scene &s) {
       const char *controller_url = attr(element, "url");
-      TiXmlElement *bind_material = child(element, "bind_material");
-      TiXmlElement *technique_common = child(bind_material, "technique_common");
+      xml_element *bind_material = child(element, "bind_material");
+      xml_element *technique_common = child(bind_material, "technique_common");
 
       int num_bones = 0;
-      for (TiXmlElement *skel_elem = child(element, "skeleton"); skel_elem; skel_elem = sibling(skel_elem, "skeleton")) {
+      for (xml_element *skel_elem = child(element, "skeleton"); skel_elem; skel_elem = sibling(skel_elem, "skeleton")) {
         num_bones++;
       }
 
@@ -534,11 +547,12 @@ namespace octet { namespace loaders {
       //skin *skn = mesh->get_skin();
 
       skeleton *skel = new skeleton();
-      TiXmlElement *skel_elem = child(element, "skeleton");
+      if (writer) writer->add_skeleton(skel);
+      xml_element *skel_elem = child(element, "skeleton");
       dictionary<int> skin_joints;
       while (skel_elem) {
         const char *skeleton_id = text(skel_elem);
-        TiXmlElement *node_elem = find_id(skeleton_id);
+        xml_element *node_elem = find_id(skeleton_id);
         scene_node *node = (scene_node*)node_elem->GetUserData();
         if (node) {
           dynarray<scene_node*> nodes;
@@ -547,6 +561,7 @@ namespace octet { namespace loaders {
           for (int i = 0; i != nodes.size(); ++i) {
             scene_node *node = nodes[i];
             skel->add_bone(node, parents[i]);
+            if (writer) writer->add_bone(node, parents[i]);
           }
         }
         skel_elem = sibling(skel_elem, "skeleton");
@@ -557,14 +572,14 @@ namespace octet { namespace loaders {
     }
 
     // utility to get a float
-    float quick_float(TiXmlElement *parent, const char *name, float deflt=0) {
-      TiXmlElement *child = parent->FirstChildElement(name);
+    float quick_float(xml_element *parent, const char *name, float deflt=0) {
+      xml_element *child = parent->FirstChildElement(name);
       return child ? (float)atof(child->GetText()) : deflt;
     }
 
     // utility to get a float
-    vec4 quick_vec(TiXmlElement *parent, const char *name) {
-      TiXmlElement *child = parent->FirstChildElement(name);
+    vec4 quick_vec(xml_element *parent, const char *name) {
+      xml_element *child = parent->FirstChildElement(name);
       dynarray<float> v;
       if (child) atofv(v, child->GetText());
       unsigned s = v.size();
@@ -572,16 +587,16 @@ namespace octet { namespace loaders {
     }
 
     // add a camera to the scene
-    void add_instance_camera(TiXmlElement *elem, scene_node *node, resource_dict &dict, visual_scene &s) {
+    void add_instance_camera(xml_element *elem, scene_node *node, resource_dict &dict, visual_scene &s) {
       const char *url = elem->Attribute("url");
-      TiXmlElement *cam = find_id(url);
+      xml_element *cam = find_id(url);
       if (!cam) return;
 
-      TiXmlElement *optics = child(cam, "optics");
-      TiXmlElement *technique_common = child(optics, "technique_common");
-      TiXmlElement *perspective = child(technique_common, "perspective");
-      TiXmlElement *ortho = child(technique_common, "ortho");
-      TiXmlElement *params = perspective ? perspective : ortho;
+      xml_element *optics = child(cam, "optics");
+      xml_element *technique_common = child(optics, "technique_common");
+      xml_element *perspective = child(technique_common, "perspective");
+      xml_element *ortho = child(technique_common, "ortho");
+      xml_element *params = perspective ? perspective : ortho;
       if (params) {
         float n = quick_float(params, "znear");
         float f = quick_float(params, "zfar");
@@ -593,58 +608,64 @@ namespace octet { namespace loaders {
           float xfov = quick_float(params, "xfov");
           float yfov = quick_float(params, "yfov");
           c->set_perspective(xfov, yfov, aspect_ratio, n, f);
+          if (writer) writer->add_camera(node, false, xfov, yfov, aspect_ratio, n, f);
         } else {
           float xmag = quick_float(params, "xmag");
           float ymag = quick_float(params, "ymag");
           c->set_ortho(xmag, ymag, aspect_ratio, n, f);
+          if (writer) writer->add_camera(node, true, xmag, ymag, aspect_ratio, n, f);
         }
       }
     }
 
     // add a light to the scene
-    void add_instance_light(TiXmlElement *elem, scene_node *node, resource_dict &dict, visual_scene &s) {
+    void add_instance_light(xml_element *elem, scene_node *node, resource_dict &dict, visual_scene &s) {
       const char *url = elem->Attribute("url");
-      TiXmlElement *light_elem = find_id(url);
+      xml_element *light_elem = find_id(url);
       if (!light_elem) return;
 
       light *_light = new light();
       light_instance *il = new light_instance(node, _light);
       s.add_light_instance(il);
       
-      TiXmlElement *technique_common = child(light_elem, "technique_common");
-      TiXmlElement *ambient = child(technique_common, "ambient");
-      TiXmlElement *directional = child(technique_common, "directional");
-      TiXmlElement *spot = child(technique_common, "spot");
-      TiXmlElement *point = child(technique_common, "point");
-      TiXmlElement *params = ambient ? ambient : directional ? directional : spot ? spot : point;
-
-      _light->set_color(vec4(1, 1, 1, 1));
+      xml_element *technique_common = child(light_elem, "technique_common");
+      xml_element *ambient = child(technique_common, "ambient");
+      xml_element *directional = child(technique_common, "directional");
+      xml_element *spot = child(technique_common, "spot");
+      xml_element *point = child(technique_common, "point");
+      xml_element *params = ambient ? ambient : directional ? directional : spot ? spot : point;
+
+      vec4 color(1, 1, 1, 1);
+      _light->set_color(color);
       if (params) {
-        vec4 color = quick_vec(params, "color");
+        color = quick_vec(params, "color");
         _light->set_color(color);
       }
 
+      float attenuation[3] = { 1, 0, 0 };
+      float falloff[2] = { 180, 0 };
       if (directional || spot || point) {
-        float constant_attenuation = quick_float(params, "constant_attenuation", 1);
-        float linear_attenuation = quick_float(params, "linear_attenuation", 0);
-        float quadratic_attenuation = quick_float(params, "quadratic_attenuation", 0);
-        float falloff_angle = quick_float(params, "falloff_angle", 180);
-        float falloff_exponent = quick_float(params, "falloff_exponent", 0);
-        _light->set_attenuation(constant_attenuation, linear_attenuation, quadratic_attenuation);
-        _light->set_falloff(falloff_angle, falloff_exponent);
+        attenuation[0] = quick_float(params, "constant_attenuation", 1);
+        attenuation[1] = quick_float(params, "linear_attenuation", 0);
+        attenuation[2] = quick_float(params, "quadratic_attenuation", 0);
+        falloff[0] = quick_float(params, "falloff_angle", 180);
+        falloff[1] = quick_float(params, "falloff_exponent", 0);
+        _light->set_attenuation(attenuation[0], attenuation[1], attenuation[2]);
+        _light->set_falloff(falloff[0], falloff[1]);
       }
+      if (writer) writer->add_light(node, color, directional || spot || point, attenuation, falloff);
     }
 
     // add a geometry element to the list of mesh states
     void add_geometry(resource_dict &dict) {
-      TiXmlElement *lib_geom = doc.RootElement()->FirstChildElement("library_geometries");
+      xml_element *lib_geom = doc.RootElement()->FirstChildElement("library_geometries");
       if (!lib_geom) return;
 
-      for (TiXmlElement *geometry = lib_geom->FirstChildElement(); geometry != NULL; geometry = geometry->NextSiblingElement()) {
-        TiXmlElement *mesh_elem = child(geometry, "mesh");
+      for (xml_element *geometry = lib_geom->FirstChildElement(); geometry != NULL; geometry = geometry->NextSiblingElement()) {
+        xml_element *mesh_elem = child(geometry, "mesh");
         const char *id = geometry->Attribute("id");
 
-        for (TiXmlElement *mesh_child = mesh_elem ? mesh_elem->FirstChildElement() : 0;
+        for (xml_element *mesh_child = mesh_elem ? mesh_elem->FirstChildElement() : 0;
           mesh_child != NULL;
           mesh_child = mesh_child->NextSiblingElement()
         ) {
@@ -658,15 +679,15 @@ namespace octet { namespace loaders {
 
     // add a geometry element to the list of mesh states
     void add_controllers(resource_dict &dict) {
-      TiXmlElement *lib_ctrl = doc.RootElement()->FirstChildElement("library_controllers");
+      xml_element *lib_ctrl = doc.RootElement()->FirstChildElement("library_controllers");
       if (!lib_ctrl) return;
 
-      for (TiXmlElement *controller = lib_ctrl->FirstChildElement(); controller != NULL; controller = controller->NextSiblingElement()) {
-        TiXmlElement *skin_elem = child(controller, "skin");
+      for (xml_element *controller = lib_ctrl->FirstChildElement(); controller != NULL; controller = controller->NextSiblingElement()) {
+        xml_element *skin_elem = child(controller, "skin");
         const char *controller_id = controller->Attribute("id");
-        TiXmlElement *geometry = find_id(attr(skin_elem, "source"));
-        TiXmlElement *bind_shape_matrix = child(skin_elem, "bind_shape_matrix");
-        TiXmlElement *joints_elem = child(skin_elem, "joints");
+        xml_element *geometry = find_id(attr(skin_elem, "source"));
+        xml_element *bind_shape_matrix = child(skin_elem, "bind_shape_matrix");
+        xml_element *joints_elem = child(skin_elem, "joints");
         skin_state skinst;
 
         if (bind_shape_matrix) {
@@ -674,17 +695,17 @@ namespace octet { namespace loaders {
         }
 
         if (joints_elem) {
-          TiXmlElement *input = child(joints_elem, "input");
+          xml_element *input = child(joints_elem, "input");
           while (input) {
             const char *semantic = attr(input, "semantic");
             const char *source_id = attr(input, "source");
             if (!strcmp(semantic, "JOINT")) {
-              TiXmlElement *name_array = child(find_id(source_id), "Name_array");
+              xml_element *name_array = child(find_id(source_id), "Name_array");
               if (name_array) {
                 skinst.joints = text(name_array);
               }
             } else if (!strcmp(semantic, "INV_BIND_MATRIX")) {
-              TiXmlElement *float_array = child(find_id(source_id), "float_array");
+              xml_element *float_array = child(find_id(source_id), "float_array");
               atofv(skinst.inv_bind_matrices, text(float_array));
             }
             input = sibling(input, "input");
@@ -709,14 +730,15 @@ namespace octet { namespace loaders {
           bindToModel.init_transpose(&skinst.inv_bind_matrices[i*16]);
           mesh_skin->add_joint(bindToModel, app_utils::get_atom(joints[i]));
         }
+        if (writer) writer->add_skin(mesh_skin);
 
-        TiXmlElement *vertex_weights = child(skin_elem, "vertex_weights");
+        xml_element *vertex_weights = child(skin_elem, "vertex_weights");
         if (vertex_weights && geometry) {
           get_skin(controller, vertex_weights, &skinst);
-          TiXmlElement *mesh_elem = child(geometry, "mesh");
+          xml_element *mesh_elem = child(geometry, "mesh");
           //const char *id = geometry->Attribute("id");
 
-          for (TiXmlElement *mesh_child = mesh_elem ? mesh_elem->FirstChildElement() : 0;
+          for (xml_element *mesh_child = mesh_elem ? mesh_elem->FirstChildElement() : 0;
             mesh_child != NULL;
             mesh_child = mesh_child->NextSiblingElement()
           ) {
@@ -731,16 +753,17 @@ namespace octet { namespace loaders {
 
     // add <library_images> to the scene
     void add_images(resource_dict &dict) {
-      TiXmlElement *lib_anim = doc.RootElement()->FirstChildElement("library_images");
+      xml_element *lib_anim = doc.RootElement()->FirstChildElement("library_images");
       if (!lib_anim) return;
 
-      for (TiXmlElement *elem = child(lib_anim, "image"); elem != NULL; elem = sibling(elem, "image")) {
+      for (xml_element *elem = child(lib_anim, "image"); elem != NULL; elem = sibling(elem, "image")) {
         const char *url_attr = text(child(elem, "init_from"));
         if (url_attr) {
           string new_path;
           new_path.format("%s%s", doc_path.c_str(), url_attr);
           image *img = new image(new_path);
           dict.set_resource(attr(elem, "id"), img);
+          if (writer) writer->add_image(attr(elem, "id"), new_path);
         }
       }
     }
@@ -748,15 +771,16 @@ namespace octet { namespace loaders {
     // add <library_animations> to the scene
     // collada animations range from sensible (array of matrices) to crazy (complex rotations and translations)
     void add_animations(resource_dict &dict) {
-      TiXmlElement *lib_anim = doc.RootElement()->FirstChildElement("library_animations");
+      xml_element *lib_anim = doc.RootElement()->FirstChildElement("library_animations");
       if (!lib_anim) return;
 
-      for (TiXmlElement *anim_elem = child(lib_anim, "animation"); anim_elem != NULL; anim_elem = sibling(anim_elem, "animation")) {
+      for (xml_element *anim_elem = child(lib_anim, "animation"); anim_elem != NULL; anim_elem = sibling(anim_elem, "animation")) {
         animation *anim = new animation();
         const char *id = attr(anim_elem, "id");
         dict.set_resource(id, anim);
+        if (writer) writer->add_animation(id);
         if (debug > 0) log("animation %s\n", id);
-        for (TiXmlElement *channel_elem = child(anim_elem, "channel"); channel_elem != NULL; channel_elem = sibling(channel_elem, "channel")) {
+        for (xml_element *channel_elem = child(anim_elem, "channel"); channel_elem != NULL; channel_elem = sibling(channel_elem, "channel")) {
           const char *target = attr(channel_elem, "target");
           string node_name = target;
           string sub_target_name;
@@ -778,24 +802,24 @@ namespace octet { namespace loaders {
           atom_t component_sid = app_utils::get_atom(component_name);
           
           if (debug > 0) log("  channel target %s %s %s\n", node_name.c_str(), sub_target_name.c_str(), component_name.c_str());
-          TiXmlElement *sampler_elem = find_id(attr(channel_elem, "source"));
+          xml_element *sampler_elem = find_id(attr(channel_elem, "source"));
           if (sampler_elem) {
             dynarray<float> times;
             dynarray<float> values;
             //dynarray<string> interpolation;
 
-            TiXmlElement *input = child(sampler_elem, "input");
+            xml_element *input = child(sampler_elem, "input");
             while (input) {
               const char *semantic = attr(input, "semantic");
               const char *source_id = attr(input, "source");
               if (!strcmp(semantic, "INPUT")) {
-                TiXmlElement *float_array = child(find_id(source_id), "float_array");
+                xml_element *float_array = child(find_id(source_id), "float_array");
                 atofv(times, text(float_array));
               } else if (!strcmp(semantic, "OUTPUT")) {
-                TiXmlElement *float_array = child(find_id(source_id), "float_array");
+                xml_element *float_array = child(find_id(source_id), "float_array");
                 atofv(values, text(float_array));
               } else if (!strcmp(semantic, "INTERPOLATION")) {
-                /*TiXmlElement *name_array = child(find_id(source_id), "Name_array");
+                /*xml_element *name_array = child(find_id(source_id), "Name_array");
                 if (name_array) {
                   atonv(interpolation, text(name_array));
                 }*/
@@ -804,16 +828,18 @@ namespace octet { namespace loaders {
             }
 
             resource *target = dict.get_resource(node_name);
+            if (!times.size()) continue;
             anim->add_channel(target, node_sid, sub_target_sid, component_sid, times, values);
+            if (writer) writer->add_channel(node_name, node_name, sub_target_name, component_name, times, values);
           }
         }
       }
     }
 
     // build the scene_node heirachy
-    void build_heirachy(dynarray<TiXmlElement *> &node_elems, dynarray<scene_node *> &nodes, TiXmlElement *scene_element, resource_dict &dict, visual_scene &s) {
+    void build_heirachy(dynarray<xml_element *> &node_elems, dynarray<scene_node *> &nodes, xml_element *scene_element, resource_dict &dict, visual_scene &s) {
       // create a stack to avoid recursion (a bad thing in games)
-      dynarray<TiXmlElement *> stack;
+      dynarray<xml_element *> stack;
       dynarray<scene_node *> node_stack;
       stack.reserve(64);
       node_stack.reserve(64);
@@ -821,11 +847,11 @@ namespace octet { namespace loaders {
       node_stack.push_back(s.get_root_node());
       stack.push_back(scene_element);
       while (!stack.empty()) {
-        TiXmlElement *parent_elem = stack.back();
+        xml_element *parent_elem = stack.back();
         scene_node *parent = node_stack.back();
         stack.pop_back();
         node_stack.pop_back();
-        TiXmlElement *node_elem = child(parent_elem, "node");
+        xml_element *node_elem = child(parent_elem, "node");
         while (node_elem) {
           mat4t nodeToParent;
           nodeToParent.loadIdentity();
@@ -846,14 +872,14 @@ namespace octet { namespace loaders {
     }
 
     // add matrices and instances
-    void build_matrices(dynarray<TiXmlElement *> &node_elems, dynarray<scene_node *> &nodes, resource_dict &dict, visual_scene &s) {
+    void build_matrices(dynarray<xml_element *> &node_elems, dynarray<scene_node *> &nodes, resource_dict &dict, visual_scene &s) {
       for (int ni = 0; ni != node_elems.size(); ++ni) {
-        TiXmlElement *node_elem = node_elems[ni];
+        xml_element *node_elem = node_elems[ni];
         scene_node *node = nodes[ni];
         mat4t &matrix = node->access_nodeToParent();
         matrix.loadIdentity();
 
-        for (TiXmlElement *child = node_elem->FirstChildElement(); child != NULL; child = child->NextSiblingElement()) {
+        for (xml_element *child = node_elem->FirstChildElement(); child != NULL; child = child->NextSiblingElement()) {
           const char *value = child->Value();
           if (!strcmp(value, "matrix")) {
             atofv(temp_floats, child->GetText());
@@ -887,12 +913,12 @@ namespace octet { namespace loaders {
     }
 
     // add instances
-    void build_instances(dynarray<TiXmlElement *> &node_elems, dynarray<scene_node *> &nodes, resource_dict &dict, visual_scene &s) {
+    void build_instances(dynarray<xml_element *> &node_elems, dynarray<scene_node *> &nodes, resource_dict &dict, visual_scene &s) {
       for (int ni = 0; ni != node_elems.size(); ++ni) {
-        TiXmlElement *node_elem = node_elems[ni];
+        xml_element *node_elem = node_elems[ni];
         scene_node *node = nodes[ni];
 
-        for (TiXmlElement *child = node_elem->FirstChildElement(); child != NULL; child = child->NextSiblingElement()) {
+        for (xml_element *child = node_elem->FirstChildElement(); child != NULL; child = child->NextSiblingElement()) {
           const char *value = child->Value();
           if (!strcmp(value, "instance_geometry")) {
             add_instance_geometry(child, node, dict, s);
@@ -934,10 +960,10 @@ namespace octet { namespace loaders {
     }
 
     // find the maximum input offset and infer the input stride (this is not explicit in the spec)
-    int get_input_stride(TiXmlElement *mesh_child) {
+    int get_input_stride(xml_element *mesh_child) {
       int input_stride = 1;
       int implicit_offset = 0;
-      for (TiXmlElement *input_elem = child(mesh_child, "input");
+      for (xml_element *input_elem = child(mesh_child, "input");
         input_elem != NULL;
         input_elem = input_elem->NextSiblingElement("input")
       ) {
@@ -951,8 +977,8 @@ namespace octet { namespace loaders {
     }
 
     // get triangles from a trilist or polylist
-    void get_mesh_component(mesh *mesh, const char *id, TiXmlElement *mesh_child, skin_state *skinst, resource_dict &dict) {
-      TiXmlElement *pelem = child(mesh_child, "p");
+    void get_mesh_component(mesh *mesh, const char *id, xml_element *mesh_child, skin_state *skinst, resource_dict &dict) {
+      xml_element *pelem = child(mesh_child, "p");
 
       if (!pelem) {
         printf("warning: no <p>\n");
@@ -991,13 +1017,14 @@ namespace octet { namespace loaders {
       unsigned p_size = state.p.size();
       if (p_size % state.input_stride != 0) {
         printf("warning: expected multiple of %d indices\n", state.input_stride);
+        if (writer) writer->add_mesh(mesh, mesh_url, id, skinst == NULL, NULL, 0, NULL, 0);
         return;
       }
 
       unsigned num_vertices = p_size / state.input_stride;
 
       // find the output size
-      for (TiXmlElement *input = child(mesh_child, "input");
+      for (xml_element *input = child(mesh_child, "input");
         input != NULL;
         input = input->NextSiblingElement("input")
       ) {
@@ -1031,7 +1058,7 @@ namespace octet { namespace loaders {
       state.vertex_input_offset = 0;
 
       // build the attributes
-      for (TiXmlElement *input = child(mesh_child, "input");
+      for (xml_element *input = child(mesh_child, "input");
         input != NULL;
         input = input->NextSiblingElement("input")
       ) {
@@ -1063,7 +1090,7 @@ namespace octet { namespace loaders {
         }
       }
 
-      TiXmlElement *vcount_elem = child(mesh_child, "vcount");
+      xml_element *vcount_elem = child(mesh_child, "vcount");
 
       // build an initial index based on the mesh_child value
       // todo: optimise the mesh.
@@ -1089,24 +1116,26 @@ namespace octet { namespace loaders {
         log("mesh component loaded with %d indices and %d floats for vertices\n", state.indices.size(), state.vertices.size());
       }
 
-      mesh->allocate(vsize, isize);
-      mesh->assign(vsize, isize, (unsigned char*)&state.vertices[0], (unsigned char*)&state.indices[0]);
+      const void *vertices = state.vertices.data();
+      const void *indices = state.indices.data();
+      mesh->allocate(vsize, isize, vertices, indices);
       mesh->set_params(state.attr_stride * 4, num_indices, num_vertices, GL_TRIANGLES, GL_UNSIGNED_INT);
       mesh->calc_aabb();
+      if (writer) writer->add_mesh(mesh, mesh_url, id, skinst == NULL, vertices, vsize, indices, isize);
       if (debug > 1) mesh->dump(log("mesh\n"));
     }
 
     // get blend weights and matrices from a skin
     // after this we are still not home yet as the weights need to be indexed by the POSITION of the skinned mesh.
-    void get_skin(TiXmlElement *geometry, TiXmlElement *mesh_child, skin_state *skin) {
-      TiXmlElement *pelem = child(mesh_child, "v");
+    void get_skin(xml_element *geometry, xml_element *mesh_child, skin_state *skin) {
+      xml_element *pelem = child(mesh_child, "v");
 
       if (!pelem) {
         printf("warning: no <v>\n");
         return;
       }
 
-      TiXmlElement *vcount_elem = child(mesh_child, "vcount");
+      xml_element *vcount_elem = child(mesh_child, "vcount");
       if (!vcount_elem) {
         printf("warning: no vcount element in skin\n");
       }
@@ -1135,7 +1164,7 @@ namespace octet { namespace loaders {
       state.input_offset = 0;
 
       // build the raw skin paramerters
-      for (TiXmlElement *input = child(mesh_child, "input");
+      for (xml_element *input = child(mesh_child, "input");
         input != NULL;
         input = input->NextSiblingElement("input")
       ) {
@@ -1193,38 +1222,81 @@ namespace octet { namespace loaders {
 
     // add all the scenes from the collada file to the resources collection
     void add_scenes(resource_dict &dict) {
-      TiXmlElement *lib = doc.RootElement()->FirstChildElement("library_visual_scenes");
+      xml_element *lib = doc.RootElement()->FirstChildElement("library_visual_scenes");
 
       if (!lib) return;
 
-      for (TiXmlElement *elem = lib->FirstChildElement(); elem != NULL; elem = elem->NextSiblingElement()) {
-        dynarray<TiXmlElement *> node_elems;
+      for (xml_element *elem = lib->FirstChildElement(); elem != NULL; elem = elem->NextSiblingElement()) {
+        dynarray<xml_element *> node_elems;
         dynarray<scene_node *> nodes;
         visual_scene *scn = new visual_scene();
         dict.set_resource(attr(elem, "id"), scn);
         build_heirachy(node_elems, nodes, elem, dict, *scn);
         build_matrices(node_elems, nodes, dict, *scn);
+        if (writer) {
+          writer->add_scene(attr(elem, "id"));
+          for (unsigned i = 0; i != nodes.size(); ++i) {
+            writer->add_node(nodes[i], attr(node_elems[i], "id"), attr(node_elems[i], "sid"), nodes[i]->get_parent());
+          }
+        }
         build_instances(node_elems, nodes, dict, *scn);
       }
 
     }
 
+    // find the cache for a file and load it if it was made from this version of the file.
+    void load_cache(const char *url) {
+      cache_path = "";
+      if (!use_cache || !strncmp(url, "zip://", 6) || !strncmp(url, "http://", 7)) {
+        return;
+      }
+
+      const char *path = app_utils::get_path(url);
+      file_map *map = new file_map(path);
+      if (map->get_error()) {
+        delete map;
+        return;
+      }
+      byte_span source(map);
+      source_hash = hash_function::bytes(source.data(), source.size());
+      source_size = source.size();
+      cache_path.format("%s.cooked", path);
+      cache.load(cache_path, source_hash, source_size);
+    }
+
   public:
     collada_builder() {
+      use_cache = true;
+      writer = NULL;
+      source_hash = 0;
+      source_size = 0;
+    }
+
+    /// Turn the binary cache on or off (the default is on). Call this before load_xml().
+    void set_use_cache(bool value) {
+      use_cache = value;
     }
 
     // public function to load a collada file
     bool load_xml(const char *url) {
       doc_path = url;
       doc_path.truncate(doc_path.filename_pos());
+
+      load_cache(url);
+      if (cache.is_loaded()) {
+        return true;
+      }
+
       const char *path = app_utils::get_path(url);
-      char buf[256];
-      getcwd(buf, sizeof(buf));
       doc.LoadFile(path);
 
-      TiXmlElement *top = doc.RootElement();
+      xml_element *top = doc.RootElement();
       if (!top) {
-        printf("file %s not found\n", path);
+        #ifdef OCTET_COLLADA_TINYXML
+          printf("file %s not found\n", path);
+        #else
+          printf("file %s: %s at line %d\n", path, doc.get_error(), doc.get_error_line());
+        #endif
         return false;
       }
 
@@ -1239,7 +1311,12 @@ namespace octet { namespace loaders {
 
     // once loaded, use this to access the first component in the mesh
     void get_mesh(mesh &s, const char *id, resource_dict &dict) {
-      TiXmlElement *geometry = find_id(id);
+      if (cache.is_loaded()) {
+        cache.get_mesh(s, id, dict);
+        return;
+      }
+
+      xml_element *geometry = find_id(id);
       s.init();
 
       if (!geometry || strcmp(geometry->Value(), "geometry")) {
@@ -1247,13 +1324,13 @@ namespace octet { namespace loaders {
         return;
       }
 
-      TiXmlElement *mesh = child(geometry, "mesh");
+      xml_element *mesh = child(geometry, "mesh");
       if (!mesh) {
         printf("warning: geometry %s has no mesh\n", id);
         return;
       }
 
-      for (TiXmlElement *mesh_child = mesh->FirstChildElement();
+      for (xml_element *mesh_child = mesh->FirstChildElement();
         mesh_child != NULL;
         mesh_child = mesh_child->NextSiblingElement()
       ) {
@@ -1266,13 +1343,27 @@ namespace octet { namespace loaders {
 
     // get the url from the default visual scene
     const char *get_default_scene() {
-      TiXmlElement *scene = doc.RootElement()->FirstChildElement("scene");
-      TiXmlElement *ivs = child(scene, "instance_visual_scene");
+      if (cache.is_loaded()) {
+        return cache.get_default_scene();
+      }
+
+      xml_element *scene = doc.RootElement()->FirstChildElement("scene");
+      xml_element *ivs = child(scene, "instance_visual_scene");
       return ivs ? ivs->Attribute("url") : 0;
     }
 
     // extract resources from the collada file into a collection.
     void get_resources(resource_dict &dict) {
+      if (cache.is_loaded()) {
+        cache.get_resources(dict);
+        return;
+      }
+
+      // record everything we make for next time.
+      if (!cache_path.empty()) {
+        writer = new collada_cache_writer();
+      }
+
       add_images(dict);
 
       add_materials(dict);
@@ -1286,6 +1377,14 @@ namespace octet { namespace loaders {
 
       // animations refer to all other objects
       add_animations(dict);
+
+      if (writer) {
+        // a read-only tree has no cache, which only costs load time.
+        writer->set_default_scene(get_default_scene());
+        writer->save(cache_path, source_hash, source_size);
+        delete writer;
+        writer = NULL;
+      }
     }
   };
 }}
@@ -0,0 +1,810 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// binary cache of a loaded COLLADA file.
+//
+// Parsing the XML, converting the float arrays and expanding the inputs into vertices
+// takes most of the time when we load a big scene. The first time we load a file, collada_builder
+// records everything it makes and we write it next to the file (eg. duck.dae.cooked).
+// If the directory can't be written, such as an installed read-only tree, we quietly go without.
+// After that we map the cache and make the same objects straight from the mapped records.
+//
+// The file is a header, a table of sections and the sections. Each section is an array of
+// fixed size records that refer to each other by index, to strings by offset in the string section
+// and to vertices and indices by offset in the blob section. There are no pointers, so nothing
+// is converted when we load: the vertices and indices go from the mapping to glBufferData.
+//
+// The header has the version of the format and a hash of the .dae file.
+// If either changes, the cache is ignored and rewritten.
+//
+
+namespace octet { namespace loaders {
+  /// Reads a binary cache of a COLLADA file and makes the resources.
+  /// collada_builder uses this automatically; see collada_builder::set_use_cache().
+  class collada_cache {
+  public:
+    enum {
+      // change this when any of the records change.
+      version = 1,
+
+      // string offset for a NULL string.
+      no_string = 0xffffffff,
+
+      // maximum attributes in a mesh.
+      max_slots = 16,
+    };
+
+    /// sections of the file, in order.
+    enum section_type {
+      section_strings,     // zero terminated strings
+      section_blobs,       // vertices, indices and animation keys
+      section_images,
+      section_materials,
+      section_skins,
+      section_joints,
+      section_meshes,
+      section_scenes,
+      section_nodes,
+      section_skeletons,
+      section_bones,
+      section_instances,
+      section_animations,
+      section_channels,
+      num_sections,
+    };
+
+    /// where a section is in the file
+    struct section {
+      uint64_t offset;
+      uint32_t count;
+      uint32_t record_size;
+    };
+
+    /// first bytes of the file
+    struct header {
+      char magic[8];
+      uint32_t version;
+      uint32_t header_size;
+      uint64_t file_size;
+      uint64_t source_hash;
+      uint64_t source_size;
+      uint32_t default_scene;
+      uint32_t section_count;
+      section sections[num_sections];
+    };
+
+    /// <library_images> image
+    struct image_rec {
+      uint32_t id;
+      uint32_t path;
+    };
+
+    /// one colour or texture of a material
+    struct param_rec {
+      uint32_t is_texture;
+      uint32_t image;    // if the image is missing, we use the colour.
+      float color[4];
+    };
+
+    enum {
+      param_emission,
+      param_ambient,
+      param_diffuse,
+      param_specular,
+      param_bump,
+      num_params,
+    };
+
+    /// <library_materials> material
+    struct material_rec {
+      uint32_t id;
+      uint32_t has_shader;
+      param_rec params[num_params];
+      float shininess;
+    };
+
+    /// skin from a controller. The joints follow each other in the joint section.
+    struct skin_rec {
+      float modelToBind[16];
+      uint32_t first_joint;
+      uint32_t num_joints;
+    };
+
+    struct joint_rec {
+      float bindToModel[16];
+      uint32_t sid;
+    };
+
+    /// mesh attribute
+    struct slot_rec {
+      uint16_t attr;
+      uint16_t size;
+      uint16_t kind;
+      uint16_t offset;
+    };
+
+    /// a triangle list or polylist of a geometry or controller
+    struct mesh_rec {
+      uint32_t name;        // "geometry+material"
+      uint32_t source;      // id of the geometry or controller
+      uint32_t is_geometry;
+      int32_t skin;
+      uint32_t stride;
+      uint32_t num_indices;
+      uint32_t num_vertices;
+      uint32_t mode;
+      uint32_t index_type;
+      uint32_t num_slots;
+      slot_rec slots[max_slots];
+      float aabb_center[3];
+      float aabb_half_extent[3];
+      uint64_t vertices;
+      uint64_t vertices_size;
+      uint64_t indices;
+      uint64_t indices_size;
+    };
+
+    /// <visual_scene>. Nodes and instances of a scene follow each other.
+    struct scene_rec {
+      uint32_t id;
+      uint32_t first_node;
+      uint32_t num_nodes;
+      uint32_t first_instance;
+      uint32_t num_instances;
+    };
+
+    /// a scene node. Parents come before their children.
+    struct node_rec {
+      uint32_t id;
+      uint32_t sid;
+      int32_t parent;      // -1 for the root of the scene
+      float nodeToParent[16];
+    };
+
+    /// skeleton of a controller instance
+    struct skeleton_rec {
+      uint32_t first_bone;
+      uint32_t num_bones;
+    };
+
+    struct bone_rec {
+      uint32_t node;
+      int32_t parent;
+    };
+
+    enum instance_kind {
+      instance_mesh,
+      instance_camera,
+      instance_light,
+    };
+
+    /// mesh, camera or light instance.
+    struct instance_rec {
+      uint32_t kind;
+      uint32_t node;
+      uint32_t mesh;       // mesh: name
+      uint32_t material;   // mesh: material id or no_string for the default material
+      int32_t skeleton;    // mesh: skeleton or -1
+      uint32_t flags;      // mesh: warn if missing. camera: ortho. light: attenuation and falloff.
+      float values[9];     // camera: x, y, aspect ratio, near, far. light: color, attenuation, falloff.
+    };
+
+    /// <animation>. The channels follow each other.
+    struct animation_rec {
+      uint32_t id;
+      uint32_t first_channel;
+      uint32_t num_channels;
+    };
+
+    struct channel_rec {
+      uint32_t target;
+      uint32_t sid;
+      uint32_t sub_target;
+      uint32_t component;
+      uint32_t num_times;
+      uint32_t num_values;
+      uint64_t times;
+      uint64_t values;
+    };
+
+    /// size of the records in each section
+    static uint32_t record_size(unsigned section) {
+      static const uint32_t sizes[] = {
+        1, 1, sizeof(image_rec), sizeof(material_rec), sizeof(skin_rec), sizeof(joint_rec), sizeof(mesh_rec),
+        sizeof(scene_rec), sizeof(node_rec), sizeof(skeleton_rec), sizeof(bone_rec), sizeof(instance_rec),
+        sizeof(animation_rec), sizeof(channel_rec),
+      };
+      return sizes[section];
+    }
+
+    static const char *magic() {
+      return "octetcc";
+    }
+
+  private:
+    // the mapped file
+    byte_span file;
+    const header *hdr;
+
+    // get an array of records from the file.
+    template <class rec_t> const rec_t *get(unsigned section) const {
+      return (const rec_t*)(file.data() + hdr->sections[section].offset);
+    }
+
+    unsigned count(unsigned section) const {
+      return hdr->sections[section].count;
+    }
+
+    // get a string from the string section. returns NULL for a NULL string or a bad offset.
+    const char *get_string(uint32_t offset) const {
+      return offset < count(section_strings) ? get<char>(section_strings) + offset : NULL;
+    }
+
+    // get a range of the blob section or NULL if it is not in the file.
+    const void *get_blob(uint64_t offset, uint64_t size) const {
+      uint64_t max = count(section_blobs);
+      return offset <= max && size <= max - offset ? get<uint8_t>(section_blobs) + offset : NULL;
+    }
+
+    static mat4t get_matrix(const float *values) {
+      mat4t result;
+      memcpy(&result, values, sizeof(result));
+      return result;
+    }
+
+    // make the vertices, indices and attributes of a mesh.
+    void fill_mesh(mesh &msh, const mesh_rec &rec) const {
+      for (unsigned i = 0; i != rec.num_slots && i != max_slots; ++i) {
+        const slot_rec &slot = rec.slots[i];
+        msh.add_attribute(slot.attr, slot.size, slot.kind, slot.offset);
+      }
+
+      const void *vertices = get_blob(rec.vertices, rec.vertices_size);
+      const void *indices = get_blob(rec.indices, rec.indices_size);
+      if (vertices && indices && (rec.vertices_size || rec.indices_size)) {
+        msh.allocate((size_t)rec.vertices_size, (size_t)rec.indices_size, vertices, indices);
+      }
+
+      msh.set_params(rec.stride, rec.num_indices, rec.num_vertices, rec.mode, rec.index_type);
+      vec3 center(rec.aabb_center[0], rec.aabb_center[1], rec.aabb_center[2]);
+      vec3 half_extent(rec.aabb_half_extent[0], rec.aabb_half_extent[1], rec.aabb_half_extent[2]);
+      msh.set_aabb(aabb(center, half_extent));
+    }
+
+    // make a material the way collada_builder::add_materials does.
+    material *make_material(const material_rec &rec, resource_dict &dict) const {
+      if (!rec.has_shader) {
+        return new material(vec4(0.5, 0.5, 0.5, 0));
+      }
+
+      static const char *names[] = { "emission", "ambient", "diffuse", "specular", "bump" };
+      dynarray<uint8_t> static_buffer(256);
+      param_buffer_info pbi(static_buffer);
+      param *params[num_params];
+      for (unsigned i = 0; i != num_params; ++i) {
+        const param_rec &p = rec.params[i];
+        atom_t name = app_utils::get_atom(names[i]);
+        image *img = p.is_texture ? dict.get_image(get_string(p.image)) : NULL;
+        if (img) {
+          params[i] = new param_sampler(pbi, name, img, new sampler(), param::stage_fragment);
+        } else {
+          params[i] = new param_color(pbi, vec4(p.color[0], p.color[1], p.color[2], p.color[3]), name, param::stage_fragment);
+        }
+      }
+      param_color *shininess = new param_color(pbi, vec4(rec.shininess, 0, 0, 0), app_utils::get_atom("shininess"), param::stage_fragment);
+      return new material(params[param_diffuse], params[param_ambient], params[param_emission], params[param_specular], params[param_bump], shininess);
+    }
+
+    // make the bones of a skeleton. parents must come before their children.
+    skeleton *make_skeleton(const skeleton_rec &rec, const dynarray<scene_node*> &nodes) const {
+      skeleton *skel = new skeleton();
+      const bone_rec *bones = get<bone_rec>(section_bones);
+      int num_added = 0;
+      for (unsigned i = rec.first_bone; i < rec.first_bone + rec.num_bones && i < count(section_bones); ++i) {
+        const bone_rec &bone = bones[i];
+        if (bone.node < nodes.size() && nodes[bone.node]) {
+          skel->add_bone(nodes[bone.node], bone.parent >= 0 && bone.parent < num_added ? bone.parent : -1);
+          num_added++;
+        }
+      }
+      return skel;
+    }
+
+    // make the nodes and instances of a scene.
+    void make_scene(const scene_rec &rec, resource_dict &dict, dynarray<scene_node*> &nodes, dynarray<ref<skeleton> > &skeletons) const {
+      visual_scene *scn = new visual_scene();
+      dict.set_resource(get_string(rec.id), scn);
+
+      const node_rec *node_recs = get<node_rec>(section_nodes);
+      for (unsigned i = rec.first_node; i != rec.first_node + rec.num_nodes; ++i) {
+        const node_rec &n = node_recs[i];
+        scene_node *node = new scene_node(get_matrix(n.nodeToParent), app_utils::get_atom(get_string(n.sid)));
+        dict.set_resource(get_string(n.id), node);
+        scene_node *parent = n.parent >= 0 && (unsigned)n.parent < i ? nodes[n.parent] : scn->get_root_node();
+        parent->add_child(node);
+        nodes[i] = node;
+      }
+
+      const instance_rec *instances = get<instance_rec>(section_instances);
+      for (unsigned i = rec.first_instance; i != rec.first_instance + rec.num_instances; ++i) {
+        const instance_rec &inst = instances[i];
+        scene_node *node = inst.node < nodes.size() ? nodes[inst.node] : NULL;
+        const float *v = inst.values;
+        if (inst.kind == instance_mesh) {
+          const char *mesh_url = get_string(inst.mesh);
+          const char *target = get_string(inst.material);
+          material *mat = target ? dict.get_material(target) : NULL;
+          if (!mat) mat = dict.get_material("default_material");
+
+          skeleton *skel = NULL;
+          if (inst.skeleton >= 0 && (unsigned)inst.skeleton < skeletons.size()) {
+            if (!skeletons[inst.skeleton]) {
+              skeletons[inst.skeleton] = make_skeleton(get<skeleton_rec>(section_skeletons)[inst.skeleton], nodes);
+            }
+            skel = skeletons[inst.skeleton];
+          }
+
+          mesh *msh = dict.get_mesh(mesh_url);
+          if (msh) {
+            scn->add_mesh_instance(new mesh_instance(node, msh, mat, skel));
+          } else if (inst.flags) {
+            log("warning: missing mesh %s\n", mesh_url);
+          }
+        } else if (inst.kind == instance_camera) {
+          camera_instance *c = new camera_instance();
+          scn->add_camera_instance(c);
+          c->set_node(node);
+          if (inst.flags) {
+            c->set_ortho(v[0], v[1], v[2], v[3], v[4]);
+          } else {
+            c->set_perspective(v[0], v[1], v[2], v[3], v[4]);
+          }
+        } else if (inst.kind == instance_light) {
+          light *_light = new light();
+          scn->add_light_instance(new light_instance(node, _light));
+          _light->set_color(vec4(v[0], v[1], v[2], v[3]));
+          if (inst.flags) {
+            _light->set_attenuation(v[4], v[5], v[6]);
+            _light->set_falloff(v[7], v[8]);
+          }
+        }
+      }
+    }
+
+  public:
+    collada_cache() {
+      hdr = NULL;
+    }
+
+    /// Map a cache file. Returns false if there is no cache for this version of the source file.
+    bool load(const char *path, uint64_t source_hash, uint64_t source_size) {
+      hdr = NULL;
+      file.reset();
+
+      file_map *map = new file_map(path, file_map::access_random);
+      if (map->get_error()) {
+        delete map;
+        return false;
+      }
+      file = byte_span(map);
+
+      // check everything before we use it, the file may be from another version or truncated.
+      const header *h = (const header*)file.data();
+      if (
+        file.size() < sizeof(header) || memcmp(h->magic, magic(), 8) ||
+        h->version != version || h->header_size != sizeof(header) || h->section_count != num_sections ||
+        h->file_size != file.size() || h->source_hash != source_hash || h->source_size != source_size
+      ) {
+        file.reset();
+        return false;
+      }
+
+      for (unsigned i = 0; i != num_sections; ++i) {
+        const section &s = h->sections[i];
+        if (
+          s.record_size != record_size(i) || (s.offset & 15) != 0 ||
+          s.offset > file.size() || (uint64_t)s.count * s.record_size > file.size() - s.offset
+        ) {
+          file.reset();
+          return false;
+        }
+      }
+
+      hdr = h;
+      if (count(section_strings) && get<char>(section_strings)[count(section_strings)-1] != 0) {
+        // strings must be terminated.
+        hdr = NULL;
+        file.reset();
+        return false;
+      }
+      return true;
+    }
+
+    /// True if we have mapped a valid cache.
+    bool is_loaded() const {
+      return hdr != NULL;
+    }
+
+    /// url of the default visual scene.
+    const char *get_default_scene() const {
+      return hdr ? get_string(hdr->default_scene) : NULL;
+    }
+
+    /// Make a mesh from the first component of a geometry. See collada_builder::get_mesh().
+    void get_mesh(mesh &s, const char *id, resource_dict &dict) const {
+      s.init();
+      if (!hdr) return;
+
+      const mesh_rec *meshes = get<mesh_rec>(section_meshes);
+      for (unsigned i = 0; i != count(section_meshes); ++i) {
+        const char *source = get_string(meshes[i].source);
+        if (meshes[i].is_geometry && source && id && !strcmp(source, id)) {
+          dict.set_resource(get_string(meshes[i].name), &s);
+          fill_mesh(s, meshes[i]);
+          return;
+        }
+      }
+      printf("warning: geometry %s not found\n", id);
+    }
+
+    /// Add everything in the cache to the resources collection, the same as collada_builder::get_resources().
+    void get_resources(resource_dict &dict) const {
+      if (!hdr) return;
+
+      const image_rec *images = get<image_rec>(section_images);
+      for (unsigned i = 0; i != count(section_images); ++i) {
+        dict.set_resource(get_string(images[i].id), new image(get_string(images[i].path)));
+      }
+
+      if (!dict.has_resource("default_material")) {
+        dict.set_resource("default_material", new material(vec4(0.5, 0.5, 0.5, 1)));
+      }
+
+      const material_rec *materials = get<material_rec>(section_materials);
+      for (unsigned i = 0; i != count(section_materials); ++i) {
+        dict.set_resource(get_string(materials[i].id), make_material(materials[i], dict));
+      }
+
+      dynarray<ref<skin> > skins(count(section_skins));
+      const skin_rec *skin_recs = get<skin_rec>(section_skins);
+      const joint_rec *joints = get<joint_rec>(section_joints);
+      for (unsigned i = 0; i != count(section_skins); ++i) {
+        const skin_rec &rec = skin_recs[i];
+        skins[i] = new skin(get_matrix(rec.modelToBind));
+        for (unsigned j = rec.first_joint; j < rec.first_joint + rec.num_joints && j < count(section_joints); ++j) {
+          skins[i]->add_joint(get_matrix(joints[j].bindToModel), app_utils::get_atom(get_string(joints[j].sid)));
+        }
+      }
+
+      const mesh_rec *meshes = get<mesh_rec>(section_meshes);
+      for (unsigned i = 0; i != count(section_meshes); ++i) {
+        const mesh_rec &rec = meshes[i];
+        mesh *msh = new mesh(rec.skin >= 0 && (unsigned)rec.skin < skins.size() ? (skin*)skins[rec.skin] : NULL);
+        dict.set_resource(get_string(rec.name), msh);
+        fill_mesh(*msh, rec);
+      }
+
+      // node and skeleton numbers are the same in every scene.
+      dynarray<scene_node*> nodes(count(section_nodes));
+      dynarray<ref<skeleton> > skeletons(count(section_skeletons));
+      if (nodes.size()) memset(nodes.data(), 0, nodes.size() * sizeof(scene_node*));
+      const scene_rec *scenes = get<scene_rec>(section_scenes);
+      for (unsigned i = 0; i != count(section_scenes); ++i) {
+        const scene_rec &rec = scenes[i];
+        if (rec.first_node + rec.num_nodes <= nodes.size() && rec.first_instance + rec.num_instances <= count(section_instances)) {
+          make_scene(rec, dict, nodes, skeletons);
+        }
+      }
+
+      const animation_rec *animations = get<animation_rec>(section_animations);
+      const channel_rec *channels = get<channel_rec>(section_channels);
+      for (unsigned i = 0; i != count(section_animations); ++i) {
+        const animation_rec &rec = animations[i];
+        animation *anim = new animation();
+        dict.set_resource(get_string(rec.id), anim);
+        for (unsigned j = rec.first_channel; j < rec.first_channel + rec.num_channels && j < count(section_channels); ++j) {
+          const channel_rec &ch = channels[j];
+          const float *times = (const float*)get_blob(ch.times, ch.num_times * sizeof(float));
+          const float *values = (const float*)get_blob(ch.values, ch.num_values * sizeof(float));
+          if (times && values && ch.num_times) {
+            anim->add_channel(
+              dict.get_resource(get_string(ch.target)),
+              app_utils::get_atom(get_string(ch.sid)),
+              app_utils::get_atom(get_string(ch.sub_target)),
+              app_utils::get_atom(get_string(ch.component)),
+              times, ch.num_times, values, ch.num_values
+            );
+          }
+        }
+      }
+    }
+  };
+
+  /// Records the resources made by collada_builder and writes them as a collada_cache file.
+  class collada_cache_writer {
+    typedef collada_cache cc;
+
+    dynarray<char> strings;
+    dynarray<uint8_t> blobs;
+    dynarray<cc::image_rec> images;
+    dynarray<cc::material_rec> materials;
+    dynarray<cc::skin_rec> skins;
+    dynarray<cc::joint_rec> joints;
+    dynarray<cc::mesh_rec> meshes;
+    dynarray<cc::scene_rec> scenes;
+    dynarray<cc::node_rec> nodes;
+    dynarray<cc::skeleton_rec> skeletons;
+    dynarray<cc::bone_rec> bones;
+    dynarray<cc::instance_rec> instances;
+    dynarray<cc::animation_rec> animations;
+    dynarray<cc::channel_rec> channels;
+    uint32_t default_scene;
+
+    // record numbers of nodes, skins and skeletons.
+    hash_map<void*, unsigned> object_index;
+
+    // get the record number of an object or -1
+    int find_object(void *object) {
+      int index = object ? object_index.get_index(object) : -1;
+      return index < 0 ? -1 : (int)object_index.get_value(index);
+    }
+
+    static void set_matrix(float *dest, const mat4t &value) {
+      memcpy(dest, &value, sizeof(value));
+    }
+
+    static void write_padded(FILE *file, const void *data, size_t size, bool &ok) {
+      static const uint8_t zeros[16] = { 0 };
+      if (size && fwrite(data, 1, size, file) != size) ok = false;
+      size_t pad = (0 - size) & 15;
+      if (pad && fwrite(zeros, 1, pad, file) != pad) ok = false;
+    }
+
+  public:
+    collada_cache_writer() {
+      default_scene = cc::no_string;
+    }
+
+    /// Add a string. Returns an offset or no_string.
+    uint32_t add_string(const char *value) {
+      if (!value) return cc::no_string;
+      uint32_t offset = strings.size();
+      size_t len = strlen(value) + 1;
+      strings.resize(offset + (unsigned)len);
+      memcpy(strings.data() + offset, value, len);
+      return offset;
+    }
+
+    /// Add vertices, indices or animation keys. Returns an offset. Blobs are aligned to 16 bytes.
+    uint64_t add_blob(const void *data, size_t size) {
+      uint64_t offset = blobs.size();
+      blobs.resize((unsigned)(offset + ((size + 15) & ~(size_t)15)));
+      if (size) memcpy(blobs.data() + offset, data, size);
+      if (blobs.size() != offset + size) memset(blobs.data() + offset + size, 0, (size_t)(blobs.size() - offset - size));
+      return offset;
+    }
+
+    void set_default_scene(const char *url) {
+      default_scene = add_string(url);
+    }
+
+    void add_image(const char *id, const char *path) {
+      cc::image_rec rec = { add_string(id), add_string(path) };
+      images.push_back(rec);
+    }
+
+    /// Add a material. Use add_string() for the images of the params.
+    void add_material(const char *id, const cc::material_rec &rec) {
+      materials.push_back(rec);
+      materials.back().id = add_string(id);
+    }
+
+    void add_skin(skin *skn) {
+      object_index[skn] = skins.size();
+      cc::skin_rec rec;
+      set_matrix(rec.modelToBind, skn->get_modelToBind());
+      rec.first_joint = joints.size();
+      rec.num_joints = skn->get_num_joints();
+      skins.push_back(rec);
+      for (unsigned i = 0; i != skn->get_num_joints(); ++i) {
+        cc::joint_rec joint;
+        set_matrix(joint.bindToModel, skn->get_bindToModel(i));
+        joint.sid = add_string(app_utils::get_atom_name(skn->get_joint(i)));
+        joints.push_back(joint);
+      }
+    }
+
+    /// Add a finished mesh with its vertices and indices.
+    void add_mesh(mesh *msh, const char *name, const char *source, bool is_geometry, const void *vertices, size_t vertices_size, const void *indices, size_t indices_size) {
+      cc::mesh_rec rec;
+      memset(&rec, 0, sizeof(rec));
+      rec.name = add_string(name);
+      rec.source = add_string(source);
+      rec.is_geometry = is_geometry;
+      rec.skin = find_object(msh->get_skin());
+      rec.stride = msh->get_stride();
+      rec.num_indices = msh->get_num_indices();
+      rec.num_vertices = msh->get_num_vertices();
+      rec.mode = msh->get_mode();
+      rec.index_type = msh->get_index_type();
+      rec.num_slots = msh->get_num_slots();
+      for (unsigned i = 0; i != rec.num_slots; ++i) {
+        cc::slot_rec &slot = rec.slots[i];
+        slot.attr = (uint16_t)msh->get_attr(i);
+        slot.size = (uint16_t)msh->get_size(i);
+        slot.kind = (uint16_t)msh->get_kind(i);
+        slot.offset = (uint16_t)msh->get_offset(i);
+      }
+      aabb bb = msh->get_aabb();
+      for (unsigned i = 0; i != 3; ++i) {
+        rec.aabb_center[i] = bb.get_center()[i];
+        rec.aabb_half_extent[i] = bb.get_half_extent()[i];
+      }
+      rec.vertices = add_blob(vertices, vertices_size);
+      rec.vertices_size = vertices_size;
+      rec.indices = add_blob(indices, indices_size);
+      rec.indices_size = indices_size;
+      meshes.push_back(rec);
+    }
+
+    /// Start a visual scene. Nodes and instances go in the last scene.
+    void add_scene(const char *id) {
+      cc::scene_rec rec = { add_string(id), nodes.size(), 0, instances.size(), 0 };
+      scenes.push_back(rec);
+    }
+
+    /// Add a node with its final matrix. The parent must have been added first.
+    void add_node(scene_node *node, const char *id, const char *sid, scene_node *parent) {
+      object_index[node] = nodes.size();
+      cc::node_rec rec;
+      rec.id = add_string(id);
+      rec.sid = add_string(sid);
+      rec.parent = find_object(parent);
+      set_matrix(rec.nodeToParent, node->get_nodeToParent());
+      nodes.push_back(rec);
+      scenes.back().num_nodes++;
+    }
+
+    /// Start a skeleton.
+    void add_skeleton(skeleton *skel) {
+      object_index[skel] = skeletons.size();
+      cc::skeleton_rec rec = { bones.size(), 0 };
+      skeletons.push_back(rec);
+    }
+
+    /// Add a bone to the last skeleton.
+    void add_bone(scene_node *node, int parent) {
+      int index = find_object(node);
+      if (index < 0) return;
+      cc::bone_rec rec = { (uint32_t)index, parent };
+      bones.push_back(rec);
+      skeletons.back().num_bones++;
+    }
+
+    /// Add a mesh instance. A NULL material means the default material.
+    void add_mesh_instance(scene_node *node, const char *mesh_url, const char *material, skeleton *skel, bool warn_if_missing) {
+      cc::instance_rec rec;
+      memset(&rec, 0, sizeof(rec));
+      rec.kind = cc::instance_mesh;
+      rec.node = (uint32_t)find_object(node);
+      rec.mesh = add_string(mesh_url);
+      rec.material = add_string(material);
+      rec.skeleton = find_object(skel);
+      rec.flags = warn_if_missing;
+      instances.push_back(rec);
+      scenes.back().num_instances++;
+    }
+
+    void add_camera(scene_node *node, bool ortho, float x, float y, float aspect_ratio, float n, float f) {
+      cc::instance_rec rec;
+      memset(&rec, 0, sizeof(rec));
+      rec.kind = cc::instance_camera;
+      rec.node = (uint32_t)find_object(node);
+      rec.flags = ortho;
+      float values[] = { x, y, aspect_ratio, n, f };
+      memcpy(rec.values, values, sizeof(values));
+      instances.push_back(rec);
+      scenes.back().num_instances++;
+    }
+
+    /// Add a light. If has_falloff is false, the attenuation and falloff are not set.
+    void add_light(scene_node *node, const vec4 &color, bool has_falloff, const float *attenuation, const float *falloff) {
+      cc::instance_rec rec;
+      memset(&rec, 0, sizeof(rec));
+      rec.kind = cc::instance_light;
+      rec.node = (uint32_t)find_object(node);
+      rec.flags = has_falloff;
+      for (unsigned i = 0; i != 4; ++i) rec.values[i] = color[i];
+      if (has_falloff) {
+        memcpy(rec.values + 4, attenuation, sizeof(float) * 3);
+        memcpy(rec.values + 7, falloff, sizeof(float) * 2);
+      }
+      instances.push_back(rec);
+      scenes.back().num_instances++;
+    }
+
+    /// Start an animation. Channels go in the last animation.
+    void add_animation(const char *id) {
+      cc::animation_rec rec = { add_string(id), channels.size(), 0 };
+      animations.push_back(rec);
+    }
+
+    void add_channel(const char *target, const char *sid, const char *sub_target, const char *component, const dynarray<float> &times, const dynarray<float> &values) {
+      cc::channel_rec rec;
+      rec.target = add_string(target);
+      rec.sid = add_string(sid);
+      rec.sub_target = add_string(sub_target);
+      rec.component = add_string(component);
+      rec.num_times = times.size();
+      rec.num_values = values.size();
+      rec.times = add_blob(times.data(), times.size() * sizeof(float));
+      rec.values = add_blob(values.data(), values.size() * sizeof(float));
+      channels.push_back(rec);
+      animations.back().num_channels++;
+    }
+
+    /// Write the cache file. We write to a temporary file first so that a reader never sees half a file.
+    bool save(const char *path, uint64_t source_hash, uint64_t source_size) {
+      cc::header hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      memcpy(hdr.magic, cc::magic(), 8);
+      hdr.version = cc::version;
+      hdr.header_size = sizeof(hdr);
+      hdr.source_hash = source_hash;
+      hdr.source_size = source_size;
+      hdr.default_scene = default_scene;
+      hdr.section_count = cc::num_sections;
+
+      struct { const void *data; unsigned count; } sections[cc::num_sections] = {
+        { strings.data(), strings.size() },
+        { blobs.data(), blobs.size() },
+        { images.data(), images.size() },
+        { materials.data(), materials.size() },
+        { skins.data(), skins.size() },
+        { joints.data(), joints.size() },
+        { meshes.data(), meshes.size() },
+        { scenes.data(), scenes.size() },
+        { nodes.data(), nodes.size() },
+        { skeletons.data(), skeletons.size() },
+        { bones.data(), bones.size() },
+        { instances.data(), instances.size() },
+        { animations.data(), animations.size() },
+        { channels.data(), channels.size() },
+      };
+
+      uint64_t offset = (sizeof(hdr) + 15) & ~15;
+      for (unsigned i = 0; i != cc::num_sections; ++i) {
+        uint64_t size = (uint64_t)sections[i].count * cc::record_size(i);
+        hdr.sections[i].offset = offset;
+        hdr.sections[i].count = sections[i].count;
+        hdr.sections[i].record_size = cc::record_size(i);
+        offset += (size + 15) & ~15;
+      }
+      hdr.file_size = offset;
+
+      string tmp_path;
+      tmp_path.format("%s.tmp", path);
+      FILE *file = fopen(tmp_path, "wb");
+      if (!file) return false;
+
+      bool ok = true;
+      write_padded(file, &hdr, sizeof(hdr), ok);
+      for (unsigned i = 0; i != cc::num_sections; ++i) {
+        write_padded(file, sections[i].data, (size_t)sections[i].count * cc::record_size(i), ok);
+      }
+      ok = fclose(file) == 0 && ok;
+
+      if (ok) {
+        remove(path);
+        ok = rename(tmp_path, path) == 0;
+      }
+      if (!ok) {
+        remove(tmp_path);
+      }
+      return ok;
+    }
+  };
+}}
@@ -0,0 +1,651 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// DXT (BCn) texture encoder
+//
+// See http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
+// and http://www.opengl.org/registry/specs/ARB/texture_compression_rgtc.txt
+//
+// Each 4x4 block of pixels becomes 8 or 16 bytes that the GPU decodes as it samples:
+//   BC1 (DXT1): two 565 colours and a 2 bit index per pixel choosing one of four on the line between them.
+//   BC4 (RGTC1): two 8 bit values and a 3 bit index per pixel choosing one of eight.
+//   BC3 (DXT5): a BC4 block of alpha followed by a BC1 block of colour.
+//   BC5 (RGTC2): BC4 blocks of red and green, for normal maps.
+//
+// Colours are fitted to the line in one of two ways:
+//   fast: "range fit". The end points are the two colours furthest apart along
+//         the principal axis of the block.
+//   high: "cluster fit". Every way of splitting the colours, in order along the axis,
+//         into the four palette entries is tried and the best end points for each split
+//         are found by least squares. The better of this and the range fit is kept.
+//
+// Block rows of every mip level are independent, so large images are encoded on many threads.
+//
+namespace octet { namespace loaders {
+  /// Compress images to BC1, BC3, BC4 or BC5 blocks for glCompressedTexImage2D.
+  ///
+  ///     dxt_encoder enc;
+  ///     dynarray<uint8_t> blocks;
+  ///     enc.encode(blocks, dxt_encoder::bc1, width, height, width * 4, pixels);
+  ///
+  /// BC1 and BC4 use a quarter of the memory of RGB(A) pixels, BC3 and BC5 a half.
+  class dxt_encoder {
+  public:
+    /// Block formats.
+    enum format_t {
+      bc1, ///< DXT1: RGB, 8 bytes per block.
+      bc3, ///< DXT5: RGBA, 16 bytes per block.
+      bc4, ///< RGTC1: red only, 8 bytes per block.
+      bc5, ///< RGTC2: red and green, 16 bytes per block.
+    };
+
+    /// How hard to look for the best end points.
+    enum quality_t {
+      quality_fast, ///< range fit.
+      quality_high, ///< cluster fit, about thirty times slower for BC1.
+    };
+
+  private:
+    // smaller images are encoded on one thread as waking the threads takes longer.
+    enum { min_parallel_pixels = 1 << 16 };
+
+    // one mip level of the image.
+    struct level {
+      const uint8_t *src;
+      int stride;
+      unsigned width;
+      unsigned height;
+      unsigned blocks_x;
+      unsigned blocks_y;
+      size_t offset;
+    };
+
+    // settings
+    quality_t quality;
+    job_pool *jobs;
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Colour (BC1) blocks
+    //
+
+    // round a colour to 565.
+    static unsigned to_565(const vec4 &c) {
+      int r = (int)(c.x() * (31.0f / 255) + 0.5f);
+      int g = (int)(c.y() * (63.0f / 255) + 0.5f);
+      int b = (int)(c.z() * (31.0f / 255) + 0.5f);
+      r = r < 0 ? 0 : r > 31 ? 31 : r;
+      g = g < 0 ? 0 : g > 63 ? 63 : g;
+      b = b < 0 ? 0 : b > 31 ? 31 : b;
+      return (r << 11) | (g << 5) | b;
+    }
+
+    // expand a 565 colour to 8 bits per component like the GPU does.
+    static void from_565(int *rgb, unsigned c) {
+      unsigned r = (c >> 11) & 0x1f, g = (c >> 5) & 0x3f, b = c & 0x1f;
+      rgb[0] = (r << 3) | (r >> 2);
+      rgb[1] = (g << 2) | (g >> 4);
+      rgb[2] = (b << 3) | (b >> 2);
+    }
+
+    // choose the nearest of the four colours for each pixel. c0 must be >= c1.
+    // returns the squared error.
+    static float fit_indices(uint32_t &indices, const float *r, const float *g, const float *b, unsigned c0, unsigned c1) {
+      int e0[3], e1[3];
+      from_565(e0, c0);
+      from_565(e1, c1);
+
+      // index 0 is c0, 1 is c1, 2 and 3 are a third of the way from c0 and c1.
+      // when c0 == c1 all four are the same and the first one wins.
+      float pr[4], pg[4], pb[4];
+      pr[0] = (float)e0[0]; pg[0] = (float)e0[1]; pb[0] = (float)e0[2];
+      pr[1] = (float)e1[0]; pg[1] = (float)e1[1]; pb[1] = (float)e1[2];
+      pr[2] = (float)((e0[0] * 2 + e1[0]) / 3); pg[2] = (float)((e0[1] * 2 + e1[1]) / 3); pb[2] = (float)((e0[2] * 2 + e1[2]) / 3);
+      pr[3] = (float)((e0[0] + e1[0] * 2) / 3); pg[3] = (float)((e0[1] + e1[1] * 2) / 3); pb[3] = (float)((e0[2] + e1[2] * 2) / 3);
+      if (c0 == c1) {
+        pr[2] = pr[3] = pr[0]; pg[2] = pg[3] = pg[0]; pb[2] = pb[3] = pb[0];
+      }
+
+      indices = 0;
+      #if OCTET_SSE2
+        // four pixels at a time.
+        __m128 total = _mm_setzero_ps();
+        for (unsigned i = 0; i != 16; i += 4) {
+          __m128 vr = _mm_loadu_ps(r + i), vg = _mm_loadu_ps(g + i), vb = _mm_loadu_ps(b + i);
+          __m128 best = _mm_set1_ps(1e30f);
+          __m128i idx = _mm_setzero_si128();
+          for (unsigned k = 0; k != 4; ++k) {
+            __m128 dr = _mm_sub_ps(vr, _mm_set1_ps(pr[k]));
+            __m128 dg = _mm_sub_ps(vg, _mm_set1_ps(pg[k]));
+            __m128 db = _mm_sub_ps(vb, _mm_set1_ps(pb[k]));
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+            __m128i less = _mm_castps_si128(_mm_cmplt_ps(d, best));
+            best = _mm_min_ps(d, best);
+            idx = _mm_or_si128(_mm_andnot_si128(less, idx), _mm_and_si128(less, _mm_set1_epi32(k)));
+          }
+          total = _mm_add_ps(total, best);
+
+          // gather the 2 bit indices: lane j moves up by 2*j bits.
+          idx = _mm_or_si128(idx, _mm_srli_si128(idx, 3));
+          idx = _mm_or_si128(idx, _mm_srli_si128(idx, 6));
+          uint32_t bits = (uint32_t)_mm_cvtsi128_si32(idx);
+          bits = (bits & 0x03) | ((bits >> 6) & 0x0c) | ((bits >> 12) & 0x30) | ((bits >> 18) & 0xc0);
+          indices |= bits << (i * 2);
+        }
+        float sums[4];
+        _mm_storeu_ps(sums, total);
+        return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+      #else
+        float error = 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          float best = 1e30f;
+          unsigned idx = 0;
+          for (unsigned k = 0; k != 4; ++k) {
+            float dr = r[i] - pr[k], dg = g[i] - pg[k], db = b[i] - pb[k];
+            float d = dr * dr + dg * dg + db * db;
+            if (d < best) { best = d; idx = k; }
+          }
+          error += best;
+          indices |= idx << (i * 2);
+        }
+        return error;
+      #endif
+    }
+
+    // mean and principal axis of the colours, by the power method on the covariance matrix.
+    static void principal_axis(vec4 &mean, vec4 &axis, const vec4 *colours) {
+      vec4 total(0, 0, 0, 0);
+      for (unsigned i = 0; i != 16; ++i) {
+        total += colours[i];
+      }
+      mean = total * (1.0f / 16);
+
+      // (xx, yy, zz) and (xy, yz, zx)
+      vec4 diag(0, 0, 0, 0), cross(0, 0, 0, 0);
+      for (unsigned i = 0; i != 16; ++i) {
+        vec4 d = colours[i] - mean;
+        diag += d * d;
+        cross += d * vec4(d.y(), d.z(), d.x(), 0);
+      }
+      float xx = diag.x(), yy = diag.y(), zz = diag.z();
+      float xy = cross.x(), yz = cross.y(), zx = cross.z();
+
+      // start with the row of the largest variance, which can not be at right angles to the axis.
+      vec4 v =
+        xx >= yy && xx >= zz ? vec4(xx, xy, zx, 0) :
+        yy >= zz ? vec4(xy, yy, yz, 0) :
+        vec4(zx, yz, zz, 0)
+      ;
+      for (unsigned i = 0; i != 8; ++i) {
+        vec4 nv(
+          v.x() * xx + v.y() * xy + v.z() * zx,
+          v.x() * xy + v.y() * yy + v.z() * yz,
+          v.x() * zx + v.y() * yz + v.z() * zz,
+          0
+        );
+        float len = nv.length();
+        if (len < 1e-6f) {
+          axis = vec4(0, 0, 0, 0);
+          return;
+        }
+        v = nv * (1.0f / len);
+      }
+      axis = v;
+    }
+
+    // end points are the colours with the smallest and largest projections on the axis.
+    static void range_fit(unsigned &c0, unsigned &c1, const vec4 *colours, const vec4 &axis) {
+      float pmin = 1e30f, pmax = -1e30f;
+      unsigned imin = 0, imax = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        float p = dot(colours[i], axis);
+        if (p < pmin) { pmin = p; imin = i; }
+        if (p > pmax) { pmax = p; imax = i; }
+      }
+      c0 = to_565(colours[imax]);
+      c1 = to_565(colours[imin]);
+    }
+
+    // try every split of the colours, in order along the axis, into the four palette entries.
+    // a, b are the end points; each colour is alpha * a + beta * b, where
+    // (alpha, beta) is (1, 0), (2/3, 1/3), (1/3, 2/3) or (0, 1).
+    // For each split, solve for a and b by least squares, round them to 565 and measure the error.
+    static void cluster_fit(unsigned &c0, unsigned &c1, const vec4 *colours, const vec4 &axis) {
+      float proj[16];
+      uint8_t order[16];
+      for (unsigned i = 0; i != 16; ++i) {
+        float p = dot(colours[i], axis);
+        unsigned j = i;
+        for (; j != 0 && proj[j-1] > p; --j) {
+          proj[j] = proj[j-1];
+          order[j] = order[j-1];
+        }
+        proj[j] = p;
+        order[j] = (uint8_t)i;
+      }
+
+      // sums[c][i] is the total of component c of the first i colours in order.
+      // the extra three are for the last group of four splits.
+      float sums[3][20];
+      for (unsigned c = 0; c != 3; ++c) {
+        sums[c][0] = 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          sums[c][i+1] = sums[c][i] + colours[order[i]][c];
+        }
+        sums[c][17] = sums[c][18] = sums[c][19] = sums[c][16];
+      }
+
+      static const float scale[3] = { 31.0f / 255, 63.0f / 255, 31.0f / 255 };
+      static const float unscale[3] = { 255.0f / 31, 255.0f / 63, 255.0f / 31 };
+      float best_a[3], best_b[3];
+
+      #if OCTET_SSE2
+        // four values of k (the start of the last cluster) at a time.
+        __m128 best_error = _mm_set1_ps(1e30f);
+        __m128 best_av[3], best_bv[3];
+        for (unsigned c = 0; c != 3; ++c) {
+          best_av[c] = best_bv[c] = _mm_set1_ps(sums[c][16] * (1.0f / 16));
+        }
+        const __m128 zero = _mm_setzero_ps(), max_value = _mm_set1_ps(255.0f);
+        for (unsigned i = 0; i <= 16; ++i) {
+          for (unsigned j = i; j <= 16; ++j) {
+            __m128 n1 = _mm_set1_ps((float)(j - i));
+            __m128 alpha2_01 = _mm_add_ps(_mm_set1_ps((float)i), _mm_mul_ps(n1, _mm_set1_ps(4.0f / 9)));
+            __m128 beta2_1 = _mm_mul_ps(n1, _mm_set1_ps(1.0f / 9));
+            for (unsigned k = j; k <= 16; k += 4) {
+              __m128 kv = _mm_add_ps(_mm_set1_ps((float)k), _mm_setr_ps(0, 1, 2, 3));
+              __m128 n2 = _mm_sub_ps(kv, _mm_set1_ps((float)j));
+              __m128 n3 = _mm_sub_ps(_mm_set1_ps(16.0f), kv);
+              __m128 alpha2 = _mm_add_ps(alpha2_01, _mm_mul_ps(n2, _mm_set1_ps(1.0f / 9)));
+              __m128 beta2 = _mm_add_ps(_mm_add_ps(n3, beta2_1), _mm_mul_ps(n2, _mm_set1_ps(4.0f / 9)));
+              __m128 alphabeta = _mm_mul_ps(_mm_add_ps(n1, n2), _mm_set1_ps(2.0f / 9));
+              __m128 det = _mm_sub_ps(_mm_mul_ps(alpha2, beta2), _mm_mul_ps(alphabeta, alphabeta));
+
+              // splits with all the colours at one end and k > 16 are not used.
+              __m128 valid = _mm_and_ps(_mm_cmpge_ps(det, _mm_set1_ps(1e-3f)), _mm_cmpge_ps(n3, zero));
+              __m128 factor = _mm_div_ps(_mm_set1_ps(1.0f), _mm_or_ps(_mm_and_ps(valid, det), _mm_andnot_ps(valid, _mm_set1_ps(1.0f))));
+
+              __m128 error = zero, av[3], bv[3];
+              for (unsigned c = 0; c != 3; ++c) {
+                __m128 x2 = _mm_sub_ps(_mm_loadu_ps(&sums[c][k]), _mm_set1_ps(sums[c][j]));
+                __m128 alphax = _mm_add_ps(
+                  _mm_set1_ps(sums[c][i] + (sums[c][j] - sums[c][i]) * (2.0f / 3)),
+                  _mm_mul_ps(x2, _mm_set1_ps(1.0f / 3))
+                );
+                __m128 betax = _mm_sub_ps(_mm_set1_ps(sums[c][16]), alphax);
+                __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(alphax, beta2), _mm_mul_ps(betax, alphabeta)), factor);
+                __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(betax, alpha2), _mm_mul_ps(alphax, alphabeta)), factor);
+
+                // clamp and round to the 565 grid.
+                a = _mm_min_ps(_mm_max_ps(a, zero), max_value);
+                b = _mm_min_ps(_mm_max_ps(b, zero), max_value);
+                a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(a, _mm_set1_ps(scale[c])))), _mm_set1_ps(unscale[c]));
+                b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(b, _mm_set1_ps(scale[c])))), _mm_set1_ps(unscale[c]));
+                av[c] = a;
+                bv[c] = b;
+
+                // squared error, less the sum of the squared colours, which is the same for every split.
+                __m128 e = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(a, a), alpha2), _mm_mul_ps(_mm_mul_ps(b, b), beta2));
+                __m128 e2 = _mm_sub_ps(_mm_mul_ps(_mm_mul_ps(a, b), alphabeta), _mm_add_ps(_mm_mul_ps(a, alphax), _mm_mul_ps(b, betax)));
+                error = _mm_add_ps(error, _mm_add_ps(e, _mm_add_ps(e2, e2)));
+              }
+
+              __m128 better = _mm_and_ps(valid, _mm_cmplt_ps(error, best_error));
+              best_error = _mm_or_ps(_mm_and_ps(better, error), _mm_andnot_ps(better, best_error));
+              for (unsigned c = 0; c != 3; ++c) {
+                best_av[c] = _mm_or_ps(_mm_and_ps(better, av[c]), _mm_andnot_ps(better, best_av[c]));
+                best_bv[c] = _mm_or_ps(_mm_and_ps(better, bv[c]), _mm_andnot_ps(better, best_bv[c]));
+              }
+            }
+          }
+        }
+
+        // the best of the four lanes.
+        float errors[4], lanes[4];
+        _mm_storeu_ps(errors, best_error);
+        unsigned best = 0;
+        for (unsigned l = 1; l != 4; ++l) {
+          if (errors[l] < errors[best]) best = l;
+        }
+        for (unsigned c = 0; c != 3; ++c) {
+          _mm_storeu_ps(lanes, best_av[c]);
+          best_a[c] = lanes[best];
+          _mm_storeu_ps(lanes, best_bv[c]);
+          best_b[c] = lanes[best];
+        }
+      #else
+        float best_error = 1e30f;
+        for (unsigned c = 0; c != 3; ++c) {
+          best_a[c] = best_b[c] = sums[c][16] * (1.0f / 16);
+        }
+        for (unsigned i = 0; i <= 16; ++i) {
+          for (unsigned j = i; j <= 16; ++j) {
+            for (unsigned k = j; k <= 16; ++k) {
+              float n0 = (float)i, n1 = (float)(j - i), n2 = (float)(k - j), n3 = (float)(16 - k);
+              float alpha2 = n0 + n1 * (4.0f / 9) + n2 * (1.0f / 9);
+              float beta2 = n3 + n2 * (4.0f / 9) + n1 * (1.0f / 9);
+              float alphabeta = (n1 + n2) * (2.0f / 9);
+              float det = alpha2 * beta2 - alphabeta * alphabeta;
+              if (det < 1e-3f) continue;
+
+              float factor = 1.0f / det, error = 0, a[3], b[3];
+              for (unsigned c = 0; c != 3; ++c) {
+                float alphax = sums[c][i] + (sums[c][j] - sums[c][i]) * (2.0f / 3) + (sums[c][k] - sums[c][j]) * (1.0f / 3);
+                float betax = sums[c][16] - alphax;
+                float ac = (alphax * beta2 - betax * alphabeta) * factor;
+                float bc = (betax * alpha2 - alphax * alphabeta) * factor;
+                ac = ac < 0 ? 0 : ac > 255 ? 255 : ac;
+                bc = bc < 0 ? 0 : bc > 255 ? 255 : bc;
+                a[c] = (float)(int)(ac * scale[c] + 0.5f) * unscale[c];
+                b[c] = (float)(int)(bc * scale[c] + 0.5f) * unscale[c];
+                error += a[c] * a[c] * alpha2 + b[c] * b[c] * beta2 + (a[c] * b[c] * alphabeta - a[c] * alphax - b[c] * betax) * 2;
+              }
+              if (error < best_error) {
+                best_error = error;
+                for (unsigned c = 0; c != 3; ++c) {
+                  best_a[c] = a[c];
+                  best_b[c] = b[c];
+                }
+              }
+            }
+          }
+        }
+      #endif
+
+      c0 = to_565(vec4(best_a[0], best_a[1], best_a[2], 0));
+      c1 = to_565(vec4(best_b[0], best_b[1], best_b[2], 0));
+    }
+
+    // encode 16 pixels of RGB as a BC1 block.
+    void encode_colours(uint8_t *dest, const uint8_t (*comps)[16]) const {
+      float r[16], g[16], b[16];
+      vec4 colours[16];
+      for (unsigned i = 0; i != 16; ++i) {
+        r[i] = comps[0][i];
+        g[i] = comps[1][i];
+        b[i] = comps[2][i];
+        colours[i] = vec4(r[i], g[i], b[i], 0);
+      }
+
+      vec4 mean, axis;
+      principal_axis(mean, axis, colours);
+
+      unsigned c0, c1;
+      range_fit(c0, c1, colours, axis);
+      if (c0 < c1) { unsigned t = c0; c0 = c1; c1 = t; }
+      uint32_t indices;
+      float error = fit_indices(indices, r, g, b, c0, c1);
+
+      if (quality == quality_high && error != 0) {
+        unsigned k0, k1;
+        cluster_fit(k0, k1, colours, axis);
+        if (k0 < k1) { unsigned t = k0; k0 = k1; k1 = t; }
+        uint32_t cluster_indices;
+        float cluster_error = fit_indices(cluster_indices, r, g, b, k0, k1);
+        if (cluster_error < error) {
+          c0 = k0;
+          c1 = k1;
+          indices = cluster_indices;
+        }
+      }
+
+      dest[0] = (uint8_t)c0;
+      dest[1] = (uint8_t)(c0 >> 8);
+      dest[2] = (uint8_t)c1;
+      dest[3] = (uint8_t)(c1 >> 8);
+      dest[4] = (uint8_t)indices;
+      dest[5] = (uint8_t)(indices >> 8);
+      dest[6] = (uint8_t)(indices >> 16);
+      dest[7] = (uint8_t)(indices >> 24);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Single channel (BC4) blocks
+    //
+
+    // the eight values a block with these end points decodes to.
+    static void make_palette(uint8_t *palette, unsigned a0, unsigned a1) {
+      palette[0] = (uint8_t)a0;
+      palette[1] = (uint8_t)a1;
+      if (a0 > a1) {
+        for (unsigned i = 1; i != 7; ++i) {
+          palette[i+1] = (uint8_t)(((7 - i) * a0 + i * a1 + 3) / 7);
+        }
+      } else {
+        for (unsigned i = 1; i != 5; ++i) {
+          palette[i+1] = (uint8_t)(((5 - i) * a0 + i * a1 + 2) / 5);
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+      }
+    }
+
+    // choose the nearest palette value for each pixel. returns the squared error.
+    static unsigned fit_values(uint8_t *indices, const uint8_t *values, const uint8_t *palette) {
+      uint8_t diffs[16];
+      #if OCTET_SSE2
+        // all 16 pixels at once as bytes.
+        __m128i v = _mm_loadu_si128((const __m128i*)values);
+        __m128i best = _mm_set1_epi8(-1);
+        __m128i idx = _mm_setzero_si128();
+        for (unsigned k = 0; k != 8; ++k) {
+          __m128i p = _mm_set1_epi8((char)palette[k]);
+          __m128i d = _mm_or_si128(_mm_subs_epu8(v, p), _mm_subs_epu8(p, v));
+          __m128i new_best = _mm_min_epu8(d, best);
+          __m128i less = _mm_andnot_si128(_mm_cmpeq_epi8(new_best, best), _mm_set1_epi8(-1));
+          best = new_best;
+          idx = _mm_or_si128(_mm_andnot_si128(less, idx), _mm_and_si128(less, _mm_set1_epi8((char)k)));
+        }
+        _mm_storeu_si128((__m128i*)indices, idx);
+        _mm_storeu_si128((__m128i*)diffs, best);
+      #else
+        for (unsigned i = 0; i != 16; ++i) {
+          unsigned best = 256, idx = 0;
+          for (unsigned k = 0; k != 8; ++k) {
+            unsigned d = values[i] > palette[k] ? values[i] - palette[k] : palette[k] - values[i];
+            if (d < best) { best = d; idx = k; }
+          }
+          indices[i] = (uint8_t)idx;
+          diffs[i] = (uint8_t)best;
+        }
+      #endif
+      unsigned error = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        error += diffs[i] * diffs[i];
+      }
+      return error;
+    }
+
+    // encode 16 values as a BC4 block.
+    void encode_values(uint8_t *dest, const uint8_t *values) const {
+      unsigned vmin = 255, vmax = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        unsigned v = values[i];
+        vmin = v < vmin ? v : vmin;
+        vmax = v > vmax ? v : vmax;
+      }
+
+      uint8_t palette[8], indices[16];
+      unsigned a0 = vmax, a1 = vmin;
+      make_palette(palette, a0, a1);
+      unsigned error = fit_values(indices, values, palette);
+
+      if (quality == quality_high && error != 0) {
+        uint8_t try_indices[16];
+
+        // the ends pulled in a little often bring more values closer.
+        for (unsigned i0 = 0; i0 != 4; ++i0) {
+          for (unsigned i1 = 0; i1 != 4; ++i1) {
+            if ((i0 | i1) == 0 || vmax - i0 <= vmin + i1) continue;
+            make_palette(palette, vmax - i0, vmin + i1);
+            unsigned try_error = fit_values(try_indices, values, palette);
+            if (try_error < error) {
+              error = try_error;
+              a0 = vmax - i0;
+              a1 = vmin + i1;
+              memcpy(indices, try_indices, 16);
+            }
+          }
+        }
+
+        // the six value mode has exact 0 and 255 for the rest to skip.
+        unsigned imin = 255, imax = 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          unsigned v = values[i];
+          if (v != 0 && v != 255) {
+            imin = v < imin ? v : imin;
+            imax = v > imax ? v : imax;
+          }
+        }
+        if (imin <= imax) {
+          make_palette(palette, imin, imax);
+          unsigned try_error = fit_values(try_indices, values, palette);
+          if (try_error < error) {
+            error = try_error;
+            a0 = imin;
+            a1 = imax;
+            memcpy(indices, try_indices, 16);
+          }
+        }
+      }
+
+      dest[0] = (uint8_t)a0;
+      dest[1] = (uint8_t)a1;
+      for (unsigned i = 0; i != 16; i += 8) {
+        uint32_t bits = 0;
+        for (unsigned j = 0; j != 8; ++j) {
+          bits |= indices[i + j] << (j * 3);
+        }
+        dest[2 + i/8*3] = (uint8_t)bits;
+        dest[3 + i/8*3] = (uint8_t)(bits >> 8);
+        dest[4 + i/8*3] = (uint8_t)(bits >> 16);
+      }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Blocks and rows
+    //
+
+    // copy a 4x4 block to one array per component, repeating the edge pixels of partial blocks.
+    static void load_block(uint8_t (*comps)[16], const level &lev, unsigned bpp, unsigned bx, unsigned by) {
+      for (unsigned y = 0; y != 4; ++y) {
+        unsigned sy = by * 4 + y;
+        sy = sy < lev.height ? sy : lev.height - 1;
+        const uint8_t *line = lev.src + (ptrdiff_t)lev.stride * sy;
+        for (unsigned x = 0; x != 4; ++x) {
+          unsigned sx = bx * 4 + x;
+          sx = sx < lev.width ? sx : lev.width - 1;
+          const uint8_t *p = line + sx * bpp;
+          unsigned i = y * 4 + x;
+          comps[0][i] = p[0];
+          comps[1][i] = bpp >= 3 ? p[1] : p[0];
+          comps[2][i] = bpp >= 3 ? p[2] : p[0];
+          comps[3][i] = bpp == 4 ? p[3] : bpp == 2 ? p[1] : 255;
+        }
+      }
+    }
+
+    void encode_row(uint8_t *dest, format_t format, const level &lev, unsigned bpp, unsigned by) const {
+      uint8_t comps[4][16];
+      for (unsigned bx = 0; bx != lev.blocks_x; ++bx) {
+        load_block(comps, lev, bpp, bx, by);
+        switch (format) {
+          case bc1: encode_colours(dest, comps); dest += 8; break;
+          case bc3: encode_values(dest, comps[3]); encode_colours(dest + 8, comps); dest += 16; break;
+          case bc4: encode_values(dest, comps[0]); dest += 8; break;
+          case bc5: encode_values(dest, comps[0]); encode_values(dest + 8, comps[1]); dest += 16; break;
+        }
+      }
+    }
+
+    // encode up to max_levels levels, each half the size of the last and packed after it.
+    bool encode_levels(dynarray<uint8_t> &data, format_t format, unsigned width, unsigned height, int stride, const uint8_t *src, unsigned bpp, unsigned max_levels) {
+      if (width == 0 || height == 0 || !src || bpp == 0 || bpp > 4) {
+        return false;
+      }
+
+      dynarray<level> levels;
+      size_t offset = data.size();
+      unsigned total_rows = 0;
+      size_t total_pixels = 0;
+      for (unsigned w = width, h = height; w != 0 && h != 0 && levels.size() != max_levels; w >>= 1, h >>= 1) {
+        level lev;
+        lev.src = src;
+        lev.stride = levels.size() == 0 ? stride : (int)(w * bpp);
+        lev.width = w;
+        lev.height = h;
+        lev.blocks_x = (w + 3) / 4;
+        lev.blocks_y = (h + 3) / 4;
+        lev.offset = offset;
+        levels.push_back(lev);
+        offset += get_size(format, w, h);
+        total_rows += lev.blocks_y;
+        total_pixels += (size_t)w * h;
+        src += (size_t)w * h * bpp;
+      }
+
+      job_pool *workers = total_pixels >= min_parallel_pixels ? jobs : NULL;
+
+      // every block row of every level is a piece of work.
+      data.resize((unsigned)offset);
+      uint8_t *dest = data.data();
+      unsigned block_bytes = get_block_bytes(format);
+      job_pool::run(workers, total_rows, [&](unsigned row) {
+        unsigned l = 0;
+        while (row >= levels[l].blocks_y) {
+          row -= levels[l++].blocks_y;
+        }
+        const level &lev = levels[l];
+        encode_row(dest + lev.offset + (size_t)row * lev.blocks_x * block_bytes, format, lev, bpp, row);
+      });
+      return true;
+    }
+
+  public:
+    dxt_encoder() {
+      quality = quality_fast;
+      jobs = &job_pool::get_shared();
+    }
+
+    /// Range fit (the default) or cluster fit.
+    void set_quality(quality_t value) {
+      quality = value;
+    }
+
+    /// Use these threads for large images. The default is job_pool::get_shared(); NULL encodes on the calling thread.
+    void set_job_pool(job_pool *value) {
+      jobs = value;
+    }
+
+    /// Bytes in a 4x4 block.
+    static unsigned get_block_bytes(format_t format) {
+      return format == bc1 || format == bc4 ? 8 : 16;
+    }
+
+    /// Bytes for an image of this size. Partial blocks at the edges take a whole block.
+    static unsigned get_size(format_t format, unsigned width, unsigned height) {
+      return ((width + 3) / 4) * ((height + 3) / 4) * get_block_bytes(format);
+    }
+
+    /// Add the blocks of an image to data, top row of blocks first.
+    /// src is the top line of the image and lines are stride bytes apart.
+    /// Pixels are RGBA (4 bytes), grey and alpha (2 bytes), RGB (3 bytes) or grey (1 byte).
+    /// BC1 ignores alpha, BC3 uses it, BC4 uses the first byte and BC5 the first two.
+    bool encode(dynarray<uint8_t> &data, format_t format, unsigned width, unsigned height, int stride, const uint8_t *src, unsigned bytes_per_pixel = 4) {
+      return encode_levels(data, format, width, height, stride, src, bytes_per_pixel, 1);
+    }
+
+    /// Add the blocks of an image and its mipmaps to data.
+    /// The mipmaps follow the image in src, each half the size of the last, like image::make_mipmaps makes them,
+    /// down to the last level with a width and height of at least one.
+    bool encode_mipmaps(dynarray<uint8_t> &data, format_t format, unsigned width, unsigned height, const uint8_t *src, unsigned bytes_per_pixel = 4) {
+      return encode_levels(data, format, width, height, (int)(width * bytes_per_pixel), src, bytes_per_pixel, ~0u);
+    }
+  };
+}}
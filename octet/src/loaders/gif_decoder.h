@@ -5,206 +5,498 @@
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
 //
-// gif file decoder - only the most common variants
-// 
+// gif file decoder - GIF87a and GIF89a, animated or still.
+//
+// Each LZW string is a string before it plus one byte, and it always comes
+// straight after that string in the output. So the table stores where each string
+// was first written and its length, and a code is one copy from earlier in the output.
+// Long strings that are runs of one byte are written with memset.
+//
 namespace octet { namespace loaders {
+  /// Decode GIF files to RGBA. All frames of an animation can be decoded,
+  /// either one at a time on demand (get_frame) or all at once (get_frames)
+  /// into a block of images one after the other, as for a texture array.
+  ///
+  /// Images are bottom line first, like the other decoders.
+  ///
+  /// Example:
+  ///
+  ///     gif_decoder dec;
+  ///     if (dec.open(src, src_max)) {
+  ///       for (unsigned i = 0; i != dec.get_num_frames(); ++i) {
+  ///         const uint8_t *rgba = dec.get_frame(i);
+  ///         ...
+  ///       }
+  ///     }
   class gif_decoder {
-    uint16_t lzw_head[0x1001];
-    uint8_t lzw_tail[0x1001];
-    enum { debug_gif = 0 };
-
-    // add a lzw string for a specific code.
-    // all strings consist of a head and a single byte tail.
-    // we follow the chains to get the whole string.
-    uint8_t add_lwz_string(unsigned code, uint8_t *&bytes, uint8_t *max_bytes, unsigned reset_code) {
-      unsigned i = code;
-      unsigned num_bytes = 1;
-      for (; i > reset_code; i = lzw_head[i]) {
-        num_bytes++;
-      }
-
-      uint8_t *dest = bytes += num_bytes;
-      if (bytes > max_bytes) return 0;
-      i = code;
-      for (; i > reset_code; i = lzw_head[i]) {
-        *--dest = lzw_tail[i];
-      }
-      *--dest = i;
-
-      if (debug_gif) {
-        for (unsigned i = 0; i != num_bytes; ++i) {
-          printf("out %02x\n", dest[i]);
+    enum {
+      max_codes = 4096,
+      // indices starts with the bytes 0..255 so single byte codes can be copied like the others.
+      root_bytes = 256,
+      // the most pixels in the screen, an image or all the frames from get_frames().
+      max_pixels = 1 << 28,
+    };
+
+    // an entry in the LZW string table.
+    struct lzw_entry {
+      uint32_t pos;              // offset in indices
+      uint16_t length;
+      uint8_t first;
+      uint8_t run;
+    };
+
+    // an image in the file.
+    struct frame_info {
+      const uint8_t *data;       // first data sub-block
+      const uint8_t *palette;    // local or global colour table
+      unsigned palette_size;
+      unsigned left;
+      unsigned top;
+      unsigned width;            // clipped to the screen
+      unsigned height;
+      unsigned image_width;      // as stored
+      unsigned image_height;
+      unsigned delay;            // hundredths of a second
+      unsigned transparent;      // 0x100 for none
+      unsigned disposal;
+      unsigned min_code_size;
+      bool interlaced;
+    };
+
+    enum {
+      dispose_none = 0,
+      dispose_leave = 1,
+      dispose_background = 2,
+      dispose_previous = 3,
+    };
+
+    lzw_entry table[max_codes];
+
+    const uint8_t *src_max;
+    unsigned width;
+    unsigned height;
+    unsigned loop_count;
+    dynarray<frame_info> frames;
+
+    // the animation so far. next_frame is the first frame not drawn.
+    dynarray<uint8_t> canvas;
+    dynarray<uint8_t> previous;
+    dynarray<uint8_t> indices;
+    dynarray<uint8_t> lzw_bytes;
+    unsigned next_frame;
+
+    static unsigned u2(const uint8_t *src) {
+      return src[0] + src[1] * 256;
+    }
+
+    // skip a chain of sub-blocks. returns null if the file is cut short.
+    const uint8_t *skip_blocks(const uint8_t *src) const {
+      while (src < src_max && *src) {
+        src += *src + 1;
+      }
+      return src < src_max ? src + 1 : 0;
+    }
+
+    // gather the sub-blocks of image data into lzw_bytes with four zeros on the end.
+    void gather_blocks(const uint8_t *src) {
+      lzw_bytes.resize(0);
+      while (src < src_max && *src) {
+        unsigned len = *src++;
+        if (len > (unsigned)(src_max - src)) len = (unsigned)(src_max - src);
+        if (len == 0) break;
+        unsigned size = lzw_bytes.size();
+        lzw_bytes.resize(size + len);
+        memcpy(lzw_bytes.data() + size, src, len);
+        src += len;
+      }
+      for (unsigned i = 0; i != 4; ++i) {
+        lzw_bytes.push_back(0);
+      }
+    }
+
+    // decode the palette indices of one image into indices after the root bytes.
+    // Short data leaves zeros at the end. returns false for bad codes.
+    bool decode_indices(unsigned num_pixels, unsigned min_code_size) {
+      // eight spare bytes at the end let us copy eight bytes at a time.
+      indices.resize(root_bytes + num_pixels + 8);
+      uint8_t *base = indices.data();
+      uint8_t *dest = base + root_bytes;
+      uint8_t *dest_max = dest + num_pixels;
+      for (unsigned i = 0; i != root_bytes; ++i) {
+        base[i] = (uint8_t)i;
+      }
+      memset(dest, 0, num_pixels);
+      if (min_code_size < 1 || min_code_size > 11) return false;
+
+      unsigned clear_code = 1 << min_code_size;
+      unsigned end_code = clear_code + 1;
+      for (unsigned i = 0; i != clear_code; ++i) {
+        lzw_entry &e = table[i];
+        e.pos = i;
+        e.length = 1;
+        e.first = (uint8_t)i;
+        e.run = 1;
+      }
+
+      unsigned code_size = min_code_size + 1;
+      unsigned mask = (1 << code_size) - 1;
+      unsigned next_code = clear_code + 2;
+      unsigned prev_code = ~0u;
+
+      const uint8_t *src = lzw_bytes.data();
+      size_t num_bits = (size_t)(lzw_bytes.size() - 4) * 8;
+      size_t bit_pos = 0;
+
+      while (dest != dest_max && bit_pos + code_size <= num_bits) {
+        // the four zeros at the end make it safe to read four bytes.
+        const uint8_t *p = src + (bit_pos >> 3);
+        uint32_t word = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+        unsigned code = (word >> (bit_pos & 7)) & mask;
+        bit_pos += code_size;
+
+        if (code == clear_code) {
+          code_size = min_code_size + 1;
+          mask = (1 << code_size) - 1;
+          next_code = clear_code + 2;
+          prev_code = ~0u;
+          continue;
+        } else if (code == end_code) {
+          break;
         }
-      }    
-      return i;
+
+        if (prev_code == ~0u) {
+          // the first code after a clear is a single byte.
+          if (code >= clear_code) return false;
+          *dest++ = (uint8_t)code;
+          prev_code = code;
+          continue;
+        }
+
+        if (code > next_code || (code == next_code && next_code == max_codes)) {
+          return false;
+        }
+
+        // add the previous string plus the first byte of this one.
+        // this is where the previous string was written, as this string comes next.
+        if (next_code != max_codes) {
+          const lzw_entry &p = table[prev_code];
+          lzw_entry &e = table[next_code];
+          uint8_t suffix = code == next_code ? p.first : table[code].first;
+          e.pos = (uint32_t)(dest - base) - p.length;
+          e.length = p.length + 1;
+          e.first = p.first;
+          e.run = p.run && suffix == p.first;
+          if (++next_code > mask && code_size != 12) {
+            code_size++;
+            mask = mask * 2 + 1;
+          }
+        }
+
+        // copy the whole string from where it was written before.
+        // the copy may overlap, so go forwards.
+        const lzw_entry &e = table[code];
+        unsigned length = e.length < dest_max - dest ? e.length : (unsigned)(dest_max - dest);
+        const uint8_t *from = base + e.pos;
+        if (e.run && length > 16) {
+          memset(dest, e.first, length);
+        } else if (dest - from >= 8) {
+          // most strings are short, so always copy the first eight bytes.
+          unsigned i = 0;
+          do {
+            uint64_t v;
+            memcpy(&v, from + i, 8);
+            memcpy(dest + i, &v, 8);
+            i += 8;
+          } while (i < length);
+        } else {
+          for (unsigned i = 0; i != length; ++i) {
+            dest[i] = from[i];
+          }
+        }
+        dest += length;
+        prev_code = code;
+      }
+      return true;
     }
 
-    // decode image data from a gif file as a lzw coding of palette values
-    bool gif_decode_bytes(uint8_t *bytes, uint8_t *max_bytes, int min_lzw_size, const uint8_t *&srcref) {
-      const uint8_t *src = srcref;
-      unsigned lzw_size = min_lzw_size + 1;
-      unsigned reset_code = ( 1 << min_lzw_size );
-      unsigned mask = reset_code * 2 - 1;
-      unsigned cur_code = reset_code + 1;
+    // byte offset in the canvas of a pixel in a frame, rows counting down from the top of the screen.
+    size_t get_offset(const frame_info &f, unsigned row) const {
+      return ((size_t)(height - 1 - f.top - row) * width + f.left) * 4;
+    }
 
-      unsigned acc = 0;
-      unsigned bits = 0;
-      unsigned prev_code = ~0;
+    // clear a rectangle of the canvas to transparent black.
+    void clear_rect(const frame_info &f) {
+      for (unsigned j = 0; j != f.height; ++j) {
+        uint8_t *dest = canvas.data() + get_offset(f, j);
+        memset(dest, 0, (size_t)f.width * 4);
+      }
+    }
 
-      while (*src) {
-        unsigned len = *src++;
-        do {
-          unsigned byte = *src++;
-          acc |= byte << bits;
-          bits += 8;
-          if (debug_gif) printf("byte %02x acc=%08x bits=%d\n", byte, acc, bits);
-          while (bits >= lzw_size) {
-            unsigned code = acc & mask;
-            if (debug_gif) printf("code=%03x\n", code);
-            bits -= lzw_size;
-            acc >>= lzw_size;
-            if ((code & ~1) == reset_code) {
-              if (code == reset_code+1) {
-                // end
-                break;
-              } else {
-                // reset
-                lzw_size = min_lzw_size + 1;
-                cur_code = reset_code + 1;
-                mask = reset_code * 2 - 1;
-              }
-            } else {
-              if (
-                (prev_code == ~0 && code >= reset_code) ||
-                code > cur_code
-              ) {
-                return true;
-              }
-
-              uint8_t tail = 0;
-              if (code == cur_code) {
-                *bytes++ = tail = add_lwz_string(prev_code, bytes, max_bytes-1, reset_code);
-                if (debug_gif) printf("out %02x\n", tail);
-              } else {
-                tail = add_lwz_string(code, bytes, max_bytes, reset_code);
-              }
-
-              if (bytes > max_bytes) return true;
-
-              lzw_head[cur_code] = prev_code;
-              lzw_tail[cur_code] = tail;
-              prev_code = code;
-
-              cur_code++;
-              if (cur_code > mask) {
-                if (debug_gif) printf("resize\n");
-                if (mask != 0xfff) {
-                  lzw_size++;
-                  mask = mask * 2 + 1;
-                } else {
-                  cur_code = 0x1000;
-                }
-              }
-            }
-          } 
-        } while( --len );
-      }
-      src++;
-      srcref = src;
-      return false;
+    // copy a rectangle of the canvas to or from the previous buffer.
+    void save_rect(const frame_info &f, bool restore) {
+      if (f.width == 0) return;
+      size_t line_bytes = (size_t)f.width * 4;
+      previous.resize(line_bytes * f.height);
+      for (unsigned j = 0; j != f.height; ++j) {
+        uint8_t *line = canvas.data() + get_offset(f, j);
+        uint8_t *saved = previous.data() + line_bytes * j;
+        if (restore) {
+          memcpy(line, saved, line_bytes);
+        } else {
+          memcpy(saved, line, line_bytes);
+        }
+      }
+    }
+
+    // decode a frame and draw it over the canvas.
+    bool draw_frame(const frame_info &f) {
+      unsigned image_width = f.image_width;
+      unsigned image_height = f.image_height;
+      gather_blocks(f.data);
+      bool ok = decode_indices(image_width * image_height, f.min_code_size);
+
+      // the transparent colour keeps its RGB with zero alpha, so filtering and mipmaps
+      // blend towards the colour of the image rather than black.
+      uint32_t palette[256];
+      memset(palette, 0, sizeof(palette));
+      for (unsigned i = 0; i != f.palette_size; ++i) {
+        const uint8_t *c = f.palette + i * 3;
+        uint8_t rgba[4] = { c[0], c[1], c[2], (uint8_t)(i == f.transparent ? 0x00 : 0xff) };
+        memcpy(&palette[i], rgba, 4);
+      }
+
+      for (unsigned j = 0; j != image_height; ++j) {
+        // interlaced images have rows 0, 8, 16... then 4, 12... then 2, 6... then 1, 3...
+        unsigned row = j;
+        if (f.interlaced) {
+          unsigned pass1 = (image_height + 7) / 8, pass2 = (image_height + 3) / 8, pass3 = (image_height + 1) / 4;
+          row =
+            j < pass1 ? j * 8 :
+            j < pass1 + pass2 ? (j - pass1) * 8 + 4 :
+            j < pass1 + pass2 + pass3 ? (j - pass1 - pass2) * 4 + 2 :
+            (j - pass1 - pass2 - pass3) * 2 + 1
+          ;
+        }
+        if (row >= f.height) continue;
+        const uint8_t *src = indices.data() + root_bytes + (size_t)j * image_width;
+        uint8_t *dest = canvas.data() + get_offset(f, row);
+        if (f.transparent == 0x100) {
+          for (unsigned i = 0; i != f.width; ++i) {
+            memcpy(dest + i * 4, &palette[src[i]], 4);
+          }
+        } else {
+          // transparent pixels show the frame below, or take the colour where there is none.
+          for (unsigned i = 0; i != f.width; ++i) {
+            unsigned idx = src[i];
+            if (idx != f.transparent || dest[i * 4 + 3] == 0) memcpy(dest + i * 4, &palette[idx], 4);
+          }
+        }
+      }
+      return ok;
+    }
+
+    // bring the canvas up to date with a frame.
+    bool advance_to(unsigned frame) {
+      if (frame < next_frame) {
+        if (canvas.size()) memset(canvas.data(), 0, canvas.size());
+        next_frame = 0;
+      }
+
+      bool ok = true;
+      for (; next_frame <= frame; ++next_frame) {
+        if (next_frame != 0) {
+          // remove the frame before this one as it asks.
+          const frame_info &p = frames[next_frame-1];
+          if (p.disposal == dispose_background) {
+            clear_rect(p);
+          } else if (p.disposal == dispose_previous) {
+            save_rect(p, true);
+          }
+        }
+        const frame_info &f = frames[next_frame];
+        if (f.disposal == dispose_previous) {
+          save_rect(f, false);
+        }
+        ok = draw_frame(f) && ok;
+      }
+      return ok;
     }
 
   public:
-    // get an opengl texture from a file in memory
-    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
-      width = src[6] + src[7]*256;
-      height = src[8] + src[9]*256;
-      unsigned flags = src[10];
-      unsigned gct_size = flags & 0x80 ? 1 << ((flags & 7)+1) : 0;
-      //unsigned background = src[11];
-      //unsigned aspect = src[12];
-      unsigned transparency_index = 0x100; // disable transparency
+    gif_decoder() {
+      src_max = 0;
+      width = height = 0;
+      loop_count = 1;
+      next_frame = 0;
+    }
 
-      unsigned size = width * height * 4;
-      image.resize(size);
-      format = 0x1908; // GL_RGBA
+    /// Read the header and find the frames of a gif file. The file must stay in memory
+    /// while frames are decoded.
+    bool open(const uint8_t *src, const uint8_t *src_max_) {
+      src_max = src_max_;
+      frames.resize(0);
+      next_frame = 0;
+      width = height = 0;
+      loop_count = 1;
+
+      if (src_max - src < 13 || memcmp(src, "GIF8", 4)) {
+        return false;
+      }
 
-      memset(&image[0], 0xff, size);
+      width = u2(src + 6);
+      height = u2(src + 8);
+      if ((uint64_t)width * height > max_pixels) {
+        printf("warning: gif_decoder - %dx%d is too big\n", width, height);
+        width = height = 0;
+        return false;
+      }
+      unsigned flags = src[10];
+      unsigned gct_size = flags & 0x80 ? 1 << ((flags & 7)+1) : 0;
       src += 13;
       const uint8_t *gct = src;
       src += gct_size * 3;
-      while (src < src_max) {
+
+      // values from a graphics control extension apply to the next image.
+      unsigned delay = 0;
+      unsigned transparent = 0x100;
+      unsigned disposal = dispose_none;
+
+      while (src && src < src_max) {
         unsigned code = *src++;
         if (code == 0x3b) {
           // end
           break;
         } else if (code == 0x21) {
-          if (*src == 0xf9) {
+          if (src + 2 > src_max) break;
+          unsigned label = *src++;
+          if (label == 0xf9 && *src >= 4 && src + 5 < src_max) {
             // graphics control extension
-            //unsigned block_size = src[1];
-            unsigned flags = src[2];
-            //unsigned delay = src[3] + src[4] * 256;
-            transparency_index = flags & 1 ? src[5] : 0x100;
-
-            src++;
-            while (*src) {
-              if (debug_gif) printf("    len=%02x\n", *src);
-              src += *src + 1;
-            }
-            src++;
-          } else {
-            // unknown extension
-            src++;
-            while (*src) {
-              if (debug_gif) printf("    len=%02x\n", *src);
-              src += *src + 1;
-            }
-            src++;
+            unsigned flags = src[1];
+            delay = u2(src + 2);
+            transparent = flags & 1 ? src[4] : 0x100;
+            disposal = (flags >> 2) & 7;
+          } else if (label == 0xff && *src == 11 && src + 16 < src_max && !memcmp(src + 1, "NETSCAPE2.0", 11) && src[12] >= 3) {
+            // looping animation, 0 is forever
+            loop_count = u2(src + 14);
           }
+          src = skip_blocks(src);
         } else if (code == 0x2c) {
           // image descriptor
-          unsigned left = src[0] + src[1]*256;
-          unsigned top = src[2] + src[3]*256;
-          unsigned lwidth = src[4] + src[5]*256;
-          unsigned lheight = src[6] + src[7]*256;
+          if (src + 10 > src_max) break;
+          frame_info f;
+          f.left = u2(src + 0);
+          f.top = u2(src + 2);
+          f.image_width = u2(src + 4);
+          f.image_height = u2(src + 6);
+          if ((uint64_t)f.image_width * f.image_height > max_pixels) break;
           unsigned flags = src[8];
           unsigned lct_size = ( flags & 0x80 ) ? 1 << ((flags & 7)+1) : 0;
+          f.interlaced = (flags & 0x40) != 0;
           src += 9;
-          const uint8_t *color_table = ( flags & 0x80 ) ? src : gct;
+          f.palette = lct_size ? src : gct;
+          f.palette_size = lct_size ? lct_size : gct_size;
           src += lct_size * 3;
-          unsigned min_lzw_size = *src++;
+          if (src >= src_max) break;
+          f.min_code_size = *src++;
+          f.data = src;
+          f.delay = delay;
+          f.transparent = transparent;
+          f.disposal = disposal;
+          delay = 0;
+          transparent = 0x100;
+          disposal = dispose_none;
 
-          dynarray<uint8_t> bytes(lwidth*lheight);
-          bool error = 
-            left + lwidth > width ||
-            top + lheight > height ||
-            gif_decode_bytes(&bytes[0], &bytes[lwidth*lheight], min_lzw_size, src)
-          ;
-          if (error) {
-            printf("warning: gif_decode_bytes - broken gif file\n");
-            goto fail;
-          } else {
-            uint8_t *src = &bytes[0];
-            for (unsigned j = 0; j != lheight; ++j) {
-              uint8_t *dest = &image[((height - 1 - j - top) * width + left) * 4];
-              for (unsigned i = 0; i != lwidth; ++i) {
-                unsigned idx = *src++;
-                dest[0] = color_table[idx*3+0];
-                dest[1] = color_table[idx*3+1];
-                dest[2] = color_table[idx*3+2];
-                dest[3] = idx == transparency_index ? 0x00 : 0xff;
-                //printf("%02x %02x %02x\n", dest[0], dest[1], dest[2]);
-                dest += 4;
-              }
-            }
-          }
+          // clip to the screen.
+          f.left = f.left < width ? f.left : width;
+          f.top = f.top < height ? f.top : height;
+          f.width = f.image_width < width - f.left ? f.image_width : width - f.left;
+          f.height = f.image_height < height - f.top ? f.image_height : height - f.top;
+
+          src = skip_blocks(src);
+          frames.push_back(f);
         } else {
           printf("warning: unknown gif file section type\n");
+          break;
         }
       }
-    fail:;
-      //num_components = transparency_index == 0x100 ? 3 : 4;
+
+      canvas.resize((size_t)width * height * 4);
+      if (canvas.size()) memset(canvas.data(), 0, canvas.size());
+      return frames.size() != 0;
+    }
+
+    /// width of the animation in pixels
+    unsigned get_width() const {
+      return width;
+    }
+
+    /// height of the animation in pixels
+    unsigned get_height() const {
+      return height;
+    }
+
+    /// number of images in the file
+    unsigned get_num_frames() const {
+      return frames.size();
+    }
+
+    /// how long to show a frame in hundredths of a second
+    unsigned get_delay(unsigned frame) const {
+      return frame < frames.size() ? frames[frame].delay : 0;
+    }
+
+    /// number of times to play the animation, 0 for forever.
+    unsigned get_loop_count() const {
+      return loop_count;
+    }
+
+    /// Decode a frame on demand and return the RGBA image, valid until the next call.
+    /// Frames are drawn over the ones before them, so playing forwards is cheapest.
+    const uint8_t *get_frame(unsigned frame) {
+      if (frame >= frames.size()) return 0;
+      if (frame + 1 != next_frame && !advance_to(frame)) {
+        printf("warning: gif_decoder - broken gif file\n");
+      }
+      return canvas.data();
+    }
+
+    /// Decode all frames into one block of width * height * 4 * frames bytes.
+    /// Returns false, with no frames, if the file is bad or the frames are too big.
+    bool get_frames(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, uint32_t &num_frames, const uint8_t *src, const uint8_t *src_max_) {
+      bool ok = open(src, src_max_);
+      width_ = (uint16_t)width;
+      height_ = (uint16_t)height;
+      format = 0x1908; // GL_RGBA
+      num_frames = frames.size();
+
+      if (!ok || (uint64_t)width * height * num_frames > max_pixels) {
+        if (ok) printf("warning: gif_decoder - %d frames of %dx%d is too big\n", num_frames, width, height);
+        num_frames = 0;
+        image.resize(0);
+        return false;
+      }
+
+      size_t frame_size = canvas.size();
+      image.resize(frame_size * num_frames);
+      for (unsigned i = 0; i != num_frames; ++i) {
+        memcpy(image.data() + frame_size * i, get_frame(i), frame_size);
+      }
+      return true;
+    }
+
+    /// get an opengl texture of the first frame from a file in memory
+    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max_) {
+      open(src, src_max_);
+      width_ = (uint16_t)width;
+      height_ = (uint16_t)height;
+      format = 0x1908; // GL_RGBA
+
+      image.resize(canvas.size());
+      if (frames.size()) {
+        memcpy(image.data(), get_frame(0), canvas.size());
+      } else if (image.size()) {
+        memset(image.data(), 0, image.size());
+      }
     }
   };
 }}
-
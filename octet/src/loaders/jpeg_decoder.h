@@ -8,124 +8,44 @@
 // jpeg file decoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
+// Decodes baseline and progressive huffman coded files with one (grey) or three (YCbCr)
+// components and any chroma subsampling.
+//
+// The image is decoded in three steps:
+//   huffman decode each 8x8 block of coefficients.
+//   inverse DCT each block into a plane of samples per component.
+//   upsample the Cb and Cr planes and convert to RGBA.
+//
+// Progressive files are made of many scans that each add some coefficients,
+// so we keep the coefficients and do the inverse DCT at the end.
+//
+// Large images use many threads. Files with restart markers (DRI) are split into
+// intervals that are huffman decoded at the same time and the colour conversion
+// is done in strips of lines. Files without restart markers huffman decode on one thread.
+//
 namespace octet { namespace loaders {
   class jpeg_decoder {
     enum { debug = 0 };
 
-    // image dimensions
-    unsigned precision;
-    unsigned width;
-    unsigned height;
-    unsigned num_components;
+    // codes of up to this many bits are decoded with a single table lookup.
+    enum { fast_bits = 9 };
 
-    // What kind of image
-    unsigned sof_code;
+    // the inverse DCT scales by 32. This rounds and adds 128 to the result.
+    enum { idct_bias = (128 << 5) + 16 };
 
-    // progressive parameters
-    unsigned spectral_start;
-    unsigned spectral_end;
-    unsigned successive_high;
-    unsigned successive_low;
+    // the most samples we will decode.
+    enum { max_pixels = 1 << 28 };
 
-    // how many blocks in a MCU (see mcu_block below)
-    unsigned num_mcu_blocks;
-    unsigned num_components_in_scan;
+    // smaller images are decoded on one thread as starting threads takes longer.
+    enum { min_parallel_pixels = 1 << 18 };
 
-    // skip a number of bits in the file.
-    // there is a special case where every 0xff byte is followed by 0x00
-    static void skip_bits(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      shift -= bits;
-      while (shift < 0) {
-        // grab more bytes
-        uint8_t byte = *src++;
-        acc = acc * 256 + byte;
-        if (byte == 0xff) {
-          // in JPEG, an 0xff byte is followed by a zero
-          // do not advance past any other 0xff marker
-          src += src[0] == 0x00 ? 1 : -1;
-        }
-        shift += 8;
-      }
-    }
-
-    // this is a component usually Y (brightness), Cb (blueness) and Cr (redness)
-    // from the file.
-    // Some JPEGs have 2x2 blocks for Y and only 1x1 for Cb and Cr (4:2:0)
-    // as you can't see colour in high resolution.
-    struct component {
-      uint8_t id;
-      uint8_t hsamp;
-      uint8_t vsamp;
-      uint8_t quantisation_table;
-    } components[4];
-
-    // this is a component that is used for a particluar "scan"
-    // of the image data. With progressive files there may be more than
-    // one scan.
-    struct scan_component {
-      uint8_t comp;
-      uint8_t ac_table;
-      uint8_t dc_table;
-      unsigned width_in_blocks;
-      unsigned height_in_blocks;
-      int last_dc;
-    } scan_components[4];
-
-    // quantisation table. We multiply the dc and ac coefficients by these numbers.
-    // this is the lossy part of the compression
-    struct quant_table {
-      float table[64];
-    } quant_tables[4];
-
-    // A huffman table maps variable length codes to lengths and values.
-    // for example. 00 010 011 100 1010 1011 1100 1110 1111 might be a huffman code
-    // where each code is distinct from the previous one, even if it has more bits.
-    // (ie. 100(0) and 100(1) are less than 1010).
-    struct huffman_table {
-      unsigned min_len;
-      uint8_t huffval[257];
-      uint16_t maxcodes[17];
-      uint16_t offset[17];
-
-      // decode a variable length huffman code
-      // we grab the next 16 bits and look in the maxcodes table to see how many
-      // bits the code has. After that, we strip the right hand bits and
-      // look up the code in a table.
-      unsigned decode(unsigned &acc, const uint8_t *&src, int &shift) {
-        unsigned i = min_len;
-        unsigned short acc16 = acc >> shift;
-
-        // find the shortest code that this could be
-        for (; acc16 > maxcodes[i]; ++i) {
-        }
-
-        unsigned code = ( acc16 >> (15-i) ) - offset[i];
-        skip_bits(i + 1, acc, src, shift);
-        return huffval[code];
-      }
-    } huffman_tables[2][4];
-
-    // a mcu_block is an 8x8 component of a MCU
-    // (Minimal coding unit). The image is tiled by MCUs
-    // which have components.
-    struct mcu_block {
-      huffman_table *dc_table;
-      huffman_table *ac_table;
-      quant_table *quant;
-      scan_component *scan_comp;
-    } mcu_blocks[8];
-
-    float dct_coeffs[8*64];
-    float ycrcb_values[8*64];
-
-    unsigned u2(const uint8_t *src) {
-      return src[0] * 256 + src[1];
-    }
+    // lines of RGBA in each piece of work for the colour conversion threads.
+    enum { strip_lines = 32 };
 
     // dct coefficients are stored in zig-zag order because the top
     // left is far more common.
-    uint8_t zig_zag(unsigned i) {
+    static const uint8_t *zig_zag() {
       static const uint8_t zig_zag_[64] = {
         0, 1, 8, 16, 9, 2, 3, 10,
         17, 24, 32, 25, 18, 11, 4, 5,
@@ -136,476 +56,1276 @@ namespace octet { namespace loaders {
         58, 59, 52, 45, 38, 31, 39, 46,
         53, 60, 61, 54, 47, 55, 62, 63,
       };
-      return i < 63 ? zig_zag_[i] : 63;
+      return zig_zag_;
     }
 
     // negative numbers need to be twiddled as all numbers coming in are positive.
-    static int extend(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      uint16_t acc16 = acc >> shift;
-      unsigned v = acc16 >> (16 - bits);
-      return v < ( 1u << ( bits-1 ) ) ? (int)v + ( -1 << bits ) + 1 : (int)v;
-    }
-
-    // decode one block of an MCU which may contain many blocks
-    // The Y component may have four blocks, for example, and only one each of Cr, Cb
-    void decode_mcu_block(unsigned block_num, unsigned &acc, const uint8_t *&src, int &shift, float *outptr) {
-      mcu_block &block = mcu_blocks[block_num];
-
-      unsigned value = block.dc_table->decode(acc, src, shift);
-
-      int dc = 0;
-      if (value) {
-        dc = extend(value, acc, src, shift);
-        skip_bits(value, acc, src, shift);
-        //if (debug) printf("dc=%d\n", dc);
-      }
-      int abs_dc = block.scan_comp->last_dc += dc;
-      outptr[0] = abs_dc * block.quant->table[0];
-
-      for (int ac_coef = 1; ac_coef < 64; ++ac_coef) {
-        unsigned value = block.ac_table->decode(acc, src, shift);
-        unsigned skip = value >> 4;
-        value &= 0x0f;
-        ac_coef += skip;
-
-        if (value) {
-          int ac = extend(value, acc, src, shift);
-          skip_bits(value, acc, src, shift);
-          //if (debug) printf("ac=%d,%d coef=%d zig_zag=%d\n", skip, ac, ac_coef, zig_zag(ac_coef));
-          outptr[zig_zag(ac_coef)] = (float)ac * block.quant->table[ac_coef];
-        } else if (skip != 15) {
-          break;
+    // a 3 bit number 0..7 maps to -7..-4 and 4..7, for example.
+    static int extend(unsigned v, unsigned bits) {
+      return v < ( 1u << ( bits-1 ) ) ? (int)v - (int)( 1u << bits ) + 1 : (int)v;
+    }
+
+    // A huffman table maps variable length codes to lengths and values.
+    // for example. 00 010 011 100 1010 1011 1100 1110 1111 might be a huffman code
+    // where each code is distinct from the previous one, even if it has more bits.
+    // (ie. 100(0) and 100(1) are less than 1010).
+    //
+    // Most codes are short, so we look up the next fast_bits bits in a table
+    // and only search for the longer ones.
+    struct huffman_table {
+      // (length << 8) | value for short codes, zero for long ones.
+      uint16_t fast[1 << fast_bits];
+
+      // AC tables only: a short code and the coefficient that follows it in one lookup.
+      // (coefficient << 8) | (run << 4) | total bits, or zero.
+      int16_t fast_ac[1 << fast_bits];
+
+      // codes of length n, left justified in 16 bits, are less than maxcode[n].
+      uint32_t maxcode[18];
+
+      // add to a code of length n to get its index in values.
+      int delta[17];
+
+      uint8_t values[256];
+
+      void clear() {
+        memset(this, 0, sizeof(*this));
+        maxcode[17] = 0xffffffff;
+      }
+
+      // make the tables from the DHT chunk. False if there are too many codes.
+      bool build(const uint8_t *num_codes, const uint8_t *huffval, unsigned count) {
+        clear();
+        memcpy(values, huffval, count);
+        unsigned code = 0;
+        unsigned k = 0;
+        for (unsigned len = 1; len <= 16; ++len) {
+          delta[len] = (int)k - (int)code;
+          for (unsigned i = 0; i != num_codes[len-1]; ++i, ++k, ++code) {
+            if (code >= (1u << len)) return false;
+            if (len <= fast_bits) {
+              unsigned first = code << (fast_bits - len);
+              for (unsigned j = 0; j != 1u << (fast_bits - len); ++j) {
+                fast[first + j] = (uint16_t)(len << 8 | values[k]);
+              }
+            }
+          }
+          maxcode[len] = code << (16 - len);
+          code *= 2;
         }
+
+        // in AC tables the value is (zero run << 4) | bits in the coefficient.
+        for (unsigned i = 0; i != 1 << fast_bits; ++i) {
+          unsigned len = fast[i] >> 8;
+          unsigned run = (fast[i] >> 4) & 15;
+          unsigned size = fast[i] & 15;
+          if (len && size && len + size <= fast_bits) {
+            unsigned v = ( ( i << len ) & ( ( 1 << fast_bits ) - 1 ) ) >> ( fast_bits - size );
+            int coeff = extend(v, size);
+            if (coeff >= -128 && coeff <= 127) {
+              fast_ac[i] = (int16_t)(coeff * 256 + run * 16 + len + size);
+            }
+          }
+        }
+        return true;
+      }
+    };
+
+    // reads bits from the entropy coded data of a scan.
+    // every 0xff byte in the data is followed by 0x00. Any other byte after 0xff is
+    // a marker, which ends the data. After that we read zeros.
+    struct bit_reader {
+      const uint8_t *src;
+      const uint8_t *src_max;
+      uint32_t bits;
+      int num_bits;
+      unsigned marker;
+
+      void init(const uint8_t *src_, const uint8_t *src_max_) {
+        src = src_;
+        src_max = src_max_;
+        bits = 0;
+        num_bits = 0;
+        marker = 0;
       }
-      if (debug) {
-        for (int j = 0; j != 8; ++j) {
-          for (int i = 0; i != 8; ++i) {
-            printf("%3.0f ", outptr[i+j*8]);
+
+      // make sure there are at least 25 bits (left justified) in bits.
+      void fill() {
+        while (num_bits <= 24) {
+          unsigned byte = 0;
+          if (!marker && src < src_max) {
+            byte = *src++;
+            if (byte == 0xff) {
+              unsigned next = src < src_max ? *src : 0xd9;
+              if (next == 0x00) {
+                src++;
+              } else {
+                // stop at the marker.
+                marker = next;
+                src--;
+                byte = 0;
+              }
+            }
           }
-          printf("\n");
+          bits |= byte << (24 - num_bits);
+          num_bits += 8;
         }
       }
+
+      void consume(unsigned n) {
+        bits <<= n;
+        num_bits -= n;
+      }
+
+      // get n (1..16) bits.
+      unsigned get_bits(unsigned n) {
+        if (num_bits < (int)n) fill();
+        unsigned v = bits >> (32 - n);
+        consume(n);
+        return v;
+      }
+
+      unsigned get_bit() {
+        return get_bits(1);
+      }
+
+      // get an n bit signed number.
+      int receive_extend(unsigned n) {
+        return extend(get_bits(n), n);
+      }
+
+      // decode a variable length huffman code.
+      // returns -1 for a bad code.
+      int decode(const huffman_table &h) {
+        if (num_bits < 16) fill();
+        unsigned f = h.fast[bits >> (32 - fast_bits)];
+        if (f) {
+          consume(f >> 8);
+          return f & 0xff;
+        }
+
+        // find the length of a long code
+        unsigned code = bits >> 16;
+        unsigned len = fast_bits + 1;
+        while (code >= h.maxcode[len]) ++len;
+        if (len > 16) return -1;
+        consume(len);
+        return h.values[( ( code >> (16 - len) ) + h.delta[len] ) & 0xff];
+      }
+
+      // skip to the data after the next RSTn marker.
+      void restart() {
+        bits = 0;
+        num_bits = 0;
+        marker = 0;
+        while (src + 1 < src_max && !(src[0] == 0xff && src[1] >= 0xd0 && src[1] <= 0xd7)) {
+          src++;
+        }
+        src = src + 1 < src_max ? src + 2 : src_max;
+      }
+
+      // find the marker at the end of the scan.
+      const uint8_t *end_of_scan() const {
+        const uint8_t *p = src;
+        while (p + 1 < src_max && !(p[0] == 0xff && p[1] != 0x00 && !(p[1] >= 0xd0 && p[1] <= 0xd7))) {
+          p++;
+        }
+        return p + 1 < src_max ? p : src_max;
+      }
+    };
+
+    // this is a component usually Y (brightness), Cb (blueness) and Cr (redness)
+    // from the file.
+    // Some JPEGs have 2x2 blocks for Y and only 1x1 for Cb and Cr (4:2:0)
+    // as you can't see colour in high resolution.
+    struct component {
+      unsigned id;
+      unsigned hsamp;
+      unsigned vsamp;
+      unsigned quantisation_table;
+
+      // tables used in the current scan
+      unsigned dc_table;
+      unsigned ac_table;
+
+      // samples in the image after subsampling
+      unsigned width;
+      unsigned height;
+
+      // blocks in the planes, rounded up to whole MCUs
+      unsigned blocks_per_line;
+      unsigned block_rows;
+
+      // blocks_per_line * 8 samples by block_rows * 8 lines.
+      dynarray<uint8_t> pixels;
+
+      // progressive files only: 64 coefficients per block.
+      dynarray<int16_t> coeffs;
+    };
+
+    // dc predictions and the end of block run for one scan.
+    // Restart markers reset them.
+    struct scan_state {
+      int last_dc[4];
+      unsigned eobrun;
+
+      void reset() {
+        last_dc[0] = last_dc[1] = last_dc[2] = last_dc[3] = 0;
+        eobrun = 0;
+      }
+    };
+
+    // image dimensions
+    unsigned width;
+    unsigned height;
+    unsigned num_components;
+    bool progressive;
+    bool have_frame;
+
+    // size of the MCU (Minimal coding unit) in blocks and the number of MCUs.
+    // The image is tiled by MCUs which have components.
+    unsigned max_hsamp;
+    unsigned max_vsamp;
+    unsigned mcus_x;
+    unsigned mcus_y;
+
+    // MCUs between restart markers or zero.
+    unsigned restart_interval;
+
+    component components[4];
+
+    // the components in the current scan. With progressive files there may be
+    // many scans.
+    unsigned num_scan_components;
+    unsigned scan_components[4];
+
+    // progressive parameters
+    unsigned spectral_start;
+    unsigned spectral_end;
+    unsigned successive_high;
+    unsigned successive_low;
+
+    // quantisation tables. We multiply the dc and ac coefficients by these numbers.
+    // this is the lossy part of the compression.
+    // These are in natural order and include the AAN scale factors (see idct_block).
+    int16_t quant_tables[4][64];
+
+    huffman_table dc_tables[4];
+    huffman_table ac_tables[4];
+
+    // threads asked for (NULL for the calling thread) and the threads used for this image.
+    job_pool *jobs;
+    job_pool *workers;
+
+    static unsigned u2(const uint8_t *src) {
+      return src[0] * 256 + src[1];
+    }
+
+    static int16_t saturate(int v) {
+      return (int16_t)(v < -32768 ? -32768 : v > 32767 ? 32767 : v);
     }
 
+    static uint8_t clamp(int v) {
+      return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Inverse DCT
+    //
+    // This is the AAN (Arai, Agui and Nakajima) transform which needs only five multiplies
+    // per eight samples. The quantisation tables are pre-scaled to make up for the missing
+    // multiplies and by four to keep two fraction bits.
+    //
+    // Everything is in 16 bit integers, so with SSE2 we do eight columns at once.
+    // The scalar version gives the same results as the SSE2 version.
+    //
+
+    #if OCTET_SSE2
+      static __m128i idct_add(__m128i a, __m128i b) { return _mm_add_epi16(a, b); }
+      static __m128i idct_sub(__m128i a, __m128i b) { return _mm_sub_epi16(a, b); }
+      static __m128i idct_mulhi(__m128i a, int16_t b) { return _mm_mulhi_epi16(a, _mm_set1_epi16(b)); }
+    #endif
+
+    static int16_t idct_add(int16_t a, int16_t b) { return (int16_t)(a + b); }
+    static int16_t idct_sub(int16_t a, int16_t b) { return (int16_t)(a - b); }
+    static int16_t idct_mulhi(int16_t a, int16_t b) { return (int16_t)((a * b) >> 16); }
+
     // one dimensional inverse DCT.
-    // c0 is the DC term and c1..c7 increase in frequency
-    // example: c0 = 128, c1..c7 = 0 -> 128, 128, 128, 128, 128, 128, 128, 128
-    // todo: improve this!
-    OCTET_HOT void idct(float &c0, float &c1, float &c2, float &c3, float &c4, float &c5, float &c6, float &c7) {
-      float c2c6_1 = (c2 + c6) * 0.541196100f;
-      float c2c6_2 = c2c6_1 + c6 * -1.847759065f;
-      float c2c6_3 = c2c6_1 + c2 * 0.765366865f;
-    
-      float c0c4_1 = c0 + c4;
-      float c0c4_2 = c0 - c4;
-    
-      float ceven_1 = c0c4_1 + c2c6_3;
-      float ceven_2 = c0c4_1 - c2c6_3;
-      float ceven_3 = c0c4_2 + c2c6_2;
-      float ceven_4 = c0c4_2 - c2c6_2;
-    
-      float c1c7 = c7 + c1;
-      float c3c5 = c5 + c3;
-      float c7c3 = c7 + c3;
-      float c5c1 = c5 + c1;
-      float codd_0 = (c7c3 + c5c1) * 1.175875602f;
-    
-      float codd_4 = c7 * 0.298631336f;
-      float codd_3 = c5 * 2.053119869f;
-      float codd_2 = c3 * 3.072711026f;
-      float codd_1 = c1 * 1.501321110f;
-      c1c7 = c1c7 * -0.899976223f;
-      c3c5 = c3c5 * -2.562915447f;
-      c7c3 = c7c3 * -1.961570560f;
-      c5c1 = c5c1 * -0.390180644f;
-    
-      c7c3 += codd_0;
-      c5c1 += codd_0;
-    
-      codd_4 += c1c7 + c7c3;
-      codd_3 += c3c5 + c5c1;
-      codd_2 += c3c5 + c7c3;
-      codd_1 += c1c7 + c5c1;
-    
-      c0 = ceven_1 + codd_1;
-      c7 = ceven_1 - codd_1;
-      c1 = ceven_3 + codd_2;
-      c6 = ceven_3 - codd_2;
-      c2 = ceven_4 + codd_3;
-      c5 = ceven_4 - codd_3;
-      c3 = ceven_2 + codd_4;
-      c4 = ceven_2 - codd_4;
-    }
-
-    // Two dimensional inverse DCT
-    // we can do the rows and columns separately.
-    // Optimisations include spotting blank rows and columns, but this
-    // is just a reference design.
-    void inverse_dct(float *inptr) {
-      // do rows
-      for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*0+i], inptr[8*1+i], inptr[8*2+i], inptr[8*3+i], inptr[8*4+i], inptr[8*5+i], inptr[8*6+i], inptr[8*7+i]);
-      }
-
-      // do columns
-      for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*i+0], inptr[8*i+1], inptr[8*i+2], inptr[8*i+3], inptr[8*i+4], inptr[8*i+5], inptr[8*i+6], inptr[8*i+7]);
-      }
-
-      if (debug) {
-        for (int j = 0; j != 8; ++j) {
-          for (int i = 0; i != 8; ++i) {
-            printf("%f ", inptr[i+j*8]);
-          }
-          printf("\n");
+    // v[0] is the DC term and v[1]..v[7] increase in frequency
+    // example: v[0] = 128, v[1]..v[7] = 0 -> 128, 128, 128, 128, 128, 128, 128, 128
+    // multiplies are split into a whole number and a fraction (mulhi) of less than 1/2.
+    template <class value> static void idct_1d(value *v) {
+      // even part
+      value tmp10 = idct_add(v[0], v[4]);
+      value tmp11 = idct_sub(v[0], v[4]);
+      value tmp13 = idct_add(v[2], v[6]);
+      value d26 = idct_sub(v[2], v[6]);
+      value tmp12 = idct_sub(idct_add(d26, idct_mulhi(d26, 27146)), tmp13); // * 1.414213562
+
+      value e0 = idct_add(tmp10, tmp13);
+      value e3 = idct_sub(tmp10, tmp13);
+      value e1 = idct_add(tmp11, tmp12);
+      value e2 = idct_sub(tmp11, tmp12);
+
+      // odd part
+      value z13 = idct_add(v[5], v[3]);
+      value z10 = idct_sub(v[5], v[3]);
+      value z11 = idct_add(v[1], v[7]);
+      value z12 = idct_sub(v[1], v[7]);
+
+      value o7 = idct_add(z11, z13);
+      value d1113 = idct_sub(z11, z13);
+      value o11 = idct_add(d1113, idct_mulhi(d1113, 27146)); // * 1.414213562
+      value z1012 = idct_add(z10, z12);
+      value z5 = idct_add(idct_add(z1012, z1012), idct_mulhi(z1012, -9977)); // * 1.847759065
+      value o10 = idct_sub(idct_add(z12, idct_mulhi(z12, 5400)), z5); // * 1.082392200
+      value o12 = idct_add(idct_sub(idct_mulhi(z10, 25354), idct_add(idct_add(z10, z10), z10)), z5); // * -2.613125930
+
+      value o6 = idct_sub(o12, o7);
+      value o5 = idct_sub(o11, o6);
+      value o4 = idct_add(o10, o5);
+
+      v[0] = idct_add(e0, o7);
+      v[7] = idct_sub(e0, o7);
+      v[1] = idct_add(e1, o6);
+      v[6] = idct_sub(e1, o6);
+      v[2] = idct_add(e2, o5);
+      v[5] = idct_sub(e2, o5);
+      v[4] = idct_add(e3, o4);
+      v[3] = idct_sub(e3, o4);
+    }
+
+    #if OCTET_SSE2
+      // swap rows and columns of 8x8 16 bit values.
+      static void transpose(__m128i *v) {
+        __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]);
+        __m128i a1 = _mm_unpackhi_epi16(v[0], v[1]);
+        __m128i a2 = _mm_unpacklo_epi16(v[2], v[3]);
+        __m128i a3 = _mm_unpackhi_epi16(v[2], v[3]);
+        __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]);
+        __m128i a5 = _mm_unpackhi_epi16(v[4], v[5]);
+        __m128i a6 = _mm_unpacklo_epi16(v[6], v[7]);
+        __m128i a7 = _mm_unpackhi_epi16(v[6], v[7]);
+        __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+        __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+        __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+        __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+        __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+        __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+        __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+        __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+        v[0] = _mm_unpacklo_epi64(b0, b4);
+        v[1] = _mm_unpackhi_epi64(b0, b4);
+        v[2] = _mm_unpacklo_epi64(b1, b5);
+        v[3] = _mm_unpackhi_epi64(b1, b5);
+        v[4] = _mm_unpacklo_epi64(b2, b6);
+        v[5] = _mm_unpackhi_epi64(b2, b6);
+        v[6] = _mm_unpacklo_epi64(b3, b7);
+        v[7] = _mm_unpackhi_epi64(b3, b7);
+      }
+    #endif
+
+    // Two dimensional inverse DCT of dequantised coefficients (natural order) to 8x8 samples.
+    // we can do the columns and rows separately.
+    // Blocks with only a DC term (very common) are flat.
+    static void idct_block(uint8_t *dest, int stride, const int16_t *block, bool has_ac) {
+      if (!has_ac) {
+        uint8_t dc = clamp(idct_add(block[0], idct_bias) >> 5);
+        for (unsigned j = 0; j != 8; ++j) {
+          memset(dest + j * stride, dc, 8);
         }
+        return;
       }
+
+      #if OCTET_SSE2
+        // each register is a row, so we do the columns first.
+        __m128i v[8];
+        for (unsigned i = 0; i != 8; ++i) {
+          v[i] = _mm_loadu_si128((const __m128i*)(block + i * 8));
+        }
+        idct_1d(v);
+        transpose(v);
+        v[0] = _mm_add_epi16(v[0], _mm_set1_epi16(idct_bias));
+        idct_1d(v);
+        for (unsigned i = 0; i != 8; ++i) {
+          v[i] = _mm_srai_epi16(v[i], 5);
+        }
+        transpose(v);
+        for (unsigned i = 0; i != 8; i += 2) {
+          __m128i bytes = _mm_packus_epi16(v[i], v[i+1]);
+          _mm_storel_epi64((__m128i*)(dest + i * stride), bytes);
+          _mm_storel_epi64((__m128i*)(dest + (i+1) * stride), _mm_srli_si128(bytes, 8));
+        }
+      #else
+        int16_t tmp[64];
+        for (unsigned i = 0; i != 8; ++i) {
+          int16_t v[8];
+          for (unsigned j = 0; j != 8; ++j) v[j] = block[j * 8 + i];
+          idct_1d(v);
+          for (unsigned j = 0; j != 8; ++j) tmp[j * 8 + i] = v[j];
+        }
+        for (unsigned j = 0; j != 8; ++j) {
+          int16_t *v = tmp + j * 8;
+          v[0] = idct_add(v[0], idct_bias);
+          idct_1d(v);
+          for (unsigned i = 0; i != 8; ++i) {
+            dest[j * stride + i] = clamp(v[i] >> 5);
+          }
+        }
+      #endif
     }
 
-    // clamp to 0..255 range without using branches.
-    // fabsf is usually implemented in hardware (with fast math options)
-    OCTET_HOT uint8_t clamp(float v) {
-      // v + fabsf(v) = 2v when v > 0
-      // v + fabsf(v) = 0  when v < 0
-      float clamp0 = v + fabsf(v);
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Colour conversion
+    //
+    // See http://en.wikipedia.org/wiki/YCbCr
+    // Fixed point: Y is scaled by 16 and the chroma terms are (c-128) * 256 * k * 4096 >> 16.
+    // Again the scalar version gives the same results as the SSE2 version.
+    //
 
-      // v - fabsf(v-n) = n when v > n
-      // v - fabsf(v-n) = 2v - n when v < n
-      return (uint8_t)( ( clamp0 - fabsf( clamp0 - (255.999f * 2) ) ) * 0.25f + 128 );
+    enum {
+      cr_to_r = 5743,  // 1.40200 * 4096
+      cb_to_g = -1410, // -0.34414 * 4096
+      cr_to_g = -2925, // -0.71414 * 4096
+      cb_to_b = 7258,  // 1.77200 * 4096
+    };
+
+    // convert count YCbCr pixels to RGBA
+    static void ycbcr_to_rgba(uint8_t *dest, const uint8_t *y, const uint8_t *cb, const uint8_t *cr, unsigned count) {
+      unsigned i = 0;
+      #if OCTET_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i bias = _mm_set1_epi8((char)128);
+        const __m128i alpha = _mm_set1_epi8((char)0xff);
+        for (; i + 16 <= count; i += 16) {
+          __m128i y8 = _mm_loadu_si128((const __m128i*)(y + i));
+          __m128i cb8 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(cb + i)), bias);
+          __m128i cr8 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(cr + i)), bias);
+          __m128i rgb[3][2];
+          for (unsigned half = 0; half != 2; ++half) {
+            // y * 16 + 8 and signed chroma * 256
+            __m128i yw = _mm_srli_epi16(half ? _mm_unpackhi_epi8(bias, y8) : _mm_unpacklo_epi8(bias, y8), 4);
+            __m128i cbw = half ? _mm_unpackhi_epi8(zero, cb8) : _mm_unpacklo_epi8(zero, cb8);
+            __m128i crw = half ? _mm_unpackhi_epi8(zero, cr8) : _mm_unpacklo_epi8(zero, cr8);
+            __m128i r = _mm_add_epi16(yw, _mm_mulhi_epi16(crw, _mm_set1_epi16(cr_to_r)));
+            __m128i g = _mm_add_epi16(_mm_add_epi16(yw, _mm_mulhi_epi16(cbw, _mm_set1_epi16(cb_to_g))), _mm_mulhi_epi16(crw, _mm_set1_epi16(cr_to_g)));
+            __m128i b = _mm_add_epi16(yw, _mm_mulhi_epi16(cbw, _mm_set1_epi16(cb_to_b)));
+            rgb[0][half] = _mm_srai_epi16(r, 4);
+            rgb[1][half] = _mm_srai_epi16(g, 4);
+            rgb[2][half] = _mm_srai_epi16(b, 4);
+          }
+          __m128i r = _mm_packus_epi16(rgb[0][0], rgb[0][1]);
+          __m128i g = _mm_packus_epi16(rgb[1][0], rgb[1][1]);
+          __m128i b = _mm_packus_epi16(rgb[2][0], rgb[2][1]);
+          __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+          __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+          __m128i ba_lo = _mm_unpacklo_epi8(b, alpha);
+          __m128i ba_hi = _mm_unpackhi_epi8(b, alpha);
+          _mm_storeu_si128((__m128i*)(dest + i * 4 + 0), _mm_unpacklo_epi16(rg_lo, ba_lo));
+          _mm_storeu_si128((__m128i*)(dest + i * 4 + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+          _mm_storeu_si128((__m128i*)(dest + i * 4 + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+          _mm_storeu_si128((__m128i*)(dest + i * 4 + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+        }
+      #endif
+      for (; i != count; ++i) {
+        int yw = y[i] * 16 + 8;
+        int cbw = (cb[i] - 128) * 256;
+        int crw = (cr[i] - 128) * 256;
+        dest[i * 4 + 0] = clamp((yw + ((crw * cr_to_r) >> 16)) >> 4);
+        dest[i * 4 + 1] = clamp((yw + ((cbw * cb_to_g) >> 16) + ((crw * cr_to_g) >> 16)) >> 4);
+        dest[i * 4 + 2] = clamp((yw + ((cbw * cb_to_b) >> 16)) >> 4);
+        dest[i * 4 + 3] = 0xff;
+      }
     }
 
-    // convert from Y to RGB
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444_greyscale(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f);
-          outptr[1] = clamp(128 + y * 0.125f);
-          outptr[2] = clamp(128 + y * 0.125f);
-          outptr[3] = 0xff;
-          outptr += 4;
+    // convert count grey pixels to RGBA
+    static void grey_to_rgba(uint8_t *dest, const uint8_t *y, unsigned count) {
+      unsigned i = 0;
+      #if OCTET_SSE2
+        const __m128i alpha = _mm_set1_epi8((char)0xff);
+        for (; i + 16 <= count; i += 16) {
+          __m128i y8 = _mm_loadu_si128((const __m128i*)(y + i));
+          __m128i yy_lo = _mm_unpacklo_epi8(y8, y8);
+          __m128i yy_hi = _mm_unpackhi_epi8(y8, y8);
+          __m128i ya_lo = _mm_unpacklo_epi8(y8, alpha);
+          __m128i ya_hi = _mm_unpackhi_epi8(y8, alpha);
+          _mm_storeu_si128((__m128i*)(dest + i * 4 + 0), _mm_unpacklo_epi16(yy_lo, ya_lo));
+          _mm_storeu_si128((__m128i*)(dest + i * 4 + 16), _mm_unpackhi_epi16(yy_lo, ya_lo));
+          _mm_storeu_si128((__m128i*)(dest + i * 4 + 32), _mm_unpacklo_epi16(yy_hi, ya_hi));
+          _mm_storeu_si128((__m128i*)(dest + i * 4 + 48), _mm_unpackhi_epi16(yy_hi, ya_hi));
         }
-        outptr += stride - 32;
+      #endif
+      for (; i != count; ++i) {
+        dest[i * 4 + 0] = dest[i * 4 + 1] = dest[i * 4 + 2] = y[i];
+        dest[i * 4 + 3] = 0xff;
       }
     }
 
-    // convert from YCrCb to RGB
-    // See http://en.wikipedia.org/wiki/YCbCr
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          float cb = inptr[64];
-          float cr = inptr[128];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
+    // double the width of a line of column sums (four times the samples) like this:
+    //   out[i*2+0] = (sums[i] * 3 + sums[i-1] + even_bias) >> 4
+    //   out[i*2+1] = (sums[i] * 3 + sums[i+1] + odd_bias) >> 4
+    // sums[-1] and sums[count] must be copies of the end values.
+    static void upsample_h2(uint8_t *dest, const int16_t *sums, unsigned count, int even_bias, int odd_bias) {
+      unsigned i = 0;
+      #if OCTET_SSE2
+        const __m128i eb = _mm_set1_epi16((int16_t)even_bias);
+        const __m128i ob = _mm_set1_epi16((int16_t)odd_bias);
+        for (; i + 8 <= count; i += 8) {
+          __m128i cur = _mm_loadu_si128((const __m128i*)(sums + i));
+          __m128i cur3 = _mm_add_epi16(_mm_add_epi16(cur, cur), cur);
+          __m128i prev = _mm_loadu_si128((const __m128i*)(sums + i - 1));
+          __m128i next = _mm_loadu_si128((const __m128i*)(sums + i + 1));
+          __m128i even = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(cur3, prev), eb), 4);
+          __m128i odd = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(cur3, next), ob), 4);
+          __m128i e8 = _mm_packus_epi16(even, even);
+          __m128i o8 = _mm_packus_epi16(odd, odd);
+          _mm_storeu_si128((__m128i*)(dest + i * 2), _mm_unpacklo_epi8(e8, o8));
         }
-        outptr += stride - 32;
+      #endif
+      for (; i != count; ++i) {
+        const int16_t *cur = sums + i;
+        dest[i*2+0] = (uint8_t)( ( cur[0] * 3 + cur[-1] + even_bias ) >> 4 );
+        dest[i*2+1] = (uint8_t)( ( cur[0] * 3 + cur[1] + odd_bias ) >> 4 );
       }
     }
 
-    // convert from YCrCb to RGB
-    // See http://en.wikipedia.org/wiki/YCbCr
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_411(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y0 = inptr[0x00];
-          float y1 = inptr[0x40];
-          float y2 = inptr[0x80];
-          float y3 = inptr[0xc0];
-          float cb = inptr[0x100];
-          float cr = inptr[0x140];
-          inptr++;
-          outptr[0] = clamp(128 + y0 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y0 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y0 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-          outptr[0] = clamp(128 + y1 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y1 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y1 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += stride - 4;
-          outptr[0] = clamp(128 + y2 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y2 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y2 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-          outptr[0] = clamp(128 + y3 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y3 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y3 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += -stride + 4;
-        }
-        outptr += stride*2 - 64;
-      }
-    }
-
-    // JPEG files are split up into chunks starting with 0xff
-    unsigned decode_chunk(const uint8_t *src, dynarray<uint8_t> &image, uint16_t &format) {
-      if (debug) printf("decode_chunk %02x\n", src[1]);
-
-      unsigned length = 2;
-
-      switch (src[1]) {
-        // different kinds of image (SOF0-7)
-        case 0xc0: case 0xc1: case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7: {
-          sof_code = src[1];
-          length = u2(src + 2) + 2;
-          precision = src[4];
-          height = u2(src + 5);
-          width = u2(src + 7);
-          num_components = src[9];
-
-          if (src[1] != 0xc0) {
-            printf("warning: only baseline JPEG is supported - disable progressive\n");
-            return 0;
+    // get line y of a component at full resolution.
+    // Half width and half height components use "fancy" upsampling: each new sample is
+    // 3/4 of the nearest old one and 1/4 of the next nearest. Other sizes are repeated.
+    // temp needs width + 32 bytes and sums c.width + 32 values.
+    const uint8_t *get_line(const component &c, unsigned y, uint8_t *temp, int16_t *sums) const {
+      unsigned stride = c.blocks_per_line * 8;
+      if (c.hsamp == max_hsamp && c.vsamp == max_vsamp) {
+        return c.pixels.data() + y * stride;
+      }
+
+      unsigned count = c.width;
+      bool half_width = c.hsamp * 2 == max_hsamp;
+      bool half_height = c.vsamp * 2 == max_vsamp;
+      if ((half_width || c.hsamp == max_hsamp) && (half_height || c.vsamp == max_vsamp)) {
+        // the nearest line and the one above or below it.
+        unsigned cy = half_height ? y / 2 : y;
+        unsigned fy = !half_height ? cy : y & 1 ? ( cy + 1 < c.height ? cy + 1 : cy ) : ( cy ? cy - 1 : 0 );
+        const uint8_t *src = c.pixels.data() + cy * stride;
+        const uint8_t *other = c.pixels.data() + fy * stride;
+
+        if (!half_width) {
+          // 4:4:0
+          int bias = y & 1 ? 2 : 1;
+          for (unsigned i = 0; i != count; ++i) {
+            temp[i] = (uint8_t)( ( src[i] * 3 + other[i] + bias ) >> 2 );
           }
+          return temp;
+        }
 
-          if (precision != 8 || width == 0 || height == 0 || num_components > 4) {
-            printf("warning: precision=%d width=%d height=%d num_components=%d\n", precision, width, height, num_components);
-            return 0;
+        // 4:2:2 and 4:2:0: 3 * nearest + other and then the same in the other direction.
+        unsigned i = 0;
+        #if OCTET_SSE2
+          const __m128i zero = _mm_setzero_si128();
+          for (; i < count; i += 8) {
+            __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + i)), zero);
+            __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(other + i)), zero);
+            _mm_storeu_si128((__m128i*)(sums + 1 + i), _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(a, a), a), b));
           }
+        #endif
+        for (; i < count; ++i) {
+          sums[1 + i] = (int16_t)(src[i] * 3 + other[i]);
+        }
+        sums[0] = sums[1];
+        sums[count + 1] = sums[count];
 
-          if (debug) printf("SOF w=%d h=%d nc=%d\n", width, height, num_components);
+        if (half_height) {
+          upsample_h2(temp, sums + 1, count, 8, 7);
+        } else {
+          upsample_h2(temp, sums + 1, count, 4, 8);
+        }
+        return temp;
+      }
 
-          // ycrcb only
-          if (num_components != 1 && num_components != 3) {
-            printf("warning: num_components=%d\n", num_components);
-            return 0;
+      // other sizes: repeat the samples.
+      const uint8_t *src = c.pixels.data() + ( y * c.vsamp / max_vsamp ) * stride;
+      if (max_hsamp % c.hsamp == 0) {
+        unsigned repeat = max_hsamp / c.hsamp;
+        for (unsigned i = 0; i != count; ++i) {
+          for (unsigned j = 0; j != repeat; ++j) {
+            temp[i * repeat + j] = src[i];
           }
+        }
+      } else {
+        for (unsigned i = 0; i != width; ++i) {
+          temp[i] = src[i * c.hsamp / max_hsamp];
+        }
+      }
+      return temp;
+    }
 
+    // write the RGBA image, bottom line first, with lines stride bytes apart.
+    // each strip of lines is independent, so the threads share them out.
+    void write_image(uint8_t *dest, size_t stride) const {
+      unsigned num_strips = ( height + strip_lines - 1 ) / strip_lines;
+      job_pool::run(workers, num_strips, [&](unsigned strip) {
+        dynarray<uint8_t> temp((width + 32) * 3);
+        dynarray<int16_t> sums(width + 32);
+        unsigned y_end = strip * strip_lines + strip_lines < height ? strip * strip_lines + strip_lines : height;
+        for (unsigned y = strip * strip_lines; y != y_end; ++y) {
+          const uint8_t *lines[3];
           for (unsigned i = 0; i != num_components; ++i) {
-            component &c = components[i];
-            c.id = src[10 + i*3 + 0];
-            c.hsamp = src[10 + i*3 + 1] >> 4;
-            c.vsamp = src[10 + i*3 + 1] & 15;
-            c.quantisation_table = src[10 + i*3 + 2] & 3;
-            if (debug) printf("id=%d h=%d v=%d q=%d\n", c.id, c.hsamp, c.vsamp, c.quantisation_table);
+            lines[i] = get_line(components[i], y, temp.data() + (width + 32) * i, sums.data());
+          }
+          uint8_t *line = dest + ( height - 1 - y ) * stride;
+          if (num_components == 1) {
+            grey_to_rgba(line, lines[0], width);
+          } else {
+            ycbcr_to_rgba(line, lines[0], lines[1], lines[2], width);
           }
-          
-        } break;
-
-        // huffman tables
-        case 0xc4: {
-          length = u2(src + 2) + 2;
-          src += 4;
-          const uint8_t *src_max = src + length;
-          while (src + 17 <= src_max) {
-            unsigned index = src[0];
-            unsigned is_ac = (index >> 4) & 1;
-            index &= 3;
-            huffman_table &h = huffman_tables[is_ac][index];
-            const uint8_t *num_codes = src + 1;
-            unsigned count = 0;
-            for (unsigned i = 0; i != 16; ++i) {
-              count += num_codes[i];
+        }
+      });
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Huffman decoding
+    //
+
+    // decode one dequantised block of a baseline file.
+    // returns true if there are any AC coefficients.
+    bool decode_block(bit_reader &br, scan_state &s, unsigned comp, int16_t *block) {
+      const component &c = components[comp];
+      const huffman_table &dc_table = dc_tables[c.dc_table];
+      const huffman_table &ac_table = ac_tables[c.ac_table];
+      const int16_t *quant = quant_tables[c.quantisation_table];
+      const uint8_t *zz = zig_zag();
+
+      memset(block, 0, 64 * sizeof(int16_t));
+
+      int value = br.decode(dc_table);
+      if (value < 0 || value > 16) return false;
+      int dc = value ? br.receive_extend(value) : 0;
+      int abs_dc = s.last_dc[comp] = clamp_dc(s.last_dc[comp] + dc);
+      block[0] = saturate(abs_dc * quant[0]);
+
+      bool has_ac = false;
+      for (unsigned k = 1; k < 64; ) {
+        if (br.num_bits < 16) br.fill();
+
+        // most coefficients are small and come with short codes.
+        int f = ac_table.fast_ac[br.bits >> (32 - fast_bits)];
+        if (f) {
+          br.consume(f & 15);
+          k += (f >> 4) & 15;
+          if (k > 63) break;
+          unsigned z = zz[k++];
+          block[z] = saturate((f >> 8) * quant[z]);
+          has_ac = true;
+          continue;
+        }
+
+        int rs = br.decode(ac_table);
+        if (rs < 0) break;
+        unsigned run = rs >> 4;
+        unsigned size = rs & 15;
+        if (size == 0) {
+          // end of block or 16 zeros
+          if (run != 15) break;
+          k += 16;
+        } else {
+          k += run;
+          if (k > 63) break;
+          unsigned z = zz[k++];
+          block[z] = saturate(br.receive_extend(size) * quant[z]);
+          has_ac = true;
+        }
+      }
+      return has_ac;
+    }
+
+    static int clamp_dc(int dc) {
+      return dc < -65536 ? -65536 : dc > 65536 ? 65536 : dc;
+    }
+
+    // progressive: the first scan of the DC coefficients.
+    void decode_dc_first(bit_reader &br, scan_state &s, unsigned comp, int16_t *coeffs) {
+      int value = br.decode(dc_tables[components[comp].dc_table]);
+      int dc = value > 0 && value <= 16 ? br.receive_extend(value) : 0;
+      s.last_dc[comp] = clamp_dc(s.last_dc[comp] + dc);
+      coeffs[0] = (int16_t)(s.last_dc[comp] * (1 << successive_low));
+    }
+
+    // progressive: one more bit of the DC coefficient.
+    void decode_dc_refine(bit_reader &br, int16_t *coeffs) {
+      if (br.get_bit()) {
+        coeffs[0] = (int16_t)(coeffs[0] | (1 << successive_low));
+      }
+    }
+
+    // progressive: the first scan of a band of AC coefficients.
+    // An EOB run says that the next few blocks have no coefficients in the band.
+    void decode_ac_first(bit_reader &br, scan_state &s, unsigned comp, int16_t *coeffs) {
+      if (s.eobrun) {
+        s.eobrun--;
+        return;
+      }
+
+      const huffman_table &ac_table = ac_tables[components[comp].ac_table];
+      const uint8_t *zz = zig_zag();
+      for (unsigned k = spectral_start; k <= spectral_end; ) {
+        if (br.num_bits < 16) br.fill();
+        int f = ac_table.fast_ac[br.bits >> (32 - fast_bits)];
+        if (f) {
+          br.consume(f & 15);
+          k += (f >> 4) & 15;
+          if (k > 63) return;
+          coeffs[zz[k++]] = (int16_t)((f >> 8) * (1 << successive_low));
+          continue;
+        }
+
+        int rs = br.decode(ac_table);
+        if (rs < 0) return;
+        unsigned run = rs >> 4;
+        unsigned size = rs & 15;
+        if (size == 0) {
+          if (run < 15) {
+            s.eobrun = ( 1u << run ) - 1;
+            if (run) s.eobrun += br.get_bits(run);
+            return;
+          }
+          k += 16;
+        } else {
+          k += run;
+          if (k > 63) return;
+          coeffs[zz[k++]] = (int16_t)(br.receive_extend(size) * (1 << successive_low));
+        }
+      }
+    }
+
+    // progressive: one more bit of a band of AC coefficients.
+    // Coefficients that are already non-zero get a correction bit, zeros may become +1 or -1.
+    void decode_ac_refine(bit_reader &br, scan_state &s, unsigned comp, int16_t *coeffs) {
+      const huffman_table &ac_table = ac_tables[components[comp].ac_table];
+      const uint8_t *zz = zig_zag();
+      int bit = 1 << successive_low;
+      unsigned k = spectral_start;
+
+      if (s.eobrun == 0) {
+        while (k <= spectral_end) {
+          int rs = br.decode(ac_table);
+          if (rs < 0) return;
+          unsigned run = rs >> 4;
+          unsigned size = rs & 15;
+          int value = 0;
+          if (size == 0) {
+            if (run < 15) {
+              // the rest of this block only has correction bits.
+              s.eobrun = 1u << run;
+              if (run) s.eobrun += br.get_bits(run);
+              break;
             }
-            src += 17;
-            if (src + count > src_max || count > 256) return 0;
-            memcpy(h.huffval, src, count);
-            src += count;
-
-            unsigned dest = 0;
-            unsigned code = 0;
-            h.min_len = 0;
-            bool done_min_len = false;
-            for (unsigned len = 1; len < 17; ++len) {
-              h.offset[len-1] = code - dest;
-              if (!done_min_len && num_codes[len-1]) {
-                h.min_len = len - 1;
-                done_min_len = true;
+            // 16 zeros
+          } else {
+            value = br.get_bit() ? bit : -bit;
+          }
+
+          // skip run zeros, correcting the non-zero coefficients on the way.
+          while (k <= spectral_end) {
+            int16_t &coeff = coeffs[zz[k++]];
+            if (coeff != 0) {
+              if (br.get_bit() && (coeff & bit) == 0) {
+                coeff = (int16_t)(coeff + (coeff > 0 ? bit : -bit));
               }
-              for (unsigned i = 0; i != num_codes[len-1]; ++i) {
-                if (debug) printf("code=%04x len=%d\n", ( ( code + i ) << (16 - len) ), len );
+            } else {
+              if (run == 0) {
+                coeff = (int16_t)value;
+                break;
               }
-              dest += num_codes[len-1];
-              code = code + num_codes[len-1];
-              h.maxcodes[len-1] = ( code << (16 - len) ) - 1;
-              code *= 2;
-              if (debug) printf("h.maxcodes[%d] = %04x\n", len-1, h.maxcodes[len-1]);
+              run--;
             }
-            h.maxcodes[16] = 0xffff;
-            
-            if (debug) printf("DHT %d\n", index);
           }
-        } break;
-
-        // start
-        case 0xd8: {
-          if (debug) printf("SOI\n");
-        } break;
-
-        // end
-        case 0xd9: {
-          if (debug) printf("EOI\n");
-        } break;
-
-        // image data
-        case 0xda: {
-          const uint8_t *src0 = src;
-          length = u2(src + 2) + 2;
-          src += 4;
-          num_components_in_scan = *src++;
-          unsigned max_hsamp = 1;
-          unsigned max_vsamp = 1;
-          num_mcu_blocks = 0;
-          const uint8_t *src_max = src + length;
-          for (unsigned i = 0; i != num_components_in_scan; ++i) {
-            scan_component &sc = scan_components[i];
-            unsigned id = *src++;
-            sc.ac_table = *src & 0x0f;
-            sc.dc_table = *src++ >> 4;
-            unsigned comp = 0;
-            while (comp < num_components) {
-              if (components[comp].id == id) break;
-              comp++;
-            }
-            if (comp >= num_components) return 0;
-            component &c = components[comp];
-            max_hsamp = c.hsamp > max_hsamp ? c.hsamp : max_hsamp;
-            max_vsamp = c.vsamp > max_vsamp ? c.vsamp : max_vsamp;
-            sc.comp = comp;
-            if (debug) printf("SOS comp=%d ac=%d dc=%d\n", comp, sc.ac_table, sc.dc_table);
-            unsigned samps = c.hsamp * c.vsamp;
-
-            if (num_mcu_blocks + samps > sizeof(mcu_blocks)/sizeof(mcu_blocks[0])) {
-              printf("too many mcu blocks\n");
-              return 0;
-            }
-
-            for (unsigned j = 0; j != samps; ++j) {
-              mcu_block &m = mcu_blocks[num_mcu_blocks++];
-              m.dc_table = &huffman_tables[0][sc.dc_table];
-              m.ac_table = &huffman_tables[1][sc.ac_table];
-              m.quant = &quant_tables[c.quantisation_table];
-              m.scan_comp = &sc;
-            }
+        }
+      }
 
-            sc.last_dc = 0;
+      if (s.eobrun) {
+        // correction bits only.
+        for (; k <= spectral_end; ++k) {
+          int16_t &coeff = coeffs[zz[k]];
+          if (coeff != 0 && br.get_bit() && (coeff & bit) == 0) {
+            coeff = (int16_t)(coeff + (coeff > 0 ? bit : -bit));
           }
+        }
+        s.eobrun--;
+      }
+    }
 
-          // at present, we only support YCrCb in 4:4:4
-          if (num_mcu_blocks != 1 && num_mcu_blocks != 3 && num_mcu_blocks != 6) {
-            printf("only 4:4:4 and 4:1:1 greyscale and ycrcb supported (%d mcu blocks)\n", num_mcu_blocks);
-            return 0;
+    // decode one block of a scan at block position bx, by in a component.
+    void decode_scan_block(bit_reader &br, scan_state &s, unsigned comp, unsigned bx, unsigned by) {
+      component &c = components[comp];
+      if (!progressive) {
+        int16_t block[64];
+        bool has_ac = decode_block(br, s, comp, block);
+        unsigned stride = c.blocks_per_line * 8;
+        idct_block(c.pixels.data() + by * 8 * stride + bx * 8, (int)stride, block, has_ac);
+      } else {
+        int16_t *coeffs = c.coeffs.data() + ( by * c.blocks_per_line + bx ) * 64;
+        if (spectral_start == 0) {
+          if (successive_high == 0) {
+            decode_dc_first(br, s, comp, coeffs);
+          } else {
+            decode_dc_refine(br, coeffs);
           }
-
-          spectral_start = *src++;
-          spectral_end = *src++;
-          successive_high = src[0] >> 4;
-          successive_low = *src++ & 0x0f;
-          if (src > src_max) return 0;
-
-          for (unsigned i = 0; i != num_components_in_scan; ++i) {
-            scan_component &sc = scan_components[i];
-            component &c = components[sc.comp];
-            sc.width_in_blocks = width * c.hsamp / max_hsamp;
-            sc.height_in_blocks = height * c.hsamp / max_hsamp;
+        } else {
+          if (successive_high == 0) {
+            decode_ac_first(br, s, comp, coeffs);
+          } else {
+            decode_ac_refine(br, s, comp, coeffs);
           }
+        }
+      }
+    }
 
-          width = (width + max_hsamp * 8 - 1) & ~(max_hsamp * 8 - 1);
-          height = (height + max_vsamp * 8 - 1) & ~(max_vsamp * 8 - 1);
-
-          unsigned xmax = ( width + max_hsamp * 8 - 1 ) / (max_hsamp * 8);
-          unsigned ymax = ( height + max_vsamp * 8 - 1 ) / (max_vsamp * 8);
-
-          unsigned acc = 0;
-          int shift = 0;
-          skip_bits(16, acc, src, shift);
-          
-          int stride = width * 4;
-
-          unsigned size = width * height * 4;
-          size_t base = image.size();
-          image.resize(base + size);
-          format = 0x1908; // GL_RGBA
-
-          uint8_t *image_base = image.data() + base;
-
-          for (unsigned y = 0; y != ymax; ++y) {
-            for (unsigned x = 0; x != xmax; ++x) {
-              float *coeffs = dct_coeffs;
-              memset(coeffs, 0, 64 * num_mcu_blocks * sizeof(float));
-              for (unsigned b = 0; b < num_mcu_blocks; ++b) {
-                decode_mcu_block(b, acc, src, shift, coeffs);
-                inverse_dct(coeffs);
-                coeffs += 64;
-              }
-              if (num_mcu_blocks == 1) {
-                // assume 4:4:4 Greyscale
-                color_convert_444_greyscale(&image_base[((height - 1 - y * 8) * stride) + (x * 8 * 4)], -stride, dct_coeffs);
-              } else if (num_mcu_blocks == 3) {
-                // assume 4:4:4 YCbCr
-                color_convert_444(&image_base[((height - 1 - y * 8) * stride) + (x * 8 * 4)], -stride, dct_coeffs);
-              } else if (num_mcu_blocks == 6) {
-                // assume 4:1:1 YCbCr
-                color_convert_411(&image_base[((height - 1 - y * 16) * stride) + (x * 16 * 4)], -stride, dct_coeffs);
+    // decode MCUs first..mcu_end-1 of a scan that has xmax MCUs per line.
+    void decode_mcus(bit_reader &br, scan_state &s, unsigned first, unsigned mcu_end, unsigned xmax) {
+      for (unsigned mcu = first; mcu != mcu_end; ++mcu) {
+        if (restart_interval && mcu != first && mcu % restart_interval == 0) {
+          br.restart();
+          s.reset();
+        }
+
+        unsigned x = mcu % xmax;
+        unsigned y = mcu / xmax;
+        if (num_scan_components == 1) {
+          decode_scan_block(br, s, scan_components[0], x, y);
+        } else {
+          for (unsigned i = 0; i != num_scan_components; ++i) {
+            unsigned comp = scan_components[i];
+            const component &c = components[comp];
+            for (unsigned v = 0; v != c.vsamp; ++v) {
+              for (unsigned h = 0; h != c.hsamp; ++h) {
+                decode_scan_block(br, s, comp, x * c.hsamp + h, y * c.vsamp + v);
               }
             }
           }
-          skip_bits(shift, acc, src, shift);
-          length = (unsigned)(src - src0);
-        } break;
-
-        // quantisation tables (the lossy bit)
-        case 0xdb: {
-          length = u2(src + 2) + 2;
-          const uint8_t *src_max = src + length;
-          src += 4;
-          while (src < src_max) {
-            unsigned prec = (src[0] >> 4) & 1;
-            unsigned n = src[0] & 0x0f;
-            src++;
-            for (unsigned i = 0; i != 64; ++i) {
-              quant_tables[n&3].table[i] = (float)( prec ? u2(src) : *src );
-              src += prec + 1;
-            }
-            if (debug) printf("DQT %d %d\n", prec, n);
+        }
+      }
+    }
+
+    // find the start of each restart interval of a scan and the marker after the scan.
+    // returns null unless there are exactly num_intervals - 1 RSTn markers.
+    static const uint8_t *find_restarts(const uint8_t **starts, unsigned num_intervals, const uint8_t *src, const uint8_t *src_max) {
+      unsigned found = 0;
+      starts[0] = src;
+      for (const uint8_t *p = src; ; ) {
+        p = (const uint8_t*)memchr(p, 0xff, src_max - p);
+        if (!p || p + 1 >= src_max) return 0;
+        unsigned marker = p[1];
+        if (marker == 0x00 || marker == 0xff) {
+          // stuffed zero or fill byte
+          p++;
+        } else if (marker >= 0xd0 && marker <= 0xd7) {
+          if (++found == num_intervals) return 0;
+          starts[found] = p += 2;
+        } else {
+          return found + 1 == num_intervals ? p : 0;
+        }
+      }
+    }
+
+    // decode the entropy coded data after a SOS chunk. returns the next marker.
+    const uint8_t *decode_scan(const uint8_t *src, const uint8_t *src_max) {
+      // a scan with one component is not interleaved: the MCU is one block and
+      // there are no extra blocks to fill whole MCUs.
+      unsigned xmax = mcus_x;
+      unsigned ymax = mcus_y;
+      if (num_scan_components == 1) {
+        const component &c = components[scan_components[0]];
+        xmax = ( c.width + 7 ) / 8;
+        ymax = ( c.height + 7 ) / 8;
+      }
+      unsigned num_mcus = xmax * ymax;
+
+      // restart intervals do not share any state, so we can decode them on many threads.
+      unsigned num_intervals = restart_interval ? ( num_mcus + restart_interval - 1 ) / restart_interval : 1;
+      if (workers && num_intervals > 1) {
+        dynarray<const uint8_t*> starts(num_intervals);
+        const uint8_t *end = find_restarts(starts.data(), num_intervals, src, src_max);
+        if (end) {
+          job_pool::run(workers, num_intervals, [&](unsigned i) {
+            bit_reader br;
+            br.init(starts[i], end);
+            scan_state s;
+            s.reset();
+            unsigned mcu = i * restart_interval;
+            decode_mcus(br, s, mcu, num_mcus - mcu < restart_interval ? num_mcus : mcu + restart_interval, xmax);
+          });
+          return end;
+        }
+      }
+
+      bit_reader br;
+      br.init(src, src_max);
+      scan_state s;
+      s.reset();
+      decode_mcus(br, s, 0, num_mcus, xmax);
+      return br.end_of_scan();
+    }
+
+    // multiply coefficients by the quantisation table.
+    // returns true if there are any AC coefficients.
+    static bool dequantise(int16_t *block, const int16_t *coeffs, const int16_t *quant) {
+      #if OCTET_SSE2
+        // 32 bit products, saturated back to 16 bits.
+        __m128i any = _mm_setzero_si128();
+        for (unsigned k = 0; k != 64; k += 8) {
+          __m128i c = _mm_loadu_si128((const __m128i*)(coeffs + k));
+          __m128i q = _mm_loadu_si128((const __m128i*)(quant + k));
+          __m128i lo = _mm_mullo_epi16(c, q);
+          __m128i hi = _mm_mulhi_epi16(c, q);
+          _mm_storeu_si128((__m128i*)(block + k), _mm_packs_epi32(_mm_unpacklo_epi16(lo, hi), _mm_unpackhi_epi16(lo, hi)));
+          any = _mm_or_si128(any, k ? c : _mm_srli_si128(c, 2));
+        }
+        return _mm_movemask_epi8(_mm_cmpeq_epi16(any, _mm_setzero_si128())) != 0xffff;
+      #else
+        bool has_ac = false;
+        block[0] = saturate(coeffs[0] * quant[0]);
+        for (unsigned k = 1; k != 64; ++k) {
+          block[k] = saturate(coeffs[k] * quant[k]);
+          has_ac |= coeffs[k] != 0;
+        }
+        return has_ac;
+      #endif
+    }
+
+    // progressive files: dequantise and inverse DCT all the blocks, a row at a time on each thread.
+    void finish_progressive() {
+      for (unsigned i = 0; i != num_components; ++i) {
+        component &c = components[i];
+        const int16_t *quant = quant_tables[c.quantisation_table];
+        unsigned stride = c.blocks_per_line * 8;
+        job_pool::run(workers, c.block_rows, [&](unsigned by) {
+          for (unsigned bx = 0; bx != c.blocks_per_line; ++bx) {
+            const int16_t *coeffs = c.coeffs.data() + ( by * c.blocks_per_line + bx ) * 64;
+            int16_t block[64];
+            bool has_ac = dequantise(block, coeffs, quant);
+            idct_block(c.pixels.data() + by * 8 * stride + bx * 8, (int)stride, block, has_ac);
           }
-        } break;
+        });
+      }
+    }
 
-        // JFIF stubset of JPEG
-        case 0xe0: {
-          length = u2(src + 2) + 2;
-          if (debug) printf("M_APP0 (JFIF)\n");
-        } break;
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Chunks
+    //
 
-        // unknown chunk
-        default: {
-          if (src[2] != 0xff) length = u2(src + 2) + 2;
-          if (debug) printf("unknown\n");
-        } break;
+    // SOF: image size and components
+    bool read_frame(const uint8_t *src, unsigned length) {
+      if (length < 10) return false;
+      unsigned precision = src[4];
+      height = u2(src + 5);
+      width = u2(src + 7);
+      num_components = src[9];
+      progressive = src[1] == 0xc2;
+
+      if (precision != 8 || width == 0 || height == 0 || (uint64_t)width * height > max_pixels) {
+        printf("warning: precision=%d width=%d height=%d\n", precision, width, height);
+        return false;
       }
-      return length;
+
+      if (debug) printf("SOF w=%d h=%d nc=%d\n", width, height, num_components);
+
+      // grey and ycrcb only
+      if (num_components != 1 && num_components != 3) {
+        printf("warning: num_components=%d\n", num_components);
+        return false;
+      }
+
+      if (length < 10 + num_components * 3) return false;
+
+      max_hsamp = 1;
+      max_vsamp = 1;
+      for (unsigned i = 0; i != num_components; ++i) {
+        component &c = components[i];
+        c.id = src[10 + i*3 + 0];
+        c.hsamp = src[10 + i*3 + 1] >> 4;
+        c.vsamp = src[10 + i*3 + 1] & 15;
+        c.quantisation_table = src[10 + i*3 + 2] & 3;
+        if (c.hsamp < 1 || c.hsamp > 4 || c.vsamp < 1 || c.vsamp > 4) return false;
+        max_hsamp = c.hsamp > max_hsamp ? c.hsamp : max_hsamp;
+        max_vsamp = c.vsamp > max_vsamp ? c.vsamp : max_vsamp;
+        if (debug) printf("id=%d h=%d v=%d q=%d\n", c.id, c.hsamp, c.vsamp, c.quantisation_table);
+      }
+
+      mcus_x = ( width + max_hsamp * 8 - 1 ) / ( max_hsamp * 8 );
+      mcus_y = ( height + max_vsamp * 8 - 1 ) / ( max_vsamp * 8 );
+
+      for (unsigned i = 0; i != num_components; ++i) {
+        component &c = components[i];
+        c.width = ( width * c.hsamp + max_hsamp - 1 ) / max_hsamp;
+        c.height = ( height * c.vsamp + max_vsamp - 1 ) / max_vsamp;
+        c.blocks_per_line = mcus_x * c.hsamp;
+        c.block_rows = mcus_y * c.vsamp;
+      }
+
+      have_frame = true;
+      return true;
     }
-  public:
-    // get an opengl texture from a file in memory
-    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
+
+    // make the planes of samples (and coefficients) for each component.
+    void allocate_planes() {
+      for (unsigned i = 0; i != num_components; ++i) {
+        component &c = components[i];
+        unsigned num_blocks = c.blocks_per_line * c.block_rows;
+        c.pixels.resize(num_blocks * 64);
+        memset(c.pixels.data(), 0, num_blocks * 64);
+        if (progressive) {
+          c.coeffs.resize(num_blocks * 64);
+          memset(c.coeffs.data(), 0, num_blocks * 64 * sizeof(int16_t));
+        }
+      }
+    }
+
+    // DHT: huffman tables
+    bool read_huffman_tables(const uint8_t *src, unsigned length) {
+      const uint8_t *src_max = src + length;
+      src += 4;
+      while (src + 17 <= src_max) {
+        unsigned index = src[0];
+        unsigned is_ac = (index >> 4) & 1;
+        index &= 3;
+        const uint8_t *num_codes = src + 1;
+        unsigned count = 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          count += num_codes[i];
+        }
+        src += 17;
+        if (src + count > src_max || count > 256) return false;
+        huffman_table &h = is_ac ? ac_tables[index] : dc_tables[index];
+        if (!h.build(num_codes, src, count)) return false;
+        src += count;
+        if (debug) printf("DHT %d %d\n", is_ac, index);
+      }
+      return true;
+    }
+
+    // DQT: quantisation tables (the lossy bit)
+    // we scale these for the AAN inverse DCT.
+    bool read_quant_tables(const uint8_t *src, unsigned length) {
+      const uint8_t *src_max = src + length;
+      src += 4;
       while (src < src_max) {
+        unsigned prec = (src[0] >> 4) & 1;
+        unsigned n = src[0] & 3;
+        src++;
+        if (src + 64 * (prec + 1) > src_max) return false;
+        for (unsigned i = 0; i != 64; ++i) {
+          unsigned natural = zig_zag()[i];
+          double scale = aan_scale(natural >> 3) * aan_scale(natural & 7) * 4;
+          double q = ( prec ? u2(src) : *src ) * scale + 0.5;
+          quant_tables[n][natural] = (int16_t)( q < 32767 ? q : 32767 );
+          src += prec + 1;
+        }
+        if (debug) printf("DQT %d %d\n", prec, n);
+      }
+      return true;
+    }
+
+    static double aan_scale(unsigned k) {
+      return k == 0 ? 1.0 : cos(k * 3.14159265358979323846 / 16) * 1.41421356237309504880;
+    }
+
+    // SOS: start of a scan
+    bool read_scan_header(const uint8_t *src, unsigned length) {
+      if (!have_frame || length < 6) return false;
+      num_scan_components = src[4];
+      if (num_scan_components < 1 || num_scan_components > num_components || length < 8 + num_scan_components * 2) {
+        return false;
+      }
+
+      src += 5;
+      for (unsigned i = 0; i != num_scan_components; ++i) {
+        unsigned id = *src++;
+        unsigned comp = 0;
+        while (comp < num_components && components[comp].id != id) {
+          comp++;
+        }
+        if (comp >= num_components) return false;
+        components[comp].dc_table = *src >> 4 & 3;
+        components[comp].ac_table = *src++ & 3;
+        scan_components[i] = comp;
+        if (debug) printf("SOS comp=%d ac=%d dc=%d\n", comp, components[comp].ac_table, components[comp].dc_table);
+      }
+
+      spectral_start = *src++;
+      spectral_end = *src++;
+      successive_high = src[0] >> 4;
+      successive_low = src[0] & 0x0f;
+
+      if (progressive) {
+        // DC and AC are always in separate scans and AC scans have one component.
+        if (spectral_end > 63 || spectral_start > spectral_end || successive_low > 13) return false;
+        if (spectral_start == 0 && spectral_end != 0) return false;
+        if (spectral_start != 0 && num_scan_components != 1) return false;
+      }
+      return true;
+    }
+
+    // read the chunks of a file and decode the scans into the component planes.
+    // if header_only is set, stop after the frame header.
+    bool read_file(const uint8_t *src, const uint8_t *src_max, bool header_only) {
+      have_frame = false;
+      restart_interval = 0;
+
+      while (src + 2 <= src_max) {
         if (src[0] != 0xff) {
           printf("warning: bad JPEG file\n");
-          return;
+          return false;
         }
-        unsigned length = decode_chunk(src, image, format);
-        if (!length) {
-          printf("warning: bad JPEG file @ chunk %02x\n", src[1]);
-          return;
+
+        unsigned marker = src[1];
+        if (debug) printf("decode_chunk %02x\n", marker);
+
+        // chunks without a length
+        if (marker == 0xff) {
+          src++;
+          continue;
+        } else if (marker == 0xd9) {
+          break;
+        } else if (marker == 0xd8 || marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+          src += 2;
+          continue;
+        }
+
+        unsigned length = src + 4 <= src_max ? u2(src + 2) + 2 : 0;
+        if (length < 4 || src + length > src_max) {
+          printf("warning: bad JPEG file @ chunk %02x\n", marker);
+          return false;
+        }
+
+        bool ok = true;
+        switch (marker) {
+          // baseline, extended and progressive huffman coded images
+          case 0xc0: case 0xc1: case 0xc2: {
+            ok = read_frame(src, length);
+            if (ok && header_only) return true;
+            if (ok) {
+              allocate_planes();
+              choose_workers();
+            }
+          } break;
+
+          // lossless, hierarchical and arithmetic coded images
+          case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+          case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf: {
+            printf("warning: only huffman coded baseline and progressive JPEG is supported\n");
+            return false;
+          }
+
+          case 0xc4: {
+            ok = read_huffman_tables(src, length);
+          } break;
+
+          case 0xdb: {
+            ok = read_quant_tables(src, length);
+          } break;
+
+          // restart interval
+          case 0xdd: {
+            ok = length >= 6;
+            if (ok) restart_interval = u2(src + 4);
+          } break;
+
+          // image data follows the scan header
+          case 0xda: {
+            if (!read_scan_header(src, length)) {
+              ok = false;
+            } else {
+              src = decode_scan(src + length, src_max);
+              continue;
+            }
+          } break;
+
+          // APPn, comments and so on
+          default: {
+            if (debug) printf("unknown\n");
+          } break;
+        }
+
+        if (!ok) {
+          printf("warning: bad JPEG file @ chunk %02x\n", marker);
+          return false;
         }
         src += length;
       }
-      width_ = width;
-      height_ = height;
-      num_components = 3;
+
+      if (!have_frame) {
+        printf("warning: bad JPEG file\n");
+        return false;
+      }
+
+      if (progressive) {
+        finish_progressive();
+      }
+      return true;
+    }
+
+    // how many threads to use for this image. Small images use one.
+    void choose_workers() {
+      bool small = (uint64_t)width * height < min_parallel_pixels;
+      workers = small || !jobs || jobs->get_num_threads() == 1 ? NULL : jobs;
+    }
+
+  public:
+    jpeg_decoder() {
+      width = height = num_components = 0;
+      progressive = have_frame = false;
+      restart_interval = 0;
+      jobs = &job_pool::get_shared();
+      workers = NULL;
+      memset(quant_tables, 0, sizeof(quant_tables));
+      for (unsigned i = 0; i != 4; ++i) {
+        dc_tables[i].clear();
+        ac_tables[i].clear();
+      }
+    }
+
+    /// Use these threads for large images. The default is job_pool::get_shared(); NULL decodes on the calling thread.
+    void set_job_pool(job_pool *value) {
+      jobs = value;
+    }
+
+    /// Get the size of an image from the frame header without decoding it.
+    bool get_size(uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
+      if (!read_file(src, src_max, true)) return false;
+      width_ = (uint16_t)width;
+      height_ = (uint16_t)height;
+      return true;
+    }
+
+    /// Decode RGBA pixels into a buffer of your own, such as a mapped pixel buffer or part of an atlas.
+    /// Lines are written bottom line first, stride bytes apart (at least width * 4).
+    /// Returns false if the file is bad or dest_size is too small for the image.
+    bool decode(uint8_t *dest, size_t dest_size, size_t stride, const uint8_t *src, const uint8_t *src_max) {
+      if (!read_file(src, src_max, false)) return false;
+      if (stride < (size_t)width * 4 || (size_t)(height - 1) * stride + width * 4 > dest_size) {
+        printf("warning: JPEG buffer too small\n");
+        return false;
+      }
+      write_image(dest, stride);
+      return true;
+    }
+
+    /// get an opengl texture from a file in memory
+    /// The RGBA pixels are added to image, bottom line first.
+    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
+      if (!read_file(src, src_max, false)) return;
+
+      size_t base = image.size();
+      image.resize(base + width * height * 4);
+      write_image(image.data() + base, width * 4);
+
+      format = 0x1908; // GL_RGBA
+      width_ = (uint16_t)width;
+      height_ = (uint16_t)height;
     }
   };
 }}
-
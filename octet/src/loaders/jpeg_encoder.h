@@ -8,72 +8,816 @@
 // jpeg file encoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
+// Makes baseline JPEG files with the standard (IJG) quantisation and huffman tables,
+// so the files are the same size as libjpeg makes at the same quality.
+//
+// The image is encoded one row of MCUs at a time:
+//   convert RGB to YCbCr and average the Cb and Cr samples (chroma subsampling).
+//   forward DCT and quantise each 8x8 block.
+//   huffman code the non-zero coefficients.
+//
+// With restart markers, groups of MCU rows do not depend on each other
+// and are encoded on many threads.
+//
 namespace octet { namespace loaders {
   class jpeg_encoder {
+  public:
+    /// Resolution of the Cb and Cr (colour) components.
+    enum subsampling {
+      subsample_444, ///< full resolution.
+      subsample_422, ///< half width.
+      subsample_420, ///< half width and half height (the usual choice).
+    };
+
+  private:
+    // smaller images are encoded on one thread as starting threads takes longer.
+    enum { min_parallel_pixels = 1 << 18 };
+
+    // most bytes one block can add to the output (63 of the longest codes, all 0xff).
+    enum { max_block_bytes = 1024 };
+
+    // natural order of coefficients in zig-zag order.
+    static const uint8_t *zig_zag() {
+      static const uint8_t zig_zag_[64] = {
+        0, 1, 8, 16, 9, 2, 3, 10,
+        17, 24, 32, 25, 18, 11, 4, 5,
+        12, 19, 26, 33, 40, 48, 41, 34,
+        27, 20, 13, 6, 7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36,
+        29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46,
+        53, 60, 61, 54, 47, 55, 62, 63,
+      };
+      return zig_zag_;
+    }
+
+    // a huffman table as it is in the DHT chunk and the code for each value.
+    struct huffman_table {
+      const uint8_t *num_codes;
+      const uint8_t *values;
+      unsigned num_values;
+      uint16_t code[256];
+      uint8_t size[256];
+
+      // codes are given out in order of length.
+      void build(const uint8_t *num_codes_, const uint8_t *values_) {
+        num_codes = num_codes_;
+        values = values_;
+        memset(code, 0, sizeof(code));
+        memset(size, 0, sizeof(size));
+        unsigned next = 0, k = 0;
+        for (unsigned len = 1; len <= 16; ++len) {
+          for (unsigned i = 0; i != num_codes[len - 1]; ++i) {
+            code[values[k]] = (uint16_t)next++;
+            size[values[k]] = (uint8_t)len;
+            k++;
+          }
+          next <<= 1;
+        }
+        num_values = k;
+      }
+    };
+
+    // writes bits to a byte buffer, putting a zero after every 0xff.
+    struct bit_writer {
+      dynarray<uint8_t> *buffer;
+      uint8_t *dest;
+      uint8_t *dest_max;
+      uint64_t bits;
+      unsigned num_bits;
+
+      void init(dynarray<uint8_t> &buffer_, size_t bytes) {
+        buffer = &buffer_;
+        buffer->resize((unsigned)bytes);
+        dest = buffer->data();
+        dest_max = dest + buffer->size();
+        bits = 0;
+        num_bits = 0;
+      }
+
+      // make sure there is room for another block.
+      void reserve() {
+        if ((size_t)(dest_max - dest) < max_block_bytes) {
+          size_t used = dest - buffer->data();
+          buffer->resize((unsigned)(buffer->size() * 2 + max_block_bytes));
+          dest = buffer->data() + used;
+          dest_max = buffer->data() + buffer->size();
+        }
+      }
+
+      void put_byte(unsigned byte) {
+        *dest++ = (uint8_t)byte;
+        if (byte == 0xff) *dest++ = 0;
+      }
+
+      // add up to 32 bits, writing four bytes at a time.
+      void put(unsigned code, unsigned len) {
+        bits = bits << len | code;
+        num_bits += len;
+        if (num_bits >= 32) {
+          num_bits -= 32;
+          uint32_t word = (uint32_t)(bits >> num_bits);
+          if (((~word - 0x01010101) & word & 0x80808080) == 0) {
+            // no 0xff bytes
+            dest[0] = (uint8_t)(word >> 24);
+            dest[1] = (uint8_t)(word >> 16);
+            dest[2] = (uint8_t)(word >> 8);
+            dest[3] = (uint8_t)word;
+            dest += 4;
+          } else {
+            put_byte(word >> 24);
+            put_byte((word >> 16) & 0xff);
+            put_byte((word >> 8) & 0xff);
+            put_byte(word & 0xff);
+          }
+        }
+      }
+
+      // pad the last byte with 1 bits and trim the buffer.
+      void flush() {
+        put(0x7f, 7);
+        while (num_bits >= 8) {
+          num_bits -= 8;
+          put_byte((unsigned)(bits >> num_bits) & 0xff);
+        }
+        num_bits = 0;
+        buffer->resize((unsigned)(dest - buffer->data()));
+      }
+    };
+
+    // settings
+    int quality;
+    subsampling chroma;
+    unsigned restart_rows;
+    job_pool *jobs;
+
+    // the image being encoded
+    const uint8_t *src;
+    int stride;
+    unsigned bytes_per_pixel;
+    unsigned width;
+    unsigned height;
+    unsigned num_components;
+
+    // size of the MCU in pixels and blocks of the Y component and the number of MCUs.
+    unsigned hsamp;
+    unsigned vsamp;
+    unsigned mcus_x;
+    unsigned mcus_y;
+    job_pool *workers;
+
+    // quantisation tables in zig-zag order as they are in the DQT chunk.
+    uint8_t quant_tables[2][64];
+
+    // 1 / (quantisation * AAN scale) in the transposed order of the DCT output.
+    float divisors[2][64];
+
+    huffman_table dc_tables[2];
+    huffman_table ac_tables[2];
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Tables
+    //
+
+    // scale the standard tables (JPEG spec Annex K) like libjpeg does.
+    void make_quant_tables() {
+      static const uint8_t luma_base[64] = {
+        16, 11, 10, 16, 24, 40, 51, 61,
+        12, 12, 14, 19, 26, 58, 60, 55,
+        14, 13, 16, 24, 40, 57, 69, 56,
+        14, 17, 22, 29, 51, 87, 80, 62,
+        18, 22, 37, 56, 68, 109, 103, 77,
+        24, 35, 55, 64, 81, 104, 113, 92,
+        49, 64, 78, 87, 103, 121, 120, 101,
+        72, 92, 95, 98, 112, 100, 103, 99,
+      };
+      static const uint8_t chroma_base[64] = {
+        17, 18, 24, 47, 99, 99, 99, 99,
+        18, 21, 26, 66, 99, 99, 99, 99,
+        24, 26, 56, 99, 99, 99, 99, 99,
+        47, 66, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+        99, 99, 99, 99, 99, 99, 99, 99,
+      };
+      static const double aan_scale[8] = {
+        1.0, 1.387039845, 1.306562965, 1.175875602,
+        1.0, 0.785694958, 0.541196100, 0.275899379
+      };
+
+      int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+      for (unsigned t = 0; t != 2; ++t) {
+        const uint8_t *base = t ? chroma_base : luma_base;
+        for (unsigned k = 0; k != 64; ++k) {
+          unsigned natural = zig_zag()[k];
+          int q = ( base[natural] * scale + 50 ) / 100;
+          q = q < 1 ? 1 : q > 255 ? 255 : q;
+          quant_tables[t][k] = (uint8_t)q;
+
+          // the DCT leaves rows and columns swapped.
+          unsigned u = natural >> 3, v = natural & 7;
+          divisors[t][v * 8 + u] = (float)( 1.0 / ( q * aan_scale[u] * aan_scale[v] * 8 ) );
+        }
+      }
+    }
+
+    // the typical huffman tables from the JPEG spec (Annex K.3).
+    void make_huffman_tables() {
+      static const uint8_t dc_luma_codes[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+      static const uint8_t dc_chroma_codes[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+      static const uint8_t dc_values[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+      static const uint8_t ac_luma_codes[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+      static const uint8_t ac_luma_values[162] = {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+        0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+        0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa,
+      };
+
+      static const uint8_t ac_chroma_codes[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+      static const uint8_t ac_chroma_values[162] = {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+        0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa,
+      };
+
+      dc_tables[0].build(dc_luma_codes, dc_values);
+      dc_tables[1].build(dc_chroma_codes, dc_values);
+      ac_tables[0].build(ac_luma_codes, ac_luma_values);
+      ac_tables[1].build(ac_chroma_codes, ac_chroma_values);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Colour conversion
+    //
+    // See http://en.wikipedia.org/wiki/YCbCr
+    // Fixed point with 14 bits of fraction so that the SSE2 version can use 16 bit multiplies.
+    // The scalar version gives the same results as the SSE2 version.
+    //
+
+    enum {
+      y_r = 4899, y_g = 9617, y_b = 1868,
+      cb_r = -2765, cb_g = -5427, cb_b = 8192,
+      cr_r = 8192, cr_g = -6860, cr_b = -1332,
+      y_bias = 1 << 13,
+      c_bias = (128 << 14) + (1 << 13) - 1,
+    };
+
+    #if OCTET_SSE2
+      // r * cr + g * cg + b * cb for four RGBA pixels, 32 bits each.
+      static __m128i dot4(__m128i lo, __m128i hi, __m128i coeffs) {
+        __m128 a = _mm_castsi128_ps(_mm_madd_epi16(lo, coeffs));
+        __m128 b = _mm_castsi128_ps(_mm_madd_epi16(hi, coeffs));
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        return _mm_add_epi32(even, odd);
+      }
+    #endif
+
+    // convert a line of pixels to Y, Cb and Cr, repeating the last pixel up to padded_width.
+    void convert_line(uint8_t *y, uint8_t *cb, uint8_t *cr, const uint8_t *line, unsigned padded_width) const {
+      unsigned i = 0;
+      if (bytes_per_pixel == 1) {
+        memcpy(y, line, width);
+        i = width;
+      } else {
+        #if OCTET_SSE2
+          if (bytes_per_pixel == 4) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i ky = _mm_setr_epi16(y_r, y_g, y_b, 0, y_r, y_g, y_b, 0);
+            const __m128i kcb = _mm_setr_epi16(cb_r, cb_g, cb_b, 0, cb_r, cb_g, cb_b, 0);
+            const __m128i kcr = _mm_setr_epi16(cr_r, cr_g, cr_b, 0, cr_r, cr_g, cr_b, 0);
+            const __m128i ybias = _mm_set1_epi32(y_bias);
+            const __m128i cbias = _mm_set1_epi32(c_bias);
+            for (; i + 8 <= width; i += 8) {
+              __m128i p0 = _mm_loadu_si128((const __m128i*)(line + i * 4));
+              __m128i p1 = _mm_loadu_si128((const __m128i*)(line + i * 4 + 16));
+              __m128i a = _mm_unpacklo_epi8(p0, zero), b = _mm_unpackhi_epi8(p0, zero);
+              __m128i c = _mm_unpacklo_epi8(p1, zero), d = _mm_unpackhi_epi8(p1, zero);
+              __m128i y0 = _mm_srai_epi32(_mm_add_epi32(dot4(a, b, ky), ybias), 14);
+              __m128i y1 = _mm_srai_epi32(_mm_add_epi32(dot4(c, d, ky), ybias), 14);
+              __m128i cb0 = _mm_srai_epi32(_mm_add_epi32(dot4(a, b, kcb), cbias), 14);
+              __m128i cb1 = _mm_srai_epi32(_mm_add_epi32(dot4(c, d, kcb), cbias), 14);
+              __m128i cr0 = _mm_srai_epi32(_mm_add_epi32(dot4(a, b, kcr), cbias), 14);
+              __m128i cr1 = _mm_srai_epi32(_mm_add_epi32(dot4(c, d, kcr), cbias), 14);
+              __m128i ys = _mm_packs_epi32(y0, y1), cbs = _mm_packs_epi32(cb0, cb1), crs = _mm_packs_epi32(cr0, cr1);
+              _mm_storel_epi64((__m128i*)(y + i), _mm_packus_epi16(ys, ys));
+              _mm_storel_epi64((__m128i*)(cb + i), _mm_packus_epi16(cbs, cbs));
+              _mm_storel_epi64((__m128i*)(cr + i), _mm_packus_epi16(crs, crs));
+            }
+          }
+        #endif
+        for (; i != width; ++i) {
+          const uint8_t *p = line + i * bytes_per_pixel;
+          int r = p[0], g = p[1], b = p[2];
+          y[i] = (uint8_t)( ( y_r * r + y_g * g + y_b * b + y_bias ) >> 14 );
+          cb[i] = (uint8_t)( ( cb_r * r + cb_g * g + cb_b * b + c_bias ) >> 14 );
+          cr[i] = (uint8_t)( ( cr_r * r + cr_g * g + cr_b * b + c_bias ) >> 14 );
+        }
+      }
+
+      for (; i < padded_width; ++i) {
+        y[i] = y[i - 1];
+        cb[i] = cb[i - 1];
+        cr[i] = cr[i - 1];
+      }
+    }
+
+    // average 2x1 or 2x2 samples like libjpeg with alternating rounding.
+    // count is a multiple of eight.
+    static void downsample(uint8_t *dest, const uint8_t *src, unsigned src_stride, unsigned count, unsigned rows) {
+      const uint8_t *next = src + src_stride;
+      unsigned i = 0;
+      #if OCTET_SSE2
+        const __m128i low_bytes = _mm_set1_epi16(0xff);
+        const __m128i bias = rows == 1 ? _mm_setr_epi16(0, 1, 0, 1, 0, 1, 0, 1) : _mm_setr_epi16(1, 2, 1, 2, 1, 2, 1, 2);
+        for (; i != count; i += 8) {
+          __m128i a = _mm_loadu_si128((const __m128i*)(src + i * 2));
+          __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, low_bytes), _mm_srli_epi16(a, 8)), bias);
+          if (rows == 1) {
+            sum = _mm_srli_epi16(sum, 1);
+          } else {
+            __m128i b = _mm_loadu_si128((const __m128i*)(next + i * 2));
+            sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_and_si128(b, low_bytes), _mm_srli_epi16(b, 8)));
+            sum = _mm_srli_epi16(sum, 2);
+          }
+          _mm_storel_epi64((__m128i*)(dest + i), _mm_packus_epi16(sum, sum));
+        }
+      #endif
+      for (; i != count; ++i) {
+        if (rows == 1) {
+          dest[i] = (uint8_t)( ( src[i*2] + src[i*2+1] + (i & 1) ) >> 1 );
+        } else {
+          dest[i] = (uint8_t)( ( src[i*2] + src[i*2+1] + next[i*2] + next[i*2+1] + 1 + (i & 1) ) >> 2 );
+        }
+      }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Forward DCT
+    //
+    // This is the floating point AAN (Arai, Agui and Nakajima) transform which needs only five
+    // multiplies per eight samples. The missing multiplies are in the divisors we quantise with.
+    //
+    // With SSE we do four columns at once. The output has rows and columns swapped, which we
+    // allow for in the divisors and the zig-zag order.
+    //
+
+    #if OCTET_SSE2
+      static __m128 fdct_add(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+      static __m128 fdct_sub(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+      static __m128 fdct_mul(__m128 a, float b) { return _mm_mul_ps(a, _mm_set1_ps(b)); }
+    #endif
+
+    static float fdct_add(float a, float b) { return a + b; }
+    static float fdct_sub(float a, float b) { return a - b; }
+    static float fdct_mul(float a, float b) { return a * b; }
+
+    // one dimensional forward DCT.
+    // example: 1, 1, 1, 1, 1, 1, 1, 1 -> 8, 0, 0, 0, 0, 0, 0, 0
+    template <class value> static void fdct_1d(value *v) {
+      value tmp0 = fdct_add(v[0], v[7]);
+      value tmp7 = fdct_sub(v[0], v[7]);
+      value tmp1 = fdct_add(v[1], v[6]);
+      value tmp6 = fdct_sub(v[1], v[6]);
+      value tmp2 = fdct_add(v[2], v[5]);
+      value tmp5 = fdct_sub(v[2], v[5]);
+      value tmp3 = fdct_add(v[3], v[4]);
+      value tmp4 = fdct_sub(v[3], v[4]);
+
+      // even part
+      value tmp10 = fdct_add(tmp0, tmp3);
+      value tmp13 = fdct_sub(tmp0, tmp3);
+      value tmp11 = fdct_add(tmp1, tmp2);
+      value tmp12 = fdct_sub(tmp1, tmp2);
+
+      v[0] = fdct_add(tmp10, tmp11);
+      v[4] = fdct_sub(tmp10, tmp11);
+
+      value z1 = fdct_mul(fdct_add(tmp12, tmp13), 0.707106781f);
+      v[2] = fdct_add(tmp13, z1);
+      v[6] = fdct_sub(tmp13, z1);
+
+      // odd part
+      value o10 = fdct_add(tmp4, tmp5);
+      value o11 = fdct_add(tmp5, tmp6);
+      value o12 = fdct_add(tmp6, tmp7);
+
+      value z5 = fdct_mul(fdct_sub(o10, o12), 0.382683433f);
+      value z2 = fdct_add(fdct_mul(o10, 0.541196100f), z5);
+      value z4 = fdct_add(fdct_mul(o12, 1.306562965f), z5);
+      value z3 = fdct_mul(o11, 0.707106781f);
+
+      value z11 = fdct_add(tmp7, z3);
+      value z13 = fdct_sub(tmp7, z3);
+
+      v[5] = fdct_add(z13, z2);
+      v[3] = fdct_sub(z13, z2);
+      v[1] = fdct_add(z11, z4);
+      v[7] = fdct_sub(z11, z4);
+    }
+
+    // forward DCT and quantise an 8x8 block of samples.
+    // the result is in zig-zag order with a bit set in the return value for each non-zero coefficient.
+    static uint64_t fdct_block(int16_t *zz, const uint8_t *src, unsigned stride, const float *divisor) {
+      int16_t result[64];
+
+      #if OCTET_SSE2
+        // v[row * 2 + half]: four columns of a row.
+        __m128 v[16];
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i bias = _mm_set1_epi16(128);
+        for (unsigned i = 0; i != 8; ++i) {
+          __m128i s = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + i * stride)), zero), bias);
+          v[i*2+0] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+          v[i*2+1] = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+        }
+
+        for (unsigned pass = 0; pass != 2; ++pass) {
+          for (unsigned half = 0; half != 2; ++half) {
+            __m128 col[8];
+            for (unsigned i = 0; i != 8; ++i) col[i] = v[i*2+half];
+            fdct_1d(col);
+            for (unsigned i = 0; i != 8; ++i) v[i*2+half] = col[i];
+          }
+
+          if (pass == 0) {
+            // swap rows and columns as four 4x4 transposes, swapping the top right and bottom left.
+            _MM_TRANSPOSE4_PS(v[0], v[2], v[4], v[6]);
+            _MM_TRANSPOSE4_PS(v[1], v[3], v[5], v[7]);
+            _MM_TRANSPOSE4_PS(v[8], v[10], v[12], v[14]);
+            _MM_TRANSPOSE4_PS(v[9], v[11], v[13], v[15]);
+            for (unsigned i = 0; i != 4; ++i) {
+              __m128 t = v[i*2+1];
+              v[i*2+1] = v[i*2+8];
+              v[i*2+8] = t;
+            }
+          }
+        }
+
+        // quantise with rounding and keep the AC coefficients in 10 bits.
+        const __m128i max_coeff = _mm_set1_epi16(1023);
+        const __m128i min_coeff = _mm_set1_epi16(-1023);
+        for (unsigned i = 0; i != 8; ++i) {
+          __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(v[i*2+0], _mm_loadu_ps(divisor + i * 8)));
+          __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(v[i*2+1], _mm_loadu_ps(divisor + i * 8 + 4)));
+          __m128i q = _mm_max_epi16(_mm_min_epi16(_mm_packs_epi32(lo, hi), max_coeff), min_coeff);
+          _mm_storeu_si128((__m128i*)(result + i * 8), q);
+        }
+      #else
+        float tmp[64];
+        for (unsigned j = 0; j != 8; ++j) {
+          for (unsigned i = 0; i != 8; ++i) {
+            tmp[j * 8 + i] = (float)(src[j * stride + i] - 128);
+          }
+        }
+        for (unsigned i = 0; i != 8; ++i) {
+          float col[8];
+          for (unsigned j = 0; j != 8; ++j) col[j] = tmp[j * 8 + i];
+          fdct_1d(col);
+          for (unsigned j = 0; j != 8; ++j) tmp[j * 8 + i] = col[j];
+        }
+        for (unsigned j = 0; j != 8; ++j) {
+          fdct_1d(tmp + j * 8);
+        }
+        for (unsigned j = 0; j != 8; ++j) {
+          for (unsigned i = 0; i != 8; ++i) {
+            long q = lrintf(tmp[j * 8 + i] * divisor[i * 8 + j]);
+            result[i * 8 + j] = (int16_t)( q < -1023 ? -1023 : q > 1023 ? 1023 : q );
+          }
+        }
+      #endif
+
+      // reorder the transposed coefficients.
+      const uint8_t *order = zig_zag();
+      for (unsigned k = 0; k != 64; ++k) {
+        unsigned n = order[k];
+        zz[k] = result[(n & 7) * 8 + (n >> 3)];
+      }
+
+      #if OCTET_SSE2
+        uint64_t mask = 0;
+        for (unsigned k = 0; k != 64; k += 16) {
+          __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(zz + k)), zero);
+          __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(zz + k + 8)), zero);
+          mask |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << k;
+        }
+        return ~mask;
+      #else
+        uint64_t mask = 0;
+        for (unsigned k = 0; k != 64; ++k) {
+          mask |= (uint64_t)(zz[k] != 0) << k;
+        }
+        return mask;
+      #endif
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Huffman coding
+    //
+
+    // index of the lowest set bit; mask must not be zero.
+    static unsigned first_bit(uint64_t mask) {
+      uint32_t lo = (uint32_t)mask;
+      #if defined(_MSC_VER)
+        unsigned long index;
+        if (lo) {
+          _BitScanForward(&index, lo);
+          return (unsigned)index;
+        }
+        _BitScanForward(&index, (uint32_t)(mask >> 32));
+        return (unsigned)index + 32;
+      #else
+        return lo ? (unsigned)__builtin_ctz(lo) : (unsigned)__builtin_ctz((uint32_t)(mask >> 32)) + 32;
+      #endif
+    }
+
+    // number of bits needed for a value 1..65535.
+    static unsigned bit_length(unsigned value) {
+      #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse(&index, value);
+        return (unsigned)index + 1;
+      #else
+        return 32 - (unsigned)__builtin_clz(value);
+      #endif
+    }
+
+    // write the huffman code for a bit length and then the bits of the value.
+    // negative values are written as value - 1.
+    static void put_value(bit_writer &bw, const huffman_table &h, unsigned run, int value) {
+      unsigned mag = value < 0 ? -value : value;
+      unsigned len = mag ? bit_length(mag) : 0;
+      unsigned symbol = run << 4 | len;
+      unsigned bits = (unsigned)(value < 0 ? value - 1 : value) & ( ( 1u << len ) - 1 );
+      bw.put((unsigned)h.code[symbol] << len | bits, h.size[symbol] + len);
+    }
+
+    // huffman code one block, skipping the zeros with the mask.
+    static void encode_block(bit_writer &bw, const int16_t *zz, uint64_t mask, int &last_dc, const huffman_table &dc, const huffman_table &ac) {
+      put_value(bw, dc, 0, zz[0] - last_dc);
+      last_dc = zz[0];
+
+      unsigned last = 0;
+      for (mask &= ~(uint64_t)1; mask; mask &= mask - 1) {
+        unsigned k = first_bit(mask);
+        unsigned run = k - last - 1;
+        while (run >= 16) {
+          // sixteen zeros
+          bw.put(ac.code[0xf0], ac.size[0xf0]);
+          run -= 16;
+        }
+        put_value(bw, ac, run, zz[k]);
+        last = k;
+      }
+
+      if (last != 63) {
+        // end of block
+        bw.put(ac.code[0x00], ac.size[0x00]);
+      }
+    }
+
+    // encode rows of MCUs from row to row_end.
+    void encode_rows(dynarray<uint8_t> &out, unsigned row, unsigned row_end) const {
+      unsigned mcu_width = hsamp * 8;
+      unsigned mcu_height = vsamp * 8;
+      unsigned padded_width = mcus_x * mcu_width;
+      unsigned chroma_width = mcus_x * 8;
+
+      // a row of MCUs of full resolution Y, Cb and Cr and the subsampled Cb and Cr.
+      dynarray<uint8_t> planes(padded_width * mcu_height * 3 + chroma_width * 8 * 2);
+      uint8_t *y_plane = planes.data();
+      uint8_t *cb_plane = y_plane + padded_width * mcu_height;
+      uint8_t *cr_plane = cb_plane + padded_width * mcu_height;
+      uint8_t *cb_small = cr_plane + padded_width * mcu_height;
+      uint8_t *cr_small = cb_small + chroma_width * 8;
+
+      // chroma blocks come from the subsampled planes or straight from the full planes.
+      bool subsampled = num_components == 3 && (hsamp != 1 || vsamp != 1);
+      const uint8_t *cb_blocks = subsampled ? cb_small : cb_plane;
+      const uint8_t *cr_blocks = subsampled ? cr_small : cr_plane;
+
+      // a guess of two bits a pixel. The buffer grows if we need more.
+      bit_writer bw;
+      bw.init(out, (size_t)(row_end - row) * mcus_x * mcu_width * mcu_height / 4 + max_block_bytes);
+      int last_dc[3] = { 0, 0, 0 };
+      int16_t zz[64];
+
+      for (; row != row_end; ++row) {
+        for (unsigned j = 0; j != mcu_height; ++j) {
+          // repeat the last line of the image to fill the last row of MCUs.
+          unsigned y = row * mcu_height + j;
+          y = y < height ? y : height - 1;
+          unsigned offset = padded_width * j;
+          convert_line(y_plane + offset, cb_plane + offset, cr_plane + offset, src + (ptrdiff_t)y * stride, padded_width);
+        }
+
+        if (subsampled) {
+          for (unsigned j = 0; j != 8; ++j) {
+            unsigned offset = padded_width * j * vsamp;
+            downsample(cb_small + chroma_width * j, cb_plane + offset, padded_width, chroma_width, vsamp);
+            downsample(cr_small + chroma_width * j, cr_plane + offset, padded_width, chroma_width, vsamp);
+          }
+        }
+
+        for (unsigned x = 0; x != mcus_x; ++x) {
+          for (unsigned v = 0; v != vsamp; ++v) {
+            for (unsigned h = 0; h != hsamp; ++h) {
+              bw.reserve();
+              const uint8_t *block = y_plane + v * 8 * padded_width + x * mcu_width + h * 8;
+              uint64_t mask = fdct_block(zz, block, padded_width, divisors[0]);
+              encode_block(bw, zz, mask, last_dc[0], dc_tables[0], ac_tables[0]);
+            }
+          }
+
+          if (num_components == 3) {
+            bw.reserve();
+            uint64_t mask = fdct_block(zz, cb_blocks + x * 8, chroma_width, divisors[1]);
+            encode_block(bw, zz, mask, last_dc[1], dc_tables[1], ac_tables[1]);
+            bw.reserve();
+            mask = fdct_block(zz, cr_blocks + x * 8, chroma_width, divisors[1]);
+            encode_block(bw, zz, mask, last_dc[2], dc_tables[1], ac_tables[1]);
+          }
+        }
+      }
+      bw.flush();
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Chunks
+    //
+
+    static void put_u2(dynarray<uint8_t> &data, unsigned value) {
+      data.push_back((uint8_t)(value >> 8));
+      data.push_back((uint8_t)value);
+    }
+
+    static void put_marker(dynarray<uint8_t> &data, unsigned marker, unsigned length) {
+      data.push_back(0xff);
+      data.push_back((uint8_t)marker);
+      if (length) put_u2(data, length);
+    }
+
+    void write_headers(dynarray<uint8_t> &data, unsigned restart_interval) const {
+      static const uint8_t jfif[] = {
+        'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+      };
+
+      put_marker(data, 0xd8, 0); // SOI
+      put_marker(data, 0xe0, 2 + sizeof(jfif)); // APP0
+      for (unsigned i = 0; i != sizeof(jfif); ++i) data.push_back(jfif[i]);
+
+      // DQT: one table for Y and one for Cb and Cr
+      unsigned num_tables = num_components == 3 ? 2 : 1;
+      for (unsigned t = 0; t != num_tables; ++t) {
+        put_marker(data, 0xdb, 2 + 65);
+        data.push_back((uint8_t)t);
+        for (unsigned k = 0; k != 64; ++k) data.push_back(quant_tables[t][k]);
+      }
+
+      // SOF0: baseline
+      put_marker(data, 0xc0, 8 + num_components * 3);
+      data.push_back(8);
+      put_u2(data, height);
+      put_u2(data, width);
+      data.push_back((uint8_t)num_components);
+      for (unsigned i = 0; i != num_components; ++i) {
+        data.push_back((uint8_t)(i + 1));
+        data.push_back((uint8_t)(i ? 0x11 : hsamp << 4 | vsamp));
+        data.push_back((uint8_t)(i ? 1 : 0));
+      }
+
+      // DHT
+      for (unsigned t = 0; t != num_tables; ++t) {
+        for (unsigned is_ac = 0; is_ac != 2; ++is_ac) {
+          const huffman_table &h = is_ac ? ac_tables[t] : dc_tables[t];
+          put_marker(data, 0xc4, 2 + 17 + h.num_values);
+          data.push_back((uint8_t)(is_ac << 4 | t));
+          for (unsigned i = 0; i != 16; ++i) data.push_back(h.num_codes[i]);
+          for (unsigned i = 0; i != h.num_values; ++i) data.push_back(h.values[i]);
+        }
+      }
+
+      // DRI
+      if (restart_interval) {
+        put_marker(data, 0xdd, 4);
+        put_u2(data, restart_interval);
+      }
+
+      // SOS: all the components in one scan
+      put_marker(data, 0xda, 6 + num_components * 2);
+      data.push_back((uint8_t)num_components);
+      for (unsigned i = 0; i != num_components; ++i) {
+        data.push_back((uint8_t)(i + 1));
+        data.push_back((uint8_t)(i ? 0x11 : 0x00));
+      }
+      data.push_back(0);
+      data.push_back(63);
+      data.push_back(0);
+    }
+
   public:
     jpeg_encoder() {
+      quality = 90;
+      chroma = subsample_420;
+      restart_rows = 1;
+      jobs = &job_pool::get_shared();
+      workers = NULL;
     }
 
-    bool encode(dynarray<uint8_t> data, uint32_t width, uint32_t height, int stride, const uint8_t *src) {
-      /*if ((height & 7) != 0 || (width & 7) != 0) {
+    /// Quality from 1 (smallest files) to 100 (best pictures). The default is 90.
+    void set_quality(int value) {
+      quality = value < 1 ? 1 : value > 100 ? 100 : value;
+    }
+
+    /// Resolution of the colour components. The default is 4:2:0.
+    void set_subsampling(subsampling value) {
+      chroma = value;
+    }
+
+    /// Put a restart marker after every n rows of MCUs (0 for none). The default is 1.
+    /// Each restart interval can be encoded on a different thread.
+    void set_restart_rows(unsigned value) {
+      restart_rows = value;
+    }
+
+    /// Use these threads for large images. The default is job_pool::get_shared(); NULL encodes on the calling thread.
+    void set_job_pool(job_pool *value) {
+      jobs = value;
+    }
+
+    /// Add a JPEG file of an image to data.
+    /// src_ is the top line of the image and lines are stride_ bytes apart.
+    /// Use a negative stride for images that are bottom line first, like those from glReadPixels.
+    /// Pixels are RGBA (4 bytes, alpha is not used), RGB (3 bytes) or grey (1 byte).
+    bool encode(dynarray<uint8_t> &data, uint32_t width_, uint32_t height_, int stride_, const uint8_t *src_, unsigned bytes_per_pixel_ = 4) {
+      if (width_ == 0 || height_ == 0 || width_ > 65535 || height_ > 65535 || !src_) {
+        return false;
+      }
+      if (bytes_per_pixel_ != 1 && bytes_per_pixel_ != 3 && bytes_per_pixel_ != 4) {
         return false;
       }
 
-      // guess
-      data.reserve(width * height / 2);
-
-      static const uint8_t hdr[] = {
-        0xff, 0xd8, // SOI
-        0xff, 0xe0, 0x00, 0x10, // APP0
-          'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x01, 0x00, 0x48, 0x00, 0x48, 0x00, 0x00,
-
-        0xff, 0xdb, 0x00, 0x43, // DQT
-          0x00,
-          0x03, 0x02, 0x02, 0x03, 0x02, 0x02, 0x03, 0x03,
-          0x03, 0x03, 0x04, 0x03, 0x03, 0x04, 0x05, 0x08,
-          0x05, 0x05, 0x04, 0x04, 0x05, 0x0a, 0x07, 0x07,
-          0x06, 0x08, 0x0c, 0x0a, 0x0c, 0x0c, 0x0b, 0x0a,
-          0x0b, 0x0b, 0x0d, 0x0e, 0x12, 0x10, 0x0d, 0x0e,
-          0x11, 0x0e, 0x0b, 0x0b, 0x10, 0x16, 0x10, 0x11,
-          0x13, 0x14, 0x15, 0x15, 0x15, 0x0c, 0x0f, 0x17,
-          0x18, 0x16, 0x14, 0x18, 0x12, 0x14, 0x15, 0x14,
-        0xff, 0xdb, 0x00, 0x43, // DQT
-          0x01,
-          0x03, 0x04, 0x04, 0x05, 0x04, 0x05, 0x09, 0x05,
-          0x05, 0x09, 0x14, 0x0d, 0x0b, 0x0d, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-        0xff, 0xc0, 0x00, 0x11, // SOF0
-          0x08, 0x02, 0x00, 0x02, 0x00, 0x03, 0x01, 0x11, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
-        0xff, 0xc4, 0x00, 0x1e, // DHT
-          0x00, 0x01, 0x00, 0x03, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x06, 0x05, 0x07, 0x09, 0x08, 0x0a,
-        0xff, 0xc4, 0x00, 0x55, // DHT
-          0x10, 0x00, 0x02, 0x00, 0x03, 0x04, 0x05, 0x08, 0x06, 0x06, 0x04, 0x0b, 0x05, 0x07, 0x05, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x61, 0x07,
-          0x14, 0x53, 0x71, 0x81, 0x92, 0xb1, 0xf0, 0x08, 0x13, 0x34, 0x72, 0x91, 0xa1, 0x09, 0x22, 0x32,
-          0x42, 0xc1, 0xd1, 0x23, 0x52, 0xe1, 0xf1, 0x15, 0x16, 0x17, 0x36, 0x43, 0x62, 0x73, 0x82, 0x94,
-          0xb2, 0xd2, 0x24, 0x55, 0x63, 0xa3, 0xc2, 0x18, 0x33, 0x35, 0x64, 0x74, 0x93, 0xa2, 0x25, 0x44,
-          0x45, 0x54, 0x83,
-        0xff, 0xc4, 0x00, 0x1d, // DHT
-          0x01, 0x01, 0x01, 0x01, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
-        0xff, 0xc4, 0x00, 0x43, // DHT
-          0x11, 0x01, 0x00, 0x01, 0x02, 0x03, 0x05, 0x02, 0x0b, 0x06, 0x04, 0x05, 0x04, 0x03, 0x01, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x11, 0x03, 0x04, 0x31, 0x05, 0x12, 0x21, 0x32, 0x51, 0x06, 0x41, 0x07,
-          0x13, 0x14, 0x22, 0x61, 0x71, 0x81, 0x91, 0xa1, 0xb1, 0xd1, 0x15, 0x34, 0x42, 0x53, 0x72, 0xf0,
-          0x52, 0x62, 0xc1, 0xe1, 0x23, 0x82, 0x92, 0xa2, 0xc2, 0x24, 0x43, 0xb2, 0xd2, 0x33, 0x63, 0x73,
-          0x93,
-        0xff, 0xda, 0x00, 0x0c, // SOS
-          0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00, 0xfd, 0x7f, 
-      };*/
-      return 0;
+      src = src_;
+      stride = stride_;
+      bytes_per_pixel = bytes_per_pixel_;
+      width = width_;
+      height = height_;
+      num_components = bytes_per_pixel == 1 ? 1 : 3;
+      hsamp = num_components == 3 && chroma != subsample_444 ? 2 : 1;
+      vsamp = num_components == 3 && chroma == subsample_420 ? 2 : 1;
+      mcus_x = ( width + hsamp * 8 - 1 ) / ( hsamp * 8 );
+      mcus_y = ( height + vsamp * 8 - 1 ) / ( vsamp * 8 );
+
+      bool small = width * height < min_parallel_pixels;
+      workers = small || !jobs || jobs->get_num_threads() == 1 ? NULL : jobs;
+
+      make_quant_tables();
+      make_huffman_tables();
+
+      // the restart interval is in MCUs and must fit in 16 bits.
+      unsigned rows = restart_rows < mcus_y ? restart_rows : mcus_y;
+      if (rows * mcus_x > 65535) rows = 65535 / mcus_x;
+      unsigned num_intervals = rows ? ( mcus_y + rows - 1 ) / rows : 1;
+      write_headers(data, rows * mcus_x);
+
+      dynarray<dynarray<uint8_t> > intervals(num_intervals);
+      job_pool::run(workers, num_intervals, [&](unsigned i) {
+        unsigned row = rows * i;
+        encode_rows(intervals[i], row, num_intervals == 1 ? mcus_y : row + rows < mcus_y ? row + rows : mcus_y);
+      });
+
+      for (unsigned i = 0; i != num_intervals; ++i) {
+        data.append(intervals[i]);
+        if (i + 1 != num_intervals) {
+          put_marker(data, 0xd0 + (i & 7), 0); // RSTn
+        }
+      }
+      put_marker(data, 0xd9, 0); // EOI
+      return true;
     }
   };
 }}
-
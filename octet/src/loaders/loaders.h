@@ -31,6 +31,7 @@
   #include "../loaders/gif_decoder.h"
   #include "../loaders/jpeg_decoder.h"
   #include "../loaders/jpeg_encoder.h"
+  #include "../loaders/dxt_encoder.h"
   #include "../loaders/tga_decoder.h"
   #include "../loaders/dds_decoder.h"
   #include "../loaders/nifti_decoder.h"
@@ -6,247 +6,691 @@
 //
 // load an OBJ file.
 //
+// The file is cut into chunks at line ends and the chunks are parsed on all cores.
+// Each chunk shares the corners (v/vt/vn) of its faces with a small hash table as it goes,
+// so big files turn into indices and a few unique corners straight away.
+// Afterwards the corners of each object and material are merged into an indexed mesh.
+//
 namespace octet { namespace loaders {
   /// Class for loading OBJ files.
+  ///
+  /// Faces with more than three corners are split into fans.
+  /// Corners with the same position, uv and normal share a vertex and meshes have 32 bit indices.
+  /// There is one mesh for each object ("o") and material ("usemtl") and
+  /// materials come from the colours and diffuse textures in the "mtllib" files.
+  ///
+  /// Example:
+  ///
+  ///     obj_loader loader;
+  ///     loader.load("assets/bunny.obj", app_scene->get_resource_dict(), app_scene);
   class obj_loader {
-  public:
-    obj_loader() {
+    enum {
+      // bytes of file in each chunk
+      chunk_bytes = 1 << 22,
+
+      // missing uv or normal
+      no_index = 0xffffffff,
+
+      // negative indices count back from the end of the chunk's vertices so far.
+      // we know where the chunk's vertices start once all the chunks are parsed.
+      relative_flag = 0x80000000,
+      relative_bias = 0x40000000,
+
+      // indices too big to represent; resolve_index counts these as bad.
+      bad_index = relative_flag - 1,
+    };
+
+    // position, uv and normal index of a face corner.
+    struct corner {
+      uint32_t v;
+      uint32_t vt;
+      uint32_t vn;
+
+      bool operator==(const corner &rhs) const {
+        return v == rhs.v && vt == rhs.vt && vn == rhs.vn;
+      }
+    };
+
+    // faces in a chunk with the same object and material.
+    struct segment {
+      unsigned object;            // number of "o" lines before it in the chunk
+      int material;               // index in chunk::material_names or -1 for the material from the chunk before
+      dynarray<corner> corners;   // unique corners
+      dynarray<uint32_t> indices; // three per triangle
+    };
+
+    // a part of the file parsed by one thread.
+    struct chunk {
+      const uint8_t *begin;
+      const uint8_t *end;
+      dynarray<vec3p> positions;
+      dynarray<vec2p> uvs;
+      dynarray<vec3p> normals;
+      dynarray<segment> segments;
+      dynarray<string> object_names;
+      dynarray<string> material_names;
+      dynarray<string> mtllibs;
+      int last_material;
+      uint32_t base[3];
+      unsigned num_bad_indices;
+    };
+
+    // all the segments that make one mesh.
+    struct mesh_group {
+      unsigned object;
+      unsigned material;
+      dynarray<segment*> segments;
+      dynarray<mesh::vertex> vertices;
+      dynarray<uint32_t> indices;
+    };
+
+    // threads to parse with (NULL for the calling thread)
+    job_pool *jobs;
+
+    // set by load()
+    string path;
+    dynarray<vec3p> positions;
+    dynarray<vec2p> uvs;
+    dynarray<vec3p> normals;
+    dictionary<unsigned> material_index;
+    dynarray<ref<material> > materials;
+
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Parsing
+    //
+
+    static bool is_space(uint8_t c) {
+      return c == ' ' || c == '\t' || c == '\r';
     }
 
-    /// Load an OBJ file
-    /// http://en.wikipedia.org/wiki/Wavefront_.obj_file
-    bool load(const char *url, resource_dict &dict, visual_scene *scene) {
-      dynarray<uint8_t> file;
-      app_utils::get_url(file, url);
-      if (file.size() == 0) return false;
+    static const uint8_t *skip_space(const uint8_t *src, const uint8_t *end) {
+      while (src != end && is_space(*src)) ++src;
+      return src;
+    }
 
-      const uint8_t *eof = file.data() + file.size();
-      this->dict = &dict;
-      material_index = 0;
-      
-      for (const uint8_t *src = file.data(); src != eof; ) {
-        while (*src == ' ' && src != eof) ++src;
-        const uint8_t *begin = src;
-        while (*src != '\n' && *src != '\r' && src != eof) ++src;
-        const uint8_t *end = src;
-        src += src != eof && *src == '\r';
-        src += src != eof && *src == '\n';
-        if (begin != end ) switch (begin[0]) {
-          case '#': {
-            fwrite(begin, 1, end-begin, stdout);
-          } break;
-          case 'o': {
-            flush();
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') obj_name.assign((const char*)begin + 2, (const char*)end);
-            node = new scene_node(mat4t(), atom_);
-          } break;
-          case 'g': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') group_name.assign((const char*)begin + 2, (const char*)end);
-          } break;
+    // parse a float, the slow way.
+    static const uint8_t *parse_float_slow(float &result, const uint8_t *src, const uint8_t *end) {
+      const uint8_t *token_end = src;
+      while (token_end != end && !is_space(*token_end) && *token_end != '\n') ++token_end;
+      char tmp[64];
+      size_t len = token_end - src < (ptrdiff_t)sizeof(tmp) - 1 ? token_end - src : sizeof(tmp) - 1;
+      memcpy(tmp, src, len);
+      tmp[len] = 0;
+      result = strtof(tmp, NULL);
+      return token_end;
+    }
+
+    // Parse a float, correctly rounded like strtof.
+    // Numbers with up to 15 or so digits and small exponents, which is nearly all of them in OBJ files,
+    // are one exact double multiply or divide (Clinger's fast path). The rest use strtof.
+    static const uint8_t *parse_float(float &result, const uint8_t *src, const uint8_t *end) {
+      static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+      };
+
+      const uint8_t *p = src;
+      bool negative = p != end && *p == '-';
+      p += p != end && (*p == '-' || *p == '+');
+
+      uint64_t mantissa = 0;
+      int digits = 0, exponent = 0;
+      const uint8_t *first_digit = p;
+      for (; p != end && (unsigned)(*p - '0') < 10; ++p) {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits += mantissa != 0;
+      }
+      bool any_digits = p != first_digit;
+      if (p != end && *p == '.') {
+        const uint8_t *frac = ++p;
+        for (; p != end && (unsigned)(*p - '0') < 10; ++p) {
+          mantissa = mantissa * 10 + (*p - '0');
+          digits += mantissa != 0;
+        }
+        exponent = (int)(frac - p);
+        any_digits = any_digits || p != frac;
+      }
+      if (!any_digits) {
+        return parse_float_slow(result, src, end);
+      }
+      if (p != end && (*p == 'e' || *p == 'E')) {
+        const uint8_t *e = p + 1;
+        bool eneg = e != end && *e == '-';
+        e += e != end && (*e == '-' || *e == '+');
+        if (e == end || (unsigned)(*e - '0') >= 10) return parse_float_slow(result, src, end);
+        int value = 0;
+        for (; e != end && (unsigned)(*e - '0') < 10; ++e) {
+          if (value < 10000) value = value * 10 + (*e - '0');
+        }
+        exponent += eneg ? -value : value;
+        p = e;
+      }
+
+      // 19 digits always fit in 64 bits; 2^53 fits in a double.
+      if (digits <= 19 && mantissa <= ((uint64_t)1 << 53) && exponent >= -22 && exponent <= 22) {
+        double d = (double)mantissa;
+        d = exponent < 0 ? d / powers[-exponent] : d * powers[exponent];
+
+        // the double is correctly rounded, so rounding it again to float is only wrong
+        // if it lands exactly half way between two floats.
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        if ((bits & 0x1fffffff) != 0x10000000 && (d == 0 || (d >= 1.17549435e-38 && d <= 3.40282347e+38))) {
+          result = negative ? -(float)d : (float)d;
+          return p;
+        }
+      }
+      return parse_float_slow(result, src, end);
+    }
+
+    // parse up to max_values floats on the rest of a line.
+    static unsigned parse_floats(float *values, unsigned max_values, const uint8_t *src, const uint8_t *end) {
+      unsigned num_values = 0;
+      for (src = skip_space(src, end); src != end && num_values != max_values; src = skip_space(src, end)) {
+        src = parse_float(values[num_values++], src, end);
+      }
+      return num_values;
+    }
+
+    // parse an integer, return 0 if there isn't one.
+    // significant digits past the tenth are dropped so that the value can't overflow.
+    static const uint8_t *parse_int(int64_t &result, const uint8_t *src, const uint8_t *end) {
+      bool negative = src != end && *src == '-';
+      src += negative;
+      int64_t value = 0;
+      for (; src != end && (unsigned)(*src - '0') < 10; ++src) {
+        if (value < 1000000000) value = value * 10 + (*src - '0');
+        else value = 10000000000LL;
+      }
+      result = negative ? -value : value;
+      return src;
+    }
+
+    // turn an OBJ index (1 is the first, -1 the last) into one of ours.
+    static uint32_t make_index(int64_t value, unsigned num_so_far) {
+      if (value > 0) return value <= bad_index ? (uint32_t)(value - 1) : (uint32_t)bad_index;
+      if (value == 0) return no_index;
+      int64_t relative = (int64_t)num_so_far + value;
+      if (relative < -(int64_t)relative_bias) return bad_index;
+      return relative_flag | (uint32_t)(relative + relative_bias);
+    }
+
+    // resolve relative indices once we know where a chunk's vertices start.
+    // chunks are resolved in parallel, so each one counts its own bad indices.
+    static uint32_t resolve_index(uint32_t index, uint32_t base, uint32_t size, unsigned &num_bad) {
+      if (index == no_index) return index;
+      if (index & relative_flag) {
+        index = base + (index & ~relative_flag) - relative_bias;
+      }
+      if (index >= size) {
+        num_bad++;
+        return no_index;
+      }
+      return index;
+    }
+
+    // hash table of unique corners: slots hold corner index + 1.
+    static unsigned corner_hash(const corner &c) {
+      return (c.v * 0x9E3779B1u) ^ (c.vt * 0x85EBCA77u) ^ (c.vn * 0xC2B2AE3Du);
+    }
+
+    static uint32_t find_corner(dynarray<uint32_t> &slots, dynarray<corner> &corners, const corner &c) {
+      // grow before every lookup so that there is always an empty slot, even in the middle of a big face.
+      grow_slots(slots, corners);
+      unsigned mask = slots.size() - 1;
+      for (unsigned i = (corner_hash(c) >> 7) & mask; ; i = (i + 1) & mask) {
+        uint32_t slot = slots[i];
+        if (slot == 0) {
+          corners.push_back(c);
+          slots[i] = corners.size();
+          return corners.size() - 1;
+        } else if (corners[slot-1] == c) {
+          return slot - 1;
+        }
+      }
+    }
+
+    // make the hash table bigger before it gets more than half full.
+    static void grow_slots(dynarray<uint32_t> &slots, const dynarray<corner> &corners) {
+      if (corners.size() * 2 < slots.size()) return;
+      unsigned size = slots.size() * 2;
+      slots.resize(size);
+      memset(slots.data(), 0, size * sizeof(uint32_t));
+      unsigned mask = size - 1;
+      for (unsigned j = 0; j != corners.size(); ++j) {
+        unsigned i = (corner_hash(corners[j]) >> 7) & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = j + 1;
+      }
+    }
+
+    // parse the lines of a chunk.
+    void parse_chunk(chunk &c) {
+      dynarray<corner> face;
+      dynarray<uint32_t> slots(1024);
+      segment *seg = 0;
+      unsigned object = 0;
+      int material = -1;
+
+      for (const uint8_t *src = c.begin; src != c.end; ) {
+        const uint8_t *line = skip_space(src, c.end);
+        const uint8_t *eol = (const uint8_t*)memchr(line, '\n', c.end - line);
+        eol = eol ? eol : c.end;
+        src = eol == c.end ? eol : eol + 1;
+        if (line == eol) continue;
+
+        switch (line[0]) {
           case 'v': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              atofv(values, begin+2, end);
-              if (values.size() == 3) {
-                src_vertices.push_back(vec3p(values[0], values[1], values[2]));
-              }
-            } else if (begin[1] == 't' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 2) {
-                src_uvs.push_back(vec2p(values[0], values[1]));
-              }
-            } else if (begin[1] == 'n' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 3) {
-                src_normals.push_back(vec3p(values[0], values[1], values[2]));
-              }
+            if (line + 1 == eol) break;
+            float values[3] = { 0, 0, 0 };
+            if (is_space(line[1])) {
+              parse_floats(values, 3, line + 1, eol);
+              c.positions.push_back(vec3p(values[0], values[1], values[2]));
+            } else if (line[1] == 't' && line + 2 != eol && is_space(line[2])) {
+              parse_floats(values, 2, line + 2, eol);
+              c.uvs.push_back(vec2p(values[0], values[1]));
+            } else if (line[1] == 'n' && line + 2 != eol && is_space(line[2])) {
+              parse_floats(values, 3, line + 2, eol);
+              c.normals.push_back(vec3p(values[0], values[1], values[2]));
             }
           } break;
           case 'f': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              unsigned slashes = 0;
-              mesh::vertex v[6];
-              atoiv(ivalues, slashes, begin + 2, end);
-              size_t num_values = ivalues.size() - slashes;
-              size_t num_comps = ivalues.size() / num_values;
-              size_t num_idx = ivalues.size() / num_comps;
-              if (num_idx > 4 || num_comps > 3) {
-                printf("warning: bad obj file face\n");
-                return false;
-              }
-              mesh::vertex vtx[4];
-              memset(vtx, 0, sizeof(vtx));
-              if (num_comps >= 1) {
-                size_t d = 0;
-                for (size_t i = 0; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].pos = src_vertices[iv < 0 ? src_vertices.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 2) {
-                size_t d = 0;
-                for (size_t i = 1; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].uv = src_uvs[iv < 0 ? src_uvs.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 3) {
-                size_t d = 0;
-                for (size_t i = 2; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].normal = src_normals[iv < 0 ? src_normals.size() + iv : iv];
+            if (line + 1 == eol || !is_space(line[1])) break;
+            face.resize(0);
+            for (const uint8_t *p = skip_space(line + 1, eol); p != eol; p = skip_space(p, eol)) {
+              int64_t v = 0, vt = 0, vn = 0;
+              p = parse_int(v, p, eol);
+              if (p != eol && *p == '/') {
+                p = parse_int(vt, p + 1, eol);
+                if (p != eol && *p == '/') {
+                  p = parse_int(vn, p + 1, eol);
                 }
               }
+              if (v == 0) break;
+              corner k = {
+                make_index(v, c.positions.size()),
+                make_index(vt, c.uvs.size()),
+                make_index(vn, c.normals.size())
+              };
+              face.push_back(k);
+            }
+            if (face.size() < 3) break;
 
-              face f;
-              f.vtx[0] = vtx[0];
-              f.vtx[1] = vtx[1];
-              f.vtx[2] = vtx[2];
-              f.material_index = material_index;
-              faces.push_back(f);
-              if (num_idx == 4) {
-                f.vtx[0] = vtx[0];
-                f.vtx[1] = vtx[2];
-                f.vtx[2] = vtx[3];
-                f.material_index = material_index;
-                faces.push_back(f);
+            if (!seg) {
+              if (c.segments.size() != 0 && c.segments.back().indices.size() == 0) {
+                c.segments.resize(c.segments.size() - 1);
               }
+              c.segments.resize(c.segments.size() + 1);
+              seg = &c.segments.back();
+              seg->object = object;
+              seg->material = material;
+              slots.resize(1024);
+              memset(slots.data(), 0, slots.size() * sizeof(uint32_t));
+            }
+
+            // fan out from the first corner.
+            uint32_t first = find_corner(slots, seg->corners, face[0]);
+            uint32_t prev = find_corner(slots, seg->corners, face[1]);
+            for (unsigned i = 2; i != face.size(); ++i) {
+              uint32_t next = find_corner(slots, seg->corners, face[i]);
+              seg->indices.push_back(first);
+              seg->indices.push_back(prev);
+              seg->indices.push_back(next);
+              prev = next;
             }
           } break;
-          default: {
-            fwrite(begin, 1, end-begin, stdout);
-            printf("unknown\n");
-            return false;
+          case 'o': {
+            if (line + 1 != eol && !is_space(line[1])) break;
+            const uint8_t *name = skip_space(line + 1, eol), *name_end = eol;
+            while (name_end != name && is_space(name_end[-1])) --name_end;
+            c.object_names.push_back(string((const char*)name, (unsigned)(name_end - name)));
+            object++;
+            seg = 0;
           } break;
-          case 'u': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin+7 < end && !memcmp(begin, "usemtl ", 7)) {
-              size_t len = end - (begin+7);
-              size_t i = 0;
-              for (; i != materials.size(); ++i) {
-                if (
-                  materials[i].size() == len &&
-                  !memcmp(materials[i].c_str(), begin+7, len)
-                ) {
-                  break;
-                }
-              }
-
-              if (i == materials.size()) {
-                materials.push_back(string((const char*)begin+7, (unsigned)len));
-              }
-
-              material_index = (uint32_t)i;
+          case 'u': case 'm': {
+            // usemtl and mtllib
+            bool use = eol - line > 7 && !memcmp(line, "usemtl", 6) && is_space(line[6]);
+            bool lib = eol - line > 7 && !memcmp(line, "mtllib", 6) && is_space(line[6]);
+            if (!use && !lib) break;
+            const uint8_t *name = skip_space(line + 7, eol), *name_end = eol;
+            while (name_end != name && is_space(name_end[-1])) --name_end;
+            string value((const char*)name, (unsigned)(name_end - name));
+            if (lib) {
+              c.mtllibs.push_back(value);
+            } else {
+              unsigned i = 0;
+              while (i != c.material_names.size() && strcmp(c.material_names[i], value)) ++i;
+              if (i == c.material_names.size()) c.material_names.push_back(value);
+              material = (int)i;
+              seg = 0;
             }
           } break;
+          default: {
+            // comments, groups, smoothing groups, lines and points.
+          } break;
         }
       }
-      flush();
 
-      return true;
+      if (c.segments.size() != 0 && c.segments.back().indices.size() == 0) {
+        c.segments.resize(c.segments.size() - 1);
+      }
+      c.last_material = material;
     }
-  private:
-    dynarray<vec3p> src_vertices;
-    dynarray<vec3p> src_normals;
-    dynarray<vec2p> src_uvs;
-    dynarray<uint32_t> src_material;
-    dynarray<string> materials;
 
-    string obj_name;
-    string group_name;
-    resource_dict *dict;
-    scene_node *node;
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Materials
+    //
 
-    struct face {
-      mesh::vertex vtx[3];
-      int material_index;
+    // get a material by name, making a grey one if we have not seen it.
+    unsigned get_material(const char *name) {
+      int index = material_index.get_index(name);
+      if (index >= 0) return material_index.get_value(index);
+      unsigned result = materials.size();
+      material_index[name] = result;
+      materials.push_back(new material(vec4(0.5f, 0.5f, 0.5f, 1)));
+      return result;
+    }
 
-      bool operator <(const face &rhs) {
-        return material_index < rhs.material_index;
-      }
-    };
+    // read newmtl, Kd, d and map_Kd from a .mtl file.
+    void load_mtllib(const char *name, resource_dict &dict) {
+      string url;
+      url.format("%s%s", path.c_str(), name);
+      byte_span file;
+      app_utils::get_url(file, url.c_str());
+      if (file.size() == 0) return;
 
-    dynarray<face> faces;
-    dynarray<uint32_t> indices;
-    dynarray<float> values;
-    dynarray<int> ivalues;
-    uint32_t material_index;
+      string mtl_name;
+      vec4 diffuse(0.5f, 0.5f, 0.5f, 1);
+      string texture;
 
-    // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, unsigned &slashes, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
-      slashes = 0;
+      // make the material we have been reading.
+      auto finish = [&]() {
+        if (mtl_name.size() == 0) return;
+        material *mat = NULL;
+        if (texture.size()) {
+          string image_url;
+          image_url.format("%s%s", path.c_str(), texture.c_str());
+          mat = new material(new image(image_url));
+        } else {
+          mat = new material(diffuse);
+        }
+        unsigned index = get_material(mtl_name);
+        materials[index] = mat;
+        dict.set_resource(mtl_name, mat);
+      };
+
+      for (const uint8_t *src = file.begin(); src != file.end(); ) {
+        const uint8_t *line = skip_space(src, file.end());
+        const uint8_t *eol = (const uint8_t*)memchr(line, '\n', file.end() - line);
+        eol = eol ? eol : file.end();
+        src = eol == file.end() ? eol : eol + 1;
 
-      while (src != end && *src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        int whole = 0, msign = 1;
-        if (src != end && *src == '-') { msign = -1; src++; }
-        while (src != end && *src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (src != end && *src > 0 && *src <= ' ') ++src;
-        if (src != end && *src == '/') { slashes++; src++; }
+        const uint8_t *word_end = line;
+        while (word_end != eol && !is_space(*word_end)) ++word_end;
+        const uint8_t *arg = skip_space(word_end, eol), *arg_end = eol;
+        while (arg_end != arg && is_space(arg_end[-1])) --arg_end;
+        string word((const char*)line, (unsigned)(word_end - line));
+
+        if (word == "newmtl") {
+          finish();
+          mtl_name.set((const char*)arg, (unsigned)(arg_end - arg));
+          diffuse = vec4(0.5f, 0.5f, 0.5f, 1);
+          texture = "";
+        } else if (word == "Kd") {
+          float values[3] = { 0, 0, 0 };
+          parse_floats(values, 3, arg, arg_end);
+          diffuse = vec4(values[0], values[1], values[2], diffuse.w());
+        } else if (word == "d") {
+          float value = 1;
+          parse_floats(&value, 1, arg, arg_end);
+          diffuse.w() = value;
+        } else if (word == "map_Kd") {
+          // the file name is the last thing on the line, after any options.
+          const uint8_t *file_name = arg_end;
+          while (file_name != arg && !is_space(file_name[-1])) --file_name;
+          texture.set((const char*)file_name, (unsigned)(arg_end - file_name));
+        }
       }
+      finish();
     }
 
-    void atofv(dynarray<float> &values, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
+    ////////////////////////////////////////////////////////////////////////////
+    //
+    // Meshes
+    //
+
+    // merge the segments of a mesh and make the vertices.
+    void build_group(mesh_group &g) {
+      unsigned num_corners = 0, num_indices = 0;
+      for (unsigned i = 0; i != g.segments.size(); ++i) {
+        num_corners += g.segments[i]->corners.size();
+        num_indices += g.segments[i]->indices.size();
+      }
+
+      unsigned num_slots = 1024;
+      while (num_slots < num_corners * 2) num_slots *= 2;
+      dynarray<uint32_t> slots(num_slots);
+      memset(slots.data(), 0, num_slots * sizeof(uint32_t));
+      dynarray<corner> corners;
+      corners.reserve(num_corners);
+      g.indices.resize(num_indices);
+
+      uint32_t *dest = g.indices.data();
+      dynarray<uint32_t> remap;
+      for (unsigned i = 0; i != g.segments.size(); ++i) {
+        segment &s = *g.segments[i];
+        remap.resize(s.corners.size());
+        for (unsigned j = 0; j != s.corners.size(); ++j) {
+          remap[j] = find_corner(slots, corners, s.corners[j]);
+        }
+        for (unsigned j = 0; j != s.indices.size(); ++j) {
+          *dest++ = remap[s.indices[j]];
+        }
+        s.corners.reset();
+        s.indices.reset();
+      }
+
+      bool missing_normals = false;
+      g.vertices.resize(corners.size());
+      for (unsigned i = 0; i != corners.size(); ++i) {
+        const corner &k = corners[i];
+        mesh::vertex &v = g.vertices[i];
+        v.pos = k.v != no_index ? positions[k.v] : vec3p(0, 0, 0);
+        v.uv = k.vt != no_index ? uvs[k.vt] : vec2p(0, 0);
+        v.normal = k.vn != no_index ? normals[k.vn] : vec3p(0, 0, 0);
+        missing_normals = missing_normals || k.vn == no_index;
+      }
 
-      while (*src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
+      if (missing_normals) {
+        // add up the face normals (weighted by area) of vertices without normals.
+        dynarray<vec3> sums(corners.size());
+        memset(sums.data(), 0, sums.size() * sizeof(vec3));
+        for (unsigned i = 0; i + 2 < g.indices.size(); i += 3) {
+          uint32_t i0 = g.indices[i], i1 = g.indices[i+1], i2 = g.indices[i+2];
+          vec3 p0 = g.vertices[i0].pos, p1 = g.vertices[i1].pos, p2 = g.vertices[i2].pos;
+          vec3 n = cross(p1 - p0, p2 - p0);
+          sums[i0] += n;
+          sums[i1] += n;
+          sums[i2] += n;
         }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
+        for (unsigned i = 0; i != corners.size(); ++i) {
+          if (corners[i].vn == no_index) {
+            float len = length(sums[i]);
+            g.vertices[i].normal = len > 0 ? sums[i] / len : vec3(0, 0, 1);
+          }
         }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
       }
     }
 
-    void flush() {
-      std::sort(faces.begin(), faces.end());
-      face *f = 0;
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, faces.size() * sizeof(f->vtx));
+  public:
+    obj_loader() {
+      jobs = &job_pool::get_shared();
+    }
+
+    /// Set the threads used to parse. The default is job_pool::get_shared(); NULL parses on the calling thread.
+    void set_job_pool(job_pool *value) {
+      jobs = value;
+    }
+
+    /// Load an OBJ file, adding a scene node for each object with a mesh instance for each material.
+    /// Meshes and materials go in the resource dictionary too.
+    /// http://en.wikipedia.org/wiki/Wavefront_.obj_file
+    bool load(const char *url, resource_dict &dict, visual_scene *scene) {
+      byte_span file;
+      app_utils::get_url(file, url);
+      if (file.size() == 0) return false;
+
+      path = url;
+      path.truncate(path.filename_pos());
 
-      {
-        gl_resource::wolock vl(vertices);
-        for (size_t i = 0; i != faces.size(); ++i) {
-          memcpy(vl.u8() + i * sizeof(f->vtx), faces[i].vtx, sizeof(f->vtx));
+      // cut the file into chunks at line ends.
+      dynarray<chunk> chunks;
+      for (const uint8_t *src = file.begin(); src != file.end(); ) {
+        const uint8_t *end = (size_t)(file.end() - src) <= chunk_bytes ? file.end() : src + chunk_bytes;
+        if (end != file.end()) {
+          const uint8_t *eol = (const uint8_t*)memchr(end, '\n', file.end() - end);
+          end = eol ? eol + 1 : file.end();
         }
+        chunks.resize(chunks.size() + 1);
+        chunks.back().begin = src;
+        chunks.back().end = end;
+        src = end;
       }
 
-      int prev_mi = -1;
-      for (size_t i = 0; i != faces.size(); ++i) {
-        if (faces[i].material_index != prev_mi) {
-          mesh *msh = new mesh();
-          msh->set_default_attributes();
-          msh->set_vertices(vertices);
-          material *mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
-          mesh_instance *mi = new mesh_instance(node, msh, mat);
+      job_pool::run(jobs, chunks.size(), [&](unsigned i) {
+        parse_chunk(chunks[i]);
+      });
+
+      // where each chunk's vertices start.
+      uint32_t totals[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        chunk &c = chunks[i];
+        c.base[0] = totals[0];
+        c.base[1] = totals[1];
+        c.base[2] = totals[2];
+        totals[0] += c.positions.size();
+        totals[1] += c.uvs.size();
+        totals[2] += c.normals.size();
+      }
+
+      positions.resize(totals[0]);
+      uvs.resize(totals[1]);
+      normals.resize(totals[2]);
+      job_pool::run(jobs, chunks.size(), [&](unsigned i) {
+        chunk &c = chunks[i];
+        if (c.positions.size()) memcpy(&positions[c.base[0]], c.positions.data(), c.positions.size() * sizeof(vec3p));
+        if (c.uvs.size()) memcpy(&uvs[c.base[1]], c.uvs.data(), c.uvs.size() * sizeof(vec2p));
+        if (c.normals.size()) memcpy(&normals[c.base[2]], c.normals.data(), c.normals.size() * sizeof(vec3p));
+        c.positions.reset();
+        c.uvs.reset();
+        c.normals.reset();
+      });
+
+      // materials, starting with a default one for faces before any usemtl.
+      material_index.reset();
+      materials.reset();
+      materials.push_back(new material(vec4(0.5f, 0.5f, 0.5f, 1)));
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        for (unsigned j = 0; j != chunks[i].mtllibs.size(); ++j) {
+          load_mtllib(chunks[i].mtllibs[j], dict);
         }
       }
 
-      faces.resize(0);
-      src_vertices.resize(0);
-      src_uvs.resize(0);
-      src_normals.resize(0);
+      // give the segments global object and material numbers and collect them into meshes.
+      dynarray<string> object_names;
+      object_names.push_back(string("obj"));
+      dynarray<mesh_group*> groups;
+      hash_map<uint64_t, unsigned> group_index;
+      unsigned current_material = 0;
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        chunk &c = chunks[i];
+        unsigned first_object = object_names.size() - 1;
+        for (unsigned j = 0; j != c.object_names.size(); ++j) {
+          object_names.push_back(c.object_names[j]);
+        }
+
+        dynarray<unsigned> materials_used(c.material_names.size());
+        for (unsigned j = 0; j != c.material_names.size(); ++j) {
+          materials_used[j] = get_material(c.material_names[j]);
+        }
+
+        for (unsigned j = 0; j != c.segments.size(); ++j) {
+          segment &s = c.segments[j];
+          unsigned object = first_object + s.object;
+          unsigned mat = s.material < 0 ? current_material : materials_used[s.material];
+          uint64_t key = (uint64_t)object << 32 | mat;
+          int index = group_index.get_index(key);
+          index = index < 0 ? -1 : (int)group_index.get_value(index);
+          if (index < 0) {
+            index = (int)groups.size();
+            group_index[key] = (unsigned)index;
+            groups.push_back(new mesh_group());
+            groups.back()->object = object;
+            groups.back()->material = mat;
+          }
+          groups[index]->segments.push_back(&s);
+        }
+        if (c.last_material >= 0) current_material = materials_used[c.last_material];
+      }
+
+      // fix up relative indices and merge the segments.
+      job_pool::run(jobs, chunks.size(), [&](unsigned i) {
+        chunk &c = chunks[i];
+        c.num_bad_indices = 0;
+        for (unsigned j = 0; j != c.segments.size(); ++j) {
+          dynarray<corner> &corners = c.segments[j].corners;
+          for (unsigned k = 0; k != corners.size(); ++k) {
+            corner &r = corners[k];
+            r.v = resolve_index(r.v, c.base[0], totals[0], c.num_bad_indices);
+            r.vt = resolve_index(r.vt, c.base[1], totals[1], c.num_bad_indices);
+            r.vn = resolve_index(r.vn, c.base[2], totals[2], c.num_bad_indices);
+          }
+        }
+      });
+
+      job_pool::run(jobs, groups.size(), [&](unsigned i) {
+        build_group(*groups[i]);
+      });
+
+      unsigned num_bad_indices = 0;
+      for (unsigned i = 0; i != chunks.size(); ++i) {
+        num_bad_indices += chunks[i].num_bad_indices;
+      }
+      if (num_bad_indices) {
+        printf("warning: obj file %s has %d bad indices\n", url, num_bad_indices);
+      }
+
+      // GL objects are made on this thread.
+      dynarray<scene_node*> nodes(object_names.size());
+      memset(nodes.data(), 0, nodes.size() * sizeof(scene_node*));
+      for (unsigned i = 0; i != groups.size(); ++i) {
+        mesh_group &g = *groups[i];
+        mesh *msh = new mesh();
+        msh->set_default_attributes();
+        msh->set_vertices(g.vertices);
+        msh->set_indices(g.indices);
+        msh->calc_aabb();
+
+        string name;
+        name.format("%s_%d", object_names[g.object].c_str(), g.material);
+        dict.set_resource(name, msh);
+
+        if (scene) {
+          if (!nodes[g.object]) {
+            nodes[g.object] = scene->add_scene_node();
+            dict.set_resource(object_names[g.object], nodes[g.object]);
+          }
+          scene->add_mesh_instance(new mesh_instance(nodes[g.object], msh, materials[g.material]));
+        }
+        delete groups[i];
+      }
+
+      positions.reset();
+      uvs.reset();
+      normals.reset();
+      return true;
     }
   };
 }}
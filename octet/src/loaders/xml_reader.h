@@ -0,0 +1,520 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// In-place XML reader for big files.
+//
+// TinyXML makes a heap object for every element, attribute and piece of text and copies
+// all the strings, so a big COLLADA file takes many times its size in memory.
+//
+// This reader maps the file copy on write and parses it where it is: names, attribute values
+// and text stay in the mapping and we write a zero after each one. Only pages with tags
+// on them get written (and copied), so the long runs of numbers in <float_array> and <p>
+// stay shared with the file cache.
+//
+// Elements and attributes go in two arrays that we size before parsing by counting
+// the '<' and '=' characters, so there is no allocation per element.
+//
+// The element functions have the same names as TinyXML's so that collada_builder can use either.
+// Unlike TinyXML, we do not squash runs of spaces inside text, only trim the ends.
+//
+
+namespace octet { namespace loaders {
+  /// In-place XML reader with the parts of the TinyXML interface that collada_builder uses.
+  ///
+  /// Example:
+  ///
+  ///     xml_reader doc;
+  ///     if (doc.LoadFile("big.dae")) {
+  ///       xml_reader::element *root = doc.RootElement();
+  ///       ...
+  ///     }
+  class xml_reader {
+  public:
+    /// name="value"
+    struct attribute {
+      const char *name;
+      const char *value;
+    };
+
+    /// An element of the document. Elements belong to the reader and go when it does.
+    class element {
+      friend class xml_reader;
+
+      const char *name;
+      const char *text;
+      const attribute *attributes;
+      unsigned num_attributes;
+      element *first_child;
+      element *next_sibling;
+      void *user_data;
+
+      element *find(element *elem, const char *value) const {
+        while (elem && value && strcmp(elem->name, value)) {
+          elem = elem->next_sibling;
+        }
+        return elem;
+      }
+
+    public:
+      element() {
+        name = "";
+        text = NULL;
+        attributes = NULL;
+        num_attributes = 0;
+        first_child = NULL;
+        next_sibling = NULL;
+        user_data = NULL;
+      }
+
+      /// Name of the element, eg. "float_array".
+      const char *Value() const {
+        return name;
+      }
+
+      /// Value of an attribute or NULL if there isn't one.
+      const char *Attribute(const char *attr_name) const {
+        for (unsigned i = 0; i != num_attributes; ++i) {
+          if (!strcmp(attributes[i].name, attr_name)) {
+            return attributes[i].value;
+          }
+        }
+        return NULL;
+      }
+
+      /// Text before the first child element (without spaces at the ends) or NULL if there isn't any.
+      const char *GetText() const {
+        return text;
+      }
+
+      /// First child element, or the first one with this name.
+      element *FirstChildElement(const char *value = NULL) const {
+        return find(first_child, value);
+      }
+
+      /// Next sibling element, or the next one with this name.
+      element *NextSiblingElement(const char *value = NULL) const {
+        return find(next_sibling, value);
+      }
+
+      void *GetUserData() const {
+        return user_data;
+      }
+
+      void SetUserData(void *value) {
+        user_data = value;
+      }
+
+      unsigned get_num_attributes() const {
+        return num_attributes;
+      }
+
+      const attribute &get_attribute(unsigned i) const {
+        return attributes[i];
+      }
+    };
+
+  private:
+    // keeps the mapped file alive
+    byte_span bytes;
+
+    // elements[0] is the document; the root element is its first child.
+    dynarray<element> elements;
+    dynarray<attribute> attributes;
+
+    // elements with an id attribute in document order
+    dynarray<element *> with_ids;
+
+    const char *error;
+    unsigned error_line;
+
+    static bool is_space(char c) {
+      return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    }
+
+    static bool is_name_end(char c) {
+      return is_space(c) || c == '/' || c == '>' || c == '=' || c == 0;
+    }
+
+    // count two characters in a buffer, sixteen bytes at a time if we can.
+    static void count_chars(const char *src, const char *end, char c1, size_t &n1, char c2, size_t &n2) {
+      n1 = n2 = 0;
+      #if OCTET_SSE2
+        __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2), zero = _mm_setzero_si128();
+        while (end - src >= 16) {
+          // count in bytes for up to 255 blocks, then add the bytes up.
+          __m128i acc1 = zero, acc2 = zero;
+          for (unsigned i = 0; i != 255 && end - src >= 16; ++i, src += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)src);
+            acc1 = _mm_sub_epi8(acc1, _mm_cmpeq_epi8(x, v1));
+            acc2 = _mm_sub_epi8(acc2, _mm_cmpeq_epi8(x, v2));
+          }
+          __m128i sum1 = _mm_sad_epu8(acc1, zero), sum2 = _mm_sad_epu8(acc2, zero);
+          n1 += (size_t)_mm_cvtsi128_si32(sum1) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sum1, 8));
+          n2 += (size_t)_mm_cvtsi128_si32(sum2) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sum2, 8));
+        }
+      #endif
+      for (; src != end; ++src) {
+        n1 += *src == c1;
+        n2 += *src == c2;
+      }
+    }
+
+    // find a string, return NULL if it is not there.
+    static char *find(char *src, char *end, const char *str) {
+      size_t len = strlen(str);
+      while (end - src >= (ptrdiff_t)len) {
+        char *p = (char*)memchr(src, str[0], end - src - len + 1);
+        if (!p) return NULL;
+        if (!memcmp(p, str, len)) return p;
+        src = p + 1;
+      }
+      return NULL;
+    }
+
+    // replace &amp; &lt; &gt; &quot; &apos; and &#nn; in place. returns the new end.
+    static char *decode_entities(char *src, char *end) {
+      char *dest = src;
+      while (src != end) {
+        if (*src != '&') {
+          *dest++ = *src++;
+          continue;
+        }
+        char *semi = (char*)memchr(src, ';', end - src);
+        size_t len = semi ? semi - src + 1 : 0;
+        unsigned code = 0;
+        if (len == 5 && !memcmp(src, "&amp;", 5)) code = '&';
+        else if (len == 4 && !memcmp(src, "&lt;", 4)) code = '<';
+        else if (len == 4 && !memcmp(src, "&gt;", 4)) code = '>';
+        else if (len == 6 && !memcmp(src, "&quot;", 6)) code = '"';
+        else if (len == 6 && !memcmp(src, "&apos;", 6)) code = '\'';
+        else if (len > 3 && src[1] == '#') {
+          code = src[2] == 'x' ? (unsigned)strtoul(src + 3, NULL, 16) : (unsigned)strtoul(src + 2, NULL, 10);
+        }
+
+        if (!code) {
+          // not an entity we know, leave it alone.
+          *dest++ = *src++;
+        } else {
+          // write as utf-8
+          if (code < 0x80) {
+            *dest++ = (char)code;
+          } else if (code < 0x800) {
+            *dest++ = (char)(0xc0 | (code >> 6));
+            *dest++ = (char)(0x80 | (code & 0x3f));
+          } else if (code < 0x10000) {
+            *dest++ = (char)(0xe0 | (code >> 12));
+            *dest++ = (char)(0x80 | ((code >> 6) & 0x3f));
+            *dest++ = (char)(0x80 | (code & 0x3f));
+          } else {
+            *dest++ = (char)(0xf0 | ((code >> 18) & 0x07));
+            *dest++ = (char)(0x80 | ((code >> 12) & 0x3f));
+            *dest++ = (char)(0x80 | ((code >> 6) & 0x3f));
+            *dest++ = (char)(0x80 | (code & 0x3f));
+          }
+          src += len;
+        }
+      }
+      return dest;
+    }
+
+    // make a zero terminated string of [src, end), decoding entities. end may be overwritten.
+    static void terminate(char *src, char *end) {
+      if (memchr(src, '&', end - src)) {
+        end = decode_entities(src, end);
+      }
+      *end = 0;
+    }
+
+    bool fail(const char *msg, const char *begin, const char *pos) {
+      error = msg;
+      error_line = 1;
+      for (const char *p = begin; p < pos; ++p) {
+        error_line += *p == '\n';
+      }
+      return false;
+    }
+
+    static const double *powers_of_ten() {
+      static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+      };
+      return powers;
+    }
+
+    // Read a run of digits. Returns the number of digits; value is modulo 2^64.
+    // Adding up in an integer is shorter than a multiply-add chain in double.
+    static unsigned digits(const char *&src, uint64_t &value) {
+      const char *begin = src;
+      value = 0;
+      for (; (unsigned)(*src - '0') < 10; ++src) {
+        value = value * 10 + (*src - '0');
+      }
+      return (unsigned)(src - begin);
+    }
+
+  public:
+    xml_reader() {
+      error = NULL;
+      error_line = 0;
+    }
+
+    /// Map a file and parse it. Returns false if the file is missing or is not XML.
+    bool LoadFile(const char *path) {
+      file_map *map = new file_map(path, file_map::access_sequential, true);
+      if (map->get_error() || !map->get_writable_data()) {
+        error = "could not open file";
+        error_line = 0;
+        delete map;
+        return false;
+      }
+      bytes = byte_span(map);
+      return parse((char*)map->get_writable_data(), (size_t)map->get_size());
+    }
+
+    /// Parse text in place. There must be a zero at text[size].
+    /// The text must stay alive while the elements are used.
+    bool parse(char *text, size_t size) {
+      char *begin = text, *end = text + size;
+      error = NULL;
+      error_line = 0;
+      elements.reset();
+      attributes.reset();
+      with_ids.reset();
+
+      // every element has a '<' and every attribute an '=', so these never grow.
+      size_t num_lt = 0, num_eq = 0;
+      count_chars(begin, end, '<', num_lt, '=', num_eq);
+      elements.reserve((unsigned)num_lt + 1);
+      attributes.reserve((unsigned)num_eq);
+
+      elements.emplace_back();
+
+      // open elements and their last children
+      dynarray<element *> stack;
+      dynarray<element *> last_child;
+      stack.push_back(&elements[0]);
+      last_child.push_back(NULL);
+
+      char *p = begin;
+      for (;;) {
+        char *lt = (char*)memchr(p, '<', end - p);
+        if (!lt) lt = end;
+
+        // text goes in the element if it comes before the first child.
+        element *parent = stack.back();
+        if (stack.size() > 1 && !parent->first_child && !parent->text) {
+          char *text_end = lt;
+          while (p != text_end && is_space(*p)) ++p;
+          while (text_end != p && is_space(text_end[-1])) --text_end;
+          if (p != text_end) {
+            parent->text = p;
+            terminate(p, text_end);
+          }
+        }
+
+        if (lt == end) break;
+        p = lt + 1;
+
+        if (*p == '/') {
+          // </name>
+          char *name = ++p;
+          while (!is_name_end(*p)) ++p;
+          if (stack.size() == 1 || strncmp(name, parent->name, p - name) || parent->name[p - name] != 0) {
+            return fail("mismatched end tag", begin, name);
+          }
+          char *gt = (char*)memchr(p, '>', end - p);
+          if (!gt) return fail("unexpected end of file", begin, end);
+          p = gt + 1;
+          stack.pop_back();
+          last_child.pop_back();
+        } else if (*p == '?') {
+          // <?xml ... ?>
+          char *q = find(p, end, "?>");
+          if (!q) return fail("unexpected end of file", begin, end);
+          p = q + 2;
+        } else if (*p == '!') {
+          if (!strncmp(p, "!--", 3)) {
+            char *q = find(p + 3, end, "-->");
+            if (!q) return fail("unterminated comment", begin, p);
+            p = q + 3;
+          } else if (!strncmp(p, "![CDATA[", 8)) {
+            char *cdata = p + 8;
+            char *q = find(cdata, end, "]]>");
+            if (!q) return fail("unterminated CDATA", begin, p);
+            p = q + 3;
+            if (stack.size() > 1 && !parent->first_child && !parent->text) {
+              parent->text = cdata;
+              *q = 0;
+            }
+          } else {
+            // <!DOCTYPE ...> which may have [ ... ] in it.
+            int depth = 0;
+            for (; p != end && (*p != '>' || depth); ++p) {
+              depth += (*p == '[') - (*p == ']');
+            }
+            if (p == end) return fail("unexpected end of file", begin, end);
+            ++p;
+          }
+        } else {
+          // <name attr="value" ...> or <name ... />
+          char *name = p;
+          while (!is_name_end(*p)) ++p;
+          char *name_end = p;
+          if (name == name_end) return fail("expected an element name", begin, name);
+
+          element &elem = elements.emplace_back();
+          elem.name = name;
+          if (last_child.back()) {
+            last_child.back()->next_sibling = &elem;
+          } else {
+            parent->first_child = &elem;
+          }
+          last_child.back() = &elem;
+
+          unsigned first_attribute = attributes.size();
+          bool has_id = false;
+          for (;;) {
+            while (is_space(*p)) ++p;
+            if (*p == '>' || (*p == '/' && p[1] == '>') || *p == 0) break;
+
+            char *attr_name = p;
+            while (!is_name_end(*p)) ++p;
+            char *attr_name_end = p;
+            while (is_space(*p)) ++p;
+            if (attr_name == attr_name_end || *p != '=') return fail("expected an attribute", begin, attr_name);
+            ++p;
+            while (is_space(*p)) ++p;
+            char quote = *p;
+            if (quote != '"' && quote != '\'') return fail("expected a quote", begin, p);
+            char *value = ++p;
+            char *value_end = (char*)memchr(value, quote, end - value);
+            if (!value_end) return fail("unterminated attribute", begin, attr_name);
+            p = value_end + 1;
+
+            *attr_name_end = 0;
+            terminate(value, value_end);
+            attribute &attr = attributes.emplace_back();
+            attr.name = attr_name;
+            attr.value = value;
+            if (!has_id && attr_name_end - attr_name == 2 && attr_name[0] == 'i' && attr_name[1] == 'd') {
+              with_ids.push_back(&elem);
+              has_id = true;
+            }
+          }
+
+          elem.attributes = attributes.data() + first_attribute;
+          elem.num_attributes = attributes.size() - first_attribute;
+
+          if (*p == 0) return fail("unexpected end of file", begin, end);
+          bool is_empty = *p == '/';
+          p += is_empty ? 2 : 1;
+          *name_end = 0;
+          if (!is_empty) {
+            stack.push_back(&elem);
+            last_child.push_back(NULL);
+          }
+        }
+      }
+
+      if (stack.size() != 1) {
+        return fail("unexpected end of file", begin, end);
+      }
+      if (!elements[0].first_child) {
+        return fail("no root element", begin, end);
+      }
+      return true;
+    }
+
+    /// The top element of the document or NULL if we failed to parse it.
+    element *RootElement() const {
+      return !error && elements.size() ? elements[0].first_child : NULL;
+    }
+
+    /// Elements with an id="..." attribute in the order they are in the file.
+    const dynarray<element *> &get_elements_with_ids() const {
+      return with_ids;
+    }
+
+    /// Reason for the last failure or NULL.
+    const char *get_error() const {
+      return error;
+    }
+
+    /// Line of the last failure.
+    unsigned get_error_line() const {
+      return error_line;
+    }
+
+    /// Read numbers like "1.5 -2 3e-4" and add them to values, stopping at anything that is not a number.
+    /// The arithmetic is the same as collada_builder's original loop so the results do not change.
+    static void parse_floats(dynarray<float> &values, const char *src) {
+      if (!src) return;
+
+      const double *powers = powers_of_ten();
+      while (*src > 0 && *src <= ' ') ++src;
+      while (*src != 0) {
+        double msign = 1;
+        if (*src == '-') { msign = -1; src++; }
+        if (!((unsigned)(*src - '0') < 10) && *src != '.') break;
+
+        // whole and fractional parts of up to 15 digits are exact in a double,
+        // longer ones are added up a digit at a time as before.
+        const char *whole_digits = src;
+        uint64_t int_value;
+        unsigned num_digits = digits(src, int_value);
+        double whole = (double)int_value;
+        if (num_digits > 15) {
+          whole = 0;
+          for (const char *p = whole_digits; p != src; ++p) whole = whole * 10 + (*p - '0');
+        }
+
+        if (*src == '.') {
+          src++;
+          const char *frac_digits = src;
+          uint64_t frac_value;
+          num_digits = digits(src, frac_value);
+          if (num_digits <= 15) {
+            whole += (double)frac_value / powers[num_digits];
+          } else {
+            double frac = 0, v = 1;
+            for (const char *p = frac_digits; p != src; ++p) { frac = frac * 10 + (*p - '0'); v *= 10; }
+            whole += frac / v;
+          }
+        }
+
+        if (*src == 'e' || *src == 'E') {
+          int esign = 1;
+          src++;
+          if (*src == '-') { esign = -1; src++; }
+          else if (*src == '+') src++;
+          int exp = 0;
+          while ((unsigned)(*src - '0') < 10) { exp = exp * 10 + (*src++ - '0'); }
+          whole = whole * pow(10.0, exp * esign);
+        }
+        values.push_back((float)(whole * msign));
+        while (*src > 0 && *src <= ' ') ++src;
+      }
+    }
+
+    /// Read integers like "1 3 -9 12" and add them to values, stopping at anything that is not a number.
+    static void parse_ints(dynarray<int> &values, const char *src) {
+      if (!src) return;
+
+      while (*src > 0 && *src <= ' ') ++src;
+      while (*src != 0) {
+        int msign = 1;
+        if (*src == '-') { msign = -1; src++; }
+        else if (!((unsigned)(*src - '0') < 10)) break;
+
+        // long numbers wrap around like an int would
+        uint64_t value;
+        digits(src, value);
+        values.push_back((int)(uint32_t)value * msign);
+        while (*src > 0 && *src <= ' ') ++src;
+      }
+    }
+  };
+}}
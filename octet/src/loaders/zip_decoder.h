@@ -6,318 +6,409 @@
 //
 //
 // zip deflate format decoder
-// 
+//
 namespace octet { namespace loaders {
+  /// Decoder for the deflate format used in zip files (RFC 1951).
+  ///
+  /// Huffman codes are decoded with one lookup in a table indexed by the next bits of the input.
+  /// Long codes use a second, smaller table. Pairs of short literals come out of one lookup.
+  ///
+  /// Example:
+  ///
+  ///     zip_decoder dec;
+  ///     dynarray<uint8_t> out(uncompressed_size);
+  ///     if (!dec.decode(out.data(), out.data() + out.size(), src, src + compressed_size)) {
+  ///       // bad data
+  ///     }
   class zip_decoder {
-    enum { debug = 1 };
-
-    struct huffman_table {
-      uint8_t min_lit_length;
-      uint8_t max_lit_length;
-      uint8_t min_dist_length;
-      uint8_t max_dist_length;
-
-      //uint8_t lit_lengths[288];
-      uint16_t lit_codes[288];
-      uint16_t lit_limits[18];
-      uint16_t lit_base[18];
-
-      //uint8_t dist_lengths[32];
-      uint16_t dist_codes[32];
-      uint16_t dist_limits[18];
-      uint16_t dist_base[18];
+    // bits of the first level lookup for literal/lengths, distances and code lengths.
+    enum { lit_bits = 11, dist_bits = 8, precode_bits = 7, max_code_length = 15 };
+
+    // table entries are 32 bits:
+    //   0-4   bits used by this lookup
+    //   5-7   kind
+    //   8-15  extra bits to read (lengths and distances), bits of a sub table
+    //   16-31 literal(s), base length or distance, first sub table entry
+    enum {
+      kind_literal = 0 << 5,
+      kind_literal2 = 1 << 5,
+      kind_length = 2 << 5,
+      kind_end = 3 << 5,
+      kind_subtable = 4 << 5,
+      kind_invalid = 5 << 5,
+      kind_mask = 7 << 5,
     };
 
-    huffman_table fixed_;
-    huffman_table var_;
-
-    // on ARM we can do this faster with the "rev" instruction
-    inline static uint16_t rev16(uint16_t value) {
-      // small table version.
-      //static const uint8_t r16[] = { 0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf };
-      //return r16[value&0x0f] * 0x1000 | r16[(value>>4)&0x0f] * 0x100 | r16[(value>>8)&0x0f] * 0x10 | r16[value>>12];
-
-      // this table is probably too big to be efficient. L1 cache misses are very expensive.
-      static const uint8_t r256[] = {
-        0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 
-        0x00+0x10, 0x80+0x10, 0x40+0x10, 0xc0+0x10, 0x20+0x10, 0xa0+0x10, 0x60+0x10, 0xe0+0x10, 
-        0x00+8, 0x80+8, 0x40+8, 0xc0+8, 0x20+8, 0xa0+8, 0x60+8, 0xe0+8, 
-        0x00+0x10+8, 0x80+0x10+8, 0x40+0x10+8, 0xc0+0x10+8, 0x20+0x10+8, 0xa0+0x10+8, 0x60+0x10+8, 0xe0+0x10+8, 
-        0x00+ 4, 0x80+ 4, 0x40+ 4, 0xc0+ 4, 0x20+ 4, 0xa0+ 4, 0x60+ 4, 0xe0+ 4, 
-        0x00+0x10+ 4, 0x80+0x10+ 4, 0x40+0x10+ 4, 0xc0+0x10+ 4, 0x20+0x10+ 4, 0xa0+0x10+ 4, 0x60+0x10+ 4, 0xe0+0x10+ 4, 
-        0x00+8+ 4, 0x80+8+ 4, 0x40+8+ 4, 0xc0+8+ 4, 0x20+8+ 4, 0xa0+8+ 4, 0x60+8+ 4, 0xe0+8+ 4, 
-        0x00+0x10+8+ 4, 0x80+0x10+8+ 4, 0x40+0x10+8+ 4, 0xc0+0x10+8+ 4, 0x20+0x10+8+ 4, 0xa0+0x10+8+ 4, 0x60+0x10+8+ 4, 0xe0+0x10+8+ 4, 
-        0x00+ 2, 0x80+ 2, 0x40+ 2, 0xc0+ 2, 0x20+ 2, 0xa0+ 2, 0x60+ 2, 0xe0+ 2, 
-        0x00+0x10+ 2, 0x80+0x10+ 2, 0x40+0x10+ 2, 0xc0+0x10+ 2, 0x20+0x10+ 2, 0xa0+0x10+ 2, 0x60+0x10+ 2, 0xe0+0x10+ 2, 
-        0x00+8+ 2, 0x80+8+ 2, 0x40+8+ 2, 0xc0+8+ 2, 0x20+8+ 2, 0xa0+8+ 2, 0x60+8+ 2, 0xe0+8+ 2, 
-        0x00+0x10+8+ 2, 0x80+0x10+8+ 2, 0x40+0x10+8+ 2, 0xc0+0x10+8+ 2, 0x20+0x10+8+ 2, 0xa0+0x10+8+ 2, 0x60+0x10+8+ 2, 0xe0+0x10+8+ 2, 
-        0x00+ 4+ 2, 0x80+ 4+ 2, 0x40+ 4+ 2, 0xc0+ 4+ 2, 0x20+ 4+ 2, 0xa0+ 4+ 2, 0x60+ 4+ 2, 0xe0+ 4+ 2, 
-        0x00+0x10+ 4+ 2, 0x80+0x10+ 4+ 2, 0x40+0x10+ 4+ 2, 0xc0+0x10+ 4+ 2, 0x20+0x10+ 4+ 2, 0xa0+0x10+ 4+ 2, 0x60+0x10+ 4+ 2, 0xe0+0x10+ 4+ 2, 
-        0x00+8+ 4+ 2, 0x80+8+ 4+ 2, 0x40+8+ 4+ 2, 0xc0+8+ 4+ 2, 0x20+8+ 4+ 2, 0xa0+8+ 4+ 2, 0x60+8+ 4+ 2, 0xe0+8+ 4+ 2, 
-        0x00+0x10+8+ 4+ 2, 0x80+0x10+8+ 4+ 2, 0x40+0x10+8+ 4+ 2, 0xc0+0x10+8+ 4+ 2, 0x20+0x10+8+ 4+ 2, 0xa0+0x10+8+ 4+ 2, 0x60+0x10+8+ 4+ 2, 0xe0+0x10+8+ 4+ 2, 
-        0x00+ 1, 0x80+ 1, 0x40+ 1, 0xc0+ 1, 0x20+ 1, 0xa0+ 1, 0x60+ 1, 0xe0+ 1, 
-        0x00+0x10+ 1, 0x80+0x10+ 1, 0x40+0x10+ 1, 0xc0+0x10+ 1, 0x20+0x10+ 1, 0xa0+0x10+ 1, 0x60+0x10+ 1, 0xe0+0x10+ 1, 
-        0x00+8+ 1, 0x80+8+ 1, 0x40+8+ 1, 0xc0+8+ 1, 0x20+8+ 1, 0xa0+8+ 1, 0x60+8+ 1, 0xe0+8+ 1, 
-        0x00+0x10+8+ 1, 0x80+0x10+8+ 1, 0x40+0x10+8+ 1, 0xc0+0x10+8+ 1, 0x20+0x10+8+ 1, 0xa0+0x10+8+ 1, 0x60+0x10+8+ 1, 0xe0+0x10+8+ 1, 
-        0x00+ 4+ 1, 0x80+ 4+ 1, 0x40+ 4+ 1, 0xc0+ 4+ 1, 0x20+ 4+ 1, 0xa0+ 4+ 1, 0x60+ 4+ 1, 0xe0+ 4+ 1, 
-        0x00+0x10+ 4+ 1, 0x80+0x10+ 4+ 1, 0x40+0x10+ 4+ 1, 0xc0+0x10+ 4+ 1, 0x20+0x10+ 4+ 1, 0xa0+0x10+ 4+ 1, 0x60+0x10+ 4+ 1, 0xe0+0x10+ 4+ 1, 
-        0x00+8+ 4+ 1, 0x80+8+ 4+ 1, 0x40+8+ 4+ 1, 0xc0+8+ 4+ 1, 0x20+8+ 4+ 1, 0xa0+8+ 4+ 1, 0x60+8+ 4+ 1, 0xe0+8+ 4+ 1, 
-        0x00+0x10+8+ 4+ 1, 0x80+0x10+8+ 4+ 1, 0x40+0x10+8+ 4+ 1, 0xc0+0x10+8+ 4+ 1, 0x20+0x10+8+ 4+ 1, 0xa0+0x10+8+ 4+ 1, 0x60+0x10+8+ 4+ 1, 0xe0+0x10+8+ 4+ 1, 
-        0x00+ 2+ 1, 0x80+ 2+ 1, 0x40+ 2+ 1, 0xc0+ 2+ 1, 0x20+ 2+ 1, 0xa0+ 2+ 1, 0x60+ 2+ 1, 0xe0+ 2+ 1, 
-        0x00+0x10+ 2+ 1, 0x80+0x10+ 2+ 1, 0x40+0x10+ 2+ 1, 0xc0+0x10+ 2+ 1, 0x20+0x10+ 2+ 1, 0xa0+0x10+ 2+ 1, 0x60+0x10+ 2+ 1, 0xe0+0x10+ 2+ 1, 
-        0x00+8+ 2+ 1, 0x80+8+ 2+ 1, 0x40+8+ 2+ 1, 0xc0+8+ 2+ 1, 0x20+8+ 2+ 1, 0xa0+8+ 2+ 1, 0x60+8+ 2+ 1, 0xe0+8+ 2+ 1, 
-        0x00+0x10+8+ 2+ 1, 0x80+0x10+8+ 2+ 1, 0x40+0x10+8+ 2+ 1, 0xc0+0x10+8+ 2+ 1, 0x20+0x10+8+ 2+ 1, 0xa0+0x10+8+ 2+ 1, 0x60+0x10+8+ 2+ 1, 0xe0+0x10+8+ 2+ 1, 
-        0x00+ 4+ 2+ 1, 0x80+ 4+ 2+ 1, 0x40+ 4+ 2+ 1, 0xc0+ 4+ 2+ 1, 0x20+ 4+ 2+ 1, 0xa0+ 4+ 2+ 1, 0x60+ 4+ 2+ 1, 0xe0+ 4+ 2+ 1, 
-        0x00+0x10+ 4+ 2+ 1, 0x80+0x10+ 4+ 2+ 1, 0x40+0x10+ 4+ 2+ 1, 0xc0+0x10+ 4+ 2+ 1, 0x20+0x10+ 4+ 2+ 1, 0xa0+0x10+ 4+ 2+ 1, 0x60+0x10+ 4+ 2+ 1, 0xe0+0x10+ 4+ 2+ 1, 
-        0x00+8+ 4+ 2+ 1, 0x80+8+ 4+ 2+ 1, 0x40+8+ 4+ 2+ 1, 0xc0+8+ 4+ 2+ 1, 0x20+8+ 4+ 2+ 1, 0xa0+8+ 4+ 2+ 1, 0x60+8+ 4+ 2+ 1, 0xe0+8+ 4+ 2+ 1, 
-        0x00+0x10+8+ 4+ 2+ 1, 0x80+0x10+8+ 4+ 2+ 1, 0x40+0x10+8+ 4+ 2+ 1, 0xc0+0x10+8+ 4+ 2+ 1, 0x20+0x10+8+ 4+ 2+ 1, 0xa0+0x10+8+ 4+ 2+ 1, 0x60+0x10+8+ 4+ 2+ 1, 0xe0+0x10+8+ 4+ 2+ 1, 
-      };
-      return r256[value&0xff] << 8 | r256[(value>>8)&0xff];
-
-      //value = ( ( value >> 1 ) & 0x5555 ) | ( ( value & 0x5555 ) << 1 );
-      //value = ( ( value >> 2 ) & 0x3333 ) | ( ( value & 0x3333 ) << 2 );
-      //value = ( ( value >> 4 ) & 0x0f0f ) | ( ( value & 0x0f0f ) << 4 );
-      //value = ( ( value >> 8 ) & 0x00ff ) | ( ( value & 0x00ff ) << 8 );
-      //return value;
-    }
+    // little endian bits read from the input 64 at a time.
+    struct bit_reader {
+      const uint8_t *src;
+      const uint8_t *src_max;
+      uint64_t bits;
+      unsigned num_bits;
+
+      // zero bytes added after the end of the input.
+      unsigned padding;
+
+      void init(const uint8_t *src_, const uint8_t *src_max_) {
+        src = src_;
+        src_max = src_max_;
+        bits = 0;
+        num_bits = 0;
+        padding = 0;
+      }
 
-    bool build_huffman(uint8_t *lengths, unsigned num_lengths, uint8_t &min_length, uint8_t &max_length, uint16_t *codes, uint16_t *limits, uint16_t *base) {
-      min_length = 16;
-      max_length = 0;
-      for (unsigned i = 0; i != num_lengths; ++i) {
-        if (debug) printf("%d,", lengths[i]);
-        if (lengths[i]) {
-          if (min_length > lengths[i]) min_length = lengths[i];
-          if (max_length < lengths[i]) max_length = lengths[i];
+      // make sure we have at least 56 bits.
+      void refill() {
+        if (src_max - src >= 8) {
+          uint64_t word;
+          memcpy(&word, src, 8);
+          bits |= word << num_bits;
+          src += (63 - num_bits) >> 3;
+          num_bits |= 56;
+        } else {
+          while (num_bits <= 56) {
+            if (src < src_max) {
+              bits |= (uint64_t)*src++ << num_bits;
+            } else {
+              padding++;
+            }
+            num_bits += 8;
+          }
         }
       }
-      if (debug) printf("\n");
 
-      if (debug) printf("min_length=%d\n", min_length);
-      if (debug) printf("max_length=%d\n", max_length);
+      unsigned peek(unsigned n) const {
+        return (unsigned)bits & ((1u << n) - 1);
+      }
 
-      if ( min_length <= 0 || min_length > max_length || max_length > 16 ) {
-        return false;
+      void consume(unsigned n) {
+        bits >>= n;
+        num_bits -= n;
       }
 
-      unsigned code = 0;
-      unsigned huffcode = 0;
-      for (unsigned length = min_length; length <= max_length; ++length) {
-        base[length-min_length] = huffcode - code;
-        for (unsigned i = 0; i != num_lengths; ++i) {
-          if (lengths[i] == length) {
-            codes[code++] = i;
-            //dump_bits(huffcode << (16-length), 16, "huffcode");
-            huffcode++;
-          }
-        }
-        limits[length-min_length] = (uint16_t)( ( huffcode << (16-length) ) - 1 );
-        if (debug) printf("length %d: lim=%04x base=%04x\n", length, ( huffcode << (16-length) ) - 1, base[length-min_length]);
-        if (( huffcode << (16-length) ) - 1 > 0xffff) {
-          if (debug) printf("invalid huffman table\n");
-          return false;
-        }
-        huffcode *= 2;
+      unsigned get(unsigned n) {
+        unsigned value = peek(n);
+        consume(n);
+        return value;
       }
 
-      // prevent escape from bitstream decoding loop.
-      limits[max_length+1-min_length] = 0xffff;
-      return true;
-    }
+      // true if we have used any of the padding.
+      bool overrun() const {
+        return padding * 8 > num_bits;
+      }
+
+      // go to the next byte boundary and return the read position. Used for uncompressed blocks.
+      const uint8_t *align() {
+        consume(num_bits & 7);
+        const uint8_t *pos = src - (num_bits >> 3) + padding;
+        bits = 0;
+        num_bits = 0;
+        padding = 0;
+        return pos;
+      }
+    };
 
-    /// debug function for dumping bit fields
-    void dump_bits(unsigned value, unsigned bits, const char *name) {
-      char tmp[64];
-      assert(bits<63);
-      for (unsigned i = 0; i != bits; ++i) tmp[i] = ( ( value >> (bits-1-i) ) & 1 ) + '0';
-      tmp[bits] = 0;
-      printf("[%s] %s\n", tmp, name);
+    // decoding tables
+    dynarray<uint32_t> fixed_lit;
+    dynarray<uint32_t> fixed_dist;
+    dynarray<uint32_t> var_lit;
+    dynarray<uint32_t> var_dist;
+    dynarray<uint32_t> var_precode;
+
+    // bytes written by the last decode()
+    size_t output_size;
+
+    static uint32_t make_entry(unsigned bits, unsigned kind, unsigned extra, unsigned value) {
+      return bits | kind | extra << 8 | value << 16;
     }
 
-    /// peek a fixed number of little-endian bits from the bitstream
-    /// note: this will have to be fixed on PPC and other big-endian devices
-    unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits, const char *name) {
-      unsigned i = bitptr >> 3, j = bitptr & 7;
-      unsigned value = ( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
-      if (name) dump_bits(value, bits, name);
-      return value;
+    // lengths of codes 257-285
+    static uint32_t length_entry(unsigned bits, unsigned code) {
+      static const uint8_t extra[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+      };
+      static const uint16_t base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+      };
+      if (code < 256) return make_entry(bits, kind_literal, 0, code);
+      if (code == 256) return make_entry(bits, kind_end, 0, 0);
+      if (code > 285) return make_entry(0, kind_invalid, 0, 0);
+      return make_entry(bits, kind_length, extra[code-257], base[code-257]);
     }
 
-    unsigned decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      bitptr = ( bitptr + 7 ) & ~7;
-      unsigned bytes_to_copy = peek(src, bitptr, 16, "bytes_to_copy");
-      unsigned clength = peek(src, bitptr + 16, 16, "store length check");
-      bitptr += 32;
+    // distances of codes 0-29
+    static uint32_t dist_entry(unsigned bits, unsigned code) {
+      static const uint8_t extra[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+      };
+      static const uint16_t base[] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+      };
+      if (code > 29) return make_entry(0, kind_invalid, 0, 0);
+      return make_entry(bits, kind_length, extra[code], base[code]);
+    }
 
-      if (bytes_to_copy != (clength^0xffff)) return ~0;
-      if (dest + bytes_to_copy > dest_max) return ~0;
-      if ((src + bitptr/8) + bytes_to_copy > src_max) return ~0;
+    // code length codes are just the value.
+    static uint32_t precode_entry(unsigned bits, unsigned code) {
+      return make_entry(bits, kind_literal, 0, code);
+    }
 
-      memcpy(dest, src + bitptr/8, bytes_to_copy);
-      dest += bytes_to_copy;
-      bitptr += bytes_to_copy * 8;
-      return bitptr;
+    // reverse the bottom "bits" bits of a code as deflate sends huffman codes backwards.
+    static unsigned reverse_bits(unsigned value, unsigned bits) {
+      unsigned result = 0;
+      for (unsigned i = 0; i != bits; ++i) {
+        result = result << 1 | (value & 1);
+        value >>= 1;
+      }
+      return result;
     }
 
-    unsigned decode_lz77(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, huffman_table *table_) {
-      for(;;) {
-        if (src + bitptr/8 > src_max) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > table_->lit_limits[index]) {
-          index++;
+    // build a two level lookup table from the code lengths of a canonical huffman code.
+    // codes that are too long for the first level go into sub tables after it.
+    // returns false if the lengths are not a valid code.
+    template <class entry_fn_t> static bool build_table(
+      dynarray<uint32_t> &table, const uint8_t *lengths, unsigned num_lengths, unsigned table_bits, entry_fn_t entry_fn
+    ) {
+      unsigned count[max_code_length+1] = {};
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        count[lengths[i]]++;
+      }
+      count[0] = 0;
+
+      // first code of each length. fail if there are too many codes.
+      unsigned next_code[max_code_length+2];
+      unsigned code = 0;
+      unsigned max_len = 0;
+      int left = 1;
+      for (unsigned len = 1; len <= max_code_length; ++len) {
+        left = left * 2 - (int)count[len];
+        if (left < 0) return false;
+        next_code[len] = code;
+        code = (code + count[len]) << 1;
+        max_len = count[len] ? len : max_len;
+      }
+
+      // like zlib, only allow an incomplete code if it is a single one bit code (or empty).
+      if (left > 0 && max_len > 1) return false;
+
+      unsigned table_size = 1u << table_bits;
+      unsigned mask = table_size - 1;
+
+      // find the longest code for each first level entry to size the sub tables.
+      uint8_t sub_bits[1 << lit_bits];
+      memset(sub_bits, 0, table_size);
+      unsigned codes[288];
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        unsigned len = lengths[i];
+        if (!len) continue;
+        codes[i] = reverse_bits(next_code[len]++, len);
+        if (len > table_bits) {
+          unsigned prefix = codes[i] & mask;
+          unsigned bits = len - table_bits;
+          sub_bits[prefix] = bits > sub_bits[prefix] ? bits : sub_bits[prefix];
         }
-        unsigned length = table_->min_lit_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = table_->lit_codes[offset - table_->lit_base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "code");
-
-        if (code < 256) {
-          if (dest+1 > dest_max) return ~0;
-          *dest++ = code;
-          if (debug) printf("%02x\n", code);
-        } else if (code == 256) {
-          return bitptr;
-        } else {
-          unsigned block_length;
-          unsigned distance;
-          {
-            if (debug) printf("[%d]\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
-            };
-            static const uint8_t base[] = {
-              3-3, 4-3, 5-3, 6-3, 7-3, 8-3, 9-3, 10-3,
-              11-3, 13-3, 15-3, 17-3, 19-3, 23-3, 27-3, 31-3,
-              35-3, 43-3, 51-3, 59-3, 67-3, 83-3, 99-3, 115-3,
-              131-3, 163-3, 195-3, 227-3, 258-3,
-            };
-            if (code-257 > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code-257 ];
-            block_length = base[ code-257 ] + 3 + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
+      }
+
+      // allocate the sub tables after the first level.
+      uint16_t sub_start[1 << lit_bits];
+      unsigned total = table_size;
+      for (unsigned i = 0; i != table_size; ++i) {
+        sub_start[i] = (uint16_t)total;
+        if (sub_bits[i]) total += 1u << sub_bits[i];
+      }
+
+      // missing codes (in incomplete tables) decode as errors.
+      table.resize(total);
+      uint32_t invalid = make_entry(0, kind_invalid, 0, 0);
+      for (unsigned i = 0; i != total; ++i) {
+        table[i] = invalid;
+      }
+      for (unsigned i = 0; i != table_size; ++i) {
+        if (sub_bits[i]) table[i] = make_entry(table_bits, kind_subtable, sub_bits[i], sub_start[i]);
+      }
+
+      // a code of length len fills every entry whose bottom len bits match.
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        unsigned len = lengths[i];
+        if (!len) continue;
+        if (len <= table_bits) {
+          uint32_t entry = entry_fn(len, i);
+          for (unsigned j = codes[i]; j < table_size; j += 1u << len) {
+            table[j] = entry;
           }
-          {
-            //if (src + (bitptr + table_->max_dist_length)/8 > src_max ) return ~0;
-            unsigned peek16 = peek(src, bitptr, 16, NULL);
-            unsigned value = rev16(peek16);
-            unsigned index = 0;
-            while (value > table_->dist_limits[index]) {
-              index++;
-            }
-            unsigned length = table_->min_dist_length + index;
-            unsigned offset = ( value >> ( 16 - length ) );
-            unsigned code = table_->dist_codes[offset - table_->dist_base[index]];
-            bitptr += length;
-
-            if (debug) printf("{%d}\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0, 0,
-            };
-            static const uint16_t base[] = {
-              1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-            };
-            if (code > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code ];
-            distance = base[ code ] + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
+        } else {
+          unsigned prefix = codes[i] & mask;
+          unsigned sub_len = len - table_bits;
+          unsigned sub_size = 1u << sub_bits[prefix];
+          uint32_t entry = entry_fn(sub_len, i);
+          uint32_t *sub = table.data() + sub_start[prefix];
+          for (unsigned j = codes[i] >> table_bits; j < sub_size; j += 1u << sub_len) {
+            sub[j] = entry;
           }
+        }
+      }
+      return true;
+    }
 
-          if (debug) printf("length=%d distance=%d\n", block_length, distance);
+    // combine pairs of literals that fit in the first level into one entry.
+    static void add_literal_pairs(dynarray<uint32_t> &table) {
+      // the second literal is at entry (i >> len1) which is never after i, so go backwards.
+      for (unsigned i = 1u << lit_bits; i-- != 0; ) {
+        uint32_t first = table[i];
+        if ((first & kind_mask) != kind_literal) continue;
+        unsigned len1 = first & 31;
+        uint32_t second = table[i >> len1];
+        unsigned len2 = second & 31;
+        if ((second & kind_mask) == kind_literal && len1 + len2 <= lit_bits) {
+          table[i] = make_entry(len1 + len2, kind_literal2, 0, (first >> 16) | (second >> 16) << 8);
+        }
+      }
+    }
 
-          if (dest+block_length > dest_max) return ~0;
+    // look up a symbol, including the sub table if the code is long.
+    static uint32_t lookup(const uint32_t *table, unsigned table_bits, bit_reader &br) {
+      uint32_t entry = table[br.peek(table_bits)];
+      if ((entry & kind_mask) == kind_subtable) {
+        br.consume(table_bits);
+        entry = table[(entry >> 16) + br.peek((entry >> 8) & 0xff)];
+      }
+      br.consume(entry & 31);
+      return entry;
+    }
 
-          for(unsigned i = 0; i != block_length; ++i) {
-            dest[0] = dest[-(int)distance];
-            dest++;
-          }
+    // decode literals and matches until the end of the block.
+    static bool decode_huffman(uint8_t *dest_begin, uint8_t *&dest, uint8_t *dest_max, bit_reader &br, const uint32_t *lit, const uint32_t *dist) {
+      for (;;) {
+        // 56 bits is enough for a literal/length code and its extra bits and a distance code and its extra bits.
+        br.refill();
+        uint32_t entry = lookup(lit, lit_bits, br);
+        unsigned kind = entry & kind_mask;
+
+        if (kind == kind_literal) {
+          if (dest == dest_max) return false;
+          *dest++ = (uint8_t)(entry >> 16);
+        } else if (kind == kind_literal2) {
+          if (dest_max - dest < 2) return false;
+          dest[0] = (uint8_t)(entry >> 16);
+          dest[1] = (uint8_t)(entry >> 24);
+          dest += 2;
+        } else if (kind == kind_length) {
+          unsigned length = (entry >> 16) + br.get((entry >> 8) & 0xff);
+
+          uint32_t dentry = lookup(dist, dist_bits, br);
+          if ((dentry & kind_mask) != kind_length) return false;
+          unsigned distance = (dentry >> 16) + br.get((dentry >> 8) & 0xff);
+
+          if (distance > (size_t)(dest - dest_begin) || length > (size_t)(dest_max - dest)) return false;
+          copy_match(dest, dest_max, distance, length);
+          dest += length;
+        } else if (kind == kind_end) {
+          return !br.overrun();
+        } else {
+          return false;
         }
       }
     }
 
-    unsigned decode_fixed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &fixed_);
+    // copy length bytes from distance bytes back. The source and destination may overlap.
+    static void copy_match(uint8_t *dest, uint8_t *dest_max, unsigned distance, unsigned length) {
+      const uint8_t *src = dest - distance;
+      if (distance >= 8 && dest_max - dest >= (ptrdiff_t)length + 8) {
+        // eight bytes at a time; each read is from bytes already written. may write up to 7 spare bytes.
+        uint8_t *end = dest + length;
+        do {
+          uint64_t word;
+          memcpy(&word, src, 8);
+          memcpy(dest, &word, 8);
+          src += 8;
+          dest += 8;
+        } while (dest < end);
+      } else if (distance == 1) {
+        memset(dest, src[0], length);
+      } else {
+        for (unsigned i = 0; i != length; ++i) {
+          dest[i] = src[i];
+        }
+      }
     }
 
-    unsigned decode_variable(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      unsigned num_lit_codes = peek(src, bitptr, 5, "num_lit_codes") + 257;
-      unsigned num_dist_codes = peek(src, bitptr+5, 5, "num_dist_codes") + 1;
-      unsigned num_length_codes = peek(src, bitptr+10, 4, "num_length_codes") + 4;
-      
-      bitptr += 14;
+    static bool decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, bit_reader &br) {
+      const uint8_t *src = br.align();
+      if (br.src_max - src < 4) return false;
+      unsigned length = src[0] | src[1] << 8;
+      unsigned check = src[2] | src[3] << 8;
+      src += 4;
+
+      if (length != (check ^ 0xffff)) return false;
+      if (length > (size_t)(dest_max - dest)) return false;
+      if (length > (size_t)(br.src_max - src)) return false;
+
+      memcpy(dest, src, length);
+      dest += length;
+      br.src = src + length;
+      return true;
+    }
 
-      uint8_t lengths[288 + 32];
-      memset(lengths, 0, 20);
-      if (src + bitptr/8 + num_length_codes > src_max ) return ~0;
+    // read the code lengths of a dynamic block and build its tables.
+    bool read_dynamic_tables(bit_reader &br) {
+      br.refill();
+      unsigned num_lit_codes = br.get(5) + 257;
+      unsigned num_dist_codes = br.get(5) + 1;
+      unsigned num_length_codes = br.get(4) + 4;
+      if (num_lit_codes > 286 || num_dist_codes > 30) return false;
+
+      static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+      uint8_t precode_lengths[19];
+      memset(precode_lengths, 0, sizeof(precode_lengths));
       for (unsigned i = 0; i != num_length_codes; ++i) {
-        static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
-        lengths[order[i]] = peek(src, bitptr, 3, "length code lenghs");
-        bitptr += 3;
+        br.refill();
+        precode_lengths[order[i]] = (uint8_t)br.get(3);
       }
-      
-      uint16_t codes[19];
-      uint16_t limits[18];
-      uint16_t base[18];
-      uint8_t min_length;
-      uint8_t max_length;
-      if (!build_huffman(lengths, 19, min_length, max_length, codes, limits, base)) return ~0;
-      
+
+      // code length codes are at most 7 bits, so there are no sub tables.
+      if (!build_table(var_precode, precode_lengths, 19, precode_bits, precode_entry)) return false;
+      const uint32_t *precode = var_precode.data();
+
+      uint8_t lengths[286 + 30];
       unsigned todo = num_lit_codes + num_dist_codes;
-      for(unsigned done = 0; done < todo;) {
-        if (src + bitptr/8 + max_length > src_max ) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > limits[index]) {
-          index++;
-        }
-        unsigned length = min_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = codes[offset - base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "length");
-        //fprintf(source_.debug(), "code=%03x\n", code);
+      for (unsigned done = 0; done < todo; ) {
+        br.refill();
+        uint32_t entry = precode[br.peek(precode_bits)];
+        if ((entry & kind_mask) != kind_literal) return false;
+        br.consume(entry & 31);
+        unsigned code = entry >> 16;
+
         unsigned copy = 1;
-        if (code < 16) {
-        } else if(code == 16) {
-          if (src + (bitptr+2)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 2, NULL) + 3;
-          bitptr += 2;
-          if (done == 0) return ~0;
-          code = lengths[ done-1 ];
-        } else if(code == 17) {
-          if (src + (bitptr+3)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 3, NULL) + 3;
-          bitptr += 3;
+        if (code == 16) {
+          if (done == 0) return false;
+          copy = br.get(2) + 3;
+          code = lengths[done-1];
+        } else if (code == 17) {
+          copy = br.get(3) + 3;
           code = 0;
-        } else if(code == 18) {
-          if (src + (bitptr+7)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 7, NULL) + 11;
-          bitptr += 7;
+        } else if (code == 18) {
+          copy = br.get(7) + 11;
           code = 0;
-        } else {
-          return ~0;
         }
-        if (done + copy > todo) return ~0;
-        do {
-          lengths[done++] = code;
-        } while( --copy );
+        if (done + copy > todo) return false;
+        memset(lengths + done, code, copy);
+        done += copy;
       }
 
-      if (debug) printf("lengths done\n");
+      // a block must be able to end.
+      if (lengths[256] == 0 || br.overrun()) return false;
 
-      if(
-        !build_huffman(lengths, num_lit_codes, var_.min_lit_length, var_.max_lit_length, var_.lit_codes, var_.lit_limits, var_.lit_base) ||
-        !build_huffman(lengths+num_lit_codes, num_dist_codes, var_.min_dist_length, var_.max_dist_length, var_.dist_codes, var_.dist_limits, var_.dist_base)
-      ) {
-        return ~0;
-      }
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &var_);
+      if (!build_table(var_lit, lengths, num_lit_codes, lit_bits, length_entry)) return false;
+      if (!build_table(var_dist, lengths + num_lit_codes, num_dist_codes, dist_bits, dist_entry)) return false;
+      add_literal_pairs(var_lit);
+      return true;
     }
+
   public:
     zip_decoder() {
+      output_size = 0;
       uint8_t lit_lengths[288];
       uint8_t dist_lengths[32];
       memset(lit_lengths +   0, 8, 144 - 0);
@@ -325,33 +416,44 @@ namespace octet { namespace loaders {
       memset(lit_lengths + 256, 7, 280-256);
       memset(lit_lengths + 280, 8, 288-280);
       memset(dist_lengths, 5, 32);
-      build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
-      build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+      build_table(fixed_lit, lit_lengths, 288, lit_bits, length_entry);
+      build_table(fixed_dist, dist_lengths, 32, dist_bits, dist_entry);
+      add_literal_pairs(fixed_lit);
     }
 
-    void decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
-      unsigned bitptr = 0;
-      unsigned is_last_block;
+    /// Decode a deflate stream into [dest, dest_max).
+    /// Returns false if the data is bad or the output does not fit.
+    /// Use get_output_size() to see how many bytes were written.
+    bool decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
+      uint8_t *dest_begin = dest;
+      output_size = 0;
+      bit_reader br;
+      br.init(src, src_max);
 
       // for each "deflate" block:
-      do {
-        // prevent (bitptr / 8) from overflowing (>512Mib)
-        src += bitptr / 8;
-        bitptr %= 8;
-
+      for (;;) {
         // three bits determine kind and exit condition
-        is_last_block = peek(src, bitptr, 1, "deflate last") != 0;
-        unsigned kind = peek(src, bitptr + 1, 2, "deflate kind");
+        br.refill();
+        unsigned is_last_block = br.get(1);
+        unsigned kind = br.get(2);
 
-        bitptr += 3;
+        bool ok = false;
         switch (kind) {
-        case 0: bitptr = decode_uncompressed(dest, dest_max, src, src_max, bitptr); break;
-        case 1: bitptr = decode_fixed(dest, dest_max, src, src_max, bitptr); break;
-        case 2: bitptr = decode_variable(dest, dest_max, src, src_max, bitptr); break;
-        default: return;
+          case 0: ok = decode_uncompressed(dest, dest_max, br); break;
+          case 1: ok = decode_huffman(dest_begin, dest, dest_max, br, fixed_lit.data(), fixed_dist.data()); break;
+          case 2: ok = read_dynamic_tables(br) && decode_huffman(dest_begin, dest, dest_max, br, var_lit.data(), var_dist.data()); break;
         }
-      } while( !is_last_block && bitptr != ~0);
+        if (!ok) return false;
+        if (is_last_block) {
+          output_size = dest - dest_begin;
+          return true;
+        }
+      }
+    }
+
+    /// Number of bytes written by the last successful decode().
+    size_t get_output_size() const {
+      return output_size;
     }
   };
 }}
-
@@ -0,0 +1,338 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Bounding volume hierarchy for ray casts
+//
+
+namespace octet { namespace math {
+  /// Bounding volume hierarchy (BVH) built with the surface area heuristic (SAH).
+  ///
+  /// The tree is built from the bounding boxes of some primitives (triangles, mesh instances etc.).
+  /// Ray casts visit the nodes front to back and call a function to test the primitives.
+  ///
+  /// Example:
+  ///
+  ///     bvh tree;
+  ///     tree.build(boxes.data(), boxes.size());
+  ///
+  ///     float t = 1; // furthest distance along the ray
+  ///     tree.cast(start, end - start, t, [&](unsigned prim, float &t) {
+  ///       // if we hit primitive "prim" closer than t, set t and return true.
+  ///     });
+  class bvh {
+    // 32 byte node. Interior nodes have count == 0 and two children at first and first+1
+    struct node {
+      float min[3];
+      uint32_t first;
+      float max[3];
+      uint32_t count;
+    };
+
+    dynarray<node> nodes;
+
+    // primitive numbers in leaf order
+    dynarray<uint32_t> prims;
+
+    enum { max_leaf_size = 4, num_bins = 16, max_depth = 48, stack_size = 64 };
+
+    // bounds and centroid of one primitive
+    struct prim_info {
+      float min[3];
+      float max[3];
+      float centroid[3];
+    };
+
+    struct bin {
+      float min[3];
+      float max[3];
+      unsigned count;
+    };
+
+    static void empty_bounds(float *bmin, float *bmax) {
+      bmin[0] = bmin[1] = bmin[2] = 1e30f;
+      bmax[0] = bmax[1] = bmax[2] = -1e30f;
+    }
+
+    static void grow_bounds(float *bmin, float *bmax, const float *pmin, const float *pmax) {
+      for (unsigned j = 0; j != 3; ++j) {
+        bmin[j] = pmin[j] < bmin[j] ? pmin[j] : bmin[j];
+        bmax[j] = pmax[j] > bmax[j] ? pmax[j] : bmax[j];
+      }
+    }
+
+    static float half_area(const float *bmin, const float *bmax) {
+      float dx = bmax[0] - bmin[0], dy = bmax[1] - bmin[1], dz = bmax[2] - bmin[2];
+      return dx < 0 ? 0 : dx * dy + dy * dz + dz * dx;
+    }
+
+    // find the cheapest split of node n by binning centroids. returns false if a leaf is better.
+    bool find_split(const node &n, const prim_info *info, unsigned &split_axis, float &split_pos) {
+      unsigned count = n.count;
+      const uint32_t *p = prims.data() + n.first;
+
+      float cmin[3], cmax[3];
+      empty_bounds(cmin, cmax);
+      for (unsigned i = 0; i != count; ++i) {
+        grow_bounds(cmin, cmax, info[p[i]].centroid, info[p[i]].centroid);
+      }
+
+      float best_cost = 1e30f;
+      for (unsigned axis = 0; axis != 3; ++axis) {
+        float extent = cmax[axis] - cmin[axis];
+        if (extent <= 0) continue;
+
+        bin bins[num_bins];
+        for (unsigned b = 0; b != num_bins; ++b) {
+          empty_bounds(bins[b].min, bins[b].max);
+          bins[b].count = 0;
+        }
+
+        float scale = num_bins / extent;
+        for (unsigned i = 0; i != count; ++i) {
+          const prim_info &pi = info[p[i]];
+          unsigned b = (unsigned)((pi.centroid[axis] - cmin[axis]) * scale);
+          b = b < num_bins ? b : num_bins - 1;
+          bins[b].count++;
+          grow_bounds(bins[b].min, bins[b].max, pi.min, pi.max);
+        }
+
+        // sweep from the right, then from the left.
+        float right_area[num_bins];
+        unsigned right_count[num_bins];
+        float rmin[3], rmax[3];
+        empty_bounds(rmin, rmax);
+        unsigned rcount = 0;
+        for (unsigned b = num_bins - 1; b != 0; --b) {
+          grow_bounds(rmin, rmax, bins[b].min, bins[b].max);
+          rcount += bins[b].count;
+          right_area[b] = half_area(rmin, rmax);
+          right_count[b] = rcount;
+        }
+
+        float lmin[3], lmax[3];
+        empty_bounds(lmin, lmax);
+        unsigned lcount = 0;
+        for (unsigned b = 1; b != num_bins; ++b) {
+          grow_bounds(lmin, lmax, bins[b-1].min, bins[b-1].max);
+          lcount += bins[b-1].count;
+          if (lcount == 0 || right_count[b] == 0) continue;
+          float cost = lcount * half_area(lmin, lmax) + right_count[b] * right_area[b];
+          if (cost < best_cost) {
+            best_cost = cost;
+            split_axis = axis;
+            split_pos = cmin[axis] + b / scale;
+          }
+        }
+      }
+
+      // compare with the cost of testing every primitive here. (traversal costs about one primitive)
+      float area = half_area(n.min, n.max);
+      return best_cost < 1e30f && (count > max_leaf_size || best_cost + area < count * area);
+    }
+
+    // set the bounds of a node from its primitives
+    void calc_leaf_bounds(node &n, const prim_info *info) {
+      empty_bounds(n.min, n.max);
+      for (unsigned i = 0; i != n.count; ++i) {
+        const prim_info &pi = info[prims[n.first + i]];
+        grow_bounds(n.min, n.max, pi.min, pi.max);
+      }
+    }
+
+    static void get_prim_info(prim_info &pi, const aabb &box) {
+      vec3 bmin = box.get_min();
+      vec3 bmax = box.get_max();
+      for (unsigned j = 0; j != 3; ++j) {
+        pi.min[j] = bmin[j];
+        pi.max[j] = bmax[j];
+        pi.centroid[j] = (bmin[j] + bmax[j]) * 0.5f;
+      }
+    }
+
+    // slab test. returns the entry distance or a negative value if we miss.
+    static float hit_node(const node &n, const float *org, const float *inv_dir, float t_max) {
+      float t0 = 0, t1 = t_max;
+      for (unsigned j = 0; j != 3; ++j) {
+        float ta = (n.min[j] - org[j]) * inv_dir[j];
+        float tb = (n.max[j] - org[j]) * inv_dir[j];
+        float tmin = ta < tb ? ta : tb;
+        float tmax = ta < tb ? tb : ta;
+        t0 = tmin > t0 ? tmin : t0;
+        t1 = tmax < t1 ? tmax : t1;
+      }
+      return t0 <= t1 ? t0 : -1.0f;
+    }
+
+  public:
+    bvh() {
+    }
+
+    /// Build the tree from the bounding boxes of num_prims primitives.
+    void build(const aabb *boxes, unsigned num_prims) {
+      nodes.resize(0);
+      prims.resize(num_prims);
+      if (num_prims == 0) return;
+
+      dynarray<prim_info> info(num_prims);
+      for (unsigned i = 0; i != num_prims; ++i) {
+        get_prim_info(info[i], boxes[i]);
+        prims[i] = i;
+      }
+
+      // a binary tree with leaves of at least one primitive has less than 2n nodes.
+      nodes.reserve(num_prims * 2);
+      nodes.resize(1);
+      nodes[0].first = 0;
+      nodes[0].count = num_prims;
+      calc_leaf_bounds(nodes[0], info.data());
+
+      // depth first, so the stack never holds more than max_depth + 1 nodes.
+      unsigned stack[stack_size];
+      unsigned depth[stack_size];
+      unsigned sp = 0;
+      stack[sp] = 0;
+      depth[sp++] = 0;
+      while (sp) {
+        --sp;
+        unsigned ni = stack[sp];
+        unsigned nd = depth[sp];
+        node n = nodes[ni];
+
+        unsigned axis = 0;
+        float pos = 0;
+        if (n.count <= 1 || nd == max_depth || !find_split(n, info.data(), axis, pos)) {
+          continue;
+        }
+
+        // partition the primitives about the split
+        uint32_t *p = prims.data() + n.first;
+        unsigned i = 0, j = n.count;
+        while (i < j) {
+          if (info[p[i]].centroid[axis] < pos) {
+            ++i;
+          } else {
+            uint32_t tmp = p[i]; p[i] = p[--j]; p[j] = tmp;
+          }
+        }
+
+        // split can fail with nearly equal centroids: fall back to the median.
+        if (i == 0 || i == n.count) {
+          i = n.count / 2;
+        }
+
+        unsigned left = nodes.size();
+        nodes.resize(left + 2);
+        nodes[left].first = n.first;
+        nodes[left].count = i;
+        nodes[left+1].first = n.first + i;
+        nodes[left+1].count = n.count - i;
+        calc_leaf_bounds(nodes[left], info.data());
+        calc_leaf_bounds(nodes[left+1], info.data());
+        nodes[ni].first = left;
+        nodes[ni].count = 0;
+
+        stack[sp] = left;
+        depth[sp++] = nd + 1;
+        stack[sp] = left + 1;
+        depth[sp++] = nd + 1;
+      }
+    }
+
+    /// Update the bounds of the nodes after the primitives have moved.
+    /// This is much faster than build() but the tree gets worse if things move a lot.
+    void refit(const aabb *boxes) {
+      // children always come after their parents.
+      for (unsigned i = nodes.size(); i-- != 0; ) {
+        node &n = nodes[i];
+        if (n.count) {
+          empty_bounds(n.min, n.max);
+          for (unsigned k = 0; k != n.count; ++k) {
+            prim_info pi;
+            get_prim_info(pi, boxes[prims[n.first + k]]);
+            grow_bounds(n.min, n.max, pi.min, pi.max);
+          }
+        } else {
+          const node &l = nodes[n.first];
+          const node &r = nodes[n.first + 1];
+          empty_bounds(n.min, n.max);
+          grow_bounds(n.min, n.max, l.min, l.max);
+          grow_bounds(n.min, n.max, r.min, r.max);
+        }
+      }
+    }
+
+    /// Cast a ray start + dir * t for t in [0, t_max].
+    /// intersect(prim, t_max) must return true and reduce t_max if it hits primitive "prim".
+    /// Returns true if anything was hit.
+    template <class intersect_t> bool cast(const vec3 &start, const vec3 &dir, float &t_max, intersect_t &&intersect) const {
+      if (nodes.empty()) return false;
+
+      float org[3] = { start[0], start[1], start[2] };
+      float inv_dir[3];
+      for (unsigned j = 0; j != 3; ++j) {
+        // avoid infinities times zero for axis aligned rays.
+        float d = dir[j];
+        inv_dir[j] = 1.0f / (fabsf(d) > 1e-20f ? d : d < 0 ? -1e-20f : 1e-20f);
+      }
+
+      bool result = false;
+      float t_root = hit_node(nodes[0], org, inv_dir, t_max);
+      if (t_root < 0) return false;
+
+      // node index and entry distance. the tree depth is limited so this can't overflow.
+      unsigned stack[stack_size];
+      float stack_t[stack_size];
+      unsigned sp = 0;
+      stack[sp] = 0;
+      stack_t[sp++] = t_root;
+      while (sp) {
+        --sp;
+        if (stack_t[sp] > t_max) continue;
+        const node &n = nodes[stack[sp]];
+        if (n.count) {
+          for (unsigned k = 0; k != n.count; ++k) {
+            result |= intersect(prims[n.first + k], t_max);
+          }
+        } else {
+          // visit the nearest child first.
+          float tl = hit_node(nodes[n.first], org, inv_dir, t_max);
+          float tr = hit_node(nodes[n.first + 1], org, inv_dir, t_max);
+          unsigned near_child = n.first, far_child = n.first + 1;
+          if (tr >= 0 && (tl < 0 || tr < tl)) {
+            float tmp = tl; tl = tr; tr = tmp;
+            near_child = n.first + 1;
+            far_child = n.first;
+          }
+          if (tr >= 0) {
+            stack[sp] = far_child;
+            stack_t[sp++] = tr;
+          }
+          if (tl >= 0) {
+            stack[sp] = near_child;
+            stack_t[sp++] = tl;
+          }
+        }
+      }
+      return result;
+    }
+
+    /// Free the tree.
+    void reset() {
+      nodes.reset();
+      prims.reset();
+    }
+
+    /// Return true if there is nothing in the tree.
+    bool empty() const {
+      return nodes.empty();
+    }
+
+    /// Number of nodes in the tree (for statistics)
+    unsigned get_num_nodes() const {
+      return nodes.size();
+    }
+  };
+} }
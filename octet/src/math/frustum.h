@@ -0,0 +1,134 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// View frustum for culling
+//
+
+namespace octet { namespace math {
+  /// View frustum: six planes taken from a world to projection matrix.
+  ///
+  /// Used to skip objects that are outside the camera's view.
+  ///
+  /// Example:
+  ///
+  ///     frustum f(worldToProjection);
+  ///     f.cull(world_boxes.data(), world_boxes.size(), visible.data());
+  class frustum {
+    enum { num_planes = 6 };
+
+    // inside is dot(plane.xyz, p) + plane.w >= 0
+    // abs_normals has the absolute values of xyz for the box radius.
+    float planes[num_planes][4];
+    float abs_normals[num_planes][3];
+
+  public:
+    frustum() {
+      memset(planes, 0, sizeof(planes));
+      memset(abs_normals, 0, sizeof(abs_normals));
+    }
+
+    frustum(const mat4t &worldToProjection) {
+      init(worldToProjection);
+    }
+
+    /// Get the planes from a matrix. Use a modelToProjection matrix to cull in model space.
+    void init(const mat4t &worldToProjection) {
+      // we use row vectors (p * m), so the clip coordinates are dot products with the columns.
+      // the visible volume is -w <= x, y, z <= w
+      vec4 x = worldToProjection.colx();
+      vec4 y = worldToProjection.coly();
+      vec4 z = worldToProjection.colz();
+      vec4 w = worldToProjection.colw();
+      vec4 p[num_planes] = { w + x, w - x, w + y, w - y, w + z, w - z };
+      for (unsigned i = 0; i != num_planes; ++i) {
+        for (unsigned j = 0; j != 4; ++j) {
+          planes[i][j] = p[i][j];
+        }
+        for (unsigned j = 0; j != 3; ++j) {
+          abs_normals[i][j] = fabsf(planes[i][j]);
+        }
+      }
+    }
+
+    /// Get a plane (xyz is the inward normal).
+    vec4 get_plane(unsigned i) const {
+      return vec4(planes[i][0], planes[i][1], planes[i][2], planes[i][3]);
+    }
+
+    /// Return false if the box is completely outside one of the planes.
+    bool intersects(const aabb &box) const {
+      vec3 c = box.get_center();
+      vec3 h = box.get_half_extent();
+      for (unsigned i = 0; i != num_planes; ++i) {
+        const float *p = planes[i];
+        const float *a = abs_normals[i];
+        float d = p[0] * c[0] + p[1] * c[1] + p[2] * c[2] + p[3];
+        float r = a[0] * h[0] + a[1] * h[1] + a[2] * h[2];
+        if (d + r < 0) return false;
+      }
+      return true;
+    }
+
+    /// Test num boxes four at a time. Set visible[i] to 1 if box i may be visible and 0 if not.
+    /// Returns the number of visible boxes.
+    unsigned cull(const aabb *boxes, unsigned num, uint8_t *visible) const {
+      unsigned num_visible = 0;
+      for (unsigned i = 0; i < num; i += 4) {
+        // transpose four boxes to one component per array.
+        float cx[4], cy[4], cz[4], hx[4], hy[4], hz[4];
+        unsigned n = num - i < 4 ? num - i : 4;
+        for (unsigned k = 0; k != 4; ++k) {
+          // repeat the last box to fill the group.
+          const aabb &box = boxes[i + (k < n ? k : n - 1)];
+          vec3 c = box.get_center();
+          vec3 h = box.get_half_extent();
+          cx[k] = c[0]; cy[k] = c[1]; cz[k] = c[2];
+          hx[k] = h[0]; hy[k] = h[1]; hz[k] = h[2];
+        }
+
+        unsigned mask = 0;
+        #if OCTET_SSE2
+          __m128 vcx = _mm_loadu_ps(cx), vcy = _mm_loadu_ps(cy), vcz = _mm_loadu_ps(cz);
+          __m128 vhx = _mm_loadu_ps(hx), vhy = _mm_loadu_ps(hy), vhz = _mm_loadu_ps(hz);
+          __m128 outside = _mm_setzero_ps();
+          for (unsigned j = 0; j != num_planes; ++j) {
+            const float *p = planes[j];
+            const float *a = abs_normals[j];
+            __m128 d = _mm_add_ps(
+              _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[0]), vcx), _mm_mul_ps(_mm_set1_ps(p[1]), vcy)),
+              _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[2]), vcz), _mm_set1_ps(p[3]))
+            );
+            __m128 r = _mm_add_ps(
+              _mm_add_ps(_mm_mul_ps(_mm_set1_ps(a[0]), vhx), _mm_mul_ps(_mm_set1_ps(a[1]), vhy)),
+              _mm_mul_ps(_mm_set1_ps(a[2]), vhz)
+            );
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+          }
+          mask = ~_mm_movemask_ps(outside) & 15;
+        #else
+          for (unsigned k = 0; k != 4; ++k) {
+            bool inside = true;
+            for (unsigned j = 0; j != num_planes; ++j) {
+              const float *p = planes[j];
+              const float *a = abs_normals[j];
+              float d = p[0] * cx[k] + p[1] * cy[k] + p[2] * cz[k] + p[3];
+              float r = a[0] * hx[k] + a[1] * hy[k] + a[2] * hz[k];
+              inside = inside && d + r >= 0;
+            }
+            mask |= inside << k;
+          }
+        #endif
+
+        for (unsigned k = 0; k != n; ++k) {
+          uint8_t v = (mask >> k) & 1;
+          visible[i + k] = v;
+          num_visible += v;
+        }
+      }
+      return num_visible;
+    }
+  };
+} }
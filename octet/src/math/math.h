@@ -83,6 +83,8 @@ namespace octet {
 #include "plane.h"
 #include "half_space.h"
 #include "ray.h"
+#include "bvh.h"
+#include "frustum.h"
 #include "polygon.h"
 #include "zcylinder.h"
 #include "voxel_grid.h"
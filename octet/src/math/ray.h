@@ -30,7 +30,8 @@ namespace octet { namespace math {
     }
 
     ray get_transform(const mat4t &mat) const {
-      return ray((origin.xyz1() * mat).xyz(), (distance.xyz0() * mat).xyz());
+      vec3 new_origin = (origin.xyz1() * mat).xyz();
+      return ray(new_origin, new_origin + (distance.xyz0() * mat).xyz());
     }
 
     const char *toString(char *dest, size_t len) const {
@@ -109,7 +110,7 @@ namespace octet { namespace math {
     }
 
     vec3 get_distance() const {
-      return origin + distance;
+      return distance;
     }
   };
 
@@ -99,6 +99,9 @@
   // data storage in containers
   #include "containers/containers.h"
 
+  // timing for benchmarks
+  #include "platform/frame_timer.h"
+
   // target specific support: Windows, Mac, Linux, PS Vita
   #include "platform/machine_specific.h"
   #include "platform/args_parser.h"
@@ -109,6 +112,9 @@
   // CG, GLSL, C++ compiler
   #include "compiler/compiler.h"
 
+  // threads for data-parallel loops, shared by the loaders
+  #include "resources/job.h"
+
   // loaders (low dependency, so you can use them in other projects)
   #include "loaders/loaders.h"
 
@@ -148,7 +154,10 @@
   #include "helpers/helper_fps_controller.h"
 
   // asset loaders
+  #include "loaders/xml_reader.h"
+  #include "loaders/collada_cache.h"
   #include "loaders/collada_builder.h"
+  #include "loaders/obj_loader.h"
 
   // forward references
   #include "resources/resources.inl"
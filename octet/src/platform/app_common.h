@@ -22,6 +22,7 @@ namespace octet {
     attribute_blendindices = 7,
     attribute_texcoord = 8,
     attribute_uv = 8,
+    attribute_instance_matrix = 9, // 9-12: per-instance modelToWorld matrix for instanced drawing
     attribute_tangent = 14,
     attribute_bitangent = 15,
     attribute_binormal = 15,
@@ -106,6 +107,9 @@ namespace octet {
 
     void end_frame() {
       prev_keys = keys;
+
+      // recycle temporary memory used this frame
+      frame_allocator::reset();
     }
 
     virtual void draw_world(int x, int y, int w, int h) = 0;
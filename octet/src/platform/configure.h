@@ -50,16 +50,50 @@
 #include <array>
 #include <deque>
 #include <queue>
+#include <unordered_map>
 #include <algorithm>
 #include <numeric>
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
 
 #if defined(WIN32)
   #include <direct.h>
 #endif
 
+// SSE2 integer instructions are on every x64 cpu; used by containers and codecs.
+// (OCTET_SSE is separate as it changes the layout of the vector classes)
+#ifndef OCTET_SSE2
+  #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define OCTET_SSE2 1
+  #else
+    #define OCTET_SSE2 0
+  #endif
+#endif
+
+#if OCTET_SSE2
+  #include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#endif
+
+// per-thread storage for plain data (eg. allocator caches)
+// Visual Studio 2013 does not support the C++11 keyword.
+#if defined(_MSC_VER) && _MSC_VER < 1900
+  #define OCTET_THREAD_LOCAL __declspec(thread)
+#else
+  #define OCTET_THREAD_LOCAL thread_local
+#endif
+
 namespace octet {
   /// write some text to log.txt
   inline static FILE * log(const char *fmt, ...) {
@@ -0,0 +1,189 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Frame timing for benchmarks
+//
+
+namespace octet {
+  /// Time spent in each phase of the current frame.
+  ///
+  /// The scene adds to these with a frame_timer::scope and the benchmark runner
+  /// reads and resets them once a frame. Any thread may add to a phase; time from
+  /// worker threads is summed, so a phase can exceed the frame time.
+  ///
+  /// Example:
+  ///
+  ///     {
+  ///       frame_timer::scope s(frame_timer::phase_physics);
+  ///       world->stepSimulation(delta_time);
+  ///     }
+  class frame_timer {
+  public:
+    /// Phases may nest: update includes animation and physics.
+    enum phase {
+      phase_update,
+      phase_animation,
+      phase_physics,
+      phase_culling,
+      phase_submission,
+      phase_max,
+    };
+
+    /// Add the time from construction to destruction to a phase.
+    class scope {
+      phase p;
+      double start;
+    public:
+      scope(phase p) : p(p), start(now()) {
+      }
+
+      ~scope() {
+        add(p, now() - start);
+      }
+    };
+
+  private:
+    // nanoseconds, so that threads can add with an atomic integer add.
+    static std::atomic<int64_t> *totals() {
+      static std::atomic<int64_t> values[phase_max];
+      return values;
+    }
+
+  public:
+    /// Time in seconds from an arbitrary start.
+    static double now() {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// Add some seconds to a phase.
+    static void add(phase p, double seconds) {
+      totals()[p].fetch_add((int64_t)(seconds * 1e9), std::memory_order_relaxed);
+    }
+
+    /// Seconds spent in a phase since the last reset.
+    static double get(phase p) {
+      return totals()[p].load(std::memory_order_relaxed) * 1e-9;
+    }
+
+    /// Set all the phases to zero.
+    static void reset() {
+      for (unsigned p = 0; p != phase_max; ++p) {
+        totals()[p].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    /// Name of a phase for reports.
+    static const char *get_name(phase p) {
+      static const char *names[] = { "update", "animation", "physics", "culling", "submission" };
+      return p < phase_max ? names[p] : "";
+    }
+  };
+
+  /// Records the frame time and the phase times of every frame and writes them to a file.
+  class frame_recorder {
+    // one row per frame: total followed by the phases. all in milliseconds.
+    enum { row_size = 1 + frame_timer::phase_max };
+    dynarray<float> rows;
+    double frame_start;
+
+    unsigned get_num_frames() const {
+      return rows.size() / row_size;
+    }
+
+    static bool ends_with(const char *str, const char *ext) {
+      size_t len = strlen(str), ext_len = strlen(ext);
+      return len >= ext_len && !strcmp(str + len - ext_len, ext);
+    }
+
+  public:
+    frame_recorder() {
+      frame_start = 0;
+    }
+
+    /// Call before the frame starts.
+    void begin_frame() {
+      frame_timer::reset();
+      frame_start = frame_timer::now();
+    }
+
+    /// Call after the frame finishes.
+    void end_frame() {
+      float total = (float)((frame_timer::now() - frame_start) * 1000);
+      rows.push_back(total);
+      for (unsigned p = 0; p != frame_timer::phase_max; ++p) {
+        rows.push_back((float)(frame_timer::get((frame_timer::phase)p) * 1000));
+      }
+    }
+
+    /// Write the frames as CSV, or as JSON if the file name ends in .json.
+    bool write(const char *path) const {
+      FILE *file = fopen(path, "wb");
+      if (!file) return false;
+
+      bool json = ends_with(path, ".json");
+      unsigned num_frames = get_num_frames();
+      if (json) {
+        fprintf(file, "{\n  \"frames\": [\n");
+      } else {
+        fprintf(file, "frame,total_ms");
+        for (unsigned p = 0; p != frame_timer::phase_max; ++p) {
+          fprintf(file, ",%s_ms", frame_timer::get_name((frame_timer::phase)p));
+        }
+        fprintf(file, "\n");
+      }
+
+      for (unsigned i = 0; i != num_frames; ++i) {
+        const float *row = rows.data() + i * row_size;
+        if (json) {
+          fprintf(file, "    { \"frame\": %d, \"total_ms\": %.4f", i, row[0]);
+          for (unsigned p = 0; p != frame_timer::phase_max; ++p) {
+            fprintf(file, ", \"%s_ms\": %.4f", frame_timer::get_name((frame_timer::phase)p), row[1 + p]);
+          }
+          fprintf(file, " }%s\n", i + 1 == num_frames ? "" : ",");
+        } else {
+          fprintf(file, "%d,%.4f", i, row[0]);
+          for (unsigned p = 0; p != frame_timer::phase_max; ++p) {
+            fprintf(file, ",%.4f", row[1 + p]);
+          }
+          fprintf(file, "\n");
+        }
+      }
+
+      if (json) {
+        fprintf(file, "  ]\n}\n");
+      }
+      fclose(file);
+      return true;
+    }
+
+    /// Print the mean, median, 95th percentile and worst frame times and the mean of each phase.
+    void print_summary(FILE *file) const {
+      unsigned num_frames = get_num_frames();
+      if (num_frames == 0) return;
+
+      dynarray<float> totals(num_frames);
+      double phase_sum[frame_timer::phase_max] = {};
+      double sum = 0;
+      for (unsigned i = 0; i != num_frames; ++i) {
+        const float *row = rows.data() + i * row_size;
+        totals[i] = row[0];
+        sum += row[0];
+        for (unsigned p = 0; p != frame_timer::phase_max; ++p) {
+          phase_sum[p] += row[1 + p];
+        }
+      }
+      std::sort(totals.data(), totals.data() + num_frames);
+
+      fprintf(
+        file, "%d frames: mean %.3fms median %.3fms p95 %.3fms max %.3fms\n",
+        num_frames, sum / num_frames, totals[num_frames / 2], totals[num_frames * 95 / 100], totals[num_frames - 1]
+      );
+      for (unsigned p = 0; p != frame_timer::phase_max; ++p) {
+        fprintf(file, "  %-10s %.3fms\n", frame_timer::get_name((frame_timer::phase)p), phase_sum[p] / num_frames);
+      }
+    }
+  };
+}
@@ -767,6 +767,13 @@ typedef struct __GLsync *GLsync;
 #define GL_NUM_SAMPLE_COUNTS                             0x9380
 #define GL_TEXTURE_IMMUTABLE_LEVELS                      0x82DF
 
+/* Desktop GL used by octet */
+#define GL_POLYGON                                       0x0009
+#define GL_COMPUTE_SHADER                                0x91B9
+#define GL_SHADER_STORAGE_BUFFER                         0x90D2
+#define GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT               0x00000001
+
+
 class gl_container {
   struct variant {
     enum kind_t {
@@ -811,6 +818,7 @@ public:
     } else if (i.kind == variant::kind_unsigned) {
       for (unsigned i = 0; i != max_results; ++i) results[i] = (unsigned)i.f[i];
     }*/
+    return true;
   }
 };
 
@@ -832,11 +840,33 @@ class gl_framebuffer : public gl_container {
 class gl_context : public gl_container {
 
   unsigned error;
+
+  // names for buffers, textures, programs etc. zero is never used.
+  unsigned next_name;
 public:
+  gl_context() {
+    error = 0;
+    next_name = 1;
+  }
 
   void set_error(unsigned value) {
     error = value;
   }
+
+  // return the last error and clear it.
+  unsigned get_error() {
+    unsigned result = error;
+    error = 0;
+    return result;
+  }
+
+  unsigned gen_name() {
+    return next_name++;
+  }
+
+  void gen_names(GLsizei n, GLuint *names) {
+    for (GLsizei i = 0; i < n; ++i) names[i] = gen_name();
+  }
 };
 
 gl_context *gl_ctxt(gl_context *in = 0) {
@@ -942,7 +972,7 @@ GL_APICALL void GL_APIENTRY glBufferSubData (GLenum target, GLintptr offset, GLs
 
 GL_APICALL GLenum GL_APIENTRY glCheckFramebufferStatus (GLenum target) {
   gl_context *ctxt = gl_ctxt();
-  return 0;
+  return GL_FRAMEBUFFER_COMPLETE;
 }
 
 
@@ -1002,13 +1032,13 @@ GL_APICALL void GL_APIENTRY glCopyTexSubImage2D (GLenum target, GLint level, GLi
 
 GL_APICALL GLuint GL_APIENTRY glCreateProgram (void) {
   gl_context *ctxt = gl_ctxt();
-  return 0;
+  return ctxt->gen_name();
 }
 
 
 GL_APICALL GLuint GL_APIENTRY glCreateShader (GLenum type) {
   gl_context *ctxt = gl_ctxt();
-  return 0;
+  return ctxt->gen_name();
 }
 
 
@@ -1124,6 +1154,7 @@ GL_APICALL void GL_APIENTRY glFrontFace (GLenum mode) {
 
 GL_APICALL void GL_APIENTRY glGenBuffers (GLsizei n, GLuint* buffers) {
   gl_context *ctxt = gl_ctxt();
+  ctxt->gen_names(n, buffers);
 }
 
 
@@ -1134,16 +1165,19 @@ GL_APICALL void GL_APIENTRY glGenerateMipmap (GLenum target) {
 
 GL_APICALL void GL_APIENTRY glGenFramebuffers (GLsizei n, GLuint* framebuffers) {
   gl_context *ctxt = gl_ctxt();
+  ctxt->gen_names(n, framebuffers);
 }
 
 
 GL_APICALL void GL_APIENTRY glGenRenderbuffers (GLsizei n, GLuint* renderbuffers) {
   gl_context *ctxt = gl_ctxt();
+  ctxt->gen_names(n, renderbuffers);
 }
 
 
 GL_APICALL void GL_APIENTRY glGenTextures (GLsizei n, GLuint* textures) {
   gl_context *ctxt = gl_ctxt();
+  ctxt->gen_names(n, textures);
 }
 
 
@@ -1164,11 +1198,13 @@ GL_APICALL void GL_APIENTRY glGetAttachedShaders (GLuint program, GLsizei maxcou
 
 GL_APICALL GLint GL_APIENTRY glGetAttribLocation (GLuint program, const GLchar* name) {
   gl_context *ctxt = gl_ctxt();
+  return -1;
 }
 
 
 GL_APICALL void GL_APIENTRY glGetBooleanv (GLenum pname, GLboolean* params) {
   gl_context *ctxt = gl_ctxt();
+  params[0] = 0;
 }
 
 
@@ -1179,11 +1215,13 @@ GL_APICALL void GL_APIENTRY glGetBufferParameteriv (GLenum target, GLenum pname,
 
 GL_APICALL GLenum GL_APIENTRY glGetError (void) {
   gl_context *ctxt = gl_ctxt();
+  return ctxt->get_error();
 }
 
 
 GL_APICALL void GL_APIENTRY glGetFloatv (GLenum pname, GLfloat* params) {
   gl_context *ctxt = gl_ctxt();
+  params[0] = 0;
 }
 
 
@@ -1194,16 +1232,20 @@ GL_APICALL void GL_APIENTRY glGetFramebufferAttachmentParameteriv (GLenum target
 
 GL_APICALL void GL_APIENTRY glGetIntegerv (GLenum pname, GLint* params) {
   gl_context *ctxt = gl_ctxt();
+  params[0] = 0;
 }
 
 
 GL_APICALL void GL_APIENTRY glGetProgramiv (GLuint program, GLenum pname, GLint* params) {
   gl_context *ctxt = gl_ctxt();
+  *params = pname == GL_COMPILE_STATUS || pname == GL_LINK_STATUS ? GL_TRUE : 0;
 }
 
 
 GL_APICALL void GL_APIENTRY glGetProgramInfoLog (GLuint program, GLsizei bufsize, GLsizei* length, GLchar* infolog) {
   gl_context *ctxt = gl_ctxt();
+  if (length) *length = 0;
+  if (bufsize) infolog[0] = 0;
 }
 
 
@@ -1214,11 +1256,14 @@ GL_APICALL void GL_APIENTRY glGetRenderbufferParameteriv (GLenum target, GLenum
 
 GL_APICALL void GL_APIENTRY glGetShaderiv (GLuint shader, GLenum pname, GLint* params) {
   gl_context *ctxt = gl_ctxt();
+  *params = pname == GL_COMPILE_STATUS || pname == GL_LINK_STATUS ? GL_TRUE : 0;
 }
 
 
 GL_APICALL void GL_APIENTRY glGetShaderInfoLog (GLuint shader, GLsizei bufsize, GLsizei* length, GLchar* infolog) {
   gl_context *ctxt = gl_ctxt();
+  if (length) *length = 0;
+  if (bufsize) infolog[0] = 0;
 }
 
 
@@ -1285,6 +1330,7 @@ GL_APICALL void GL_APIENTRY glHint (GLenum target, GLenum mode) {
 
 
 GL_APICALL GLboolean GL_APIENTRY glIsBuffer (GLuint buffer) {
+  return buffer != 0;
   gl_context *ctxt = gl_ctxt();
 }
 
@@ -1635,6 +1681,7 @@ GL_APICALL void GL_APIENTRY glCompressedTexSubImage3D (GLenum target, GLint leve
 
 GL_APICALL void GL_APIENTRY glGenQueries (GLsizei n, GLuint* ids) {
   gl_context *ctxt = gl_ctxt();
+  ctxt->gen_names(n, ids);
 }
 
 
@@ -1753,6 +1800,7 @@ GL_APICALL void GL_APIENTRY glDeleteVertexArrays (GLsizei n, const GLuint* array
 
 GL_APICALL void GL_APIENTRY glGenVertexArrays (GLsizei n, GLuint* arrays) {
   gl_context *ctxt = gl_ctxt();
+  ctxt->gen_names(n, arrays);
 }
 
 
@@ -2005,6 +2053,7 @@ GL_APICALL void GL_APIENTRY glGetBufferParameteri64v (GLenum target, GLenum pnam
 
 GL_APICALL void GL_APIENTRY glGenSamplers (GLsizei count, GLuint* samplers) {
   gl_context *ctxt = gl_ctxt();
+  ctxt->gen_names(count, samplers);
 }
 
 
@@ -2071,6 +2120,7 @@ GL_APICALL void GL_APIENTRY glDeleteTransformFeedbacks (GLsizei n, const GLuint*
 
 GL_APICALL void GL_APIENTRY glGenTransformFeedbacks (GLsizei n, GLuint* ids) {
   gl_context *ctxt = gl_ctxt();
+  ctxt->gen_names(n, ids);
 }
 
 
@@ -2129,3 +2179,13 @@ GL_APICALL void GL_APIENTRY glGetInternalformativ (GLenum target, GLenum interna
   gl_context *ctxt = gl_ctxt();
 }
 
+
+GL_APICALL void GL_APIENTRY glDispatchCompute (GLuint num_groups_x, GLuint num_groups_y, GLuint num_groups_z) {
+  gl_context *ctxt = gl_ctxt();
+}
+
+
+GL_APICALL void GL_APIENTRY glMemoryBarrier (GLbitfield barriers) {
+  gl_context *ctxt = gl_ctxt();
+}
+
@@ -36,6 +36,10 @@
   #include <OpenGL/gl.h>
   #include <OpenGL/glext.h>
   #include <GLUT/glut.h>
+  // instancing is an extension in the legacy context
+  #define glDrawArraysInstanced glDrawArraysInstancedARB
+  #define glDrawElementsInstanced glDrawElementsInstancedARB
+  #define glVertexAttribDivisor glVertexAttribDivisorARB
   #if OCTET_OPENCL
     #include <OpenCL/opencl.h>
   #endif
@@ -152,7 +156,7 @@ namespace octet {
     static void timer(int value) {
       glutTimerFunc(16, timer, 1);
       map_t &m = map();
-      for (int i = 0; i != m.size(); ++i) {
+      for (unsigned i = 0; i != m.get_num_indices(); ++i) {
         if (m.get_key(i)) {
           glutSetWindow(m.get_key(i));
           glutPostRedisplay();
@@ -177,7 +181,7 @@ namespace octet {
 
     static void run_all_apps() {
       map_t &m = map();
-      for (int i = 0; i != m.size(); ++i) {
+      for (unsigned i = 0; i != m.get_num_indices(); ++i) {
         if (m.get_key(i)) {
           glutSetWindow(m.get_key(i));
           glutDisplayFunc(display);
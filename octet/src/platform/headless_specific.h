@@ -0,0 +1,144 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Headless platform: no window, GPU or sound card.
+//
+// Build with -DOCTET_HEADLESS to run the apps for a number of frames on a server.
+// GL and AL calls do nothing and gl_resource keeps its data on the CPU.
+//
+// Command line:
+//
+//   --frames=N          number of frames to run (default 600)
+//   --size=WxH          viewport size (default 512x512)
+//   --benchmark=file    write the frame times to file.csv or file.json
+//
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#define OCTET_HOT __attribute__( ( always_inline ) )
+#define ioctlsocket ioctl
+#define closesocket close
+
+// keep copies of buffers on the CPU as there is nothing to map.
+#ifndef OCTET_GLES2
+  #define OCTET_GLES2 1
+#endif
+
+#include "gl_skeleton.h"
+#include "al_defs.h"
+
+// include cross platform app helpers, such as texture loaders
+#include "video_capture.h"
+#include "app_common.h"
+
+namespace octet {
+  // this is the class that all apps are derived from.
+  class app : public app_common {
+    struct settings {
+      unsigned num_frames;
+      int width;
+      int height;
+      const char *benchmark_path;
+    };
+
+    static settings &get_settings() {
+      static settings instance = { 600, 512, 512, 0 };
+      return instance;
+    }
+
+    static dynarray<app*> &apps() {
+      static dynarray<app*> instance;
+      return instance;
+    }
+
+  public:
+    // constructor
+    app(int argc, char **argv) {
+    }
+
+    // initialiser (it is nice to keep the two separate for aggregate memory allocation)
+    void init() {
+      settings &s = get_settings();
+      set_viewport_size(s.width, s.height);
+      apps().push_back(this);
+      app_init();
+    }
+
+    void render() {
+      begin_frame();
+
+      int vx, vy;
+      get_viewport_size(vx, vy);
+      draw_world(0, 0, vx, vy);
+      inc_frame_number();
+      end_frame();
+    }
+
+    void disable_cursor() const {
+    }
+
+    void enable_cursor() const {
+    }
+
+    ~app() {
+    }
+
+    static void init_all(int &argc, char **argv) {
+      settings &s = get_settings();
+      for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (!strncmp(arg, "--frames=", 9)) {
+          s.num_frames = (unsigned)atoi(arg + 9);
+        } else if (!strncmp(arg, "--size=", 7)) {
+          sscanf(arg + 7, "%dx%d", &s.width, &s.height);
+        } else if (!strncmp(arg, "--benchmark=", 12)) {
+          s.benchmark_path = arg + 12;
+        }
+      }
+
+      gl_ctxt(new gl_context());
+      alcMakeContextCurrent(alcCreateContext(alcOpenDevice(NULL), NULL));
+    }
+
+    // render every app for the number of frames and record the frame times.
+    static void run_all_apps() {
+      settings &s = get_settings();
+      dynarray<app*> &a = apps();
+      frame_recorder recorder;
+      for (unsigned frame = 0; frame != s.num_frames; ++frame) {
+        recorder.begin_frame();
+        for (unsigned i = 0; i != a.size(); ++i) {
+          a[i]->render();
+        }
+        recorder.end_frame();
+      }
+
+      recorder.print_summary(stdout);
+      if (s.benchmark_path && !recorder.write(s.benchmark_path)) {
+        printf("could not write %s\n", s.benchmark_path);
+      }
+    }
+
+    static void error(const char *msg) {
+      printf("%s - exiting\n", msg);
+      exit(1);
+    }
+  };
+
+  inline static unsigned rev16(unsigned value) {
+    value = ( ( value >> 1 ) & 0x5555 ) | ( ( value & 0x5555 ) << 1 );
+    value = ( ( value >> 2 ) & 0x3333 ) | ( ( value & 0x3333 ) << 2 );
+    value = ( ( value >> 4 ) & 0x0f0f ) | ( ( value & 0x0f0f ) << 4 );
+    value = ( ( value >> 8 ) & 0x00ff ) | ( ( value & 0x00ff ) << 8 );
+    return value;
+  }
+}
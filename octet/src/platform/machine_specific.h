@@ -29,7 +29,9 @@ static char *get_sprintf_buffer() {
   return tmp[i++ & 3];
 }
 
-#if defined(__GENERIC__)
+#if defined(OCTET_HEADLESS)
+  #include "headless_specific.h"
+#elif defined(__GENERIC__)
   #include "generic.h"
 #elif defined(WIN32)
   #include "direct_show.h"
@@ -42,6 +44,8 @@ static char *get_sprintf_buffer() {
   #include <sys/socket.h>
   #include <sys/ioctl.h>
   #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
   #include <netinet/in.h>
   #define OCTET_HOT __attribute__( ( always_inline ) )
   #define ioctlsocket ioctl
@@ -52,6 +52,8 @@ namespace octet { namespace resources {
     /// open a zip file for a given URL
     static zip_file *get_zip_file(const char *url) {
       static dictionary<ref<zip_file> > zip_files;
+      static std::mutex zip_files_mutex;
+      std::lock_guard<std::mutex> lock(zip_files_mutex);
       int index = zip_files.get_index(url);
       if (index == -1) {
         return zip_files[url] = new zip_file(get_path(url));
@@ -118,6 +120,40 @@ namespace octet { namespace resources {
       }
     }
 
+    /// Get a file without copying it, given a URL.
+    /// Regular files are mapped into memory and the span keeps the mapping until the last copy goes.
+    /// Stored files in zip files are not followed by a zero byte.
+    static void get_url(byte_span &span, const char *url, file_map::access_hint hint = file_map::access_sequential) {
+      if (!strncmp(url, "zip://", 6)) {
+        // stored files come straight from the zip file's mapping.
+        const char *zip = strstr(url + 6, ".zip");
+        span.reset();
+        if (zip) {
+          int path_len = (int)(zip - (url + 6) + 4);
+          string zip_url;
+          zip_url.set(url + 6, path_len);
+          const char *file = (url + 6) + path_len;
+          file += file[0] == '/';
+          get_zip_file(zip_url.c_str())->get_file(span, file);
+        }
+      } else if (!strncmp(url, "http://", 7)) {
+        dynarray<uint8_t> buffer;
+        get_url(buffer, url);
+        span = byte_span(new file_map(std::move(buffer)));
+      } else {
+        const char *path = get_path(url);
+        file_map *map = new file_map(path, hint);
+        if (map->get_error()) {
+          char tmp[1024];
+          printf("file %s not found. cwd=%s\n", path, getcwd(tmp, sizeof(tmp)));
+          delete map;
+          span.reset();
+        } else {
+          span = byte_span(map);
+        }
+      }
+    }
+
     /// Generate a stock texture. To be deprecated.
     static GLuint get_stock_texture(unsigned gl_kind, const char *name) {
       //stock_texture_generator stock;
@@ -232,13 +268,13 @@ namespace octet { namespace resources {
           (*dict)[predefined_atom(num_atoms)] = (atom_t)num_atoms;
         }
       }
-      if (dict->contains(name)) {
-        //log("old atom %s %d\n", name, (*dict)[name]);
-        return (*dict)[name];
-      } else {
+      // one lookup for both old and new atoms (new values start at zero)
+      atom_t &atom = (*dict)[name];
+      if (atom == atom_) {
         //log("new atom %s %d\n", name, num_atoms);
-        return (*dict)[name] = (atom_t)num_atoms++;
+        atom = (atom_t)num_atoms++;
       }
+      return atom;
     }
 
     /// Get the text of a predefined atom (atom_*)
@@ -144,3 +144,14 @@ OCTET_ATOM(npos)
 OCTET_ATOM(diffuse_light)
 OCTET_ATOM(specular_light)
 OCTET_ATOM(first_index)
+OCTET_ATOM(compressed)
+OCTET_ATOM(timelines)
+OCTET_ATOM(key_times)
+OCTET_ATOM(key_values)
+OCTET_ATOM(packed_keys)
+OCTET_ATOM(tracks)
+OCTET_ATOM(pose_size)
+OCTET_ATOM(layers)
+OCTET_ATOM(anims)
+OCTET_ATOM(masks)
+OCTET_ATOM(version)
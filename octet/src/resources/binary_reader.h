@@ -112,6 +112,15 @@ namespace octet { namespace resources {
       return true;
     }
 
+    /// true if the next thing in the file is the end of the current object.
+    bool is_end_of_ref() {
+      if (get_error()) return false;
+      long pos = ftell(file);
+      atom_t next = read_atom();
+      fseek(file, pos, SEEK_SET);
+      return next == atom_end_ref;
+    }
+
     /// register a reference after creating a new object
     void add_new_ref(void *ref) {
       id_to_ref.push_back(ref);
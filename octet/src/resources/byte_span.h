@@ -0,0 +1,89 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// shared read only bytes
+
+namespace octet { namespace resources {
+  /// Read only bytes borrowed from a file_map.
+  ///
+  /// Copies share the same storage, which is freed when the last span goes.
+  /// A span of a whole file_map is followed by a zero byte. Parts of a span, such as
+  /// stored files in a zip_file, are not: use begin() and end(), not the terminator.
+  ///
+  /// Example:
+  ///
+  ///     byte_span bytes;
+  ///     app_utils::get_url(bytes, "assets/big.jpg");
+  ///     decoder.get_image(..., bytes.begin(), bytes.end());
+  class byte_span {
+    ref<file_map> storage;
+    const uint8_t *data_;
+    size_t size_;
+
+  public:
+    /// An empty span.
+    byte_span() {
+      data_ = 0;
+      size_ = 0;
+    }
+
+    /// All the bytes of a file_map.
+    byte_span(file_map *map) : storage(map) {
+      data_ = map->get_data();
+      size_ = (size_t)map->get_size();
+    }
+
+    /// Part of another span, sharing its storage.
+    byte_span(const byte_span &parent, size_t offset, size_t size) : storage(parent.storage) {
+      offset = offset < parent.size_ ? offset : parent.size_;
+      size = size < parent.size_ - offset ? size : parent.size_ - offset;
+      data_ = parent.data_ + offset;
+      size_ = size;
+    }
+
+    /// Forget the bytes, freeing the storage if this is the last span.
+    void reset() {
+      storage = (file_map*)0;
+      data_ = 0;
+      size_ = 0;
+    }
+
+    /// first byte
+    const uint8_t *data() const {
+      return data_;
+    }
+
+    /// number of bytes
+    size_t size() const {
+      return size_;
+    }
+
+    /// true if there are no bytes
+    bool empty() const {
+      return size_ == 0;
+    }
+
+    /// first byte
+    const uint8_t *begin() const {
+      return data_;
+    }
+
+    /// one after the last byte
+    const uint8_t *end() const {
+      return data_ + size_;
+    }
+
+    /// Ask the system to start reading these bytes from disk.
+    void prefetch() const {
+      if (storage) storage->will_need(data_, size_);
+    }
+
+    /// get one byte
+    const uint8_t &operator[](size_t index) const {
+      return data_[index];
+    }
+  };
+} }
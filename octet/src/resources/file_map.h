@@ -6,75 +6,252 @@
 //
 // map a file to memory
 
-class file_map {
-  #ifdef WIN32
-    HANDLE file_handle;
-    HANDLE mapping_handle;
-  #else
-    int file_handle;
-  #endif
-  uint64_t size;
-  const uint8_t *data;
-  const char *error;
-public:
-  file_map(const char *file_name) {
-    error = 0;
-    data = 0;
-    size = 0;
-
-    if (file_name == NULL) {
-      error = "no file name";
-      return;
-    }
+namespace octet { namespace resources {
+  /// Read only view of a whole file in memory.
+  ///
+  /// On Windows, Mac and Linux the file is mapped, so the pages are only read when they are used
+  /// and nothing is copied. The bytes are always followed by at least one zero,
+  /// so text files can be parsed in place.
+  ///
+  /// Use ref<file_map> or byte_span to share the mapping.
+  ///
+  /// A copy on write map can be changed in memory (eg. by an in-place parser) without
+  /// changing the file. Only the pages that are written are copied.
+  ///
+  /// Example:
+  ///
+  ///     ref<file_map> map = new file_map("big.dae");
+  ///     if (!map->get_error()) {
+  ///       parse(map->get_data(), map->get_size());
+  ///     }
+  class file_map {
+  public:
+    /// How the bytes will be read. This is a hint to the virtual memory system.
+    enum access_hint {
+      access_sequential, ///< read once from start to end: read ahead and drop pages early.
+      access_random,     ///< read a little from many places (eg. zip file directories).
+      access_normal,     ///< no hint.
+    };
+
+  private:
+    std::atomic<int> ref_cnt;
 
     #ifdef WIN32
-      mapping_handle = INVALID_HANDLE_VALUE;
+      HANDLE file_handle;
+      HANDLE mapping_handle;
+    #endif
 
-      file_handle = CreateFileA(
-        file_name, GENERIC_READ, FILE_SHARE_READ, 0,
-        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0
-      );
+    uint64_t size;
+    const uint8_t *data;
+    const char *error;
+    bool writable;
 
-      if (file_handle == INVALID_HANDLE_VALUE) {
+    // address and length of the mapping including the zero bytes at the end.
+    void *map_base;
+    size_t map_size;
+
+    // used if we can not map the file.
+    dynarray<uint8_t> copy;
+
+    // read the whole file into memory with a zero on the end.
+    void read_copy(const char *file_name) {
+      FILE *file = fopen(file_name, "rb");
+      if (!file) {
         error = "could not open file";
         return;
       }
+      fseek(file, 0, SEEK_END);
+      long file_size = ftell(file);
+      fseek(file, 0, SEEK_SET);
+      copy.resize((unsigned)file_size + 1);
+      copy[(unsigned)file_size] = 0;
+      size = fread(copy.data(), 1, (size_t)file_size, file);
+      fclose(file);
+      data = copy.data();
+      writable = true;
+    }
 
-      DWORD sizehi = 0, sizelo = GetFileSize(file_handle, &sizehi);
-      size = ((uint64_t)sizehi << 32) | sizelo;
-      mapping_handle = CreateFileMappingA(file_handle, 0, PAGE_READONLY, 0, 0, 0);
+    void init() {
+      ref_cnt = 0;
+      error = 0;
+      data = 0;
+      size = 0;
+      writable = false;
+      map_base = 0;
+      map_size = 0;
+      #ifdef WIN32
+        file_handle = INVALID_HANDLE_VALUE;
+        mapping_handle = NULL;
+      #endif
+    }
+
+  public:
+    /// Map a file for reading, or for reading and changing in memory if copy_on_write is true.
+    file_map(const char *file_name, access_hint hint = access_sequential, bool copy_on_write = false) {
+      init();
 
-      if (mapping_handle == INVALID_HANDLE_VALUE) {
-        error = "could not map file";
+      if (file_name == NULL) {
+        error = "no file name";
         return;
       }
 
-      data = (const uint8_t *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
-    #else
-      //file_handle = open(file_name, O_RDONLY);
-      //mmap
-    #endif
-  }
+      #if defined(WIN32)
+        file_handle = CreateFileA(
+          file_name, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING,
+          hint == access_sequential ? FILE_FLAG_SEQUENTIAL_SCAN : hint == access_random ? FILE_FLAG_RANDOM_ACCESS : FILE_ATTRIBUTE_NORMAL,
+          0
+        );
 
-  ~file_map() {
-    #ifdef WIN32
-      UnmapViewOfFile(data);
-      CloseHandle(file_handle);
-      CloseHandle(mapping_handle);
-    #else
-    #endif
-  }
+        if (file_handle == INVALID_HANDLE_VALUE) {
+          error = "could not open file";
+          return;
+        }
 
-  const char *get_error() const {
-    return error;
-  }
+        DWORD sizehi = 0, sizelo = GetFileSize(file_handle, &sizehi);
+        size = ((uint64_t)sizehi << 32) | sizelo;
 
-  const uint8_t *get_data() const {
-    return data;
-  }
+        // views end at a page boundary, so a whole number of pages has no zero after it.
+        if ((size & 4095) == 0 || size >= (size_t)-1) {
+          CloseHandle(file_handle);
+          file_handle = INVALID_HANDLE_VALUE;
+          size = 0;
+          read_copy(file_name);
+          return;
+        }
 
-  uint64_t get_size() const {
-    return size;
-  }
-};
+        mapping_handle = CreateFileMappingA(file_handle, 0, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, 0);
 
+        if (mapping_handle == NULL) {
+          error = "could not map file";
+          return;
+        }
+
+        map_base = MapViewOfFile(mapping_handle, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+        map_size = (size_t)size;
+        data = (const uint8_t *)map_base;
+        writable = copy_on_write;
+      #elif defined(__APPLE__) || defined(OCTET_LINUX) || defined(OCTET_HEADLESS)
+        #if defined(O_LARGEFILE)
+          int fd = open(file_name, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+        #else
+          int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+        #endif
+        if (fd < 0) {
+          error = "could not open file";
+          return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+          close(fd);
+          error = "could not open file";
+          return;
+        }
+
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size = (uint64_t)st.st_size;
+        if (size >= (uint64_t)((size_t)-1 - page_size)) {
+          close(fd);
+          size = 0;
+          error = "file too large to map";
+          return;
+        }
+
+        // reserve zero pages with at least one byte more than the file and map the file over the start.
+        // the rest of the last page of a file mapping is also zero.
+        map_size = ((size_t)size + page_size) & ~(page_size - 1);
+        int prot = copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ;
+        map_base = mmap(0, map_size, prot, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (map_base == MAP_FAILED) {
+          map_base = 0;
+          close(fd);
+          error = "could not map file";
+          return;
+        }
+
+        if (size && mmap(map_base, (size_t)size, prot, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+          close(fd);
+          error = "could not map file";
+          return;
+        }
+
+        // the mapping keeps the file open.
+        close(fd);
+
+        if (size) {
+          madvise(map_base, (size_t)size, hint == access_sequential ? MADV_SEQUENTIAL : hint == access_random ? MADV_RANDOM : MADV_NORMAL);
+          if (hint == access_sequential) {
+            // start reading now rather than on the first page fault.
+            madvise(map_base, (size_t)size, MADV_WILLNEED);
+          }
+        }
+        data = (const uint8_t *)map_base;
+        writable = copy_on_write;
+      #else
+        read_copy(file_name);
+      #endif
+    }
+
+    /// Share bytes that are already in memory (eg. from a zip file) like a mapped file.
+    file_map(dynarray<uint8_t> &&bytes) {
+      init();
+      copy = std::move(bytes);
+      size = copy.size();
+      copy.push_back(0);
+      data = copy.data();
+      writable = true;
+    }
+
+    ~file_map() {
+      #if defined(WIN32)
+        if (map_base) UnmapViewOfFile(map_base);
+        if (mapping_handle != NULL) CloseHandle(mapping_handle);
+        if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+      #elif defined(__APPLE__) || defined(OCTET_LINUX) || defined(OCTET_HEADLESS)
+        if (map_base) munmap(map_base, map_size);
+      #endif
+    }
+
+    /// allow ref<file_map>
+    void add_ref() {
+      ref_cnt++;
+    }
+
+    /// allow ref<file_map>
+    void release() {
+      if (--ref_cnt == 0) {
+        delete this;
+      }
+    }
+
+    /// Ask the system to start reading part of the mapping from disk.
+    void will_need(const uint8_t *ptr, size_t bytes) const {
+      #if defined(__APPLE__) || defined(OCTET_LINUX) || defined(OCTET_HEADLESS)
+        if (!map_base || ptr < data || ptr + bytes > data + size) return;
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t)ptr & ~(uintptr_t)(page_size - 1);
+        madvise((void*)start, (uintptr_t)(ptr + bytes) - start, MADV_WILLNEED);
+      #endif
+    }
+
+    /// Return NULL if the file was mapped or a message if not.
+    const char *get_error() const {
+      return error;
+    }
+
+    /// Get the first byte of the file.
+    const uint8_t *get_data() const {
+      return data;
+    }
+
+    /// Get the first byte of a copy on write map or a copy, or NULL if the bytes are read only.
+    uint8_t *get_writable_data() const {
+      return writable ? (uint8_t*)data : 0;
+    }
+
+    /// Get the size of the file in bytes.
+    uint64_t get_size() const {
+      return size;
+    }
+  };
+} }
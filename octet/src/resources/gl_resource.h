@@ -7,15 +7,25 @@
 // a gl_resource can be stored in a gl buffer or allocated memory
 //
 
+// fence sync objects need GL 3.2 or GLES3. Without them, streaming buffers are orphaned instead.
+#if !defined(OCTET_GLES2) && !defined(__APPLE__)
+  #define OCTET_GL_FENCES 1
+#else
+  #define OCTET_GL_FENCES 0
+#endif
+
 namespace octet { namespace resources {
   /// Wrapper for an OpenGL resource.
+  ///
+  /// Optionally keeps a copy of the data in CPU memory (set_shadow) so that reads do not map the buffer.
+  /// Buffers rewritten every frame, such as particles, should use set_streaming().
   class gl_resource : public resource {
-    #ifdef OCTET_GLES2
-      // in GLES2, we need to have a second buffer containing the data
-      dynarray<uint8_t> bytes;
-    #else
-      size_t size;
-    #endif
+    // copy of the data in CPU memory. In GLES2, we always need this.
+    dynarray<uint8_t> bytes;
+    bool has_shadow;
+
+    // size of one copy of the data
+    size_t size;
 
     // This buffer object contains the bytes in GPU memory
     GLuint buffer;
@@ -23,6 +33,83 @@ namespace octet { namespace resources {
     // GL_ARRAY_BUFFER etc.
     GLuint target;
 
+    // GL_STATIC_DRAW etc.
+    GLuint usage;
+
+    // changes whenever the contents may have changed.
+    mutable unsigned version;
+
+    // streaming buffers have several copies of the data (segments) and each write
+    // goes to the next one, so we never write to data the GPU may be using.
+    enum { max_segments = 3 };
+    bool streaming;
+    unsigned num_segments;
+    mutable unsigned segment;
+    #if OCTET_GL_FENCES
+      mutable GLsync fences[max_segments];
+    #endif
+
+    static unsigned next_version() {
+      static std::atomic<unsigned> counter;
+      return ++counter;
+    }
+
+    // move to the next segment before writing a streaming buffer.
+    void next_segment() const {
+      #if OCTET_GL_FENCES
+        if (num_segments > 1) {
+          // commands so far may use the current segment.
+          if (fences[segment]) glDeleteSync(fences[segment]);
+          fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+          segment = (segment + 1) % num_segments;
+
+          // usually the GPU finished with this segment some frames ago.
+          if (fences[segment]) {
+            glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, (GLuint64)1000000000);
+            glDeleteSync(fences[segment]);
+            fences[segment] = 0;
+          }
+        }
+      #endif
+    }
+
+    void delete_fences() {
+      #if OCTET_GL_FENCES
+        for (unsigned i = 0; i != max_segments; ++i) {
+          if (fences[i]) glDeleteSync(fences[i]);
+          fences[i] = 0;
+        }
+      #endif
+    }
+
+    // copy the shadow to the current segment.
+    void upload() const {
+      glBindBuffer(target, buffer);
+      if (streaming && num_segments == 1) {
+        // orphan the old storage so that the driver does not wait for the GPU.
+        glBufferData(target, size, NULL, usage);
+      }
+      glBufferSubData(target, get_base_offset(), size, bytes.data());
+    }
+
+    void *map(GLbitfield access) const {
+      glBindBuffer(target, buffer);
+      #ifdef __APPLE__
+        // OSX does not support glMapBufferRange 
+        if (streaming && (access & GL_MAP_INVALIDATE_RANGE_BIT)) {
+          glBufferData(target, size, NULL, usage);
+        }
+        return glMapBuffer(target, access & GL_MAP_READ_BIT ? (access & GL_MAP_WRITE_BIT ? GL_READ_WRITE : GL_READ_ONLY) : GL_WRITE_ONLY);
+      #else
+        return glMapBufferRange(target, get_base_offset(), size, access);
+      #endif
+    }
+
+    void unmap() const {
+      glBindBuffer(target, buffer);
+      glUnmapBuffer(target);
+    }
+
   public:
     /// Helper class to make a write-only lock
     class wolock {
@@ -70,7 +157,21 @@ namespace octet { namespace resources {
     /// Make a new OpenGL Resource
     gl_resource(unsigned target=0, unsigned size=0) {
       buffer = 0;
+      this->size = 0;
       this->target = target;
+      usage = GL_STATIC_DRAW;
+      version = next_version();
+      #ifdef OCTET_GLES2
+        has_shadow = true;
+      #else
+        has_shadow = false;
+      #endif
+      streaming = false;
+      num_segments = 1;
+      segment = 0;
+      #if OCTET_GL_FENCES
+        for (unsigned i = 0; i != max_segments; ++i) fences[i] = 0;
+      #endif
       if (size) {
         allocate(target, size);
       }
@@ -84,18 +185,27 @@ namespace octet { namespace resources {
       v.visit(target, atom_target);
     }
 
-    /// Allocate a new OpenGL object.
-    void allocate(GLuint target, size_t size, GLuint kind = GL_STATIC_DRAW) {
+    /// Allocate a new OpenGL object, optionally filling it with size bytes from src.
+    void allocate(GLuint target, size_t size, GLuint kind = GL_STATIC_DRAW, const void *src = NULL) {
       reset();
+      this->size = size;
+      this->target = target;
+      usage = kind;
+      segment = 0;
       glGenBuffers(1, &buffer);
       glBindBuffer(target, buffer);
-      glBufferData(target, size, NULL, kind);
-      #ifdef OCTET_GLES2
+      if (src && num_segments == 1) {
+        // one upload, no need for a glBufferSubData.
+        glBufferData(target, size, src, kind);
+      } else {
+        glBufferData(target, size * num_segments, NULL, kind);
+        if (src) glBufferSubData(target, 0, size, src);
+      }
+      if (has_shadow) {
         bytes.resize(size);
-      #else
-        this->size = size;
-      #endif
-      this->target = target;
+        if (src) memcpy(bytes.data(), src, size);
+      }
+      version = next_version();
       glBindBuffer(target, 0);
     }
 
@@ -104,9 +214,8 @@ namespace octet { namespace resources {
       if (buffer != 0) {
         glDeleteBuffers(1, &buffer);
       }
-      #ifdef OCTET_GLES2
-        bytes.reset();
-      #endif
+      delete_fences();
+      bytes.reset();
       buffer = 0;
     }
 
@@ -115,6 +224,55 @@ namespace octet { namespace resources {
       reset();
     }
 
+    /// Keep a copy of the data in CPU memory. Reads (eg. rolock) then never touch the GPU
+    /// and writes are sent with glBufferSubData. Costs memory; always on for GLES2.
+    void set_shadow(bool value) {
+      #ifndef OCTET_GLES2
+        if (value == has_shadow) return;
+        if (value) {
+          // read the data back once.
+          dynarray<uint8_t> tmp(size);
+          if (buffer && size) {
+            memcpy(tmp.data(), map(GL_MAP_READ_BIT), size);
+            unmap();
+          }
+          bytes = std::move(tmp);
+        } else {
+          bytes.reset();
+        }
+        has_shadow = value;
+      #endif
+    }
+
+    /// true if we have a copy of the data in CPU memory.
+    bool get_shadow() const {
+      return has_shadow;
+    }
+
+    /// Use this for buffers that are rewritten every frame. Each write goes to a fresh copy
+    /// of the data (a ring of three, fenced) so that we never wait for the GPU to finish with it.
+    /// The whole buffer must be written each time. Reallocates the buffer, losing the data unless there is a shadow.
+    void set_streaming(bool value) {
+      unsigned n = value && OCTET_GL_FENCES ? max_segments : 1;
+      if (value == streaming && n == num_segments) return;
+      streaming = value;
+      num_segments = n;
+      if (buffer) {
+        dynarray<uint8_t> tmp;
+        if (has_shadow) tmp = std::move(bytes);
+        allocate(target, size, value ? GL_STREAM_DRAW : usage);
+        if (has_shadow) {
+          bytes = std::move(tmp);
+          upload();
+        }
+      }
+    }
+
+    /// true if this buffer is a streaming buffer.
+    bool get_streaming() const {
+      return streaming;
+    }
+
     /// get the target this resource is bound to
     unsigned get_target() const {
       return target;
@@ -122,11 +280,7 @@ namespace octet { namespace resources {
 
     /// get the buffer size
     size_t get_size() const {
-      #ifdef OCTET_GLES2
-        return bytes.size();
-      #else
-        return size;
-      #endif
+      return size;
     }
 
     /// get the GL buffer object we are wrapping.
@@ -134,84 +288,77 @@ namespace octet { namespace resources {
       return buffer;
     }
 
+    /// Offset of the current data in the GL buffer. Non-zero for streaming buffers:
+    /// add this to attribute and index offsets when drawing.
+    size_t get_base_offset() const {
+      return segment * size;
+    }
+
+    /// get a number that changes every time the buffer is written or reallocated.
+    /// Numbers are unique across buffers, so use this to check if a copy of the data is out of date.
+    unsigned get_version() const {
+      return version;
+    }
+
     /// get a read-only lock on this buffer
     /// deprecated
     const void *lock_read_only() const {
-      #ifdef OCTET_GLES2
-        return (const void*)&bytes[0];
-      #else
-        glBindBuffer(target, buffer);
-        #ifdef __APPLE__
-          // OSX does not support glMapBufferRange 
-          return glMapBuffer(target, GL_READ_ONLY);
-        #else
-          return glMapBufferRange(target, 0, size, GL_MAP_READ_BIT);
-        #endif
-      #endif
+      if (has_shadow) {
+        return (const void*)bytes.data();
+      }
+      return map(GL_MAP_READ_BIT);
     }
 
     /// release read-only lock on this buffer
     /// deprecated
     void unlock_read_only() const {
-      #ifndef OCTET_GLES2
-        glBindBuffer(target, buffer);
-        glUnmapBuffer(target);
-      #endif
+      if (!has_shadow) {
+        unmap();
+      }
     }
 
     /// get a read-write lock on this buffer. Do not use this by preference.
     /// deprecated
     void *lock() const {
-      #ifdef OCTET_GLES2
-        return (void*)&bytes[0];
-      #else
-        glBindBuffer(target, buffer);
-        #ifdef __APPLE__
-          // OSX does not support glMapBufferRange 
-          void *res = glMapBuffer(target, GL_READ_WRITE);
-          return res;
-        #else
-          return glMapBufferRange(target, 0, size, GL_MAP_WRITE_BIT|GL_MAP_WRITE_BIT);
-        #endif
-      #endif
+      if (has_shadow) {
+        return (void*)bytes.data();
+      }
+      return map(GL_MAP_READ_BIT|GL_MAP_WRITE_BIT);
     }
 
     /// release a read-write lock
     /// deprecated
     void unlock() const {
-      #ifdef OCTET_GLES2
-        glBindBuffer(target, buffer);
-        glBufferSubData(target, 0, bytes.size(), &bytes[0]);
-      #else
-        glUnmapBuffer(target);
-      #endif
+      version = next_version();
+      if (has_shadow) {
+        upload();
+      } else {
+        unmap();
+      }
     }
 
-    /// get a read-write lock on this buffer
+    /// get a write-only lock on this buffer
     /// deprecated
     void *lock_write_only() const {
-      #ifdef OCTET_GLES2
-        return (void*)&bytes[0];
-      #else
-        glBindBuffer(target, buffer);
-        #ifdef __APPLE__
-          // OSX does not support glMapBufferRange 
-          return glMapBuffer(target, GL_WRITE_ONLY);
-        #else
-          return glMapBufferRange(target, 0, size, GL_MAP_WRITE_BIT);
-        #endif
-      #endif
+      if (streaming) {
+        next_segment();
+      }
+      if (has_shadow) {
+        return (void*)bytes.data();
+      }
+      // streaming: the fence (or orphaning) means we don't need to synchronise.
+      return map(streaming ? GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_RANGE_BIT|GL_MAP_UNSYNCHRONIZED_BIT : GL_MAP_WRITE_BIT);
     }
 
-    /// release a read-write lock
+    /// release a write-only lock
     /// deprecated
     void unlock_write_only() const {
-      #ifdef OCTET_GLES2
-        glBindBuffer(target, buffer);
-        glBufferSubData(target, 0, bytes.size(), &bytes[0]);
-      #else
-        glUnmapBuffer(target);
-      #endif
+      version = next_version();
+      if (has_shadow) {
+        upload();
+      } else {
+        unmap();
+      }
     }
 
     /// bind the resource to the target
@@ -220,11 +367,22 @@ namespace octet { namespace resources {
     }
 
     /// copy data into the resource
+    /// For streaming buffers, the rest of the data is undefined unless there is a shadow.
     void assign(const void *ptr, size_t offset, size_t size) {
       assert(offset + size <= this->get_size());
 
-      memcpy((void*)((char*)lock_write_only() + offset), ptr, size);
-      unlock_write_only();
+      if (!streaming) {
+        // no need to map the buffer.
+        if (has_shadow) {
+          memcpy(bytes.data() + offset, ptr, size);
+        }
+        glBindBuffer(target, buffer);
+        glBufferSubData(target, offset, size, ptr);
+        version = next_version();
+      } else {
+        memcpy((void*)((char*)lock_write_only() + offset), ptr, size);
+        unlock_write_only();
+      }
     }
 
     /// copy data from another gl resource.
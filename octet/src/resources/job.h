@@ -4,52 +4,158 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// work in progress
+// Pool of worker threads for data-parallel jobs
+//
 
 namespace octet { namespace resources {
-  class job : public resource {
-    ref<job> next;
+  /// A pool of threads that run loops in parallel.
+  ///
+  /// The threads sleep between jobs, so a job costs a wake up rather than starting threads.
+  /// The calling thread does its share of the work too.
+  /// The loaders and codecs share get_shared() unless they are given another pool.
+  ///
+  /// Example:
+  ///
+  ///     job_pool &pool = job_pool::get_shared();
+  ///     pool.parallel_for(num_items, [&](unsigned i) {
+  ///       process(items[i]);
+  ///     });
+  class job_pool {
+    // the current job
+    void (*job_fn)(void *context, unsigned index);
+    void *job_context;
+    unsigned job_count;
+    std::atomic<unsigned> next;
+
+    // workers wait for a new generation, the caller waits for busy to get to zero.
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    unsigned generation;
+    unsigned busy;
+    bool quitting;
 
-    enum state_t {
-      state_waiting,
-      state_running,
-    };
+    // true while a parallel_for is using the threads.
+    std::atomic<bool> running;
 
-    state_t state;
+    dynarray<std::thread*> threads;
 
-    class scheduler {
-      job *waiting;
-      job *running;
-    public:
-      scheduler() {
-        waiting = 0;
-        running = 0;
+    void work() {
+      for (unsigned i = next++; i < job_count; i = next++) {
+        job_fn(job_context, i);
       }
+    }
 
-      void add_to_waiting(job *jb) {
-        jb->next = waiting;
-        waiting = this;
+    void worker(unsigned seen) {
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          start_cv.wait(lock, [&]() { return quitting || generation != seen; });
+          if (quitting) break;
+          seen = generation;
+        }
+        work();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy == 0) done_cv.notify_one();
       }
-    };
 
-    scheduler *get_scheduler() {
-      static scheduler sch;
-      return &sch;
+      // give the blocks the jobs freed on this thread back to the other threads.
+      allocator::flush_thread_cache();
+    }
+
+    template <class fn_t> static void call(void *context, unsigned index) {
+      (*(fn_t*)context)(index);
+    }
+
+    void stop_threads() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quitting = true;
+      }
+      start_cv.notify_all();
+      for (unsigned i = 0; i != threads.size(); ++i) {
+        threads[i]->join();
+        delete threads[i];
+      }
+      threads.reset();
+      quitting = false;
     }
   public:
-    job() {
-      scheduler *sch = get_scheduler();
-      sch->add_to_waiting(this);
+    /// Make a pool with num_threads threads including the caller. 0 means one per core.
+    job_pool(unsigned num_threads = 0) : next(0), running(false) {
+      job_fn = NULL;
+      job_context = NULL;
+      job_count = 0;
+      generation = 0;
+      busy = 0;
+      quitting = false;
+      set_num_threads(num_threads);
     }
 
-    virtual ~job() {
+    ~job_pool() {
+      stop_threads();
     }
 
-    virtual void kernel() = 0;
-    virtual bool is_ready() = 0;
+    /// Change the number of threads, including the caller. 0 means one per core.
+    void set_num_threads(unsigned num_threads) {
+      stop_threads();
+      if (num_threads == 0) {
+        num_threads = std::thread::hardware_concurrency();
+      }
+      for (unsigned i = 1; i < num_threads; ++i) {
+        threads.push_back(new std::thread(&job_pool::worker, this, generation));
+      }
+    }
 
-    state_t get_state() {
-      return state;
+    /// Number of threads, including the caller.
+    unsigned get_num_threads() const {
+      return threads.size() + 1;
+    }
+
+    /// The pool used by the loaders and codecs: one thread per core, started on first use.
+    static job_pool &get_shared() {
+      static job_pool pool;
+      return pool;
+    }
+
+    /// Call fn(i) for every i from 0 to count-1 on jobs, or on the calling thread if jobs is NULL.
+    template <class fn_t> static void run(job_pool *jobs, unsigned count, fn_t fn) {
+      if (jobs) {
+        jobs->parallel_for(count, fn);
+      } else {
+        for (unsigned i = 0; i != count; ++i) {
+          fn(i);
+        }
+      }
+    }
+
+    /// Call fn(i) for every i from 0 to count-1, spread over the threads. Returns when they are all done.
+    /// If the pool is already busy, because another thread is using it or because a job called this,
+    /// the loop runs on the calling thread instead.
+    template <class fn_t> void parallel_for(unsigned count, fn_t fn) {
+      if (threads.size() == 0 || count < 2 || running.exchange(true)) {
+        for (unsigned i = 0; i != count; ++i) {
+          fn(i);
+        }
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        job_fn = &call<fn_t>;
+        job_context = (void*)&fn;
+        job_count = count;
+        next = 0;
+        busy = threads.size();
+        ++generation;
+      }
+      start_cv.notify_all();
+      work();
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [&]() { return busy == 0; });
+      }
+      running = false;
     }
   };
 } }
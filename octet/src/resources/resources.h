@@ -18,6 +18,7 @@
 
   // resources
   #include "../resources/file_map.h"
+  #include "../resources/byte_span.h"
   #include "../resources/zip_file.h"
   #include "../resources/app_utils.h"
   #include "../resources/visitor.h"
@@ -87,6 +87,10 @@ namespace octet { namespace resources {
     /// Implement this for readers.
     virtual bool is_reader() { return false; }
 
+    /// Implement this for readers: true if the object being read has no more fields.
+    /// A class that adds fields can use this to read files saved before it had them.
+    virtual bool is_end_of_ref() { return false; }
+
     /// Implement this to read/write references
     virtual bool begin_read_ref(void *&ref, atom_t &sid, atom_t &type) { return false; }
 
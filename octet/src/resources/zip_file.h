@@ -9,110 +9,196 @@ namespace octet { namespace resources {
   /// Zip file reader, uses zip_decoder to inflate compressed files.
   /// Zip files are smaller and faster than regular files.
   /// They make updates easier and work will over the internet.
+  ///
+  /// The archive is mapped into memory, so any thread can read files at the same time.
+  /// Stored (uncompressed) files are returned without copying, so unlike inflated files,
+  /// they are not followed by a zero byte.
+  /// Inflated files are kept in a cache until it uses more than a byte budget.
+  /// Every file is checked against the size and CRC-32 in the directory before it is returned.
+  ///
+  /// Example:
+  ///
+  ///     ref<zip_file> zip = new zip_file("assets/level1.zip");
+  ///     byte_span spans[3];
+  ///     const char *names[] = { "a.jpg", "b.jpg", "c.dae" };
+  ///     zip->get_files(spans, names, 3); // inflate on all cores
   class zip_file {
-    int ref_cnt;
-    FILE *the_file;
+    std::atomic<int> ref_cnt;
+
+    // the whole archive
+    byte_span archive;
 
     struct dir_entry {
-      uint32_t offset;
-      uint32_t csize;
-      uint32_t usize;
+      uint64_t offset;
+      uint64_t csize;
+      uint64_t usize;
       uint32_t compression;
+      uint32_t crc;
+    };
+
+    // name -> index in entries
+    dictionary<unsigned> directory;
+    dynarray<dir_entry> entries;
+
+    // least recently used cache of inflated files.
+    // cached files are in a list with the most recently used at the head.
+    struct cache_slot {
+      byte_span bytes;
+      int prev;
+      int next;
     };
 
-    dictionary<dir_entry> directory;
+    std::mutex cache_mutex;
+    dynarray<cache_slot> cache;
 
-    zip_decoder decoder;
+    // stored files that have passed the CRC check. (protected by cache_mutex)
+    dynarray<uint8_t> verified;
+    int cache_head;
+    int cache_tail;
+    size_t cache_size;
+    size_t cache_budget;
 
     // read little endian bytes on any machine
     static unsigned u4(const uint8_t *src) {
-      return src[0] + src[1] * 256 + src[2] * 65536 + src[3] * 0x1000000;
-    }
-
-    static int s4(const uint8_t *src) {
-      return (int32_t)(src[0] + src[1] * 256 + src[2] * 65536 + src[3] * 0x1000000);
+      return src[0] + src[1] * 256 + src[2] * 65536 + src[3] * 0x1000000u;
     }
 
     static unsigned u2(const uint8_t *src) {
       return src[0] + src[1] * 256;
     }
 
-    static int s2(const uint8_t *src) {
-      return (int16_t)(src[0] + src[1] * 256);
+    static uint64_t u8(const uint8_t *src) {
+      return u4(src) | (uint64_t)u4(src + 4) << 32;
     }
 
-  public:
-    /// Open a zip file for reading
-    zip_file(const char *filename) {
-      ref_cnt = 0;
-      the_file = fopen(filename, "rb");
-      if (!the_file) {
-        printf("file %s not found\n", filename);
-      } else {
-        uint8_t tmp[256];
-        unsigned tmp_size = (unsigned)sizeof(tmp);
-        fseek(the_file, 0, SEEK_END);
-        long file_size = ftell(the_file);
-        long search_offset = file_size - (long)tmp_size;
-        search_offset = search_offset < 0 ? 0 : search_offset;
-        fseek(the_file, search_offset, SEEK_SET);
-        fread(&tmp, 1, tmp_size, the_file);
-        for( unsigned i = 0; i != tmp_size; ++i) {
-          if (u4(tmp + i) == 0x06054b50) {
-            dynarray<uint8_t> dir;
-            dir.resize(u4(tmp + i + 12));
-            fseek(the_file, (long)u4(tmp + i + 16), SEEK_SET);
-            fread(&dir[0], 1, dir.size(), the_file);
-            for (unsigned i = 0; i + 4 < dir.size();) {
-              uint8_t *p = &dir[i];
-              if (u4(p) != 0x02014b50) break;
-              struct dir_entry d;
-              d.compression = u2(p + 10);
-              d.csize = u4(p + 20);
-              d.usize = u4(p + 24);
-              unsigned file_name_len = u2(p + 28);
-              unsigned extra_len = u2(p + 30);
-              string file;
-              file.set((const char*)(p + 46), file_name_len);
-              i += 46 + file_name_len + extra_len;
-              d.offset = u4(p + 42);// + (46 + file_name_len + extra_len);
-              for (unsigned i = 0; file[i]; ++i) {
-                if (file[i] == '\\') file[i] = '/';
+    // CRC-32 as used by zip, eight bytes at a time (slicing-by-8).
+    static const uint32_t *crc_tables() {
+      static uint32_t tables[8][256];
+      static bool initialized = [&]() {
+        for (unsigned i = 0; i != 256; ++i) {
+          uint32_t crc = i;
+          for (unsigned j = 0; j != 8; ++j) {
+            crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+          }
+          tables[0][i] = crc;
+        }
+        for (unsigned i = 0; i != 256; ++i) {
+          for (unsigned t = 1; t != 8; ++t) {
+            tables[t][i] = (tables[t-1][i] >> 8) ^ tables[0][tables[t-1][i] & 0xff];
+          }
+        }
+        return true;
+      }();
+      (void)initialized;
+      return &tables[0][0];
+    }
+
+    static uint32_t crc32(const uint8_t *src, size_t size) {
+      const uint32_t *t = crc_tables();
+      uint32_t crc = 0xffffffff;
+      for (; size >= 8; size -= 8, src += 8) {
+        uint32_t lo = crc ^ u4(src), hi = u4(src + 4);
+        crc =
+          t[7*256 + (lo & 0xff)] ^ t[6*256 + (lo >> 8 & 0xff)] ^ t[5*256 + (lo >> 16 & 0xff)] ^ t[4*256 + (lo >> 24)] ^
+          t[3*256 + (hi & 0xff)] ^ t[2*256 + (hi >> 8 & 0xff)] ^ t[1*256 + (hi >> 16 & 0xff)] ^ t[0*256 + (hi >> 24)]
+        ;
+      }
+      for (; size; --size) {
+        crc = (crc >> 8) ^ t[(crc ^ *src++) & 0xff];
+      }
+      return ~crc;
+    }
+
+    // find the central directory from the end of central directory record.
+    bool find_directory(uint64_t &dir_offset, uint64_t &dir_size, uint64_t &num_entries) {
+      const uint8_t *data = archive.data();
+      uint64_t size = archive.size();
+      if (size < 22) return false;
+
+      // the record is at the end, followed by a comment of up to 65535 bytes.
+      uint64_t min_pos = size > 22 + 65535 ? size - 22 - 65535 : 0;
+      for (uint64_t pos = size - 22; ; --pos) {
+        const uint8_t *p = data + pos;
+        if (u4(p) == 0x06054b50) {
+          num_entries = u2(p + 10);
+          dir_size = u4(p + 12);
+          dir_offset = u4(p + 16);
+
+          // ZIP64: the real values are in another record found with a locator just before this one.
+          if ((num_entries == 0xffff || dir_size == 0xffffffff || dir_offset == 0xffffffff) && pos >= 20) {
+            const uint8_t *loc = p - 20;
+            if (u4(loc) == 0x07064b50) {
+              uint64_t rec = u8(loc + 8);
+              if (rec + 56 <= size && u4(data + rec) == 0x06064b50) {
+                num_entries = u8(data + rec + 32);
+                dir_size = u8(data + rec + 40);
+                dir_offset = u8(data + rec + 48);
               }
-              //printf("%s\n", file.c_str());
-              directory[file] = d;
             }
-            break;
           }
+          return dir_offset <= size && dir_size <= size - dir_offset;
         }
+        if (pos == min_pos) return false;
       }
     }
 
-    /// close the zip file
-    ~zip_file() {
-      if (the_file) fclose(the_file);
-    }
+    // read the central directory.
+    void read_directory() {
+      uint64_t dir_offset = 0, dir_size = 0, num_entries = 0;
+      if (!find_directory(dir_offset, dir_size, num_entries)) {
+        printf("zip file has no directory\n");
+        return;
+      }
 
-    /// allow ref<zip_file>
-    void add_ref() {
-      ref_cnt++;
-    }
+      const uint8_t *dir = archive.data() + dir_offset;
+      uint64_t i = 0;
+      while (i + 46 <= dir_size) {
+        const uint8_t *p = dir + i;
+        if (u4(p) != 0x02014b50) break;
+        dir_entry d;
+        d.compression = u2(p + 10);
+        d.crc = u4(p + 16);
+        d.csize = u4(p + 20);
+        d.usize = u4(p + 24);
+        d.offset = u4(p + 42);
+        unsigned file_name_len = u2(p + 28);
+        unsigned extra_len = u2(p + 30);
+        unsigned comment_len = u2(p + 32);
+        if (i + 46 + file_name_len + extra_len > dir_size) break;
 
-    /// allow ref<zip_file>
-    void release() {
-      if (--ref_cnt) {
-        delete this;
+        // ZIP64 extra field: 64 bit versions of the values that do not fit.
+        const uint8_t *extra = p + 46 + file_name_len;
+        for (unsigned j = 0; j + 4 <= extra_len; ) {
+          unsigned id = u2(extra + j), len = u2(extra + j + 2);
+          if (id == 0x0001) {
+            const uint8_t *x = extra + j + 4, *x_max = x + len;
+            if (d.usize == 0xffffffff && x + 8 <= x_max) { d.usize = u8(x); x += 8; }
+            if (d.csize == 0xffffffff && x + 8 <= x_max) { d.csize = u8(x); x += 8; }
+            if (d.offset == 0xffffffff && x + 8 <= x_max) { d.offset = u8(x); x += 8; }
+          }
+          j += 4 + len;
+        }
+
+        string file;
+        file.set((const char*)(p + 46), file_name_len);
+        for (unsigned k = 0; file[k]; ++k) {
+          if (file[k] == '\\') file[k] = '/';
+        }
+        directory[file] = entries.size();
+        entries.push_back(d);
+        i += 46 + file_name_len + extra_len + comment_len;
+      }
+
+      cache.resize(entries.size());
+      for (unsigned k = 0; k != cache.size(); ++k) {
+        cache[k].prev = cache[k].next = -1;
       }
+      verified.resize(entries.size());
+      memset(verified.data(), 0, verified.size());
     }
 
-    /// get a file from a zip file, this is called from get_url with a zip:// prefix.
-    void get_file(dynarray<uint8_t> &buffer, const char *file) {
-      int index = directory.get_index(file);
-      if (index < 0) return;
-      if (!the_file) return;
-      const dir_entry &d = directory.get_value(index);
-      buffer.resize(d.usize);
-      fseek(the_file, d.offset, SEEK_SET);
+    // get the bytes of an entry as they are in the archive.
+    bool get_compressed(byte_span &span, const dir_entry &d) const {
       /*local file header signature     4 bytes  (0x04034b50) 0
       version needed to extract       2 bytes 4
       general purpose bit flag        2 bytes 6
@@ -124,19 +210,192 @@ namespace octet { namespace resources {
       uncompressed size               4 bytes 22
       file name length                2 bytes 26
       extra field length              2 bytes 28 / 30*/
+      uint64_t size = archive.size();
+      if (d.offset > size || size - d.offset < 30) return false;
+      const uint8_t *p = archive.data() + d.offset;
+      if (u4(p) != 0x04034b50) return false;
+      uint64_t start = d.offset + 30 + u2(p + 26) + u2(p + 28);
+      if (start > size || d.csize > size - start) return false;
+      span = byte_span(archive, (size_t)start, (size_t)d.csize);
+      return true;
+    }
+
+    // cache functions: call with the mutex locked.
+    void cache_unlink(int index) {
+      cache_slot &s = cache[index];
+      if (s.prev >= 0) cache[s.prev].next = s.next; else cache_head = s.next;
+      if (s.next >= 0) cache[s.next].prev = s.prev; else cache_tail = s.prev;
+      s.prev = s.next = -1;
+    }
+
+    void cache_push_front(int index) {
+      cache_slot &s = cache[index];
+      s.prev = -1;
+      s.next = cache_head;
+      if (cache_head >= 0) cache[cache_head].prev = index; else cache_tail = index;
+      cache_head = index;
+    }
+
+    // drop the least recently used files. Spans that are in use keep their bytes.
+    void cache_trim() {
+      while (cache_size > cache_budget && cache_tail >= 0) {
+        int index = cache_tail;
+        cache_unlink(index);
+        cache_size -= cache[index].bytes.size();
+        cache[index].bytes.reset();
+      }
+    }
+
+    bool get_entry(byte_span &span, unsigned index) {
+      const dir_entry &d = entries[index];
+      byte_span compressed;
+      if (!get_compressed(compressed, d)) return false;
 
-      uint8_t tmp[30];
-      fread(tmp, 1, sizeof(tmp), the_file);
-      if (u4(tmp) != 0x04034b50) return;
-      unsigned extra = u2(tmp + 26) + u2(tmp + 28);
-      fseek(the_file, d.offset + 30 + extra, SEEK_SET);
       if (d.compression == 0) {
-        fread(buffer.data(), 1, d.usize, the_file);
-      } else if (d.compression == 8) {
-        dynarray<uint8_t> uncomp(d.csize + 4); // note: + 4 bytes prevents decode() overflowing
-        fread(uncomp.data(), 1, d.csize, the_file);
-        decoder.decode(buffer.data(), buffer.data() + d.usize, uncomp.data(), uncomp.data() + d.csize);
+        // stored: no copy, but check the CRC the first time.
+        if (d.csize != d.usize) return false;
+        {
+          std::lock_guard<std::mutex> lock(cache_mutex);
+          if (verified[index]) {
+            span = compressed;
+            return true;
+          }
+        }
+        if (crc32(compressed.data(), compressed.size()) != d.crc) return false;
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        verified[index] = 1;
+        span = compressed;
+        return true;
+      } else if (d.compression != 8 || d.usize >= 0xffffffff) {
+        return false;
+      }
+
+      if (d.usize == 0) {
+        span.reset();
+        return d.crc == 0;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (!cache[index].bytes.empty()) {
+          cache_unlink(index);
+          cache_push_front(index);
+          span = cache[index].bytes;
+          return true;
+        }
+      }
+
+      // inflate without the lock, so other threads can work. (one more byte for the zero terminator)
+      dynarray<uint8_t> buffer;
+      buffer.reserve((unsigned)d.usize + 1);
+      buffer.resize((unsigned)d.usize);
+      zip_decoder decoder;
+      if (!decoder.decode(buffer.data(), buffer.data() + buffer.size(), compressed.begin(), compressed.end())) {
+        return false;
+      }
+      if (decoder.get_output_size() != buffer.size() || crc32(buffer.data(), buffer.size()) != d.crc) {
+        return false;
+      }
+      byte_span result(new file_map(std::move(buffer)));
+
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      if (cache[index].bytes.empty()) {
+        // another thread may have got here first.
+        cache[index].bytes = result;
+        cache_size += result.size();
+        cache_push_front(index);
+        cache_trim();
+      }
+      span = result;
+      return true;
+    }
+
+  public:
+    /// Open a zip file for reading
+    zip_file(const char *filename) : ref_cnt(0) {
+      cache_head = cache_tail = -1;
+      cache_size = 0;
+      cache_budget = 64 * 1024 * 1024;
+
+      file_map *map = new file_map(filename, file_map::access_random);
+      if (map->get_error()) {
+        printf("file %s not found\n", filename);
+        delete map;
+      } else {
+        archive = byte_span(map);
+        read_directory();
+      }
+    }
+
+    /// close the zip file
+    ~zip_file() {
+    }
+
+    /// allow ref<zip_file>
+    void add_ref() {
+      ref_cnt++;
+    }
+
+    /// allow ref<zip_file>
+    void release() {
+      if (--ref_cnt == 0) {
+        delete this;
+      }
+    }
+
+    /// Get a file from a zip file without copying if possible. Safe to call from any thread.
+    /// Returns false if the file is not there or is bad.
+    bool get_file(byte_span &span, const char *file) {
+      span.reset();
+      int index = directory.get_index(file);
+      if (index < 0) return false;
+      return get_entry(span, directory.get_value(index));
+    }
+
+    /// get a file from a zip file, this is called from get_url with a zip:// prefix.
+    void get_file(dynarray<uint8_t> &buffer, const char *file) {
+      byte_span span;
+      get_file(span, file);
+      buffer.resize((unsigned)span.size());
+      if (span.size()) memcpy(buffer.data(), span.data(), span.size());
+    }
+
+    /// Get many files at once, inflating them on the threads of jobs (NULL for the calling thread).
+    /// spans[i] is empty if names[i] is not there or is bad.
+    void get_files(byte_span *spans, const char *const *names, unsigned num_files, job_pool *jobs = &job_pool::get_shared()) {
+      // ask for all the compressed bytes to be read now.
+      dynarray<int> indices(num_files);
+      for (unsigned i = 0; i != num_files; ++i) {
+        int index = directory.get_index(names[i]);
+        indices[i] = index < 0 ? -1 : (int)directory.get_value(index);
+        byte_span compressed;
+        if (indices[i] >= 0 && get_compressed(compressed, entries[indices[i]])) {
+          compressed.prefetch();
+        }
       }
+
+      job_pool::run(jobs, num_files, [&](unsigned i) {
+        spans[i].reset();
+        if (indices[i] >= 0) get_entry(spans[i], (unsigned)indices[i]);
+      });
+    }
+
+    /// Set the most bytes of inflated files to keep.
+    void set_cache_budget(size_t bytes) {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      cache_budget = bytes;
+      cache_trim();
+    }
+
+    /// Bytes of inflated files in the cache.
+    size_t get_cache_size() {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      return cache_size;
+    }
+
+    /// Number of files in the archive.
+    unsigned get_num_files() const {
+      return entries.size();
     }
   };
 } }
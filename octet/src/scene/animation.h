@@ -7,8 +7,164 @@
 
 namespace octet { namespace scene {
   /// Animation resource: Contains times and values.
-  /// Still a work in progress. Requires splines, compression, blending etc.
+  /// Still a work in progress. Requires splines, blending etc.
+  ///
+  /// For playback, compile() turns the channels into tracks that sample() evaluates together:
+  /// channels with the same key times share a timeline, so the keys are found once for all of them,
+  /// and each track writes its value to a slot in a pose (an array of floats).
+  ///
+  /// compress() makes tracks that are much smaller than the channels and frees the channels' keys.
+  /// Transform matrices become quantised translation, rotation and scale and keys that
+  /// can be interpolated from their neighbours are removed.
   class animation : public resource {
+  public:
+    /// Where playback is on a timeline. Keep these between calls to sample().
+    struct cursor {
+      unsigned key;  ///< the key at or before the time.
+      float t;       ///< how far the time is towards the next key, 0 to 1.
+
+      cursor() {
+        key = 0;
+        t = 0;
+      }
+    };
+
+    /// Settings for compress().
+    ///
+    /// The error of a transform is how far a point within a radius of the joint moves.
+    /// Given a skeleton, the radius of each bone reaches its furthest child, and each bone gets
+    /// the tolerance divided by the number of bones on the longest chain through it, so that the
+    /// errors of a joint and the bones above it add up to no more than the tolerance in world space.
+    /// Without a skeleton, the tolerance is the error of each bone on its own.
+    struct compress_params {
+      float tolerance;        ///< largest error to allow, in the units of the scene.
+      float radius;           ///< smallest radius to measure the error at, eg. the thickness of a limb.
+      unsigned max_key_gap;   ///< most source keys that one pair of keys may replace; limits the time taken.
+
+      compress_params() {
+        tolerance = 0.001f;
+        radius = 0.1f;
+        max_key_gap = 256;
+      }
+    };
+
+    /// What compress() did.
+    struct compress_stats {
+      size_t raw_bytes;          ///< size of the channels' times and values before.
+      size_t compressed_bytes;   ///< size of the tracks after.
+      unsigned source_keys;      ///< keys in the channels before.
+      unsigned compressed_keys;  ///< keys in the tracks after.
+      float max_error;           ///< largest error of one bone found at the source keys; the part of the tolerance it had.
+
+      compress_stats() {
+        raw_bytes = compressed_bytes = 0;
+        source_keys = compressed_keys = 0;
+        max_error = 0;
+      }
+    };
+
+    /// Translation, rotation (a unit quaternion) and scale of a transform; for blending poses.
+    struct trs {
+      float t[3];
+      float q[4];
+      float s[3];
+    };
+
+    /// Split a transposed matrix (as in the channels and the pose) into translation, rotation and scale.
+    /// Any shear is lost.
+    static void decompose(trs &dest, const float *value) {
+      mat4t m;
+      m.init_transpose(value);
+      vec3 x = m[0].xyz(), y = m[1].xyz(), z = m[2].xyz();
+      float sx = x.length(), sy = y.length(), sz = z.length();
+      if (dot(cross(x, y), z) < 0) sx = -sx;
+      mat4t r;
+      r[0] = vec4(x * (sx ? 1 / sx : 0), 0);
+      r[1] = vec4(y * (sy ? 1 / sy : 0), 0);
+      r[2] = vec4(z * (sz ? 1 / sz : 0), 0);
+      quat q = r.toQuaternion();
+      float len = sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+      float rlen = len ? 1 / len : 1;
+      for (int i = 0; i != 3; ++i) dest.t[i] = m[3][i];
+      for (int i = 0; i != 4; ++i) dest.q[i] = q[i] * rlen;
+      dest.s[0] = sx;
+      dest.s[1] = sy;
+      dest.s[2] = sz;
+    }
+
+    /// Make a transposed matrix from translation, rotation and scale.
+    static void compose(float *dest, const trs &src) {
+      float x = src.q[0], y = src.q[1], z = src.q[2], w = src.q[3];
+      float sx = src.s[0], sy = src.s[1], sz = src.s[2];
+      dest[0] = (1 - 2 * (y * y + z * z)) * sx;
+      dest[1] = 2 * (x * y - w * z) * sy;
+      dest[2] = 2 * (x * z + w * y) * sz;
+      dest[3] = src.t[0];
+      dest[4] = 2 * (x * y + w * z) * sx;
+      dest[5] = (1 - 2 * (x * x + z * z)) * sy;
+      dest[6] = 2 * (y * z - w * x) * sz;
+      dest[7] = src.t[1];
+      dest[8] = 2 * (x * z - w * y) * sx;
+      dest[9] = 2 * (y * z + w * x) * sy;
+      dest[10] = (1 - 2 * (x * x + y * y)) * sz;
+      dest[11] = src.t[2];
+      dest[12] = 0;
+      dest[13] = 0;
+      dest[14] = 0;
+      dest[15] = 1;
+    }
+
+    /// Interpolate from a to b: lerp of translation and scale, normalised lerp of the rotation.
+    static void blend(trs &dest, const trs &a, const trs &b, float t) {
+      float cosine = a.q[0] * b.q[0] + a.q[1] * b.q[1] + a.q[2] * b.q[2] + a.q[3] * b.q[3];
+      float ta = 1 - t, tb = cosine < 0 ? -t : t;
+      float len2 = 0;
+      for (int i = 0; i != 4; ++i) {
+        dest.q[i] = a.q[i] * ta + b.q[i] * tb;
+        len2 += dest.q[i] * dest.q[i];
+      }
+      float rlen = 1 / sqrtf(len2);
+      for (int i = 0; i != 4; ++i) dest.q[i] *= rlen;
+      for (int i = 0; i != 3; ++i) {
+        dest.t[i] = a.t[i] * ta + b.t[i] * t;
+        dest.s[i] = a.s[i] * ta + b.s[i] * t;
+      }
+    }
+
+    /// Add the difference between pose and reference to dest, scaled by weight.
+    /// This is for additive layers: eg. a breathing animation on top of a walk.
+    static void add_delta(trs &dest, const trs &pose, const trs &reference, float weight) {
+      // delta is pose * inverse(reference); in quaternions conjugate(reference) then pose.
+      const float *r = reference.q, *p = pose.q;
+      float d[4];
+      d[3] = r[3] * p[3] + r[0] * p[0] + r[1] * p[1] + r[2] * p[2];
+      d[0] = r[3] * p[0] - p[3] * r[0] - r[1] * p[2] + r[2] * p[1];
+      d[1] = r[3] * p[1] - p[3] * r[1] - r[2] * p[0] + r[0] * p[2];
+      d[2] = r[3] * p[2] - p[3] * r[2] - r[0] * p[1] + r[1] * p[0];
+
+      // scale the delta rotation by weight with a normalised lerp from no rotation.
+      float tw = d[3] < 0 ? -weight : weight;
+      float w[4] = { d[0] * tw, d[1] * tw, d[2] * tw, d[3] * tw + 1 - weight };
+      float len2 = w[0] * w[0] + w[1] * w[1] + w[2] * w[2] + w[3] * w[3];
+      float rlen = len2 > 0 ? 1 / sqrtf(len2) : 1;
+      for (int i = 0; i != 4; ++i) w[i] *= rlen;
+
+      // the delta goes before dest, as in delta * dest with matrices.
+      const float *q = dest.q;
+      float result[4];
+      result[3] = q[3] * w[3] - q[0] * w[0] - q[1] * w[1] - q[2] * w[2];
+      result[0] = q[3] * w[0] + w[3] * q[0] + q[1] * w[2] - q[2] * w[1];
+      result[1] = q[3] * w[1] + w[3] * q[1] + q[2] * w[0] - q[0] * w[2];
+      result[2] = q[3] * w[2] + w[3] * q[2] + q[0] * w[1] - q[1] * w[0];
+      for (int i = 0; i != 4; ++i) dest.q[i] = result[i];
+
+      for (int i = 0; i != 3; ++i) {
+        dest.t[i] += (pose.t[i] - reference.t[i]) * weight;
+        dest.s[i] *= 1 + (reference.s[i] ? pose.s[i] / reference.s[i] - 1 : 0) * weight;
+      }
+    }
+
+  private:
     // todo: this could be a GL/CL buffer
     dynarray<unsigned char> data;
 
@@ -17,7 +173,7 @@ namespace octet { namespace scene {
       atom_t sid;          /// atom for sid on target (eg. node22)
       atom_t sub_target;   /// sub target (eg. rotateX)
       atom_t component;    /// component (eg. ANGLE)
-      int offset;          /// where in data
+      int offset;          /// where in data: times (seconds) then values
       unsigned num_times;  /// how many time values
       unsigned component_size; /// number of bytes per component
     };
@@ -31,20 +187,458 @@ namespace octet { namespace scene {
     dynarray<ref<resource> > targets;
 
     float end_time;
+
+    // key times of one or more tracks.
+    struct timeline {
+      unsigned first_time;   // index in key_times
+      unsigned num_keys;
+    };
+
+    enum {
+      // floats, one key after another
+      track_floats,
+
+      // quantised translation, rotation and scale of a transform matrix
+      track_trs,
+    };
+
+    enum {
+      animated_translation = 1,
+      animated_scale = 2,
+    };
+
+    // the values of one channel.
+    struct track {
+      unsigned timeline;     // which timeline the keys are on
+      unsigned kind;         // track_floats or track_trs
+      unsigned stride;       // floats: floats per value rounded up to four, so values can be read four at a time
+                             // trs: uint16_t per key
+      unsigned first_value;  // floats: index in key_values; trs: index in packed_keys
+      unsigned pose_offset;  // index in the pose
+      unsigned first_range;  // trs: index in key_values of the translation and scale base and step
+      unsigned flags;        // trs: animated_translation, animated_scale
+    };
+
+    // derived from data and channels by compile() or compress()
+    dynarray<timeline> timelines;
+    dynarray<float> key_times;
+    dynarray<float> key_values;
+    dynarray<uint16_t> packed_keys;
+    dynarray<track> tracks;
+    unsigned pose_size;
+    bool compiled;
+
+    // compress() has freed the channels' times and values. The tracks are all there is.
+    bool compressed;
+
+    // index of a timeline with these times, adding one if there isn't one.
+    unsigned add_timeline(const float *times, unsigned num_keys) {
+      for (unsigned tl = 0; tl != timelines.size(); ++tl) {
+        const timeline &other = timelines[tl];
+        if (other.num_keys == num_keys && !memcmp(&key_times[other.first_time], times, num_keys * sizeof(float))) {
+          return tl;
+        }
+      }
+      timeline new_timeline;
+      new_timeline.first_time = key_times.size();
+      new_timeline.num_keys = num_keys;
+      timelines.push_back(new_timeline);
+      key_times.append(times, num_keys);
+      return timelines.size() - 1;
+    }
+
+    void reset_tracks() {
+      timelines.reset();
+      key_times.reset();
+      key_values.reset();
+      packed_keys.reset();
+      tracks.reset();
+      pose_size = 0;
+    }
+
+    // copy the values of a channel to a new track.
+    void add_float_track(const channel &ch) {
+      const float *times = (const float *)&data[ch.offset];
+      const float *values = times + ch.num_times;
+      unsigned num_floats = ch.component_size / sizeof(float);
+
+      // a single key is stored twice so that there is always a next key.
+      unsigned num_keys = ch.num_times < 2 ? 2 : ch.num_times;
+      float single[2] = { times[0], times[0] };
+
+      track tr;
+      tr.timeline = add_timeline(ch.num_times < 2 ? single : times, num_keys);
+      tr.kind = track_floats;
+      tr.stride = (num_floats + 3) & ~3;
+      tr.first_value = key_values.size();
+      tr.pose_offset = pose_size;
+      tr.first_range = 0;
+      tr.flags = 0;
+      pose_size += tr.stride;
+      key_values.resize(tr.first_value + tr.stride * num_keys);
+      for (unsigned i = 0; i != num_keys; ++i) {
+        float *dest = &key_values[tr.first_value + tr.stride * i];
+        const float *src = values + (i < ch.num_times ? i : 0) * num_floats;
+        for (unsigned j = 0; j != tr.stride; ++j) {
+          dest[j] = j < num_floats ? src[j] : 0;
+        }
+      }
+      tracks.push_back(tr);
+    }
+
+    // find the keys either side of a time.
+    void seek(const timeline &tl, cursor &cur, float time) const {
+      const float *times = &key_times[tl.first_time];
+      unsigned last = tl.num_keys - 1;
+      if (time <= times[0]) {
+        cur.key = 0;
+        cur.t = 0;
+      } else if (time >= times[last]) {
+        cur.key = last - 1;
+        cur.t = 1;
+      } else {
+        // times[key] <= time < times[key+1]
+        unsigned key = cur.key < last ? cur.key : 0;
+        if (times[key] > time) {
+          unsigned a = 0, b = last;
+          while (b - a > 1) {
+            unsigned mid = a + ((b - a) >> 1);
+            if (times[mid] <= time) a = mid; else b = mid;
+          }
+          key = a;
+        } else {
+          while (times[key+1] <= time) ++key;
+        }
+        cur.key = key;
+        cur.t = (time - times[key]) / (times[key+1] - times[key]);
+      }
+    }
+
+    // a channel of 4x4 matrices without projection can be a trs track.
+    bool is_transform(const channel &ch) const {
+      if (ch.sub_target != atom_transform || ch.component_size != 16 * sizeof(float)) return false;
+      const float *values = (const float *)&data[ch.offset] + ch.num_times;
+      for (unsigned i = 0; i != ch.num_times; ++i) {
+        // matrices are stored transposed, so the bottom row is at the end.
+        const float *m = values + i * 16;
+        if (m[12] != 0 || m[13] != 0 || m[14] != 0 || m[15] != 1) return false;
+      }
+      return true;
+    }
+
+    // "smallest three": drop the largest component of the quaternion and store the others in 15 bits.
+    // The index of the largest goes in the top bits of the first two.
+    static void pack_rotation(uint16_t *dest, const float *q) {
+      unsigned largest = 0;
+      for (unsigned i = 1; i != 4; ++i) {
+        if (fabsf(q[i]) > fabsf(q[largest])) largest = i;
+      }
+      // q and -q are the same rotation; make the largest positive so it can be recovered.
+      float scale = (q[largest] < 0 ? -1.0f : 1.0f) * 1.41421356f;
+      for (unsigned i = 0, j = 0; i != 4; ++i) {
+        if (i != largest) {
+          // the others are between -1/sqrt(2) and 1/sqrt(2)
+          int value = (int)floorf((q[i] * scale + 1) * (32767.0f / 2) + 0.5f);
+          dest[j++] = (uint16_t)(value < 0 ? 0 : value > 32767 ? 32767 : value);
+        }
+      }
+      dest[0] |= (largest & 1) << 15;
+      dest[1] |= (largest >> 1) << 15;
+    }
+
+    static void unpack_rotation(float *q, const uint16_t *src) {
+      static const uint8_t others[4][3] = { { 1, 2, 3 }, { 0, 2, 3 }, { 0, 1, 3 }, { 0, 1, 2 } };
+      unsigned largest = (src[0] >> 15) | ((src[1] >> 15) << 1);
+      const float scale = (2.0f / 32767) * 0.70710678f, bias = -0.70710678f;
+      float a = (src[0] & 0x7fff) * scale + bias;
+      float b = (src[1] & 0x7fff) * scale + bias;
+      float c = src[2] * scale + bias;
+      float sum = a * a + b * b + c * c;
+      q[others[largest][0]] = a;
+      q[others[largest][1]] = b;
+      q[others[largest][2]] = c;
+      q[largest] = sqrtf(sum < 1 ? 1 - sum : 0);
+    }
+
+    // write a key of a trs track. range is the base and step of translation then scale.
+    static void pack_trs(uint16_t *dest, const trs &src, const float *range, unsigned flags) {
+      pack_rotation(dest, src.q);
+      dest += 3;
+      if (flags & animated_translation) {
+        for (int i = 0; i != 3; ++i) {
+          int value = (int)floorf((src.t[i] - range[i]) / range[i+3] + 0.5f);
+          *dest++ = (uint16_t)(value < 0 ? 0 : value > 65535 ? 65535 : value);
+        }
+      }
+      if (flags & animated_scale) {
+        for (int i = 0; i != 3; ++i) {
+          int value = (int)floorf((src.s[i] - range[i+6]) / range[i+9] + 0.5f);
+          *dest++ = (uint16_t)(value < 0 ? 0 : value > 65535 ? 65535 : value);
+        }
+      }
+    }
+
+    static void unpack_trs(trs &dest, const uint16_t *src, const float *range, unsigned flags) {
+      unpack_rotation(dest.q, src);
+      src += 3;
+      for (int i = 0; i != 3; ++i) {
+        dest.t[i] = range[i];
+        dest.s[i] = range[i+6];
+      }
+      if (flags & animated_translation) {
+        for (int i = 0; i != 3; ++i) dest.t[i] += *src++ * range[i+3];
+      }
+      if (flags & animated_scale) {
+        for (int i = 0; i != 3; ++i) dest.s[i] += *src++ * range[i+9];
+      }
+    }
+
+    // how far a point within radius of the joint moves between two transposed matrices.
+    static float transform_error(const float *a, const float *b, float radius) {
+      float dt = sqrtf((a[3]-b[3]) * (a[3]-b[3]) + (a[7]-b[7]) * (a[7]-b[7]) + (a[11]-b[11]) * (a[11]-b[11]));
+      // the Frobenius norm is at least the largest distance a unit vector moves.
+      float dm = 0;
+      for (int i = 0; i != 3; ++i) {
+        for (int j = 0; j != 3; ++j) {
+          float d = a[i*4+j] - b[i*4+j];
+          dm += d * d;
+        }
+      }
+      return dt + sqrtf(dm) * radius;
+    }
+
+    // the furthest a child joint is from a node.
+    static float get_reach(scene_node *node) {
+      float reach = 0;
+      for (int i = 0; i != node->get_num_children(); ++i) {
+        scene_node *child = node->get_child(i);
+        float r = child->get_nodeToParent()[3].xyz().length() + get_reach(child);
+        reach = r > reach ? r : reach;
+      }
+      return reach;
+    }
+
+    // the number of bones from the skeleton's root to the deepest joint below a node.
+    static unsigned get_chain_length(scene_node *skeleton, scene_node *node) {
+      unsigned length = get_depth(node);
+      for (; node != skeleton && node->get_parent(); node = node->get_parent()) {
+        length++;
+      }
+      return length;
+    }
+
+    // the number of bones from a node to the deepest joint below it.
+    static unsigned get_depth(scene_node *node) {
+      unsigned depth = 0;
+      for (int i = 0; i != node->get_num_children(); ++i) {
+        unsigned d = get_depth(node->get_child(i));
+        depth = d > depth ? d : depth;
+      }
+      return depth + 1;
+    }
+
+    // make a trs track for a transform channel: quantise, then drop the keys we can do without.
+    // returns false if quantising alone is not accurate enough.
+    bool add_trs_track(const channel &ch, const compress_params &params, float radius, compress_stats &stats) {
+      const float *times = (const float *)&data[ch.offset];
+      const float *values = times + ch.num_times;
+      unsigned num_times = ch.num_times;
+
+      dynarray<trs> source(num_times);
+      for (unsigned i = 0; i != num_times; ++i) {
+        decompose(source[i], values + i * 16);
+      }
+
+      // base and step for translation and scale. Ones that don't move enough to matter are not stored per key.
+      float range[12];
+      unsigned flags = 0;
+      for (int k = 0; k != 2; ++k) {
+        float lo[3], hi[3];
+        for (int i = 0; i != 3; ++i) {
+          lo[i] = hi[i] = k ? source[0].s[i] : source[0].t[i];
+        }
+        for (unsigned j = 1; j != num_times; ++j) {
+          for (int i = 0; i != 3; ++i) {
+            float value = k ? source[j].s[i] : source[j].t[i];
+            lo[i] = value < lo[i] ? value : lo[i];
+            hi[i] = value > hi[i] ? value : hi[i];
+          }
+        }
+        float extent = 0, units = k ? radius : 1.0f;
+        for (int i = 0; i != 3; ++i) {
+          extent = hi[i] - lo[i] > extent ? hi[i] - lo[i] : extent;
+        }
+        bool animated = extent * 0.5f * units > params.tolerance * 0.1f;
+        for (int i = 0; i != 3; ++i) {
+          range[k*6+i] = animated ? lo[i] : (lo[i] + hi[i]) * 0.5f;
+          range[k*6+i+3] = animated ? (hi[i] - lo[i]) * (1.0f / 65535) : 0;
+          if (range[k*6+i+3] == 0) range[k*6+i+3] = 1;
+        }
+        flags |= animated ? (k ? animated_scale : animated_translation) : 0;
+      }
+
+      unsigned stride = 3 + (flags & animated_translation ? 3 : 0) + (flags & animated_scale ? 3 : 0);
+      dynarray<uint16_t> packed(num_times * stride);
+      dynarray<trs> decoded(num_times);
+      float tmp[16];
+      for (unsigned i = 0; i != num_times; ++i) {
+        pack_trs(&packed[i * stride], source[i], range, flags);
+        unpack_trs(decoded[i], &packed[i * stride], range, flags);
+        compose(tmp, decoded[i]);
+        if (transform_error(tmp, values + i * 16, radius) > params.tolerance) {
+          return false;
+        }
+      }
+
+      // greedily make each pair of keys span as many source keys as the tolerance allows.
+      dynarray<unsigned> keep;
+      keep.push_back(0);
+      for (unsigned a = 0; a + 1 < num_times; ) {
+        unsigned b = a + 1;
+        while (b + 1 < num_times && b + 1 - a <= params.max_key_gap) {
+          unsigned c = b + 1;
+          bool fits = true;
+          for (unsigned i = a + 1; i != c && fits; ++i) {
+            trs value;
+            blend(value, decoded[a], decoded[c], (times[i] - times[a]) / (times[c] - times[a]));
+            compose(tmp, value);
+            fits = transform_error(tmp, values + i * 16, radius) <= params.tolerance;
+          }
+          if (!fits) break;
+          b = c;
+        }
+        keep.push_back(b);
+        a = b;
+      }
+      if (keep.size() == 1) keep.push_back(0);
+
+      dynarray<float> kept_times(keep.size());
+      for (unsigned i = 0; i != keep.size(); ++i) {
+        kept_times[i] = times[keep[i]];
+      }
+
+      track tr;
+      tr.timeline = add_timeline(kept_times.data(), kept_times.size());
+      tr.kind = track_trs;
+      tr.stride = stride;
+      tr.first_value = packed_keys.size();
+      tr.pose_offset = pose_size;
+      tr.first_range = key_values.size();
+      tr.flags = flags;
+      pose_size += 16;
+      key_values.append(range, 12);
+      for (unsigned i = 0; i != keep.size(); ++i) {
+        packed_keys.append(&packed[keep[i] * stride], stride);
+      }
+      tracks.push_back(tr);
+
+      // measure the result at every source key.
+      for (unsigned i = 0, seg = 0; i != num_times; ++i) {
+        while (seg + 2 < keep.size() && keep[seg+1] <= i) ++seg;
+        unsigned a = keep[seg], b = keep[seg+1];
+        trs value;
+        blend(value, decoded[a], decoded[b], a == b ? 0 : (times[i] - times[a]) / (times[b] - times[a]));
+        compose(tmp, value);
+        float error = transform_error(tmp, values + i * 16, radius);
+        stats.max_error = error > stats.max_error ? error : stats.max_error;
+      }
+      stats.compressed_keys += keep.size();
+      return true;
+    }
+
+    // evaluate one track at a cursor.
+    void sample_track(float *dest, const track &tr, const cursor &cur) const {
+      float t = cur.t;
+      if (tr.kind == track_trs) {
+        const uint16_t *k0 = &packed_keys[tr.first_value + tr.stride * cur.key];
+        const float *range = &key_values[tr.first_range];
+        trs a, b, value;
+        unpack_trs(a, k0, range, tr.flags);
+        unpack_trs(b, k0 + tr.stride, range, tr.flags);
+        blend(value, a, b, t);
+        compose(dest, value);
+        return;
+      }
+
+      const float *v0 = &key_values[tr.first_value + tr.stride * cur.key];
+      const float *v1 = v0 + tr.stride;
+      #if OCTET_SSE2
+        __m128 t1 = _mm_set1_ps(t), t0 = _mm_set1_ps(1 - t);
+        for (unsigned j = 0; j != tr.stride; j += 4) {
+          __m128 a = _mm_loadu_ps(v0 + j), b = _mm_loadu_ps(v1 + j);
+          _mm_storeu_ps(dest + j, _mm_add_ps(_mm_mul_ps(a, t0), _mm_mul_ps(b, t1)));
+        }
+      #else
+        for (unsigned j = 0; j != tr.stride; ++j) {
+          dest[j] = v0[j] * (1 - t) + v1[j] * t;
+        }
+      #endif
+    }
+
+    // version 1 files keep the channels' times as float seconds and may have compressed tracks.
+    enum { file_version = 1 };
+
+    // files from before there was a version kept the times as unsigned short milliseconds.
+    void convert_ms_times() {
+      dynarray<unsigned char> old_data = data;
+      data.reset();
+      for (unsigned ch = 0; ch != channels.size(); ++ch) {
+        channel &chan = channels[ch];
+        const unsigned short *times = (const unsigned short *)&old_data[chan.offset];
+        const uint8_t *values = &old_data[chan.offset + chan.num_times * sizeof(unsigned short)];
+        chan.offset = (int)data.size();
+        data.resize(chan.offset + chan.num_times * (sizeof(float) + chan.component_size));
+        float *new_times = (float*)&data[chan.offset];
+        for (unsigned i = 0; i != chan.num_times; ++i) {
+          new_times[i] = times[i] * 0.001f;
+        }
+        memcpy(new_times + chan.num_times, values, chan.num_times * chan.component_size);
+      }
+    }
   public:
     RESOURCE_META(animation)
-  
+
     /// Default constructor. Use add_channel to add channels to the animation,
     animation() {
       end_time = 0;
+      pose_size = 0;
+      compiled = false;
+      compressed = false;
     }
 
     /// Serialisation, script etc.
+    /// A compressed animation saves its tracks instead of the channels' keys.
+    /// Files from before the version field are converted; files from later versions are an error.
     void visit(visitor &v) {
       v.visit(data, atom_data);
       v.visit(channels, atom_channels);
       v.visit(targets, atom_targets);
       v.visit(end_time, atom_end_time);
+
+      uint32_t version = file_version;
+      if (v.is_reader() && v.is_end_of_ref()) {
+        convert_ms_times();
+        compressed = false;
+        compiled = false;
+        return;
+      }
+      v.visit(version, atom_version);
+      if (version != file_version) {
+        log("animation: can't read version %d\n", version);
+        v.set_error(true);
+        return;
+      }
+
+      v.visit(compressed, atom_compressed);
+      if (compressed) {
+        v.visit(timelines, atom_timelines);
+        v.visit(key_times, atom_key_times);
+        v.visit(key_values, atom_key_values);
+        v.visit(packed_keys, atom_packed_keys);
+        v.visit(tracks, atom_tracks);
+        v.visit(pose_size, atom_pose_size);
+      }
+      compiled = compressed;
     }
 
     /// How many channels?
@@ -77,12 +671,26 @@ namespace octet { namespace scene {
       return end_time;
     }
 
+    /// has compress() been called?
+    bool is_compressed() const {
+      return compressed;
+    }
+
     /// add a channel to the animation.
     // just store the floats in the channel for now.
-    // todo: optimise animation data
     void add_channel(resource *target, atom_t sid, atom_t sub_target, atom_t component, dynarray<float> &times, dynarray<float> &values) {
-      int num_times = (int)times.size();
-      int num_values = (int)values.size();
+      add_channel(target, sid, sub_target, component, times.data(), times.size(), values.data(), values.size());
+    }
+
+    /// add a channel to the animation from arrays of times (in seconds) and values.
+    void add_channel(resource *target, atom_t sid, atom_t sub_target, atom_t component, const float *times, unsigned num_times_, const float *values, unsigned num_values_) {
+      if (compressed) {
+        log("animation: can't add channels after compress()\n");
+        return;
+      }
+
+      int num_times = (int)num_times_;
+      int num_values = (int)num_values_;
       int component_size = (num_values / num_times) * sizeof(float);
 
       channel ch;
@@ -93,39 +701,139 @@ namespace octet { namespace scene {
       ch.component_size = component_size;
 
       int offset = ch.offset = (int)data.size();
-      int bytes = num_times * sizeof(unsigned short) + component_size * num_times;
+      int bytes = num_times * sizeof(float) + component_size * num_times;
       data.resize(ch.offset + bytes);
       end_time = times[num_times-1] > end_time ? times[num_times-1] : end_time;
-      for (int i = 0; i != num_times; ++i) {
-        unsigned short it = (unsigned short)( times[i] * 1000 );
-        *((unsigned short*)&data[offset]) = it;
-        offset += sizeof(unsigned short);
-      }
-      
-      memcpy(&data[offset], &values[0], component_size * num_times);
+      memcpy(&data[offset], times, num_times * sizeof(float));
+      offset += num_times * sizeof(float);
+
+      memcpy(&data[offset], values, component_size * num_times);
       channels.push_back(ch);
       targets.push_back(target);
+      compiled = false;
+    }
+
+    /// Build the timelines and tracks for sample(). animation_instance does this when it starts playing.
+    void compile() {
+      if (compiled) return;
+
+      reset_tracks();
+      for (unsigned ch = 0; ch != channels.size(); ++ch) {
+        add_float_track(channels[ch]);
+      }
+      compiled = true;
+    }
+
+    /// Replace the channels' keys with compressed tracks.
+    /// Call this after loading, or before saving the animation with a visitor.
+    /// Transform matrices become translation, rotation and scale and keys are dropped
+    /// while the error stays within params.tolerance.
+    /// Give the skeleton that the animation plays on to measure each bone out to its furthest child
+    /// and to share the tolerance between the bones of each chain.
+    /// Other channels are kept as floats.
+    void compress(const compress_params &params = compress_params(), scene_node *skeleton = NULL, compress_stats *stats = NULL) {
+      compress_stats result;
+      if (compressed) {
+        if (stats) *stats = result;
+        return;
+      }
+
+      reset_tracks();
+      result.raw_bytes = data.size();
+      for (unsigned i = 0; i != channels.size(); ++i) {
+        const channel &ch = channels[i];
+        result.source_keys += ch.num_times;
+        float radius = params.radius;
+        compress_params bone_params = params;
+        scene_node *node = skeleton ? skeleton->find_sid(ch.sid) : NULL;
+        if (node) {
+          float reach = get_reach(node);
+          radius = reach > radius ? reach : radius;
+          bone_params.tolerance = params.tolerance / get_chain_length(skeleton, node);
+        }
+        if (!is_transform(ch) || !add_trs_track(ch, bone_params, radius, result)) {
+          add_float_track(ch);
+          result.compressed_keys += ch.num_times;
+        }
+      }
+
+      result.compressed_bytes =
+        timelines.size() * sizeof(timeline) + key_times.size() * sizeof(float) +
+        key_values.size() * sizeof(float) + packed_keys.size() * sizeof(uint16_t) +
+        tracks.size() * sizeof(track)
+      ;
+
+      // the channels keep their names; the keys are in the tracks now.
+      data.reset();
+      for (unsigned i = 0; i != channels.size(); ++i) {
+        channels[i].offset = 0;
+        channels[i].num_times = 0;
+      }
+      compiled = true;
+      compressed = true;
+      if (stats) *stats = result;
+    }
+
+    /// Number of timelines after compile(); sample() needs a cursor for each.
+    unsigned get_num_timelines() const {
+      return timelines.size();
+    }
+
+    /// Number of floats in a pose after compile().
+    unsigned get_pose_size() const {
+      return pose_size;
     }
 
-    /// Evaluate one channel. Time is in ms. This is very inefficient, it is much better to evalaute all channels together.
+    /// Where a channel's value is in the pose after compile().
+    unsigned get_pose_offset(int ch) const {
+      return tracks[ch].pose_offset;
+    }
+
+    /// Evaluate every channel at a time in seconds into pose (get_pose_size() floats).
+    /// Times before the first key or after the last one get the first or last key.
+    /// Playing forwards, the cursors find the next keys in constant time; going back searches.
+    void sample(float *pose, cursor *cursors, float time) const {
+      for (unsigned i = 0; i != timelines.size(); ++i) {
+        seek(timelines[i], cursors[i], time);
+      }
+
+      for (unsigned i = 0; i != tracks.size(); ++i) {
+        const track &tr = tracks[i];
+        sample_track(pose + tr.pose_offset, tr, cursors[tr.timeline]);
+      }
+    }
+
+    /// Evaluate one channel. Time is in seconds. This is very inefficient, it is much better to evalaute all channels together.
     void eval_chan(int chan, float time, resource *target) const {
-      int time_ms = int(time * 1000);
       const channel &ch = channels[chan];
-      unsigned short *p = (unsigned short *)&data[ch.offset];
+      if (compressed) {
+        const track &tr = tracks[chan];
+        float tmp[16];
+        cursor cur;
+        seek(timelines[tr.timeline], cur, time);
+        if (tr.kind == track_trs || tr.stride <= 16) {
+          sample_track(tmp, tr, cur);
+          target->set_value(ch.sid, ch.sub_target, ch.component, tmp);
+        }
+        return;
+      }
+
+      const float *p = (const float *)&data[ch.offset];
       unsigned a = 0;
       unsigned b = ch.num_times - 1;
       unsigned component_size = ch.component_size;
-      //log("ec %f %d\n", time, time_ms);
+      //log("ec %f\n", time);
 
-      if (time_ms < p[0]) {
-        time_ms = p[0];
-      } else if (time_ms >= p[b]) {
-        time_ms = p[b];
+      if (b == 0 || time < p[0]) {
+        time = p[0];
+        b = 0;
+      } else if (time >= p[b]) {
+        time = p[b];
         a = b - 1;
       } else {
         while (b - a > 1) {
           unsigned mid = a + ((b - a) >> 1);
-          if (time_ms > p[mid]) {
+          if (time > p[mid]) {
             a = mid;
           } else {
             b = mid;
@@ -133,18 +841,16 @@ namespace octet { namespace scene {
         }
       }
 
-      //log("t=%d a=%d b=%d p[a]=%d p[b]=%d\n", time_ms, a, b, p[a], p[b]);
+      //log("t=%f a=%d b=%d p[a]=%f p[b]=%f\n", time, a, b, p[a], p[b]);
 
-      unsigned data_offset = ch.offset + ch.num_times * sizeof(unsigned short);
+      const float *values = p + ch.num_times;
+      unsigned num_floats = component_size / sizeof(float);
 
-      float t = float(time_ms - p[a]) / (p[b] - p[a]);
+      float t = p[b] > p[a] ? (time - p[a]) / (p[b] - p[a]) : 0;
       float tmp1[16];
-      float tmp2[16];
       if (component_size <= sizeof(tmp1)) {
-        memcpy(tmp1, &data[data_offset + a * component_size], component_size);
-        memcpy(tmp2, &data[data_offset + b * component_size], component_size);
-        for (int i = 0; i != component_size/4; ++i) {
-          tmp1[i] = tmp1[i] * (1-t) + tmp2[i] * t;
+        for (unsigned i = 0; i != num_floats; ++i) {
+          tmp1[i] = values[a * num_floats + i] * (1-t) + values[b * num_floats + i] * t;
         }
         //log("  t=%f %f %f %f\n", t, tmp1[0], tmp1[1], tmp1[2]);
         target->set_value(ch.sid, ch.sub_target, ch.component, tmp1);
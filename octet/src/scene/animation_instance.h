@@ -9,68 +9,466 @@
 
 namespace octet { namespace scene {
   /// Instance of an animation; which Animation, what the target is, current time, etc.
+  ///
+  /// An instance plays one or more layers on its target. Each layer samples its animation
+  /// into a pose of its own, then the layers are combined in order and the result is written once.
+  /// Override layers blend towards their pose by their weight; additive layers add the difference
+  /// between their pose and the start of their animation. A mask limits a layer to part of a skeleton.
   class animation_instance : public resource {
-    ref<animation> anim;
+  public:
+    /// How a layer combines with the layers before it.
+    enum layer_mode {
+      layer_override,   ///< blend from the pose so far towards this layer's pose.
+      layer_additive,   ///< add the difference between this layer's pose and the start of its animation.
+    };
+
+  private:
     ref<resource> target;
-    float time;
-    bool is_looping;
-    bool is_paused;
+
+    // one animation playing in a layer. Layer 0 is the animation given to the constructor.
+    struct layer {
+      float time;
+      float weight;           // 0 to 1
+      float fade_to;          // weight we are fading to
+      float fade_rate;        // change in weight per second
+      uint8_t mode;           // layer_mode
+      bool is_looping;
+      bool is_paused;
+      bool remove_when_faded; // remove when the weight gets to zero or a later layer covers it
+
+      // where this layer is in the arrays below when bound
+      unsigned first_cursor;
+      unsigned first_value;
+      unsigned first_channel;
+    };
+
+    dynarray<layer> layers;
+    dynarray<ref<animation> > anims;    // animation of each layer
+    dynarray<ref<scene_node> > masks;   // only animate this node and the nodes below it. NULL for all.
+
+    // something we write to: the matrix of a scene_node, or a value through set_value().
+    struct anim_output {
+      scene_node *node;
+      resource *target;
+      atom_t sid;
+      atom_t sub_target;
+      atom_t component;
+      unsigned num_floats;   // value size; nodes use an animation::trs
+      unsigned first_value;  // index in rest and result
+    };
+
+    // where a channel of a layer goes.
+    struct channel_binding {
+      scene_node *node;       // the output's node, if it is one
+      unsigned output_index;  // index in outputs, or ~0 for nothing
+      unsigned pose_offset;   // where the channel is in the layer's pose
+      float weight;           // from the mask
+    };
+
+    // bound state: the layers' cursors and poses, the outputs and where each layer's channels go.
+    dynarray<animation::cursor> cursors;
+    dynarray<float> samples;
+    dynarray<anim_output> outputs;
+    dynarray<float> rest;                // outputs before the layers
+    dynarray<float> result;              // outputs after the layers
+    dynarray<channel_binding> channel_bindings;  // for each channel of each layer
+    dynarray<float> references;          // for additive layers, the pose at time zero (nodes as a trs)
+    bool is_bound;
+    bool is_parallel;
+    bool is_masked;                      // any layer has a mask
+
+    static bool is_below(scene_node *node, scene_node *ancestor) {
+      for (; node; node = node->get_parent()) {
+        if (node == ancestor) return true;
+      }
+      return false;
+    }
+
+    // find an output, or add one with its value before any animation.
+    unsigned find_output(const anim_output &out, const float *first_value, const dynarray<anim_output> &old_outputs, const dynarray<float> &old_rest) {
+      for (unsigned i = 0; i != outputs.size(); ++i) {
+        const anim_output &o = outputs[i];
+        if (o.node ? o.node == out.node : o.target == out.target && o.sid == out.sid && o.sub_target == out.sub_target && o.component == out.component) {
+          return i;
+        }
+      }
+
+      anim_output new_out = out;
+      new_out.first_value = rest.size();
+      rest.resize(new_out.first_value + new_out.num_floats);
+      float *dest = &rest[new_out.first_value];
+
+      // keep the rest pose from the last time we were bound (the nodes have moved since then).
+      for (unsigned i = 0; i != old_outputs.size(); ++i) {
+        const anim_output &o = old_outputs[i];
+        if (o.node == out.node && o.target == out.target && o.sid == out.sid && o.sub_target == out.sub_target && o.component == out.component) {
+          memcpy(dest, &old_rest[o.first_value], new_out.num_floats * sizeof(float));
+          outputs.push_back(new_out);
+          return outputs.size() - 1;
+        }
+      }
+
+      if (out.node) {
+        animation::decompose(*(animation::trs*)dest, out.node->get_nodeToParent().transpose4x4().get());
+      } else {
+        memcpy(dest, first_value, new_out.num_floats * sizeof(float));
+      }
+      outputs.push_back(new_out);
+      return outputs.size() - 1;
+    }
+
+    // work out where each channel of each layer goes once, instead of every frame.
+    // A scene_node target is searched for nodes with the channels' sids, so one
+    // animation can play on many copies of a character.
+    void bind() {
+      dynarray<anim_output> old_outputs;
+      dynarray<float> old_rest;
+      old_outputs.append(outputs);
+      old_rest.append(rest);
+
+      cursors.reset();
+      samples.reset();
+      outputs.reset();
+      rest.reset();
+      channel_bindings.reset();
+      references.reset();
+      is_parallel = target && target->get_scene_node();
+      is_masked = false;
+
+      for (unsigned l = 0; l != layers.size(); ++l) {
+        layer &lay = layers[l];
+        animation *anim = anims[l];
+        anim->compile();
+        is_masked |= masks[l] != NULL;
+        lay.first_cursor = cursors.size();
+        lay.first_value = samples.size();
+        lay.first_channel = channel_bindings.size();
+        cursors.resize(lay.first_cursor + anim->get_num_timelines());
+        samples.resize(lay.first_value + anim->get_pose_size());
+        references.resize(samples.size());
+
+        // the pose at the start, for additive layers and the rest values of outputs that aren't nodes.
+        float *start = &references[lay.first_value];
+        anim->sample(start, &cursors[lay.first_cursor], 0);
+
+        for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
+          anim_output out;
+          out.target = target ? (resource*)target : anim->get_target(ch);
+          out.node = NULL;
+          out.sid = anim->get_sid(ch);
+          out.sub_target = anim->get_sub_target(ch);
+          out.component = anim->get_component(ch);
+          out.num_floats = 0;
+          out.first_value = 0;
+          scene_node *node = out.target ? out.target->get_scene_node() : NULL;
+          if (node && out.sub_target == atom_transform) {
+            scene_node *sid_node = target ? node->find_sid(out.sid) : NULL;
+            out.node = sid_node ? sid_node : node;
+            out.target = NULL;
+            out.sid = out.sub_target = out.component = atom_;
+            out.num_floats = sizeof(animation::trs) / sizeof(float);
+          } else {
+            out.num_floats = ch + 1 < anim->get_num_channels() ? anim->get_pose_offset(ch + 1) - anim->get_pose_offset(ch) : anim->get_pose_size() - anim->get_pose_offset(ch);
+            is_parallel = false;
+          }
+
+          float *value = start + anim->get_pose_offset(ch);
+          channel_binding b;
+          b.node = out.node;
+          b.output_index = !out.node && !out.target ? ~0u : find_output(out, value, old_outputs, old_rest);
+          b.pose_offset = anim->get_pose_offset(ch);
+          b.weight = !masks[l] || (out.node && is_below(out.node, masks[l])) ? 1.0f : 0.0f;
+          channel_bindings.push_back(b);
+
+          if (out.node) {
+            // keep the start as a trs for add_delta.
+            animation::trs ref;
+            animation::decompose(ref, value);
+            memcpy(value, &ref, sizeof(ref));
+          }
+        }
+      }
+
+      result.resize(rest.size());
+      is_bound = true;
+    }
+
+    // sample the layers and combine them in result.
+    void evaluate() {
+      memcpy(result.data(), rest.data(), rest.size() * sizeof(float));
+      for (unsigned l = 0; l != layers.size(); ++l) {
+        const layer &lay = layers[l];
+        if (lay.weight <= 0) continue;
+
+        animation *anim = anims[l];
+        float *pose = &samples[lay.first_value];
+        anim->sample(pose, &cursors[lay.first_cursor], lay.time);
+        for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
+          const channel_binding &b = channel_bindings[lay.first_channel + ch];
+          float weight = lay.weight * b.weight;
+          if (b.output_index == ~0u || weight <= 0) continue;
+
+          const anim_output &out = outputs[b.output_index];
+          const float *value = pose + b.pose_offset;
+          const float *reference = &references[lay.first_value + b.pose_offset];
+          float *dest = &result[out.first_value];
+          if (out.node) {
+            animation::trs &acc = *(animation::trs*)dest;
+            animation::trs value_trs;
+            animation::decompose(value_trs, value);
+            if (lay.mode == layer_additive) {
+              animation::add_delta(acc, value_trs, *(const animation::trs*)reference, weight);
+            } else if (weight >= 1) {
+              acc = value_trs;
+            } else {
+              animation::blend(acc, acc, value_trs, weight);
+            }
+          } else {
+            for (unsigned i = 0; i != out.num_floats; ++i) {
+              dest[i] = lay.mode == layer_additive ? dest[i] + (value[i] - reference[i]) * weight : dest[i] * (1 - weight) + value[i] * weight;
+            }
+          }
+        }
+      }
+    }
+
+    // one layer at full weight: write its pose straight to the targets.
+    bool is_simple() const {
+      return layers.size() == 1 && layers[0].mode == layer_override && layers[0].weight >= 1 && !is_masked;
+    }
+
+    void write_simple() {
+      animation *anim = anims[0];
+      float *pose = samples.data();
+      anim->sample(pose, cursors.data(), layers[0].time);
+      for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
+        const channel_binding &b = channel_bindings[ch];
+        float *value = pose + b.pose_offset;
+        if (b.node) {
+          b.node->access_nodeToParent().init_transpose(value);
+        } else if (b.output_index != ~0u) {
+          const anim_output &out = outputs[b.output_index];
+          out.target->set_value(out.sid, out.sub_target, out.component, value);
+        }
+      }
+    }
+
+    // move the layers on in time and weight.
+    void advance(float delta_time) {
+      for (unsigned l = 0; l != layers.size(); ++l) {
+        layer &lay = layers[l];
+        if (lay.fade_rate) {
+          float step = lay.fade_rate * delta_time;
+          if (fabsf(lay.fade_to - lay.weight) <= step) {
+            lay.weight = lay.fade_to;
+            lay.fade_rate = 0;
+          } else {
+            lay.weight += lay.fade_to > lay.weight ? step : -step;
+          }
+        }
+
+        float end_time = anims[l]->get_end_time();
+        if (!lay.is_paused) {
+          lay.time += delta_time;
+          if (lay.time >= end_time) {
+            if (lay.is_looping) {
+              lay.time = end_time > 0 ? fmodf(lay.time, end_time) : 0;
+            } else {
+              lay.is_paused = true;
+            }
+          }
+        }
+      }
+    }
+
+    // remove the layers we don't need any more. This releases animations, so it is not done in update_prepared().
+    void remove_faded_layers() {
+      bool any_removable = false;
+      for (unsigned l = 0; l != layers.size(); ++l) {
+        any_removable |= layers[l].remove_when_faded;
+      }
+      if (!any_removable) return;
+
+      // a layer that overrides everything at full weight hides the ones before it.
+      unsigned first_visible = 0;
+      for (unsigned l = 0; l != layers.size(); ++l) {
+        const layer &lay = layers[l];
+        if (lay.mode == layer_override && !masks[l] && lay.weight >= 1 && !lay.fade_rate) {
+          first_visible = l;
+        }
+      }
+
+      for (unsigned l = layers.size(); l-- != 0; ) {
+        const layer &lay = layers[l];
+        if (lay.remove_when_faded && !lay.fade_rate && (lay.weight <= 0 || l < first_visible)) {
+          layers.erase(l);
+          anims.erase(l);
+          masks.erase(l);
+          is_bound = false;
+        }
+      }
+    }
   public:
     RESOURCE_META(animation_instance)
 
     /// Create an animation instance. Adding this to the scene starts the animation playing.
     animation_instance(animation *anim=0, resource *target=0, bool is_looping=true) {
       this->target = target;
-      this->anim = anim;
-      this->time = 0;
-      this->is_looping = is_looping;
-      this->is_paused = false;
+      this->is_bound = false;
+      this->is_parallel = false;
+      this->is_masked = false;
+      if (anim) {
+        add_layer(anim, 1, layer_override, NULL, is_looping);
+      }
     }
 
     /// serialize the animation
+    /// The first layer is also saved in the fields used before there were layers,
+    /// so files saved with a single animation still load.
     void visit(visitor &v) {
+      ref<animation> anim = anims.size() ? (animation*)anims[0] : NULL;
+      float time = get_time();
+      bool is_looping = layers.size() ? layers[0].is_looping : true;
+      bool is_paused = layers.size() ? layers[0].is_paused : false;
       v.visit(anim, atom_anim);
       v.visit(target, atom_target);
       v.visit(time, atom_time);
       v.visit(is_looping, atom_is_looping);
       v.visit(is_paused, atom_is_paused);
+      if (v.is_reader() && v.is_end_of_ref()) {
+        layers.reset();
+        anims.reset();
+        masks.reset();
+        if (anim) {
+          add_layer(anim, 1, layer_override, NULL, is_looping);
+          layers[0].time = time;
+          layers[0].is_paused = is_paused;
+        }
+      } else {
+        v.visit(layers, atom_layers);
+        v.visit(anims, atom_anims);
+        v.visit(masks, atom_masks);
+      }
+      is_bound = false;
     }
 
-    /// get the animation
+    /// get the animation of the first layer
     const animation *get_anim() const {
-      return anim;
+      return anims.size() ? (animation*)anims[0] : NULL;
     }
 
-    /// get the current time.
+    /// get the current time of the first layer.
     float get_time() const {
-      return time;
+      return layers.size() ? layers[0].time : 0;
     }
 
-    /// update the animation and the resources it connects to.
-    void update(float delta_time) {
-      if (target) {
-        for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
-          anim->eval_chan(ch, time, target);
-        }
+    /// jump to a time in the first layer, eg. to start copies of an animation at different places.
+    void set_time(float value) {
+      if (layers.size()) layers[0].time = value;
+    }
+
+    /// Add a layer after the others. Returns its index.
+    /// The mask limits the layer to a node and the nodes below it, eg. the upper body.
+    int add_layer(animation *anim, float weight = 1, layer_mode mode = layer_override, scene_node *mask = NULL, bool is_looping = true) {
+      layer lay;
+      memset(&lay, 0, sizeof(lay));
+      lay.weight = lay.fade_to = weight;
+      lay.mode = (uint8_t)mode;
+      lay.is_looping = is_looping;
+      layers.push_back(lay);
+      anims.push_back(anim);
+      masks.push_back(mask);
+      is_bound = false;
+      return layers.size() - 1;
+    }
+
+    /// Number of layers.
+    int get_num_layers() const {
+      return (int)layers.size();
+    }
+
+    /// Get the weight of a layer.
+    float get_layer_weight(int index) const {
+      return layers[index].weight;
+    }
+
+    /// Fade the weight of a layer over some seconds; zero seconds to change it now.
+    void fade_layer(int index, float weight, float seconds, bool remove_when_faded = false) {
+      layer &lay = layers[index];
+      lay.fade_to = weight;
+      lay.remove_when_faded = remove_when_faded;
+      if (seconds > 0) {
+        lay.fade_rate = fabsf(weight - lay.weight) / seconds;
       } else {
-        for (int ch = 0; ch != anim->get_num_channels(); ++ch) {
-          resource *anim_target = anim->get_target(ch);
-          anim->eval_chan(ch, time, anim_target);
-        }
+        lay.weight = weight;
+        lay.fade_rate = 0;
+      }
+    }
+
+    /// Get the time of a layer.
+    float get_layer_time(int index) const {
+      return layers[index].time;
+    }
+
+    /// Jump to a time in a layer.
+    void set_layer_time(int index, float value) {
+      layers[index].time = value;
+    }
+
+    /// Fade in a new animation over some seconds. The layers before it are removed when it is fully in.
+    int cross_fade(animation *anim, float seconds, bool is_looping = true) {
+      for (unsigned l = 0; l != layers.size(); ++l) {
+        layers[l].remove_when_faded = true;
       }
+      int index = add_layer(anim, 0, layer_override, NULL, is_looping);
+      fade_layer(index, 1, seconds);
+      return index;
+    }
 
-      //log("update %f\n", delta_time);
-      if (!is_paused) {
-        time += delta_time;
-        //log("..update %f\n", time);
-        if (time >= anim->get_end_time()) {
-          if (is_looping) {
-            time -= anim->get_end_time();
+    /// Bind the layers to their targets if needed. visual_scene calls this on the main thread
+    /// as binding compiles animations, which may be shared.
+    /// Returns true if update() only writes to nodes under the target, so instances
+    /// whose targets are not under each other can update at the same time.
+    bool prepare() {
+      remove_faded_layers();
+      if (!is_bound) {
+        bind();
+      }
+      return is_parallel;
+    }
+
+    /// The resource that the layers are played on, or NULL to use the targets of the channels.
+    resource *get_target() const {
+      return target;
+    }
+
+    /// update the animation and the resources it connects to.
+    void update(float delta_time) {
+      prepare();
+      update_prepared(delta_time);
+    }
+
+    /// update after prepare() has been called this frame. This touches no shared state,
+    /// so it can run on a worker thread if prepare() returned true.
+    void update_prepared(float delta_time) {
+      if (is_simple()) {
+        write_simple();
+      } else if (layers.size()) {
+        evaluate();
+        float matrix[16];
+        for (unsigned i = 0; i != outputs.size(); ++i) {
+          const anim_output &out = outputs[i];
+          float *value = &result[out.first_value];
+          if (out.node) {
+            animation::compose(matrix, *(animation::trs*)value);
+            out.node->access_nodeToParent().init_transpose(matrix);
           } else {
-            is_paused = true;
+            out.target->set_value(out.sid, out.sub_target, out.component, value);
           }
         }
       }
+
+      advance(delta_time);
     }
   };
 }}
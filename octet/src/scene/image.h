@@ -37,6 +37,18 @@ namespace octet { namespace scene {
 
     GLuint gl_target;
 
+    // animated gifs: frames are decoded when they are shown, unless they all go in a texture array.
+    byte_span animation_source;
+    gif_decoder *animation;
+    unsigned current_frame;
+    bool frame_array;
+
+    // compress with dxt_encoder when loaded. choose_format picks BC1 or BC3 by looking at the alpha.
+    bool compress;
+    bool choose_format;
+    dxt_encoder::format_t compress_format;
+    dxt_encoder::quality_t compress_quality;
+
     void init(const char *name) {
       bool is_cubemap = strstr(name, "%s") != 0;
       this->url = name;
@@ -47,6 +59,14 @@ namespace octet { namespace scene {
       mip_levels = 1;
       cube_faces = is_cubemap ? 6 : 1;
       format = 0;
+      frames = 1;
+      animation = 0;
+      current_frame = 0;
+      frame_array = false;
+      compress = false;
+      choose_format = false;
+      compress_format = dxt_encoder::bc1;
+      compress_quality = dxt_encoder::quality_fast;
     }
 
     // these are here to avoid including glext.h which may be platform dependent.
@@ -62,8 +82,28 @@ namespace octet { namespace scene {
       COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
       COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
     };
 
+    // GL internal format of dxt_encoder blocks for glCompressedTexImage2D.
+    static unsigned get_compressed_format(dxt_encoder::format_t block_format) {
+      switch (block_format) {
+        case dxt_encoder::bc1: return COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case dxt_encoder::bc3: return COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case dxt_encoder::bc4: return COMPRESSED_RED_RGTC1;
+        default: return COMPRESSED_RG_RGTC2;
+      }
+    }
+
+    static bool is_compressed(unsigned format) {
+      return
+        format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ||
+        format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT ||
+        format == COMPRESSED_RED_RGTC1 || format == COMPRESSED_RG_RGTC2
+      ;
+    }
+
     /// Make mipmaps for this image.
     void make_mipmaps() {
       if (format != RGB && format != RGBA) return;
@@ -99,118 +139,34 @@ namespace octet { namespace scene {
       //printf("%d %d\n", dest - &bytes[0], bytes.size());
     }
 
-    /// DXT encode the image, making it smaller and grainier.
-    /// Todo: do standard error-diffusion and other improvements.
+    /// DXT encode the image and its mipmaps, making it smaller and grainier.
     void dxt_encode() {
       if (format != RGB && format != RGBA) return;
 
       unsigned num_comps = format == RGB ? 3 : 4;
-      dynarray<uint8_t> result;
-      result.resize(bytes.size() / num_comps);
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &result[0];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      unsigned new_mip_levels = 0;
-      while (w > 4 && h > 4 && new_mip_levels < mip_levels) {
-        for (unsigned y = 0; y < h/4; ++y) {
-          log("w=%d y=%d src=%08x\n", w, y, src - &bytes[0]);
-          for (unsigned x = 0; x < w/4; ++x) {
-            // ye olde covariance method http://en.wikipedia.org/wiki/Linear_discriminant_analysis
-            vec4 tot(0, 0, 0, 0);
-            vec4 colours[16];
-            for (unsigned j = 0; j != 4; ++j) {
-              for (unsigned i = 0; i != 4; ++i) {
-                //vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), (num_comps == 4 ? src[3] * (1.0f/255) : 1.0f));
-                vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), 1.0f);
-                colours[i+j*4] = colour;
-                tot += colour;
-                src += num_comps;
-              }
-              src += ( w - 4 ) * num_comps;
-            }
-            src -= ( w - 1 ) * 4 * num_comps;
-
-            // calculate the covariance matrix
-            vec4 mean = tot * 0.0625f;
-            mat4t covariance(0);
-            for (unsigned i = 0; i != 16; ++i) {
-              vec4 colour = colours[i] -= mean;
-              covariance += outer(colour, colour);
-            }
-
-            // power method to find largest eigenvector (axis)
-            vec4 axis = covariance.trace();
-            for (unsigned i = 0; i != 4; ++i) {
-              axis = axis * covariance;
-            }
-            float len = axis.length();
-            if (abs(len) >= 0.001f) axis = axis / len;
-            //if (y == 27) log("%s %s %s\n", mean.toString(), axis.toString(), covariance.toString(tmp, sizeof(tmp)));
-
-            // our colours all have to live on the axis.
-            // in practice, we can ignore "odd man out" colours
-            // for better compression. But for now, do all the colours.
-            float pmin = dot(colours[0], axis);
-            float pmax = pmin;
-            float projs[16];
-            projs[0] = pmin;
-            for (unsigned i = 1; i != 16; ++i) {
-              float proj = dot(colours[i], axis);
-              projs[i] = proj;
-              pmin = pmin < proj ? pmin : proj;
-              pmax = pmax > proj ? pmax : proj;
-            }
-            vec4 cmin = mean + axis * pmin;
-            vec4 cmax = mean + axis * pmax;
-            //if (y == 27) log("%s -> %s\n", cmin.toString(), cmax.toString(tmp, sizeof(tmp)));
-            cmin = min(max(cmin, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-            cmax = min(max(cmax, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-
-            unsigned c0 =
-              ( (unsigned)(cmin.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmin.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmin.z() * 31.999f) << 0 )
-            ;
-            unsigned c1 =
-              ( (unsigned)(cmax.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmax.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmax.z() * 31.999f) << 0 )
-            ;
-
-            if (c0 < c1) {
-              unsigned t = c0; c0 = c1; c1 = t;
-              float p = pmin; pmin = pmax; pmax = p;
-            }
-
-            float pscale = abs(pmax - pmin) > 0.001f ? 3.999f / (pmax - pmin) : 0;
-            uint8_t pal[16];
-            for (unsigned i = 0; i != 16; ++i) {
-              pal[i] = (unsigned)( ( projs[i] - pmin ) * pscale );
-            }
-
-            dest[0] = ( c0 >> 0 ) & 0xff;
-            dest[1] = ( c0 >> 8 ) & 0xff;
-            dest[2] = ( c1 >> 0 ) & 0xff;
-            dest[3] = ( c1 >> 8 ) & 0xff;
-            for (int i = 0; i != 4; ++i) {
-              dest[i+4] = pal[i*4+0] + pal[i*4+1] * 4 + pal[i*4+2] * 16 + pal[i*4+3] * 64;
-            }
-            dest += 8;
+      dxt_encoder::format_t block_format = compress_format;
+      if (choose_format) {
+        // only keep alpha if it is used.
+        block_format = dxt_encoder::bc1;
+        for (unsigned i = 3; format == RGBA && i < (unsigned)width * height * 4; i += 4) {
+          if (bytes[i] != 0xff) {
+            block_format = dxt_encoder::bc3;
+            break;
           }
-          src += stride * 3;
         }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        new_mip_levels++;
       }
-      assert(dest - &result[0] < (int)result.size());
-      bytes.resize((int)(dest - &result[0]));
-      memcpy(&bytes[0], &result[0], dest - &result[0]);
-      format = COMPRESSED_RGB_S3TC_DXT1_EXT;
-      mip_levels = new_mip_levels;
+
+      dxt_encoder enc;
+      enc.set_quality(compress_quality);
+      dynarray<uint8_t> result;
+      if (mip_levels > 1) {
+        enc.encode_mipmaps(result, block_format, width, height, &bytes[0], num_comps);
+      } else {
+        enc.encode(result, block_format, width, height, width * num_comps, &bytes[0], num_comps);
+      }
+      bytes.reset();
+      bytes.append(result.data(), result.size());
+      format = (uint16_t)get_compressed_format(block_format);
     }
 
     void add_texture() {
@@ -224,6 +180,9 @@ namespace octet { namespace scene {
         } else if (gl_target == GL_TEXTURE_3D) {
           glTexImage3D(gl_target, 0, format, width, height, 1, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
           printf("err=%08x\n", glGetError());
+        } else if (gl_target == GL_TEXTURE_2D_ARRAY) {
+          glTexImage3D(gl_target, 0, format, width, height, frames, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
+          glGenerateMipmap(gl_target);
         } else if (gl_target == GL_TEXTURE_CUBE_MAP) {
           unsigned num_comps = format == RGBA ? 4 : 3;
           for (int i = 0; i != 6; ++i) {
@@ -262,6 +221,12 @@ namespace octet { namespace scene {
       init(name);
     }
 
+    /// give url of an animated file to load with all the frames in a GL_TEXTURE_2D_ARRAY.
+    image(const char *name, bool frame_array_) {
+      init(name);
+      frame_array = frame_array_;
+    }
+
     /// generate an image from an opengl texture
     image(GLuint _target, GLuint _texture, unsigned _width, unsigned _height, unsigned _depth=1) {
       gl_target = _target;
@@ -269,10 +234,15 @@ namespace octet { namespace scene {
       width = _width;
       height = _height;
       depth = _depth; // for 3D textures
+      frames = 1;
+      animation = 0;
+      current_frame = 0;
+      frame_array = false;
     }
 
     /// release resources.
     ~image() {
+      delete animation;
     }
 
     /// width in pixels
@@ -300,6 +270,42 @@ namespace octet { namespace scene {
       return frames;
     }
 
+    /// how long to show a frame of an animated gif in hundredths of a second.
+    unsigned get_frame_delay(unsigned frame) const {
+      return animation ? animation->get_delay(frame) : 0;
+    }
+
+    /// show a frame of an animated gif, decoding it now.
+    /// Playing the frames in order is cheapest, as each one is drawn over the last.
+    void set_frame(unsigned frame) {
+      if (!animation || frame >= frames || frame == current_frame) return;
+
+      const uint8_t *pixels = animation->get_frame(frame);
+      current_frame = frame;
+      memcpy(&bytes[0], pixels, width * height * 4);
+      if (gl_texture) {
+        glBindTexture(gl_target, gl_texture);
+        glTexSubImage2D(gl_target, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, (void*)pixels);
+        glGenerateMipmap(gl_target);
+      }
+    }
+
+    /// Compress the image when it is loaded, to use four to eight times less GPU memory.
+    /// Images with alpha become BC3 (DXT5), the rest BC1 (DXT1).
+    void set_compression(dxt_encoder::quality_t quality = dxt_encoder::quality_fast) {
+      compress = true;
+      choose_format = true;
+      compress_quality = quality;
+    }
+
+    /// Compress the image to this format when it is loaded, eg. dxt_encoder::bc5 for normal maps.
+    void set_compression(dxt_encoder::format_t block_format, dxt_encoder::quality_t quality = dxt_encoder::quality_fast) {
+      compress = true;
+      choose_format = false;
+      compress_format = block_format;
+      compress_quality = quality;
+    }
+
     /// access attributes by name
     void visit(visitor &v) {
       v.visit(url, atom_url);
@@ -335,13 +341,34 @@ namespace octet { namespace scene {
     }
 
     void load_part(const char *_url) {
-      dynarray<uint8_t> buffer;
+      // decode straight from the file mapping.
+      byte_span buffer;
       app_utils::get_url(buffer, _url);
-      const unsigned char *src = &buffer[0];
-      const unsigned char *src_max = src + buffer.size();
-      if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
-        gif_decoder dec;
-        dec.get_image(bytes, format, width, height, src, src_max);
+      const unsigned char *src = buffer.begin();
+      const unsigned char *src_max = buffer.end();
+      if (buffer.size() >= 6 && (!memcmp(&buffer[0], "GIF89a", 6) || !memcmp(&buffer[0], "GIF87a", 6))) {
+        if (frame_array) {
+          gif_decoder dec;
+          dec.get_frames(bytes, format, width, height, frames, src, src_max);
+          gl_target = GL_TEXTURE_2D_ARRAY;
+          depth = (uint16_t)frames;
+          // mipmaps are made by the GPU.
+          return;
+        }
+
+        // keep the decoder and the file for animations.
+        delete animation;
+        animation = new gif_decoder();
+        animation->get_image(bytes, format, width, height, src, src_max);
+        frames = animation->get_num_frames();
+        current_frame = 0;
+        if (frames > 1) {
+          animation_source = buffer;
+        } else {
+          delete animation;
+          animation = 0;
+          frames = 1;
+        }
       } else if (buffer.size() >= 6 && buffer[0] == 0xff && buffer[1] == 0xd8) {
         jpeg_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
@@ -361,7 +388,9 @@ namespace octet { namespace scene {
       }
 
       make_mipmaps();
-      //dxt_encode();
+      if (compress && gl_target == GL_TEXTURE_2D && cube_faces == 1 && !animation) {
+        dxt_encode();
+      }
     }
 
     /// get the OpenGL texture handle for this image.
@@ -375,20 +404,19 @@ namespace octet { namespace scene {
         glGenTextures(1, &gl_texture);
         glActiveTexture(GL_TEXTURE0);
 
-        // todo: handle compressed textures
         if (format == GL_RGB || format == GL_RGBA) {
           add_texture();
-        } else if (format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+        } else if (is_compressed(format)) {
           glBindTexture(gl_target, gl_texture);
           unsigned w = width;
           unsigned h = height;
           uint8_t *src = &bytes[0];
+          uint8_t *src_max = src + bytes.size();
           unsigned level = 0;
-          unsigned shift = ( format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ) ? 1 : 0;
+          unsigned block_bytes = format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT || format == COMPRESSED_RED_RGTC1 ? 8 : 16;
           while (w != 0 && h != 0) {
-            unsigned wmin = w < 4 ? 4 : w;
-            unsigned hmin = h < 4 ? 4 : h;
-            unsigned size = ( wmin * hmin ) >> shift;
+            unsigned size = ((w + 3) / 4) * ((h + 3) / 4) * block_bytes;
+            if (src + size > src_max) break;
             glCompressedTexImage2D(gl_target, level++, format, w, h, 0, size, (void*)src);
             //printf("%d\n", glGetError());
             src += size;
@@ -107,14 +107,16 @@ namespace octet { namespace scene {
       log("lu[1] = %s\n", light_uniforms[1].toString(tmp, sizeof(tmp)));
       log("lu[2] = %s\n", light_uniforms[2].toString(tmp, sizeof(tmp)));
       log("lu[3] = %s\n", light_uniforms[3].toString(tmp, sizeof(tmp)));*/
-      {
-        // matrices and lighting go in the dynamic uniform buffer
-        param_uniform *modelToProjection_param = get_param_uniform(atom_modelToProjection);
-        if (modelToProjection_param) modelToProjection_param->set_value(buffer.data(), modelToProjection.get(), sizeof(modelToProjection));
-
-        param_uniform *modelToCamera_param = get_param_uniform(atom_modelToCamera);
-        if (modelToCamera_param) modelToCamera_param->set_value(buffer.data(), modelToCamera.get(), sizeof(modelToCamera));
+      bind(light_uniforms, num_light_uniforms, num_lights);
+      set_matrices(modelToProjection, modelToCamera);
+    }
 
+    /// Set the shader, lighting, colours and textures, but not the matrices.
+    /// Many objects can then be drawn with this material by calling set_matrices() for each one.
+    /// use_program is false if the caller knows this material's program is already in use.
+    void bind(vec4 *light_uniforms, int num_light_uniforms, int num_lights, bool use_program=true) {
+      {
+        // lighting goes in the dynamic uniform buffer
         param_uniform *lighting_param = get_param_uniform(atom_lighting);
         if (lighting_param) lighting_param->set_value(buffer.data(), light_uniforms, sizeof(vec4) * num_light_uniforms);
 
@@ -122,13 +124,15 @@ namespace octet { namespace scene {
         if (num_lights_param) num_lights_param->set_value(buffer.data(), &num_lights, sizeof(int32_t));
       }
 
-      custom_shader->render();
+      if (use_program) {
+        custom_shader->render();
+      }
 
       {
         // colours and textures go in the static uniform buffer
         for (unsigned i = 0; i != params.size(); ++i) {
           param_uniform *pu = params[i]->get_param_uniform();
-          if (pu) {
+          if (pu && pu->get_name() != atom_modelToProjection && pu->get_name() != atom_modelToCamera) {
             //printf("%s: %d off=%x\n", app_utils::get_atom_name(pu->get_name()), pu->get_uniform_buffer_index(), pu->get_offset());
             pu->render(buffer.data());
           }
@@ -136,6 +140,32 @@ namespace octet { namespace scene {
       }
     }
 
+    /// Set the matrices for one object after bind().
+    void set_matrices(const mat4t &modelToProjection, const mat4t &modelToCamera) {
+      // matrices go in the dynamic uniform buffer
+      param_uniform *modelToProjection_param = get_param_uniform(atom_modelToProjection);
+      if (modelToProjection_param) {
+        modelToProjection_param->set_value(buffer.data(), modelToProjection.get(), sizeof(modelToProjection));
+        modelToProjection_param->render(buffer.data());
+      }
+
+      param_uniform *modelToCamera_param = get_param_uniform(atom_modelToCamera);
+      if (modelToCamera_param) {
+        modelToCamera_param->set_value(buffer.data(), modelToCamera.get(), sizeof(modelToCamera));
+        modelToCamera_param->render(buffer.data());
+      }
+    }
+
+    /// True if this material's shader can draw instances (see shader::is_instanced()).
+    bool is_instanced() const {
+      return custom_shader && custom_shader->is_instanced();
+    }
+
+    /// Get the OpenGL program used by this material (for sorting draws).
+    GLuint get_program() const {
+      return custom_shader ? custom_shader->get_program() : 0;
+    }
+
     /// Set the uniforms for this material on skinned meshes.
     void render_skinned(const mat4t &cameraToProjection, const mat4t *modelToCamera, int num_nodes, vec4 *light_uniforms, int num_light_uniforms, int num_lights) const {
       //shader.render_skinned(cameraToProjection, modelToCamera, num_nodes, light_uniforms, num_light_uniforms, num_lights);
@@ -25,6 +25,24 @@ namespace octet { namespace scene {
       }
     };
 
+    /// Result of a ray cast against the triangles of a mesh.
+    struct ray_hit {
+      /// in: furthest distance along the ray to look (1 = end of the ray). out: distance to the hit.
+      float t;
+
+      /// vertex indices of the triangle we hit
+      unsigned indices[3];
+
+      /// barycentric coordinates of the hit, eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
+      vec3 bary;
+
+      ray_hit() {
+        t = 1;
+        indices[0] = indices[1] = indices[2] = 0;
+        bary = vec3(0, 0, 0);
+      }
+    };
+
     // sortable edge
     struct edge {
       int32_t idx0;
@@ -57,6 +75,94 @@ namespace octet { namespace scene {
     // bounding box
     aabb mesh_aabb;
 
+    // CPU copy of the triangles and a BVH for ray casts, built on demand.
+    struct ray_cache_t {
+      bvh tree;
+      dynarray<float> pos;
+      dynarray<uint32_t> tris;
+      enum { key_size = 8 };
+      unsigned key[key_size];
+      ray_cache_t() { memset(key, 0, sizeof(key)); }
+    };
+    ray_cache_t ray_cache;
+
+    // rebuild the ray cast BVH if the mesh has changed.
+    // returns false if we can't ray cast this mesh.
+    bool update_ray_cache() {
+      unsigned pos_slot = get_slot(attribute_pos);
+      if (mode != GL_TRIANGLES || pos_slot == ~0 || !vertices || !indices) return false;
+
+      unsigned key[ray_cache_t::key_size] = {
+        vertices->get_version(), index_type ? indices->get_version() : 0, num_indices, num_vertices,
+        first_index, index_type, stride, format[pos_slot]
+      };
+      if (!memcmp(key, ray_cache.key, sizeof(key))) return true;
+      memcpy(ray_cache.key, key, sizeof(key));
+
+      // copy the triangles, skipping any with bad indices.
+      unsigned max_vertices = stride ? (unsigned)(vertices->get_size() / stride) : 0;
+      unsigned num_tris = (index_type ? num_indices : num_vertices) / 3;
+      dynarray<uint32_t> &tris = ray_cache.tris;
+      tris.resize(0);
+      tris.reserve(num_tris * 3);
+      unsigned num_used = 0;
+      if (index_type) {
+        if (first_index + num_tris * 3 > indices->get_size() / get_index_size()) return false;
+        gl_resource::rolock idx_lock(get_indices());
+        for (unsigned i = 0; i != num_tris * 3; i += 3) {
+          unsigned i0 = get_index(idx_lock.u8(), i);
+          unsigned i1 = get_index(idx_lock.u8(), i + 1);
+          unsigned i2 = get_index(idx_lock.u8(), i + 2);
+          if (i0 < max_vertices && i1 < max_vertices && i2 < max_vertices) {
+            tris.push_back(i0);
+            tris.push_back(i1);
+            tris.push_back(i2);
+            num_used = std::max(num_used, std::max(i0, std::max(i1, i2)) + 1);
+          }
+        }
+      } else {
+        num_tris = std::min(num_tris, max_vertices / 3);
+        for (unsigned i = 0; i != num_tris * 3; ++i) {
+          tris.push_back(i);
+        }
+        num_used = num_tris * 3;
+      }
+      num_tris = tris.size() / 3;
+
+      // copy the positions
+      dynarray<float> &pos = ray_cache.pos;
+      pos.resize(num_used * 3);
+      if (num_used) {
+        gl_resource::rolock vtx_lock(get_vertices());
+        const uint8_t *src = vtx_lock.u8();
+        if (get_kind(pos_slot) == GL_FLOAT && get_size(pos_slot) >= 3) {
+          src += get_offset(pos_slot);
+          for (unsigned i = 0; i != num_used; ++i, src += stride) {
+            memcpy(&pos[i*3], src, sizeof(float) * 3);
+          }
+        } else {
+          for (unsigned i = 0; i != num_used; ++i) {
+            vec4 value = get_value(src, pos_slot, i);
+            pos[i*3+0] = value[0];
+            pos[i*3+1] = value[1];
+            pos[i*3+2] = value[2];
+          }
+        }
+      }
+
+      dynarray<aabb> boxes(num_tris);
+      for (unsigned i = 0; i != num_tris; ++i) {
+        vec3 a(pos[tris[i*3+0]*3], pos[tris[i*3+0]*3+1], pos[tris[i*3+0]*3+2]);
+        vec3 b(pos[tris[i*3+1]*3], pos[tris[i*3+1]*3+1], pos[tris[i*3+1]*3+2]);
+        vec3 c(pos[tris[i*3+2]*3], pos[tris[i*3+2]*3+1], pos[tris[i*3+2]*3+2]);
+        vec3 vmin = min(a, min(b, c));
+        vec3 vmax = max(a, max(b, c));
+        boxes[i] = aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f);
+      }
+      ray_cache.tree.build(boxes.data(), num_tris);
+      return true;
+    }
+
     struct general_vertex {
       const uint8_t *bytes;
       unsigned size;
@@ -427,12 +533,31 @@ namespace octet { namespace scene {
       return result;
     }
 
+    /// Keep CPU copies of the vertices and indices so that reading them (calc_aabb, ray_cast etc.)
+    /// does not map the GL buffers.
+    void set_shadow(bool value) {
+      vertices->set_shadow(value);
+      indices->set_shadow(value);
+    }
+
+    /// Make the vertices and indices streaming buffers for meshes that are rewritten every frame.
+    void set_streaming(bool value) {
+      vertices->set_streaming(value);
+      indices->set_streaming(value);
+    }
+
     /// Allocate VBO and IBO objects together.
     void allocate(size_t vsize, size_t isize) {
       vertices->allocate(GL_ARRAY_BUFFER, vsize);
       indices->allocate(GL_ELEMENT_ARRAY_BUFFER, isize);
     }
 
+    /// Allocate VBO and IBO objects and fill them in one go (eg. straight from a mapped file).
+    void allocate(size_t vsize, size_t isize, const void *vsrc, const void *isrc) {
+      vertices->allocate(GL_ARRAY_BUFFER, vsize, GL_STATIC_DRAW, vsrc);
+      indices->allocate(GL_ELEMENT_ARRAY_BUFFER, isize, GL_STATIC_DRAW, isrc);
+    }
+
     /// allocate and assign data to IBO and VBO
     void assign(size_t vsize, size_t isize, uint8_t *vsrc, uint8_t *isrc) {
       vertices->assign(vsrc, 0, vsize);
@@ -477,12 +602,14 @@ namespace octet { namespace scene {
     void enable_attributes() const {
       vertices->bind();
 
+      // streaming buffers move about in the GL buffer.
+      size_t base = vertices->get_base_offset();
       unsigned n = normalized;
       for (unsigned slot = 0; slot != get_num_slots(); ++slot) {
         unsigned size = get_size(slot);
         unsigned kind = get_kind(slot);
         unsigned attr = get_attr(slot);
-        size_t offset = get_offset(slot);
+        size_t offset = base + get_offset(slot);
         glVertexAttribPointer(attr, size, kind, n & 1, get_stride(), (void*)(offset));
         glEnableVertexAttribArray(attr);
         n >>= 1;
@@ -494,12 +621,23 @@ namespace octet { namespace scene {
       //printf("de %04x %d %d\n", get_mode(), get_num_vertices(), get_index_type());
       if (get_index_type()) {
         indices->bind();
-        glDrawElements(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(get_index_size() * first_index));
+        glDrawElements(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(indices->get_base_offset() + get_index_size() * first_index));
       } else {
         glDrawArrays(get_mode(), 0, get_num_vertices());
       }
     }
 
+    /// Draw num_instances copies of the primitives with one call (hardware instancing).
+    /// The per-instance attributes must be enabled with a divisor of one.
+    void draw_instanced(unsigned num_instances) {
+      if (get_index_type()) {
+        indices->bind();
+        glDrawElementsInstanced(get_mode(), get_num_indices(), get_index_type(), (GLvoid*)(indices->get_base_offset() + get_index_size() * first_index), num_instances);
+      } else {
+        glDrawArraysInstanced(get_mode(), 0, get_num_vertices(), num_instances);
+      }
+    }
+
     /// When rendering a mesh, call this last to disable attributes.
     void disable_attributes() {
       for (unsigned slot = 0; slot != get_num_slots(); ++slot) {
@@ -536,89 +674,84 @@ namespace octet { namespace scene {
       mesh_aabb = aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f);
     }
 
-    /// *very* slow ray cast.
-    /// returns "barycentric" coordinates.
-    /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
-    /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
-    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
-      unsigned pos_slot = get_slot(attribute_pos);
-      if (get_index_type() != GL_UNSIGNED_INT) return false;
-      if (get_size(pos_slot) < 3) return false;
-      if (get_kind(pos_slot) != GL_FLOAT) return false;
+    /// Cast a ray against the triangles of the mesh (in model space).
+    ///
+    /// The first call builds a BVH from a CPU copy of the triangles.
+    /// This is rebuilt if the vertices or indices are written.
+    ///
+    /// hit.t is the furthest distance to look on input (1 = end of the ray) and the nearest hit on output.
+    bool ray_cast(const ray &the_ray, ray_hit &hit) {
+      if (!update_ray_cache()) return false;
 
+      const float *pos = ray_cache.pos.data();
+      const uint32_t *tris = ray_cache.tris.data();
       vec3 org = the_ray.get_start();
       vec3 dir = the_ray.get_distance();
-      //log("ray_cast: org=%s dir=%s\n", org.toString(), dir.toString());
+      unsigned best_tri = ~0;
+      float best_u = 0, best_v = 0;
+
+      // Moller-Trumbore test, hitting either side of the triangle.
+      ray_cache.tree.cast(org, dir, hit.t, [&](unsigned tri, float &t_max) -> bool {
+        const float *pa = pos + tris[tri*3+0] * 3;
+        const float *pb = pos + tris[tri*3+1] * 3;
+        const float *pc = pos + tris[tri*3+2] * 3;
+        vec3 a(pa[0], pa[1], pa[2]);
+        vec3 e1 = vec3(pb[0], pb[1], pb[2]) - a;
+        vec3 e2 = vec3(pc[0], pc[1], pc[2]) - a;
+        vec3 p = cross(dir, e2);
+        float det = dot(e1, p);
+        if (fabsf(det) < 1e-20f) return false;
+        float inv_det = 1.0f / det;
+        vec3 s = org - a;
+        float u = dot(s, p) * inv_det;
+        if (u < 0 || u > 1) return false;
+        vec3 q = cross(s, e1);
+        float v = dot(dir, q) * inv_det;
+        if (v < 0 || u + v > 1) return false;
+        float t = dot(e2, q) * inv_det;
+        if (t < 0 || t > t_max) return false;
+        t_max = t;
+        best_tri = tri;
+        best_u = u;
+        best_v = v;
+        return true;
+      });
 
-      unsigned pos_offset = get_offset(pos_slot);
-      gl_resource::rolock idx_lock(get_indices());
-      gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *idx = idx_lock.u32() + first_index;
-      const uint8_t *vtx = vtx_lock.u8();
-
-      float best_denom = 0;
-      vec4 best_numer(0, 0, 0, 0);
-      for (unsigned i = 0; i != get_num_indices(); i += 3) {
-        vec3 a = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+0]) - org;
-        vec3 b = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+1]) - org;
-        vec3 c = (vec3)*(const vec3p*)(vtx + pos_offset + stride * idx[i+2]) - org;
-        vec3 d = dir;
-
-        // solve [ba, bb, bc, bd] * [[ax, ay, az, 1], [bx, by, bz, 1], [cx, cy, cz, 1], [-dx, -dy, -dz, 0]] = [0, 0, 0, 1]
-        //
-        // ie. ba + bb + bc = 1  and  ba * a + bb * b + bc * c = bd * d
-        //
-        // [ba, bb, bc] are barycentric coordinates, bd is the distance along the vector
-
-        // The last line of the inverse matrix is the solution (vector triple products)
-
-        // numerator
-        vec4 numer(
-          dot(cross(b, c), d),
-          dot(cross(c, a), d),
-          dot(cross(a, b), d),
-          dot(cross(a, b), c)
-        );
-
-        // denominator
-        float denom = numer[0] + numer[1] + numer[2];
-
-        //log("a=%s b=%s c=%s d=%s denom=%f\n", a.toString(), b.toString(), c.toString(), d.toString(), denom);
-        //log("numer=%s\n", numer.toString());
-        //log("res=%s\n", (numer / denom).toString());
-
-        // using a multiply lets us check the sign without using a divide.
-        vec4 bary2 = numer * denom;
-
-        if (all(bary2 >= vec4(0, 0, 0, 0))) {
-          rational best_distance(best_numer[3], best_denom);
-          rational new_distance(numer[3], denom);
-          /*printf(
-            "t%d %9.3f %d %d %d  %s %s %s\n",
-            i, numer[3]/denom, idx[i+0], idx[i+1], idx[i+2],
-            (numer/denom).toString(), best_distance.toString(), new_distance.toString()
-          );*/
-
-          unsigned further = new_distance > best_distance;
-          if (!further) {
-            indices[0] = idx[i+0];
-            indices[1] = idx[i+1];
-            indices[2] = idx[i+2];
-            best_numer = numer;
-            best_denom = denom;
-          }
-        }
+      if (best_tri == ~0) return false;
+      hit.indices[0] = tris[best_tri*3+0];
+      hit.indices[1] = tris[best_tri*3+1];
+      hit.indices[2] = tris[best_tri*3+2];
+      hit.bary = vec3(1 - best_u - best_v, best_u, best_v);
+      return true;
+    }
+
+    /// Cast many rays against the mesh. Set up the hits with the furthest distance first.
+    /// Returns the number of rays that hit.
+    unsigned ray_cast(const ray *rays, unsigned num_rays, ray_hit *hits) {
+      if (!update_ray_cache()) return 0;
+      unsigned num_hits = 0;
+      for (unsigned i = 0; i != num_rays; ++i) {
+        num_hits += ray_cast(rays[i], hits[i]);
       }
+      return num_hits;
+    }
 
-      if (fabsf(best_denom) < 1e-6f) {
+    /// ray cast returning "barycentric" coordinates.
+    /// eg. hit pos = bary[0] * pos0 + bary[1] * pos1 + bary[2] * pos2 (or ray.start + ray.distance * bary[3])
+    /// eg. hit uv = bary[0] * uv0 + bary[1] * uv1 + bary[2] * uv2
+    bool ray_cast(const ray &the_ray, int indices[], vec4 &bary_numer, float &bary_denom) {
+      ray_hit hit;
+      if (!ray_cast(the_ray, hit)) {
         bary_numer = vec4(0, 0, 0, 0);
         bary_denom = 0;
         return false;
-      } else {
-        bary_numer = best_numer;
-        bary_denom = best_denom;
-        return true;
       }
+      indices[0] = (int)hit.indices[0];
+      indices[1] = (int)hit.indices[1];
+      indices[2] = (int)hit.indices[2];
+      bary_numer = vec4(hit.bary, hit.t);
+      bary_denom = 1;
+      return true;
     }
 
     /// access the vertex buffer (VBO) or memory buffer
@@ -35,6 +35,121 @@ namespace octet { namespace scene {
     // if the object is further than this from the camera, do not draw.
     float max_draw_distance;
 
+    // for skeletons with more bones than the skin shader takes: the mesh skinned on the CPU every frame.
+    ref<mesh> cpu_skinned_mesh;
+
+    // where the attributes are in a source vertex for CPU skinning, in floats. ~0 if missing.
+    struct skin_format {
+      unsigned stride;
+      unsigned pos;
+      unsigned normal;
+      unsigned uv;
+      unsigned blendweight;
+      unsigned blendindices;
+      unsigned num_influences;  // blendindices per vertex; blendweight has one less, as in the shader.
+    };
+
+    // find a float attribute and return its offset in floats.
+    static unsigned find_float_attribute(const mesh *msh, unsigned attr, unsigned min_size, unsigned &size) {
+      unsigned slot = msh->get_slot(attr);
+      if (slot == ~0u || msh->get_kind(slot) != GL_FLOAT || msh->get_size(slot) < min_size || (msh->get_offset(slot) & 3)) {
+        return ~0u;
+      }
+      size = msh->get_size(slot);
+      return msh->get_offset(slot) / 4;
+    }
+
+    static bool get_skin_format(const mesh *msh, skin_format &fmt) {
+      unsigned size = 0, weight_size = 0;
+      fmt.stride = msh->get_stride();
+      fmt.pos = find_float_attribute(msh, attribute_pos, 3, size);
+      fmt.normal = find_float_attribute(msh, attribute_normal, 3, size);
+      fmt.uv = find_float_attribute(msh, attribute_uv, 2, size);
+      fmt.blendweight = find_float_attribute(msh, attribute_blendweight, 1, weight_size);
+      fmt.blendindices = find_float_attribute(msh, attribute_blendindices, 1, size);
+      fmt.num_influences = size < 4 ? size : 4;
+      if (fmt.blendweight == ~0u) {
+        fmt.num_influences = 1;
+      } else if (weight_size + 1 < fmt.num_influences) {
+        fmt.num_influences = weight_size + 1;
+      }
+      return fmt.pos != ~0u && fmt.blendindices != ~0u && !(fmt.stride & 3);
+    }
+
+    // skin vertices [begin, end) with a palette of matrices, writing position, normal and uv.
+    static void skin_vertices(mesh::vertex *dest, const uint8_t *src, const skin_format &fmt, const mat4t *transforms, unsigned num_transforms, unsigned begin, unsigned end) {
+      for (unsigned i = begin; i != end; ++i) {
+        const float *v = (const float*)(src + i * fmt.stride);
+        float weights[4];
+        unsigned bones[4];
+        float total = 0;
+        for (unsigned k = 1; k != fmt.num_influences; ++k) {
+          weights[k] = v[fmt.blendweight + k - 1];
+          total += weights[k];
+        }
+        weights[0] = 1 - total;
+        for (unsigned k = 0; k != fmt.num_influences; ++k) {
+          unsigned bone = (unsigned)v[fmt.blendindices + k];
+          bones[k] = bone < num_transforms ? bone : 0;
+        }
+
+        const float *pos = v + fmt.pos;
+        const float *normal = fmt.normal != ~0u ? v + fmt.normal : NULL;
+        mesh::vertex &out = dest[i];
+        #if OCTET_SSE2
+          // blend the rows of the bones' matrices, then transform.
+          __m128 r0 = _mm_setzero_ps(), r1 = r0, r2 = r0, r3 = r0;
+          for (unsigned k = 0; k != fmt.num_influences; ++k) {
+            if (weights[k] == 0) continue;
+            const float *m = transforms[bones[k]].get();
+            __m128 w = _mm_set1_ps(weights[k]);
+            r0 = _mm_add_ps(r0, _mm_mul_ps(w, _mm_loadu_ps(m)));
+            r1 = _mm_add_ps(r1, _mm_mul_ps(w, _mm_loadu_ps(m + 4)));
+            r2 = _mm_add_ps(r2, _mm_mul_ps(w, _mm_loadu_ps(m + 8)));
+            r3 = _mm_add_ps(r3, _mm_mul_ps(w, _mm_loadu_ps(m + 12)));
+          }
+          __m128 p = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(pos[0]), r0), _mm_mul_ps(_mm_set1_ps(pos[1]), r1)),
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(pos[2]), r2), r3)
+          );
+          float result[8];
+          _mm_storeu_ps(result, p);
+          if (normal) {
+            __m128 n = _mm_add_ps(
+              _mm_add_ps(_mm_mul_ps(_mm_set1_ps(normal[0]), r0), _mm_mul_ps(_mm_set1_ps(normal[1]), r1)),
+              _mm_mul_ps(_mm_set1_ps(normal[2]), r2)
+            );
+            _mm_storeu_ps(result + 4, n);
+          }
+        #else
+          float rows[16] = { 0 };
+          for (unsigned k = 0; k != fmt.num_influences; ++k) {
+            const float *m = transforms[bones[k]].get();
+            for (unsigned j = 0; j != 16; ++j) rows[j] += weights[k] * m[j];
+          }
+          float result[8];
+          for (unsigned j = 0; j != 3; ++j) {
+            result[j] = pos[0] * rows[j] + pos[1] * rows[4+j] + pos[2] * rows[8+j] + rows[12+j];
+            if (normal) result[4+j] = normal[0] * rows[j] + normal[1] * rows[4+j] + normal[2] * rows[8+j];
+          }
+        #endif
+
+        out.pos = vec3p(result[0], result[1], result[2]);
+        if (normal) {
+          float len2 = result[4] * result[4] + result[5] * result[5] + result[6] * result[6];
+          float rlen = len2 > 0 ? 1 / sqrtf(len2) : 0;
+          out.normal = vec3p(result[4] * rlen, result[5] * rlen, result[6] * rlen);
+        } else {
+          out.normal = vec3p(0, 0, 1);
+        }
+        if (fmt.uv != ~0u) {
+          out.uv = vec2p(v[fmt.uv], v[fmt.uv + 1]);
+        } else {
+          out.uv = vec2p(0, 0);
+        }
+      }
+    }
+
   public:
     RESOURCE_META(mesh_instance)
 
@@ -104,6 +219,57 @@ namespace octet { namespace scene {
     void update(float delta_time) {
     }
 
+    /// For skeletons with more bones than the skin shader takes: skin the mesh on the CPU
+    /// with the matrices from skeleton::calc_transforms and return a mesh of mesh::vertex
+    /// in the matrices' space, drawn with the normal shader. The vertices are written to a streaming
+    /// buffer every call; jobs, if not NULL, share them out. Returns NULL if the mesh has no
+    /// float positions and blend indices.
+    mesh *calc_cpu_skin(const mat4t *transforms, unsigned num_transforms, job_pool *jobs) {
+      skin_format fmt;
+      if (!msh || !get_skin_format(msh, fmt)) {
+        return NULL;
+      }
+
+      unsigned num_vertices = msh->get_num_vertices();
+      if (!cpu_skinned_mesh || cpu_skinned_mesh->get_num_vertices() != num_vertices || cpu_skinned_mesh->get_indices() != msh->get_indices()) {
+        // read the source vertices from memory every frame.
+        msh->get_vertices()->set_shadow(true);
+
+        gl_resource *vertices = new gl_resource();
+        vertices->set_streaming(true);
+        vertices->allocate(GL_ARRAY_BUFFER, num_vertices * sizeof(mesh::vertex), GL_STREAM_DRAW);
+
+        // same indices, new vertices.
+        cpu_skinned_mesh = new mesh();
+        cpu_skinned_mesh->set_default_attributes();
+        cpu_skinned_mesh->set_vertices(vertices);
+        cpu_skinned_mesh->set_indices(msh->get_indices());
+        cpu_skinned_mesh->set_params(sizeof(mesh::vertex), msh->get_num_indices(), num_vertices, msh->get_mode(), msh->get_index_type());
+        cpu_skinned_mesh->set_first_index(msh->get_first_index());
+      }
+
+      gl_resource::rolock src(msh->get_vertices());
+      gl_resource::wolock dest(cpu_skinned_mesh->get_vertices());
+      const uint8_t *src_bytes = src.u8();
+      mesh::vertex *dest_vertices = (mesh::vertex*)dest.u8();
+
+      enum { batch_size = 1024 };
+      unsigned num_batches = (num_vertices + batch_size - 1) / batch_size;
+      auto skin_batch = [&](unsigned batch) {
+        unsigned begin = batch * batch_size;
+        unsigned end = begin + batch_size < num_vertices ? begin + batch_size : num_vertices;
+        skin_vertices(dest_vertices, src_bytes, fmt, transforms, num_transforms, begin, end);
+      };
+      if (jobs) {
+        jobs->parallel_for(num_batches, skin_batch);
+      } else {
+        for (unsigned batch = 0; batch != num_batches; ++batch) {
+          skin_batch(batch);
+        }
+      }
+      return cpu_skinned_mesh;
+    }
+
     //////////////////////////////
     //
     // accessor methods
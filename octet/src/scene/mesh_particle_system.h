@@ -8,6 +8,17 @@ namespace octet { namespace scene {
   /// Particle system: billboards, trails and cloth.
   /// Note all particles in the system must use the same material, but you
   /// can use a custom shader to select different effects.
+  ///
+  /// Billboard particles are stored as structure-of-arrays and kept packed in the order
+  /// they were added. Dead particles are removed by animate(), which moves the others down,
+  /// so particle indices are only valid until the next call to animate().
+  ///
+  /// Changes from the array-of-structs version:
+  ///   - add_billboard_particle() returns -1 for a particle that is not enabled, and adds nothing.
+  ///   - access_billboard_particle() and access_particle_animator() are gone, as the fields are not
+  ///     stored together. Use get_billboard_particle(), set_billboard_particle() and get_particle_animator()
+  ///     to read and change copies. add_particle_animator() replaces the animator of a particle.
+  ///   - add_particle_animator() uses link as the particle to animate and returns -1 if there is none.
   class mesh_particle_system : public mesh {
   public:
     /// general particle, billboard, trail, cloth etc.
@@ -73,35 +84,74 @@ namespace octet { namespace scene {
       sphere geom;
     };
   private:
+    // billboard particles, one array per field.
+    enum {
+      pos_x, pos_y, pos_z,
+      vel_x, vel_y, vel_z,
+      acc_x, acc_y, acc_z,
+      size_x, size_y,
+      uv_left, uv_bottom, uv_right, uv_top,
+      num_float_fields
+    };
+
+    enum {
+      angle, spin, age, lifetime,
+      num_int_fields
+    };
+
+    // particles without an animator live forever. Lifetimes are kept below 2^31 for signed SIMD compares.
+    enum { max_lifetime = 0x7fffffff };
+
+    // animate() and update() split the particles into chunks of this many for the job pool.
+    enum { chunk_size = 4096 };
 
-    // POD (plain-old-data) structure dynarray of camera-facing particles
-    dynarray<billboard_particle> billboard_particles;
-    int free_billboard_particle;
+    dynarray<float> float_fields[num_float_fields];
+    dynarray<uint32_t> int_fields[num_int_fields];
+    unsigned num_billboard_particles;
+
+    // scratch for animate()
+    dynarray<unsigned> chunk_deaths;
+    dynarray<unsigned> survivors;
 
     // POD structure dynarray of trail particles.
     dynarray<trail_particle> trail_particles;
     int free_trail_particle;
 
-    // POD structure dynarray of animators for particles.
-    dynarray<particle_animator> particle_animators;
-    int free_particle_animator;
-
     // camera matrix
     mat4t cameraToWorld;
 
-    void init(const aabb &size, int bbcap, int tpcap, int pacap) {
+    // optional threads for animate() and update(), owned by the caller.
+    job_pool *jobs;
+
+    void init(const aabb &size, int bbcap, int tpcap) {
       set_default_attributes();
       set_aabb(size);
-      billboard_particles.reserve(bbcap);
+      for (unsigned f = 0; f != num_float_fields; ++f) {
+        float_fields[f].resize(bbcap);
+      }
+      for (unsigned f = 0; f != num_int_fields; ++f) {
+        int_fields[f].resize(bbcap);
+      }
+      num_billboard_particles = 0;
       trail_particles.reserve(tpcap);
-      particle_animators.reserve(pacap);
-      free_billboard_particle = -1;
       free_trail_particle = -1;
-      free_particle_animator = -1;
+      jobs = NULL;
 
       unsigned vsize = (bbcap * 4 + tpcap * 2) * sizeof(vertex);
       unsigned isize = (bbcap * 6 + tpcap * 6) * sizeof(uint32_t);
+
+      // we rewrite the vertices every frame, but billboard quads always use the same indices.
+      get_vertices()->set_streaming(true);
       mesh::allocate(vsize, isize);
+
+      gl_resource::wolock ilock(get_indices());
+      uint32_t *idx = ilock.u32();
+      for (unsigned i = 0; i != (unsigned)bbcap; ++i) {
+        unsigned v = i * 4;
+        idx[0] = v; idx[1] = v+1; idx[2] = v+2;
+        idx[3] = v; idx[4] = v+2; idx[5] = v+3;
+        idx += 6;
+      }
     }
 
     // pool allocation of particles.
@@ -119,35 +169,200 @@ namespace octet { namespace scene {
 
     // return to pool
     template <class Type> void free(dynarray<Type> &array, int &free, int element) {
-      array[free].link = free;
+      array[element].link = free;
       free = element;
     }
 
+    unsigned get_num_chunks(unsigned num) const {
+      return (num + chunk_size - 1) / chunk_size;
+    }
+
+    // run fn(chunk, begin, end) over ranges of the billboard particles.
+    template <class fn_t> void for_each_chunk(unsigned num, fn_t fn) {
+      unsigned num_chunks = get_num_chunks(num);
+      auto chunk = [&](unsigned c) {
+        unsigned begin = c * chunk_size;
+        fn(c, begin, std::min(begin + chunk_size, num));
+      };
+      if (jobs) {
+        jobs->parallel_for(num_chunks, chunk);
+      } else {
+        for (unsigned c = 0; c != num_chunks; ++c) chunk(c);
+      }
+    }
+
+    // move and age particles [begin, end). Returns the number that have reached their lifetime,
+    // which are marked with an age of ~0 for compact().
+    unsigned integrate(unsigned begin, unsigned end, float time_step) {
+      float *px = float_fields[pos_x].data(), *py = float_fields[pos_y].data(), *pz = float_fields[pos_z].data();
+      float *vx = float_fields[vel_x].data(), *vy = float_fields[vel_y].data(), *vz = float_fields[vel_z].data();
+      const float *ax = float_fields[acc_x].data(), *ay = float_fields[acc_y].data(), *az = float_fields[acc_z].data();
+      uint32_t *ang = int_fields[angle].data(), *ages = int_fields[age].data();
+      const uint32_t *spins = int_fields[spin].data(), *lifetimes = int_fields[lifetime].data();
+      unsigned deaths = 0;
+      unsigned i = begin;
+
+      #if OCTET_SSE2
+        __m128 dt = _mm_set1_ps(time_step);
+        for (; i + 4 <= end; i += 4) {
+          __m128 x = _mm_loadu_ps(vx + i), y = _mm_loadu_ps(vy + i), z = _mm_loadu_ps(vz + i);
+          _mm_storeu_ps(px + i, _mm_add_ps(_mm_loadu_ps(px + i), _mm_mul_ps(x, dt)));
+          _mm_storeu_ps(py + i, _mm_add_ps(_mm_loadu_ps(py + i), _mm_mul_ps(y, dt)));
+          _mm_storeu_ps(pz + i, _mm_add_ps(_mm_loadu_ps(pz + i), _mm_mul_ps(z, dt)));
+          _mm_storeu_ps(vx + i, _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(ax + i), dt)));
+          _mm_storeu_ps(vy + i, _mm_add_ps(y, _mm_mul_ps(_mm_loadu_ps(ay + i), dt)));
+          _mm_storeu_ps(vz + i, _mm_add_ps(z, _mm_mul_ps(_mm_loadu_ps(az + i), dt)));
+
+          // alive is all ones for particles still within their lifetime. They age, the others get ~0.
+          __m128i a = _mm_loadu_si128((const __m128i*)(ages + i));
+          __m128i alive = _mm_cmplt_epi32(a, _mm_loadu_si128((const __m128i*)(lifetimes + i)));
+          _mm_storeu_si128((__m128i*)(ages + i), _mm_or_si128(_mm_sub_epi32(a, alive), _mm_andnot_si128(alive, _mm_set1_epi32(-1))));
+          unsigned dead = ~_mm_movemask_ps(_mm_castsi128_ps(alive)) & 15;
+          deaths += (dead & 1) + (dead >> 1 & 1) + (dead >> 2 & 1) + (dead >> 3);
+
+          for (unsigned j = i; j != i + 4; ++j) {
+            ang[j] += (uint32_t)(spins[j] * time_step);
+          }
+        }
+      #endif
+
+      for (; i != end; ++i) {
+        px[i] += vx[i] * time_step; py[i] += vy[i] * time_step; pz[i] += vz[i] * time_step;
+        vx[i] += ax[i] * time_step; vy[i] += ay[i] * time_step; vz[i] += az[i] * time_step;
+        ang[i] += (uint32_t)(spins[i] * time_step);
+        if (ages[i] < lifetimes[i]) {
+          ages[i]++;
+        } else {
+          ages[i] = ~0u;
+          deaths++;
+        }
+      }
+      return deaths;
+    }
+
+    // write the quads for particles [begin, end) to vtx[begin*4...]
+    void expand_billboards(vertex *vtx, unsigned begin, unsigned end) {
+      const float *px = float_fields[pos_x].data(), *py = float_fields[pos_y].data(), *pz = float_fields[pos_z].data();
+      const float *sx = float_fields[size_x].data(), *sy = float_fields[size_y].data();
+      const float *u0 = float_fields[uv_left].data(), *v0 = float_fields[uv_bottom].data();
+      const float *u1 = float_fields[uv_right].data(), *v1 = float_fields[uv_top].data();
+      vec3 cx = cameraToWorld.x().xyz();
+      vec3 cy = cameraToWorld.y().xyz();
+      vec3 n = cameraToWorld.z().xyz();
+      unsigned i = begin;
+
+      #if OCTET_SSE2
+        __m128 cxx = _mm_set1_ps(cx.x()), cxy = _mm_set1_ps(cx.y()), cxz = _mm_set1_ps(cx.z());
+        __m128 cyx = _mm_set1_ps(cy.x()), cyy = _mm_set1_ps(cy.y()), cyz = _mm_set1_ps(cy.z());
+        __m128 nx = _mm_set1_ps(n.x()), ny = _mm_set1_ps(n.y()), nz = _mm_set1_ps(n.z());
+
+        // nobody reads the vertices back, so bypass the cache if we can.
+        bool aligned = ((size_t)vtx & 15) == 0;
+        for (; i + 4 <= end; i += 4) {
+          __m128 x = _mm_loadu_ps(px + i), y = _mm_loadu_ps(py + i), z = _mm_loadu_ps(pz + i);
+          __m128 w = _mm_loadu_ps(sx + i), h = _mm_loadu_ps(sy + i);
+          __m128 dxx = _mm_mul_ps(w, cxx), dxy = _mm_mul_ps(w, cxy), dxz = _mm_mul_ps(w, cxz);
+          __m128 dyx = _mm_mul_ps(h, cyx), dyy = _mm_mul_ps(h, cyy), dyz = _mm_mul_ps(h, cyz);
+          __m128 tx = _mm_add_ps(x, dyx), ty = _mm_add_ps(y, dyy), tz = _mm_add_ps(z, dyz);
+          __m128 bx = _mm_sub_ps(x, dyx), by = _mm_sub_ps(y, dyy), bz = _mm_sub_ps(z, dyz);
+          __m128 l = _mm_loadu_ps(u0 + i), b = _mm_loadu_ps(v0 + i);
+          __m128 r = _mm_loadu_ps(u1 + i), t = _mm_loadu_ps(v1 + i);
+          float *dest = (float*)(vtx + i * 4);
+          store_corners(dest + 0, _mm_sub_ps(tx, dxx), _mm_sub_ps(ty, dxy), _mm_sub_ps(tz, dxz), l, t, nx, ny, nz, aligned);
+          store_corners(dest + 8, _mm_add_ps(tx, dxx), _mm_add_ps(ty, dxy), _mm_add_ps(tz, dxz), r, t, nx, ny, nz, aligned);
+          store_corners(dest + 16, _mm_add_ps(bx, dxx), _mm_add_ps(by, dxy), _mm_add_ps(bz, dxz), r, b, nx, ny, nz, aligned);
+          store_corners(dest + 24, _mm_sub_ps(bx, dxx), _mm_sub_ps(by, dxy), _mm_sub_ps(bz, dxz), l, b, nx, ny, nz, aligned);
+        }
+        _mm_sfence();
+      #endif
+
+      for (; i != end; ++i) {
+        vec3 pos(px[i], py[i], pz[i]);
+        vec3 dx = sx[i] * cx;
+        vec3 dy = sy[i] * cy;
+        vertex *v = vtx + i * 4;
+        v->pos = pos - dx + dy; v->normal = n; v->uv = vec2(u0[i], v1[i]); v++;
+        v->pos = pos + dx + dy; v->normal = n; v->uv = vec2(u1[i], v1[i]); v++;
+        v->pos = pos + dx - dy; v->normal = n; v->uv = vec2(u1[i], v0[i]); v++;
+        v->pos = pos - dx - dy; v->normal = n; v->uv = vec2(u0[i], v0[i]); v++;
+      }
+    }
+
+    #if OCTET_SSE2
+      // store one corner of four quads. Vertices are 8 floats apart, quads 32 floats apart.
+      static void store_corners(float *dest, __m128 x, __m128 y, __m128 z, __m128 u, __m128 v, __m128 nx, __m128 ny, __m128 nz, bool aligned) {
+        _MM_TRANSPOSE4_PS(x, y, z, nx);
+        _MM_TRANSPOSE4_PS(ny, nz, u, v);
+        if (aligned) {
+          _mm_stream_ps(dest + 0, x); _mm_stream_ps(dest + 4, ny);
+          _mm_stream_ps(dest + 32, y); _mm_stream_ps(dest + 36, nz);
+          _mm_stream_ps(dest + 64, z); _mm_stream_ps(dest + 68, u);
+          _mm_stream_ps(dest + 96, nx); _mm_stream_ps(dest + 100, v);
+        } else {
+          _mm_storeu_ps(dest + 0, x); _mm_storeu_ps(dest + 4, ny);
+          _mm_storeu_ps(dest + 32, y); _mm_storeu_ps(dest + 36, nz);
+          _mm_storeu_ps(dest + 64, z); _mm_storeu_ps(dest + 68, u);
+          _mm_storeu_ps(dest + 96, nx); _mm_storeu_ps(dest + 100, v);
+        }
+      }
+    #endif
+
+    // remove dead particles, keeping the others in order.
+    void compact(unsigned first_chunk) {
+      unsigned num = num_billboard_particles;
+      const uint32_t *ages = int_fields[age].data(), *lifetimes = int_fields[lifetime].data();
+      unsigned first = first_chunk * chunk_size;
+      survivors.resize(num - first);
+      unsigned num_survivors = 0;
+      for (unsigned i = first; i != num; ++i) {
+        survivors[num_survivors] = i;
+        num_survivors += ages[i] <= lifetimes[i];
+      }
+
+      // each field is moved independently.
+      const unsigned *src = survivors.data();
+      auto move_field = [&](unsigned f) {
+        if (f < num_float_fields) {
+          float *data = float_fields[f].data() + first;
+          for (unsigned j = 0; j != num_survivors; ++j) data[j] = data[src[j] - first];
+        } else {
+          uint32_t *data = int_fields[f - num_float_fields].data() + first;
+          for (unsigned j = 0; j != num_survivors; ++j) data[j] = data[src[j] - first];
+        }
+      };
+      if (jobs) {
+        jobs->parallel_for(num_float_fields + num_int_fields, move_field);
+      } else {
+        for (unsigned f = 0; f != num_float_fields + num_int_fields; ++f) move_field(f);
+      }
+      num_billboard_particles = first + num_survivors;
+    }
+
   public:
     RESOURCE_META(mesh_particle_system)
 
-    /// Default constructor
+    /// Default constructor. Animators are stored with their billboard particles, so pacap is unused.
     mesh_particle_system(aabb_in size=aabb(vec3(0, 0, 0), vec3(1, 1, 1)), int bbcap=256, int tpcap=256, int pacap=256) {
-      init(size, bbcap, tpcap, pacap);
+      init(size, bbcap, tpcap);
+    }
+
+    /// Use these threads in animate() and update(). The pool is not owned by the particle system.
+    void set_job_pool(job_pool *value) {
+      jobs = value;
     }
 
-    /// Update the vertices for newtonian physics.
+    /// Update the particles for newtonian physics and remove those that have reached their lifetime.
     void animate(float time_step) {
-      for (unsigned i = 0; i != particle_animators.size(); ++i) {
-        particle_animator &g = particle_animators[i];
-        if (g.link >= 0) {
-          billboard_particle &p = billboard_particles[g.link];
-          if (g.age >= g.lifetime) {
-            p.enabled = false;
-            free(billboard_particles, free_billboard_particle, g.link);
-            g.link = -1;
-            free(particle_animators, free_particle_animator, i);
-          } else {
-            p.pos = (vec3)p.pos + (vec3)g.vel * time_step;
-            g.vel = (vec3)g.vel + (vec3)g.acceleration * time_step;
-            p.angle += (uint32_t)(g.spin * time_step);
-            g.age++;
-          }
+      unsigned num = num_billboard_particles;
+      chunk_deaths.resize(get_num_chunks(num));
+      for_each_chunk(num, [&](unsigned c, unsigned begin, unsigned end) {
+        chunk_deaths[c] = integrate(begin, end, time_step);
+      });
+
+      for (unsigned c = 0; c != chunk_deaths.size(); ++c) {
+        if (chunk_deaths[c]) {
+          compact(c);
+          break;
         }
       }
     }
@@ -159,63 +374,50 @@ namespace octet { namespace scene {
 
     /// Generate mesh from particles
     virtual void update() {
-      //unsigned np = billboard_particles.size();
-      //unsigned vsize = billboard_particles.capacity() * sizeof(vertex) * 4;
-      //unsigned isize = billboard_particles.capacity() * sizeof(uint32_t) * 4;
-
+      unsigned num = num_billboard_particles;
       gl_resource::wolock vlock(get_vertices());
       vertex *vtx = (vertex*)vlock.u8();
-      gl_resource::wolock ilock(get_indices());
-      uint32_t *idx = ilock.u32();
-      unsigned num_vertices = 0;
-      unsigned num_indices = 0;
+      for_each_chunk(num, [&](unsigned c, unsigned begin, unsigned end) {
+        expand_billboards(vtx, begin, end);
+      });
 
-      vec3 cx = cameraToWorld.x().xyz();
-      vec3 cy = cameraToWorld.y().xyz();
-      vec3p n = cameraToWorld.z().xyz();
-
-      for (unsigned i = 0; i != billboard_particles.size(); ++i) {
-        billboard_particle &p = billboard_particles[i];
-        if (p.enabled) {
-          vec2 size = p.size;
-          vec3 dx = size.x() * cx;
-          vec3 dy = size.y() * cy;
-          vec2 bl = p.uv_bottom_left;
-          vec2 tr = p.uv_top_right;
-          vec2 tl = vec2(bl.x(), tr.y());
-          vec2 br = vec2(tr.x(), bl.y());
-          vtx->pos = (vec3)p.pos - dx + dy; vtx->normal = n; vtx->uv = tl; vtx++;
-          vtx->pos = (vec3)p.pos + dx + dy; vtx->normal = n; vtx->uv = tr; vtx++;
-          vtx->pos = (vec3)p.pos + dx - dy; vtx->normal = n; vtx->uv = br; vtx++;
-          vtx->pos = (vec3)p.pos - dx - dy; vtx->normal = n; vtx->uv = bl; vtx++;
-          idx[0] = num_vertices; idx[1] = num_vertices+1; idx[2] = num_vertices+2;
-          idx[3] = num_vertices; idx[4] = num_vertices+2; idx[5] = num_vertices+3;
-          idx += 6;
-          num_vertices += 4;
-          num_indices += 6;
-        }
-      }
-
-      set_num_vertices(num_vertices);
-      set_num_indices(num_indices);
+      set_num_vertices(num * 4);
+      set_num_indices(num * 6);
       //dump(log("mesh\n"));
     }
 
-    /// Add a billboard particle. Returns -1 if capacity reached.
+    /// Add a billboard particle. Returns -1 if capacity reached or the particle is not enabled.
     int add_billboard_particle(const billboard_particle &p) {
-      int i = allocate(billboard_particles, free_billboard_particle);
-      if (i != -1) {
-        billboard_particles[i] = p;
+      if (num_billboard_particles == float_fields[pos_x].size() || !p.enabled) {
+        return -1;
       }
+      int i = (int)num_billboard_particles++;
+      set_billboard_particle(i, p);
+      particle_animator pa;
+      memset(&pa, 0, sizeof(pa));
+      pa.link = i;
+      pa.lifetime = max_lifetime;
+      add_particle_animator(pa);
       return i;
     }
 
-    /// Add a particle animator. Returns -1 if capacity reached.
+    /// Add a particle animator to the billboard particle p.link, replacing any previous one.
+    /// Returns -1 if there is no such particle.
     int add_particle_animator(const particle_animator &p) {
-      int i = allocate(particle_animators, free_particle_animator);
-      if (i != -1) {
-        particle_animators[i] = p;
+      int i = p.link;
+      if (i < 0 || i >= (int)num_billboard_particles) {
+        return -1;
       }
+      vec3 vel = p.vel, acc = p.acceleration;
+      float_fields[vel_x][i] = vel.x();
+      float_fields[vel_y][i] = vel.y();
+      float_fields[vel_z][i] = vel.z();
+      float_fields[acc_x][i] = acc.x();
+      float_fields[acc_y][i] = acc.y();
+      float_fields[acc_z][i] = acc.z();
+      int_fields[lifetime][i] = std::min(p.lifetime, (uint32_t)max_lifetime);
+      int_fields[age][i] = std::min(p.age, (uint32_t)max_lifetime);
+      int_fields[spin][i] = p.spin;
       return i;
     }
 
@@ -228,23 +430,65 @@ namespace octet { namespace scene {
       return i;
     }
 
-    billboard_particle &access_billboard_particle(int i) { return billboard_particles[i]; }
+    /// number of live billboard particles.
+    unsigned get_num_billboard_particles() const {
+      return num_billboard_particles;
+    }
+
+    /// Get a copy of a billboard particle.
+    billboard_particle get_billboard_particle(int i) const {
+      billboard_particle p;
+      p.link = -1;
+      p.pos = vec3p(float_fields[pos_x][i], float_fields[pos_y][i], float_fields[pos_z][i]);
+      p.size = vec2p(float_fields[size_x][i], float_fields[size_y][i]);
+      p.uv_bottom_left = vec2p(float_fields[uv_left][i], float_fields[uv_bottom][i]);
+      p.uv_top_right = vec2p(float_fields[uv_right][i], float_fields[uv_top][i]);
+      p.angle = int_fields[angle][i];
+      p.enabled = true;
+      return p;
+    }
+
+    /// Change a billboard particle. Disabling it removes it at the next animate().
+    void set_billboard_particle(int i, const billboard_particle &p) {
+      vec3 pos = p.pos;
+      vec2 size = p.size, bl = p.uv_bottom_left, tr = p.uv_top_right;
+      float_fields[pos_x][i] = pos.x();
+      float_fields[pos_y][i] = pos.y();
+      float_fields[pos_z][i] = pos.z();
+      float_fields[size_x][i] = size.x();
+      float_fields[size_y][i] = size.y();
+      float_fields[uv_left][i] = bl.x();
+      float_fields[uv_bottom][i] = bl.y();
+      float_fields[uv_right][i] = tr.x();
+      float_fields[uv_top][i] = tr.y();
+      int_fields[angle][i] = p.angle;
+      if (!p.enabled) {
+        int_fields[lifetime][i] = 0;
+      }
+    }
+
+    /// Get a copy of the animator of billboard particle i.
+    particle_animator get_particle_animator(int i) const {
+      particle_animator p;
+      p.link = i;
+      p.vel = vec3p(float_fields[vel_x][i], float_fields[vel_y][i], float_fields[vel_z][i]);
+      p.acceleration = vec3p(float_fields[acc_x][i], float_fields[acc_y][i], float_fields[acc_z][i]);
+      p.lifetime = int_fields[lifetime][i];
+      p.age = int_fields[age][i];
+      p.spin = int_fields[spin][i];
+      return p;
+    }
+
     trail_particle &access_trail_particle(int i) { return trail_particles[i]; }
-    particle_animator &access_particle_animator(int i) { return particle_animators[i]; }
 
     /// Serialise
     void visit(visitor &v) {
       mesh::visit(v);
       /*
-      v.visit(billboard_particles);
-      v.visit(free_billboard_particle);
       v.visit(trail_particles);
       v.visit(free_trail_particle);
-      v.visit(particle_animators);
-      v.visit(free_particle_animator);
       v.visit(cameraToWorld);
       */
     }
   };
 }}
-
@@ -29,6 +29,7 @@ namespace octet { namespace scene {
 	    add_attribute(attribute_uv, 2, GL_FLOAT, sizeof(float)*3);
 	    add_attribute(attribute_color, 4, GL_UNSIGNED_BYTE, sizeof(float)*5);
       set_params(sizeof(vertex), 0, 0, GL_TRIANGLES, GL_UNSIGNED_INT);
+      set_streaming(true);
 
       if (text.size()) update();
     }
@@ -57,16 +58,16 @@ namespace octet { namespace scene {
 	      allocate(vsize, isize);
       }
 
-      vertex *vtx = (vertex *)get_vertices()->lock();
-      uint32_t *idx = (uint32_t *)get_indices()->lock();
+      vertex *vtx = (vertex *)get_vertices()->lock_write_only();
+      uint32_t *idx = (uint32_t *)get_indices()->lock_write_only();
 
       unsigned num_quads = font->build_mesh(
         bb, vtx, idx, max_quads,
         text.c_str(), text.c_str() + text.size()
       );
 
-      get_vertices()->unlock();
-      get_indices()->unlock();
+      get_vertices()->unlock_write_only();
+      get_indices()->unlock_write_only();
       set_num_indices(num_quads * 6);
       set_num_vertices(num_quads * 4);
     }
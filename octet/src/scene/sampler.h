@@ -74,6 +74,7 @@ namespace octet { namespace scene {
     unsigned get_sampler_type() {
       switch (gl_target) {
         case GL_TEXTURE_3D: return GL_SAMPLER_3D;
+        case GL_TEXTURE_2D_ARRAY: return GL_SAMPLER_2D_ARRAY;
         case GL_TEXTURE_CUBE_MAP: return GL_SAMPLER_CUBE;
         default: return GL_SAMPLER_2D;
       }
@@ -82,14 +83,22 @@ namespace octet { namespace scene {
     const char *get_glsl_type() {
       switch (gl_target) {
         case GL_TEXTURE_3D: return "sampler3D";
+        case GL_TEXTURE_2D_ARRAY: return "sampler2DArray";
         case GL_TEXTURE_CUBE_MAP: return "samplerCube";
         default: return "sampler2D";
       }
     }
 
+    // sampler2DArray and texture2DArray are not in GLSL 1.10 or GLSL ES 1.00;
+    // shaders that use them must start with this line.
+    const char *get_glsl_extension() {
+      return gl_target == GL_TEXTURE_2D_ARRAY ? "#extension GL_EXT_texture_array : enable\n" : "";
+    }
+
     const char *get_glsl_texture_fetch() {
       switch (gl_target) {
         case GL_TEXTURE_3D: return "texture3D";
+        case GL_TEXTURE_2D_ARRAY: return "texture2DArray";
         case GL_TEXTURE_CUBE_MAP: return "textureCube";
         default: return "texture2D";
       }
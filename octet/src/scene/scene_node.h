@@ -27,6 +27,54 @@ namespace octet { namespace scene {
     // is this node and all its children renderable?
     bool enabled;
 
+    // cached nodeToParent * parent's modelToWorld and enabled state of the chain.
+    // dirty nodes always have dirty children, so clean nodes can trust their parent.
+    mat4t modelToWorld;
+    bool world_enabled;
+    bool world_dirty;
+
+    // changes when any node is added to a parent. Used to rebuild flat node lists.
+    static unsigned &hierarchy_version() {
+      static unsigned version;
+      return version;
+    }
+
+    // changes when any clean node becomes dirty. Animations may move nodes on worker threads.
+    static std::atomic<unsigned> &move_version() {
+      static std::atomic<unsigned> version;
+      return version;
+    }
+
+    // mark this node and its children out of date.
+    void set_dirty() {
+      if (world_dirty) return;
+      world_dirty = true;
+      move_version().fetch_add(1, std::memory_order_relaxed);
+      for (unsigned i = 0; i != children.size(); ++i) {
+        children[i]->set_dirty();
+      }
+    }
+
+    // recalculate the world matrix from a clean parent.
+    void update_world(scene_node *p) {
+      if (p) {
+        modelToWorld = nodeToParent * p->modelToWorld;
+        world_enabled = enabled && p->world_enabled;
+      } else {
+        modelToWorld = nodeToParent;
+        world_enabled = enabled;
+      }
+      world_dirty = false;
+    }
+
+    // make sure the cached world matrix is up to date.
+    void update_world() {
+      if (world_dirty) {
+        if (parent) parent->update_world();
+        update_world(parent);
+      }
+    }
+
   public:
     RESOURCE_META(scene_node)
 
@@ -35,6 +83,7 @@ namespace octet { namespace scene {
       nodeToParent.loadIdentity();
       sid = atom_;
       enabled = true;
+      world_dirty = true;
       if (parent) {
         parent->add_child(this);
       }
@@ -45,6 +94,7 @@ namespace octet { namespace scene {
       this->nodeToParent = nodeToParent;
       this->sid = sid;
       enabled = true;
+      world_dirty = true;
     }
 
     /// the virtual add_ref on animation_target gets passed to here and we pass iton (delegate it) to the resource
@@ -61,6 +111,7 @@ namespace octet { namespace scene {
     void set_value(atom_t sid, atom_t sub_target, atom_t component, float *value) {
       if (sub_target == atom_transform) {
         nodeToParent.init_transpose(value);
+        set_dirty();
       }
     }
 
@@ -73,6 +124,8 @@ namespace octet { namespace scene {
       //log("visit scene_node nodeToParent\n");
       v.visit(nodeToParent, atom_nodeToParent);
       v.visit(sid, atom_sid);
+      world_dirty = true;
+      hierarchy_version()++;
     }
 
 
@@ -80,6 +133,9 @@ namespace octet { namespace scene {
     void add_child(scene_node *new_node) {
       new_node->parent = this;
       children.push_back(new_node);
+      new_node->world_dirty = false;
+      new_node->set_dirty();
+      hierarchy_version()++;
     }
 
     /// Get the parent node of this node.
@@ -97,21 +153,45 @@ namespace octet { namespace scene {
       return children[index];
     }
 
-    // compute the scene_node to world matrix for an individual scene_node;
-    mat4t calcModelToWorld() {
-      mat4t result = nodeToParent;
-      for (scene_node *p = parent; p != NULL; p = p->parent) {
-        result = result * p->nodeToParent;
-      }
-      return result;
+    /// get the scene_node to world matrix for an individual scene_node.
+    /// This is cached and only recalculated if this node or a parent has moved.
+    const mat4t &calcModelToWorld() {
+      update_world();
+      return modelToWorld;
     }
 
-    // calculate whether this node is enabled (recursively)
+    /// calculate whether this node and all its parents are enabled (cached like calcModelToWorld)
     bool calcEnabled() {
-      for (scene_node *p = this; p != NULL; p = p->parent) {
-        if (!p->enabled) return false;
+      update_world();
+      return world_enabled;
+    }
+
+    /// Update the cached world matrices of a list of nodes in one pass.
+    /// parents[i] is the index of the parent of nodes[i] in the list (or -1) and must be less than i,
+    /// as made by get_all_child_nodes(). Only nodes that have moved are recalculated.
+    static void update_world_matrices(scene_node *const *nodes, const int *parents, unsigned num_nodes) {
+      for (unsigned i = 0; i != num_nodes; ++i) {
+        scene_node *node = nodes[i];
+        if (node->world_dirty) {
+          if (parents[i] >= 0) {
+            node->update_world(nodes[parents[i]]);
+          } else {
+            node->update_world();
+          }
+        }
       }
-      return true;
+    }
+
+    /// Get a number that changes whenever a node is added to a parent.
+    /// Use this to see if a list from get_all_child_nodes() is out of date.
+    static unsigned get_hierarchy_version() {
+      return hierarchy_version();
+    }
+
+    /// Get a number that changes whenever a node moves (or is enabled or disabled) after its world
+    /// matrix was last calculated. If this has not changed, no cached world matrix is out of date.
+    static unsigned get_move_version() {
+      return move_version().load(std::memory_order_relaxed);
     }
 
     /// transform a point from model space to world space
@@ -134,7 +214,10 @@ namespace octet { namespace scene {
     }
 
     /// access the node to parent transform matrix for writing.
+    /// Note: this marks the world matrices as out of date, so write the matrix before
+    /// calling calcModelToWorld() again.
     mat4t &access_nodeToParent() {
+      set_dirty();
       return nodeToParent;
     }
 
@@ -166,26 +249,31 @@ namespace octet { namespace scene {
     /// set enabled state
     void set_enabled(bool value) {
       enabled = value;
+      set_dirty();
     }
 
     /// reset the matrix
     void loadIdentity() {
       nodeToParent.loadIdentity();
+      set_dirty();
     }
 
     /// Translate the matrix
     void translate(vec3_in xyz) {
       nodeToParent.translate(xyz[0], xyz[1], xyz[2]);
+      set_dirty();
     }
 
     /// Rotate the matrix
     void rotate(float angle, vec3_in axis) {
       nodeToParent.rotate(angle, axis[0], axis[1], axis[2]);
+      set_dirty();
     }
 
     /// Scale the matrix
     void scale(vec3_in xyz) {
       nodeToParent.scale(xyz[0], xyz[1], xyz[2]);
+      set_dirty();
     }
 
     /// Get the identifying sid
@@ -193,6 +281,16 @@ namespace octet { namespace scene {
       return sid;
     }
 
+    /// Find this node or the first node below it with an sid.
+    scene_node *find_sid(atom_t value) {
+      if (sid == value) return this;
+      for (unsigned i = 0; i != children.size(); ++i) {
+        scene_node *result = children[i]->find_sid(value);
+        if (result) return result;
+      }
+      return NULL;
+    }
+
     /// recursively fetch all child nodes
     void get_all_child_nodes(dynarray<scene_node*> &nodes, dynarray<int> &parents) {
       dynarray<scene_node*> stack;
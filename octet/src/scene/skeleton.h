@@ -20,6 +20,53 @@ namespace octet { namespace scene {
     // cached skin components
     dynarray<mat4t> result;  /// uniforms to shader
     dynarray<int> indices;   /// map skeleton to skin indices
+    ref<skin> bound_skin;    // the skin that indices are for
+
+    // dest = a * b for an affine a (last column 0, 0, 0, 1), which node and skin matrices are.
+    // This is 12 multiply-adds a row instead of 16. dest must not be a or b.
+    static void mul_affine(mat4t &dest, const mat4t &a, const mat4t &b) {
+      const float *pa = a.get();
+      const float *pb = b.get();
+      float *pd = dest.get();
+      #if OCTET_SSE2
+        __m128 b0 = _mm_loadu_ps(pb), b1 = _mm_loadu_ps(pb + 4), b2 = _mm_loadu_ps(pb + 8), b3 = _mm_loadu_ps(pb + 12);
+        __m128 a0 = _mm_loadu_ps(pa), a1 = _mm_loadu_ps(pa + 4), a2 = _mm_loadu_ps(pa + 8), a3 = _mm_loadu_ps(pa + 12);
+        #define OCTET_AFFINE_ROW(a) _mm_add_ps( \
+          _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, 0x00), b0), _mm_mul_ps(_mm_shuffle_ps(a, a, 0x55), b1)), \
+          _mm_mul_ps(_mm_shuffle_ps(a, a, 0xaa), b2) \
+        )
+        _mm_storeu_ps(pd, OCTET_AFFINE_ROW(a0));
+        _mm_storeu_ps(pd + 4, OCTET_AFFINE_ROW(a1));
+        _mm_storeu_ps(pd + 8, OCTET_AFFINE_ROW(a2));
+        _mm_storeu_ps(pd + 12, _mm_add_ps(OCTET_AFFINE_ROW(a3), b3));
+        #undef OCTET_AFFINE_ROW
+      #else
+        float tmp[16];
+        for (int i = 0; i != 4; ++i) {
+          for (int j = 0; j != 4; ++j) {
+            tmp[i*4+j] = pa[i*4+0] * pb[j] + pa[i*4+1] * pb[4+j] + pa[i*4+2] * pb[8+j] + (i == 3 ? pb[12+j] : 0);
+          }
+        }
+        memcpy(pd, tmp, sizeof(tmp));
+      #endif
+    }
+
+    // map the skin's joints to our bones once, not every frame.
+    void bind_skin(skin *skn) {
+      hash_map<int, int> bone_of_sid;
+      for (unsigned i = 0; i != joints.size(); ++i) {
+        int &bone = bone_of_sid[(int)joints[i]];
+        if (!bone) bone = i + 1;
+      }
+
+      unsigned num_joints = skn->get_num_joints();
+      result.resize(num_joints);
+      indices.resize(num_joints);
+      for (unsigned i = 0; i != num_joints; ++i) {
+        indices[i] = bone_of_sid[(int)skn->get_joint(i)] - 1;
+      }
+      bound_skin = skn;
+    }
   public:
     RESOURCE_META(skeleton)
 
@@ -56,52 +103,38 @@ namespace octet { namespace scene {
       return -1;
     }
 
+    /// Calculate the matrix of each joint of a skin: from the model to the skin's bind space,
+    /// to the bone, up the skeleton and through worldToCamera.
+    /// Bones read their scene nodes directly; the skin's matrices are premultiplied,
+    /// so each bone and joint costs one affine multiply.
     mat4t *calc_transforms(const mat4t &worldToCamera, skin *skn) {
-      //static bool first_frame = true;
-      if (boneToNode.size() < nodeToParents.size()) {
-        boneToNode.resize(nodeToParents.size());
-      }
-
-      // todo: optionally drive animation directly to the skeleton.
-      for (int i = 0; i != nodes.size(); ++i) {
-        nodeToParents[i] = nodes[i]->access_nodeToParent();
-      }
+      unsigned num_bones = nodeToParents.size();
+      boneToNode.resize(num_bones);
 
-      // compute matrix heirachy
-      for (int i = 0; i != nodeToParents.size(); ++i) {
+      // compute matrix heirachy. Parents come before their children.
+      for (unsigned i = 0; i != num_bones; ++i) {
+        const mat4t &nodeToParent = i < nodes.size() && nodes[i] ? nodes[i]->get_nodeToParent() : nodeToParents[i];
         int parent = parents[i];
         // skeleton -> parent -> parent -> world -> camera
-        if (parent == -1) {
-          boneToNode[i] = nodeToParents[i] * worldToCamera;
-        } else {
-          boneToNode[i] = nodeToParents[i] * boneToNode[parent];
-        }
-        //log("%d %s p=%d\n", i, result[i].toString(), parent);
+        mul_affine(boneToNode[i], nodeToParent, parent == -1 ? worldToCamera : boneToNode[parent]);
       }
 
-      unsigned num_joints = skn->get_num_joints();
-      if (result.size() < num_joints) {
-        result.resize(num_joints);
-        indices.resize(num_joints);
-        for (int i = 0; i != num_joints; ++i) {
-          // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
-          indices[i] = find_joint(skn->get_joint(i));
-        }
+      if (skn != bound_skin || result.size() != skn->get_num_joints()) {
+        bind_skin(skn);
       }
 
       // premultiply by skin matrices
-      for (int i = 0; i != num_joints; ++i) {
+      for (unsigned i = 0; i != result.size(); ++i) {
         // skin -> bind space -> skeleton -> parent -> parent -> world -> camera
         int index = indices[i];
         if (index != -1) {
-          result[i] = skn->get_modelToBind() * skn->get_bindToModel(i) * boneToNode[index];
+          mul_affine(result[i], skn->get_modelToJoint(i), boneToNode[index]);
         } else {
           result[i] = worldToCamera;
         }
-        //if (first_frame) log("%d %d [%s]\n", i, index, result[i].toString());
       }
 
-      return &result[0];
+      return result.data();
     }
 
     // convert an sid into an index. (should be cached!)
@@ -18,6 +18,16 @@ namespace octet { namespace scene {
     // a name for each joint (sid)
     dynarray<atom_t> joints;
 
+    // modelToBind * bindToModel[i], which is the same every frame.
+    dynarray<mat4t> modelToJoint;
+
+    void calc_modelToJoint() {
+      modelToJoint.resize(bindToModel.size());
+      for (unsigned i = 0; i != bindToModel.size(); ++i) {
+        modelToJoint[i] = modelToBind * bindToModel[i];
+      }
+    }
+
   public:
     RESOURCE_META(skin)
 
@@ -32,11 +42,13 @@ namespace octet { namespace scene {
       v.visit(modelToBind, atom_modelToBind);
       v.visit(bindToModel, atom_bindToModel);
       v.visit(joints, atom_joints);
+      calc_modelToJoint();
     }
 
     void add_joint(const mat4t &bindToModel, atom_t sid) {
       this->bindToModel.push_back(bindToModel);
       joints.push_back(sid);
+      modelToJoint.push_back(modelToBind * bindToModel);
       log("skin: add_joint %d\n", sid);
     }
 
@@ -51,6 +63,9 @@ namespace octet { namespace scene {
 
     const mat4t &get_bindToModel(int i) const { return bindToModel[i]; }
     const mat4t &get_modelToBind() const { return modelToBind; }
+
+    /// modelToBind * bindToModel(i), premultiplied.
+    const mat4t &get_modelToJoint(int i) const { return modelToJoint[i]; }
     atom_t get_joint(int i) const { return joints[i]; }
     unsigned get_num_joints() const { return joints.size(); }
   };
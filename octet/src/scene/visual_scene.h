@@ -21,6 +21,18 @@ namespace octet { namespace scene {
     /// animations playing at the moment
     dynarray<ref<animation_instance> > animation_instances;
 
+    /// animation instances that update in parallel this frame, grouped by the top node they write to.
+    struct parallel_animation {
+      scene_node *top;
+      animation_instance *inst;
+    };
+    dynarray<parallel_animation> parallel_animations;
+    dynarray<scene_node*> parallel_targets;
+    dynarray<unsigned> parallel_groups;
+
+    /// threads for the animations and CPU skinning. NULL to use this thread.
+    job_pool *jobs;
+
     /// cameras available
     dynarray<ref<camera_instance> > camera_instances;
 
@@ -47,6 +59,67 @@ namespace octet { namespace scene {
     ref<bump_shader> object_shader;
     ref<bump_shader> skin_shader;
 
+    /// top level BVH of mesh instance world bounding boxes for ray casts.
+    /// rebuilt on the first cast after update() and refitted on later casts only if nodes have moved.
+    /// call update() after giving a mesh instance a new mesh or node.
+    bvh instance_bvh;
+    dynarray<mesh_instance*> bvh_instances;
+    dynarray<aabb> bvh_bounds;
+    dynarray<mat4t> bvh_worldToModel;
+    bool instance_bvh_dirty;
+    unsigned bvh_move_version;
+
+    /// all the nodes in the scene with parents before children, for updating world matrices.
+    dynarray<scene_node*> transform_nodes;
+    dynarray<int> transform_parents;
+    unsigned transform_version;
+
+    /// render queue: the visible mesh instances sorted by draw_key().
+    /// num_instances > 1 starts a batch drawn with hardware instancing.
+    struct draw_item {
+      uint64_t key;
+      mesh_instance *mi;
+      unsigned first_instance;
+      unsigned num_instances;
+
+      bool operator<(const draw_item &rhs) const {
+        return key < rhs.key;
+      }
+    };
+    dynarray<draw_item> draw_queue;
+
+    /// world bounds of the enabled mesh instances for frustum culling.
+    dynarray<mesh_instance*> cull_instances;
+    dynarray<aabb> cull_bounds;
+    dynarray<uint8_t> cull_visible;
+
+    bool sort_draws;
+
+    /// per-frame modelToWorld matrices for instanced drawing.
+    enum { min_instance_batch = 4 };
+    dynarray<mat4t> instance_matrices;
+    ref<gl_resource> instance_buffer;
+    bool use_instancing;
+
+  public:
+    /// Counters for the last render.
+    struct render_stats {
+      unsigned num_instances;         /// enabled mesh instances
+      unsigned num_culled;            /// outside the view frustum or the LOD distances
+      unsigned num_drawn;             /// draw calls
+      unsigned num_instanced;         /// mesh instances drawn with hardware instancing
+      unsigned num_shader_changes;    /// glUseProgram calls
+      unsigned num_material_changes;  /// materials bound (uniforms and textures)
+      unsigned num_mesh_changes;      /// enable_attributes calls
+
+      render_stats() {
+        memset(this, 0, sizeof(*this));
+      }
+    };
+
+  private:
+    render_stats stats;
+
     #ifdef OCTET_BULLET
       btDefaultCollisionConfiguration config;       /// setup for the world
       btCollisionDispatcher *dispatcher;            /// handler for collisions between objects
@@ -58,6 +131,52 @@ namespace octet { namespace scene {
       typedef void collison_shape_t;
     #endif
 
+    // get the world bounds of the mesh instances and rebuild or refit the BVH.
+    void update_instance_bvh() {
+      if (!instance_bvh_dirty && bvh_move_version == scene_node::get_move_version()) {
+        return;
+      }
+
+      unsigned num = 0;
+      bool changed = instance_bvh_dirty;
+      for (unsigned i = 0; i != mesh_instances.size(); ++i) {
+        mesh_instance *mi = mesh_instances[i];
+        if (mi && mi->get_node() && mi->get_mesh()) {
+          if (num == bvh_instances.size()) {
+            bvh_instances.push_back(mi);
+            changed = true;
+          } else if (bvh_instances[num] != mi) {
+            bvh_instances[num] = mi;
+            changed = true;
+          }
+          num++;
+        }
+      }
+      if (num != bvh_instances.size()) {
+        bvh_instances.resize(num);
+        changed = true;
+      }
+
+      bvh_bounds.resize(num);
+      bvh_worldToModel.resize(num);
+      for (unsigned i = 0; i != num; ++i) {
+        mesh_instance *mi = bvh_instances[i];
+        mat4t modelToWorld = mi->get_node()->calcModelToWorld();
+        bvh_bounds[i] = mi->get_mesh()->get_aabb().get_transform(modelToWorld);
+        bvh_worldToModel[i] = modelToWorld.inverse3x4();
+      }
+
+      if (changed) {
+        instance_bvh.build(bvh_bounds.data(), num);
+        instance_bvh_dirty = false;
+      } else {
+        instance_bvh.refit(bvh_bounds.data());
+      }
+
+      // calcModelToWorld() cleaned the instance nodes, so any later move changes the version.
+      bvh_move_version = scene_node::get_move_version();
+    }
+
     void draw_aabb(const aabb &bb) {
       vec3 pos[8];
       vec3 center = bb.get_center();
@@ -181,6 +300,189 @@ namespace octet { namespace scene {
       }
     }
 
+    // sort by program, material, mesh and then front to back.
+    // collisions only affect the order; state changes compare the real pointers.
+    static uint64_t draw_key(GLuint program, const material *mat, const mesh *msh, float depth) {
+      // positive floats sort in the same order as their bits.
+      uint32_t depth_bits = 0;
+      if (depth > 0) {
+        memcpy(&depth_bits, &depth, sizeof(depth_bits));
+      }
+      return
+        (uint64_t)(program & 0xffff) << 48 |
+        (uint64_t)(((uintptr_t)mat >> 4) & 0xffff) << 32 |
+        (uint64_t)(((uintptr_t)msh >> 4) & 0xffff) << 16 |
+        (uint64_t)(depth_bits >> 16)
+      ;
+    }
+
+    // find the visible mesh instances and put them in the draw queue.
+    void build_draw_queue(camera_instance &cam) {
+      frame_timer::scope timer(frame_timer::phase_culling);
+      mat4t worldToProjection;
+      mat4t worldToCamera;
+      mat4t worldToWorld;
+      worldToWorld.loadIdentity();
+      cam.get_matrices(worldToProjection, worldToCamera, worldToWorld);
+
+      cull_instances.resize(0);
+      cull_bounds.resize(0);
+      for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
+        mesh_instance *mi = mesh_instances[mesh_index];
+        scene_node *node = mi->get_node();
+        if (
+          !(mi->get_flags() & mesh_instance::flag_enabled) ||
+          !node->calcEnabled() ||
+          !mi->get_mesh()
+        ) continue;
+
+        cull_instances.push_back(mi);
+        cull_bounds.push_back(mi->get_mesh()->get_aabb().get_transform(node->calcModelToWorld()));
+      }
+
+      unsigned num = cull_instances.size();
+      cull_visible.resize(num);
+      frustum view(worldToProjection);
+      view.cull(cull_bounds.data(), num, cull_visible.data());
+
+      stats.num_instances = num;
+      draw_queue.resize(0);
+      for (unsigned i = 0; i != num; ++i) {
+        mesh_instance *mi = cull_instances[i];
+        if (!cull_visible[i]) {
+          stats.num_culled++;
+          continue;
+        }
+
+        // distance of the model origin in front of the camera.
+        vec4 pos = mi->get_node()->calcModelToWorld().w() * worldToCamera;
+        float distance = -pos.z();
+
+        // selecting LOD meshes by distance
+        if (mi->get_flags() & mesh_instance::flag_lod) {
+          if (
+            distance < mi->get_min_draw_distance() ||
+            distance >= mi->get_max_draw_distance()
+          ) {
+            stats.num_culled++;
+            continue;
+          }
+        }
+
+        draw_item item;
+        item.key = sort_draws ? draw_key(mi->get_material()->get_program(), mi->get_material(), mi->get_mesh(), distance) : i;
+        item.mi = mi;
+        draw_queue.push_back(item);
+      }
+
+      if (sort_draws) {
+        std::sort(draw_queue.data(), draw_queue.data() + draw_queue.size());
+      }
+
+      build_instance_batches();
+    }
+
+    // can we draw this with the instanced version of its material's shader?
+    bool can_instance(mesh_instance *mi) const {
+      return
+        !(mi->get_flags() & mesh_instance::flag_selected) &&
+        !(mi->get_skeleton() && mi->get_mesh()->get_skin()) &&
+        mi->get_material()->is_instanced()
+      ;
+    }
+
+    // find runs of draws with the same mesh and material and copy their matrices to the instance buffer.
+    void build_instance_batches() {
+      instance_matrices.resize(0);
+      unsigned num = draw_queue.size();
+      for (unsigned i = 0; i != num; ) {
+        draw_item &first = draw_queue[i];
+        unsigned n = 1;
+        if (use_instancing && can_instance(first.mi)) {
+          while (
+            i + n != num &&
+            draw_queue[i + n].mi->get_mesh() == first.mi->get_mesh() &&
+            draw_queue[i + n].mi->get_material() == first.mi->get_material() &&
+            can_instance(draw_queue[i + n].mi)
+          ) {
+            ++n;
+          }
+        }
+
+        if (n < min_instance_batch) {
+          for (unsigned k = 0; k != n; ++k) {
+            draw_queue[i + k].first_instance = 0;
+            draw_queue[i + k].num_instances = 1;
+          }
+        } else {
+          first.first_instance = instance_matrices.size();
+          first.num_instances = n;
+          for (unsigned k = 0; k != n; ++k) {
+            instance_matrices.push_back(draw_queue[i + k].mi->get_node()->calcModelToWorld());
+          }
+        }
+        i += n;
+      }
+
+      if (instance_matrices.size()) {
+        size_t bytes = instance_matrices.size() * sizeof(mat4t);
+        if (!instance_buffer) {
+          instance_buffer = new gl_resource();
+          instance_buffer->set_streaming(true);
+        }
+        if (instance_buffer->get_size() < bytes) {
+          // grow geometrically so that we rarely reallocate.
+          size_t size = instance_buffer->get_size() ? instance_buffer->get_size() : 256 * sizeof(mat4t);
+          while (size < bytes) size *= 2;
+          instance_buffer->allocate(GL_ARRAY_BUFFER, size, GL_STREAM_DRAW);
+        }
+        instance_buffer->assign(instance_matrices.data(), 0, bytes);
+      }
+    }
+
+    // bind a material unless it is already bound.
+    void use_material(material *mat, material *&cur_mat, GLuint &cur_program) {
+      if (mat != cur_mat) {
+        GLuint program = mat->get_program();
+        bool use_program = program != cur_program;
+        mat->bind(light_uniforms, num_light_uniforms, num_lights, use_program);
+        stats.num_shader_changes += use_program;
+        stats.num_material_changes++;
+        cur_program = program;
+        cur_mat = mat;
+      }
+    }
+
+    // enable a mesh's attributes unless they are already enabled.
+    void use_mesh(mesh *msh, mesh *&cur_mesh) {
+      if (msh != cur_mesh) {
+        if (cur_mesh) cur_mesh->disable_attributes();
+        msh->enable_attributes();
+        stats.num_mesh_changes++;
+        cur_mesh = msh;
+      }
+    }
+
+    // draw a batch with one call using the matrices in the instance buffer.
+    void draw_instances(mesh *msh, unsigned first_instance, unsigned num_instances) {
+      instance_buffer->bind();
+      for (unsigned row = 0; row != 4; ++row) {
+        unsigned attr = attribute_instance_matrix + row;
+        size_t offset = instance_buffer->get_base_offset() + first_instance * sizeof(mat4t) + row * sizeof(vec4);
+        glVertexAttribPointer(attr, 4, GL_FLOAT, GL_FALSE, sizeof(mat4t), (void*)offset);
+        glEnableVertexAttribArray(attr);
+        glVertexAttribDivisor(attr, 1);
+      }
+
+      msh->draw_instanced(num_instances);
+
+      for (unsigned row = 0; row != 4; ++row) {
+        unsigned attr = attribute_instance_matrix + row;
+        glVertexAttribDivisor(attr, 0);
+        glDisableVertexAttribArray(attr);
+      }
+    }
+
     void render_impl(bump_shader &object_shader, bump_shader &skin_shader, camera_instance &cam, float aspect_ratio) {
       mat4t cameraToWorld = cam.get_node()->calcModelToWorld();
 
@@ -194,17 +496,35 @@ namespace octet { namespace scene {
 
       draw_debug_data(cam);
 
-      for (unsigned mesh_index = 0; mesh_index != mesh_instances.size(); ++mesh_index) {
-        mesh_instance *mi = mesh_instances[mesh_index];
+      stats = render_stats();
+      build_draw_queue(cam);
+
+      // instanced shaders take world to camera and world to projection matrices.
+      mat4t worldToProjection = worldToCamera * cameraToProjection;
+
+      // only change the program, material and mesh when we have to.
+      GLuint cur_program = ~(GLuint)0;
+      material *cur_mat = NULL;
+      mesh *cur_mesh = NULL;
+      double submission_start = frame_timer::now();
+
+      for (unsigned draw_index = 0; draw_index != draw_queue.size(); ) {
+        const draw_item &item = draw_queue[draw_index];
+        mesh_instance *mi = item.mi;
+        draw_index += item.num_instances;
+
+        if (item.num_instances > 1) {
+          // hardware instancing: one draw for the whole batch.
+          use_material(mi->get_material(), cur_mat, cur_program);
+          mi->get_material()->set_matrices(worldToProjection, worldToCamera);
+          use_mesh(mi->get_mesh(), cur_mesh);
+          draw_instances(mi->get_mesh(), item.first_instance, item.num_instances);
+          stats.num_drawn++;
+          stats.num_instanced += item.num_instances;
+          continue;
+        }
 
         scene_node *node = mi->get_node();
-        unsigned flags = mi->get_flags();
-
-        if (
-          !(flags & mesh_instance::flag_enabled) ||
-          !node->calcEnabled()
-        ) continue;
-
         mesh *msh = mi->get_mesh();
         skin *skn = msh->get_skin();
         skeleton *skel = mi->get_skeleton();
@@ -214,35 +534,27 @@ namespace octet { namespace scene {
         mat4t modelToCamera;
         mat4t modelToProjection;
         cam.get_matrices(modelToProjection, modelToCamera, modelToWorld);
-        //printf("%d %f\n", mesh_index, modelToWorld.w().y());
-
-        // selecting LOD meshes by distance
-        if (flags & mesh_instance::flag_lod) {
-          float distance = -modelToCamera.w().z();
-          //printf("%f %f %f\n", distance, mi->get_min_draw_distance(), mi->get_max_draw_distance());
-          if (
-            distance < mi->get_min_draw_distance() ||
-            distance >= mi->get_max_draw_distance()
-          ) {
-            continue;
-          }
-        }
 
         if (!skel || !skn) {
           /// normal rendering for single matrix objects
           /// build a projection matrix: model -> world -> camera_instance -> projection
           /// the projection space is the cube -1 <= x/w, y/w, z/w <= 1
-          mat->render(modelToProjection, modelToCamera, light_uniforms, num_light_uniforms, num_lights);
+          use_material(mat, cur_mat, cur_program);
+          mat->set_matrices(modelToProjection, modelToCamera);
         } else {
           /// multi-matrix rendering
+          // there is a matrix for each joint of the skin, which may be fewer than the bones.
           mat4t *transforms = skel->calc_transforms(modelToCamera, skn);
-          int num_bones = skel->get_num_bones();
-          if(num_bones > 192) {
-            GLint mvuv = 0;
-            //glGetIntegerv(GL_MAX_VERTEX_UNIFORM_VECTORS, &mvuv);
-            printf("warning: too many bones (%d/%d)\n", num_bones, mvuv/4);
+          int num_joints = skn->get_num_joints();
+          if (num_joints <= bump_shader::max_skinned_bones) {
+            mat->render_skinned(cameraToProjection, transforms, num_joints, light_uniforms, num_light_uniforms, num_lights);
+          } else if (mesh *skinned = mi->calc_cpu_skin(transforms, num_joints, jobs)) {
+            // too many bones for the shader: the CPU skinned vertices are in camera space.
+            use_material(mat, cur_mat, cur_program);
+            mat->set_matrices(cameraToProjection, mat4t());
+            msh = skinned;
           } else {
-            mat->render_skinned(cameraToProjection, transforms, num_bones, light_uniforms, num_light_uniforms, num_lights);
+            printf("warning: too many joints (%d/%d)\n", num_joints, (int)bump_shader::max_skinned_bones);
           }
         }
 
@@ -250,18 +562,76 @@ namespace octet { namespace scene {
           static bool dumped;
           if (!dumped) { msh->dump_transformed(modelToProjection); dumped = true; }
         }*/
-        msh->enable_attributes();
+        use_mesh(msh, cur_mesh);
         msh->draw();
-        msh->disable_attributes();
+        stats.num_drawn++;
 
         if (mi->get_flags() & mesh_instance::flag_selected) {
-          aabb bb = mi->get_mesh()->get_aabb();
-          bb = bb.get_transform(mi->get_node()->calcModelToWorld());
-          draw_aabb(bb);
+          // draw_aabb changes the vertex attributes.
+          cur_mesh->disable_attributes();
+          cur_mesh = NULL;
+          draw_aabb(mi->get_mesh()->get_aabb().get_transform(modelToWorld));
         }
       }
+
+      if (cur_mesh) {
+        cur_mesh->disable_attributes();
+      }
+      frame_timer::add(frame_timer::phase_submission, frame_timer::now() - submission_start);
       frame_number++;
     }
+
+    // bind on this thread, as binding compiles animations which may be shared.
+    // Instances that only write to the nodes under their own target then update on the job pool.
+    // Targets may be under each other, eg. a character and one of its bones, and writing
+    // a node marks the nodes below it as moved, so each instance is grouped with the instance whose
+    // target is highest above it. Groups update in parallel; the instances of a group in order.
+    void update_animations_in_parallel(float delta_time) {
+      parallel_animations.resize(0);
+      parallel_targets.resize(0);
+      for (int idx = 0; idx != animation_instances.size(); ++idx) {
+        animation_instance *inst = animation_instances[idx];
+        if (inst->prepare()) {
+          parallel_animation pa = { inst->get_target()->get_scene_node(), inst };
+          parallel_animations.push_back(pa);
+          parallel_targets.push_back(pa.top);
+        } else {
+          inst->update_prepared(delta_time);
+        }
+      }
+
+      scene_node **targets = parallel_targets.data();
+      unsigned num_targets = parallel_targets.size();
+      std::sort(targets, targets + num_targets);
+      for (unsigned i = 0; i != parallel_animations.size(); ++i) {
+        parallel_animation &pa = parallel_animations[i];
+        for (scene_node *node = pa.top->get_parent(); node; node = node->get_parent()) {
+          if (std::binary_search(targets, targets + num_targets, node)) {
+            pa.top = node;
+          }
+        }
+      }
+
+      parallel_animation *anims = parallel_animations.data();
+      unsigned num_anims = parallel_animations.size();
+      std::stable_sort(anims, anims + num_anims, [](const parallel_animation &a, const parallel_animation &b) {
+        return a.top < b.top;
+      });
+      parallel_groups.resize(0);
+      for (unsigned i = 0; i != num_anims; ++i) {
+        if (i == 0 || anims[i].top != anims[i-1].top) {
+          parallel_groups.push_back(i);
+        }
+      }
+      parallel_groups.push_back(num_anims);
+
+      const unsigned *groups = parallel_groups.data();
+      jobs->parallel_for(parallel_groups.size() - 1, [anims, groups, delta_time](unsigned g) {
+        for (unsigned i = groups[g]; i != groups[g+1]; ++i) {
+          anims[i].inst->update_prepared(delta_time);
+        }
+      });
+    }
   public:
     RESOURCE_META(visual_scene)
 
@@ -278,6 +648,12 @@ namespace octet { namespace scene {
       assert(is_power_of_two(debug_line_buffer.size()));
       memset(&debug_line_buffer[0], 0, debug_line_buffer.size() * sizeof(debug_line_buffer[0]));
       debug_in_ptr = 0;
+      instance_bvh_dirty = true;
+      bvh_move_version = 0;
+      transform_version = ~0;
+      sort_draws = true;
+      use_instancing = true;
+      jobs = &job_pool::get_shared();
 
       #ifdef OCTET_BULLET
         dispatcher = new btCollisionDispatcher(&config);
@@ -345,6 +721,7 @@ namespace octet { namespace scene {
 
     /// reset the scene.
     void reset() {
+      instance_bvh_dirty = true;
       mesh_instances.reset();
       animation_instances.reset();
       camera_instances.reset();
@@ -443,6 +820,7 @@ namespace octet { namespace scene {
 
     mesh_instance *add_mesh_instance(mesh_instance *inst=0) {
       mesh_instances.push_back(inst);
+      instance_bvh_dirty = true;
       return inst;
     }
 
@@ -529,7 +907,11 @@ namespace octet { namespace scene {
     /// advance all the animation instances
     /// note that we want to update before rendering or doing physics and AI actions.
     void update(float delta_time) {
+      frame_timer::scope timer(frame_timer::phase_update);
+      instance_bvh_dirty = true;
+
       #ifdef OCTET_BULLET
+        double physics_start = frame_timer::now();
         world->stepSimulation(delta_time, 1, delta_time);
         btCollisionObjectArray &array = world->getCollisionObjectArray();
         for (int i = 0; i != array.size(); ++i) {
@@ -541,17 +923,39 @@ namespace octet { namespace scene {
             //printf("%d %f\n", i, mat.w().y());
           }
         }
+        frame_timer::add(frame_timer::phase_physics, frame_timer::now() - physics_start);
       #endif
 
-      for (int idx = 0; idx != animation_instances.size(); ++idx) {
-        animation_instance *inst = animation_instances[idx];
-        inst->update(delta_time);
+      double animation_start = frame_timer::now();
+
+      if (animation_instances.size() < 2 || !jobs || jobs->get_num_threads() == 1) {
+        for (int idx = 0; idx != animation_instances.size(); ++idx) {
+          animation_instance *inst = animation_instances[idx];
+          inst->update(delta_time);
+        }
+      } else {
+        update_animations_in_parallel(delta_time);
       }
 
       for (int idx = 0; idx != mesh_instances.size(); ++idx) {
         mesh_instance *inst = mesh_instances[idx];
         inst->update(delta_time);
       }
+      frame_timer::add(frame_timer::phase_animation, frame_timer::now() - animation_start);
+
+      update_transforms();
+    }
+
+    /// Update the world matrices of all the nodes that have moved in one pass.
+    /// update() calls this, so rendering and ray casts do not have to walk the hierarchy.
+    void update_transforms() {
+      if (transform_version != scene_node::get_hierarchy_version()) {
+        transform_nodes.resize(0);
+        transform_parents.resize(0);
+        get_all_child_nodes(transform_nodes, transform_parents);
+        transform_version = scene_node::get_hierarchy_version();
+      }
+      scene_node::update_world_matrices(transform_nodes.data(), transform_parents.data(), transform_nodes.size());
     }
 
     /// render using specific shaders.
@@ -560,6 +964,23 @@ namespace octet { namespace scene {
       render_impl(object_shader, skin_shader, cam, aspect_ratio);
     }
 
+    /// Sort draws by shader, material and mesh to reduce state changes (default true).
+    /// Turn this off to draw in the order the mesh instances were added, eg. for transparency.
+    void set_sort_draws(bool value) {
+      sort_draws = value;
+    }
+
+    /// Draw runs of mesh instances with the same mesh and material with hardware instancing (default true).
+    /// The material's shader must have a "modelToWorld" attribute, as in shaders/default.vs.
+    void set_instancing(bool value) {
+      use_instancing = value;
+    }
+
+    /// Get the counters from the last render.
+    const render_stats &get_render_stats() const {
+      return stats;
+    }
+
     /// render using default shaders.
     void render(float aspect_ratio) {
       if (camera_instances.size() != 0) {
@@ -574,6 +995,12 @@ namespace octet { namespace scene {
       animation_instances.push_back(inst);
     }
 
+    /// Set the threads that update animation instances and skin meshes on the CPU.
+    /// The default is the shared job pool; NULL does the work on the calling thread.
+    void set_job_pool(job_pool *value) {
+      jobs = value;
+    }
+
     /// play an animation with built-in targets (as in the collada file)
     void play(animation *anim, bool is_looping) {
       animation_instance *inst = new animation_instance(anim, NULL, is_looping);
@@ -613,40 +1040,54 @@ namespace octet { namespace scene {
     }
 
     struct cast_result {
+      /// the mesh instance we hit or NULL
       mesh_instance *mi;
+
+      /// distance along the ray (0 = start, 1 = end)
       rational depth;
+
+      /// triangle and barycentric coordinates in the mesh
+      mesh::ray_hit hit;
     };
 
-    /// brute force & ignorance ray cast.
-    /// return the mesh instance and location of hits.
-    /// todo: build a kd tree for mesh instance bbs & mesh triangles
+    /// Ray cast against all the mesh instances.
+    /// return the nearest mesh instance and location of the hit.
     void cast_ray(cast_result &result, const ray &the_ray) {
-      result.mi = 0;
-      result.depth = rational(0, 0);
+      cast_rays(&result, &the_ray, 1);
+    }
 
-      for (int i = 0; i != mesh_instances.size(); ++i) {
-        mesh_instance *mi = mesh_instances[i];
-        if (mi && mi->get_node()) {
-          mat4t nodeToWorld = mi->get_node()->calcModelToWorld();
-          mesh *mesh = mi->get_mesh();
-          aabb bb = mesh->get_aabb();
-          bb = bb.get_transform(nodeToWorld);
-          if (the_ray.intersects(bb)) {
-            mat4t worldToNode = nodeToWorld.inverse3x4();
-            //ray model_ray = ray(vec3(0, 0, -1), vec3(0, 0, 2)); //the_ray.get_transform(worldToNode);
-            ray model_ray = the_ray.get_transform(worldToNode);
-            int indices[3] = {0};
-            vec4 bary_numer(0, 0, 0, 0);
-            float bary_denom;
-            bool hit = mesh->ray_cast(model_ray, indices, bary_numer, bary_denom);
-            if (hit) {
-              rational depth(bary_numer.w() / bary_denom);
-              result.depth = min(depth, result.depth);
-            }
-            //printf("hit=%d %s %f\n", hit, (bary_numer/bary_denom).toString(tmp, sizeof(tmp)), (float)result.depth);
-          }
+    /// Cast many rays at once; this is much faster than calling cast_ray for each one.
+    /// Returns the number of rays that hit something.
+    unsigned cast_rays(cast_result *results, const ray *rays, unsigned num_rays) {
+      update_instance_bvh();
+
+      unsigned num_hits = 0;
+      for (unsigned r = 0; r != num_rays; ++r) {
+        const ray &the_ray = rays[r];
+        cast_result &result = results[r];
+        result.mi = 0;
+        result.depth = rational(0, 0);
+        result.hit = mesh::ray_hit();
+
+        // the distance along the ray is the same in world and model space.
+        float t = 1;
+        instance_bvh.cast(the_ray.get_start(), the_ray.get_distance(), t, [&](unsigned i, float &t_max) -> bool {
+          ray model_ray = the_ray.get_transform(bvh_worldToModel[i]);
+          mesh::ray_hit hit;
+          hit.t = t_max;
+          if (!bvh_instances[i]->get_mesh()->ray_cast(model_ray, hit)) return false;
+          t_max = hit.t;
+          result.mi = bvh_instances[i];
+          result.hit = hit;
+          return true;
+        });
+
+        if (result.mi) {
+          result.depth = rational(result.hit.t);
+          num_hits++;
         }
       }
+      return num_hits;
     }
 
     /// Debug rendering: add a new line in world space (old ones will be lost)
@@ -32,7 +32,11 @@ namespace octet { namespace shaders {
     }
 
   public:
-    void init(bool is_skinned=false) {
+    /// Size of the matrix array in the skinned shader. Skeletons with more bones are skinned on the CPU.
+    enum { max_skinned_bones = 192 };
+
+    /// is_instanced makes a shader for hardware instancing: see render_instanced().
+    void init(bool is_skinned=false, bool is_instanced=false) {
       // this is the vertex shader for regular geometry
       // it is called for each corner of each triangle
       // it inputs pos and uv from each corner
@@ -62,6 +66,35 @@ namespace octet { namespace shaders {
         }
       );
 
+      // this is the vertex shader for instanced geometry
+      // modelToProjection and modelToCamera are world to projection and world to camera
+      // and each instance has its own modelToWorld matrix from the instance buffer.
+      const char instanced_vertex_shader[] = SHADER_STR(
+        varying vec2 uv_;
+        varying vec3 normal_;
+        varying vec3 tangent_;
+        varying vec3 bitangent_;
+      
+        attribute vec4 pos;
+        attribute vec3 normal;
+        attribute vec3 tangent;
+        attribute vec3 bitangent;
+        attribute vec2 uv;
+        attribute mat4 modelToWorld;
+      
+        uniform mat4 modelToProjection;
+        uniform mat4 modelToCamera;
+      
+        void main() {
+          uv_ = uv;
+          mat4 instanceToCamera = modelToCamera * modelToWorld;
+          normal_ = (instanceToCamera * vec4(normal,0)).xyz;
+          tangent_ = (instanceToCamera * vec4(tangent,0)).xyz;
+          bitangent_ = (instanceToCamera * vec4(bitangent,0)).xyz;
+          gl_Position = modelToProjection * (modelToWorld * pos);
+        }
+      );
+
       // this is the vertex shader for skinned geometry
       // this is the shader for skinned geometry
       // it is not terribly efficient, but does the job.
@@ -159,7 +192,7 @@ namespace octet { namespace shaders {
     
       // use the common shader code to compile and link the shaders
       // the result is a shader program
-      init_uniforms(is_skinned ? skinned_vertex_shader : vertex_shader, fragment_shader);
+      init_uniforms(is_skinned ? skinned_vertex_shader : is_instanced ? instanced_vertex_shader : vertex_shader, fragment_shader);
     }
 
     void render(const mat4t &modelToProjection, const mat4t &modelToCamera, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
@@ -178,6 +211,12 @@ namespace octet { namespace shaders {
       glUniform1iv(samplers_index, 6, samplers);
     }
 
+    /// For shaders made with is_instanced: the matrices apply to all instances.
+    /// Bind an instance buffer of modelToWorld matrices and use glDrawElementsInstanced.
+    void render_instanced(const mat4t &worldToProjection, const mat4t &worldToCamera, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
+      render(worldToProjection, worldToCamera, light_uniforms, num_light_uniforms, num_lights);
+    }
+
     void render_skinned(const mat4t &cameraToProjection, const mat4t *modelToCamera, int num_matrices, const vec4 *light_uniforms, int num_light_uniforms, int num_lights) {
       // tell openGL to use the program
       shader::render();
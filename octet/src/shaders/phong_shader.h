@@ -22,7 +22,8 @@ namespace octet { namespace shaders {
     GLuint light_specular_index;    // index for specular light color
 
   public:
-    void init() {
+    /// is_instanced makes a shader for hardware instancing: see render_instanced().
+    void init(bool is_instanced=false) {
       // this is the vertex shader.
       // it is called for each corner of each triangle
       // it inputs pos and uv from each corner
@@ -46,6 +47,28 @@ namespace octet { namespace shaders {
         }
       );
 
+      // this is the vertex shader for instanced geometry
+      // modelToProjection and modelToCamera are world to projection and world to camera
+      // and each instance has its own modelToWorld matrix from the instance buffer.
+      const char instanced_vertex_shader[] = SHADER_STR(
+        varying vec2 uv_;
+        varying vec3 normal_;
+      
+        attribute vec4 pos;
+        attribute vec3 normal;
+        attribute vec2 uv;
+        attribute mat4 modelToWorld;
+      
+        uniform mat4 modelToProjection;
+        uniform mat4 modelToCamera;
+      
+        void main() {
+          uv_ = uv;
+          normal_ = (modelToCamera * (modelToWorld * vec4(normal,0))).xyz;
+          gl_Position = modelToProjection * (modelToWorld * pos);
+        }
+      );
+
       // this is the fragment shader
       // after the rasterizer breaks the triangle into fragments
       // this is called for every fragment
@@ -77,7 +100,7 @@ namespace octet { namespace shaders {
             specular * light_specular * specular_factor;
         }
       );
-      init_uniforms(vertex_shader, fragment_shader);
+      init_uniforms(is_instanced ? instanced_vertex_shader : vertex_shader, fragment_shader);
     }
 
     void init_uniforms(const char *vertex_shader, const char *fragment_shader) {
@@ -115,6 +138,12 @@ namespace octet { namespace shaders {
       glUniform1iv(samplers_index, num_samplers, samplers);
     }
 
+    /// For shaders made with is_instanced: the matrices apply to all instances.
+    /// Bind an instance buffer of modelToWorld matrices and use glDrawElementsInstanced.
+    void render_instanced(const mat4t &worldToProjection, const mat4t &worldToCamera, const vec4 &light_direction, float shininess, vec4 &light_ambient, vec4 &light_diffuse, vec4 &light_specular, int num_samplers=4) {
+      render(worldToProjection, worldToCamera, light_direction, shininess, light_ambient, light_diffuse, light_specular, num_samplers);
+    }
+
     void render_skinned(const mat4t &cameraToProjection, const mat4t *modelToCamera, int num_matrices, const vec4 &light_direction, float shininess, vec4 &light_ambient, vec4 &light_diffuse, vec4 &light_specular, int num_samplers=4) {
       // tell openGL to use the program
       shader::render();
@@ -13,6 +13,7 @@
 namespace octet { namespace shaders {
   class shader : public resource {
     GLuint program_;
+    bool instanced_;
 
     void link(GLuint vertex_shader, GLuint fragment_shader) {
           // assemble the program for use by glUseProgram
@@ -29,9 +30,11 @@ namespace octet { namespace shaders {
       glBindAttribLocation(program, attribute_blendindices, "blendindices");
       glBindAttribLocation(program, attribute_color, "color");
       glBindAttribLocation(program, attribute_uv, "uv");
+      glBindAttribLocation(program, attribute_instance_matrix, "modelToWorld");
       glLinkProgram(program);
 
       program_ = program;
+      instanced_ = glGetAttribLocation(program, "modelToWorld") >= 0;
       GLsizei length;
       char buf[0x10000];
       glGetProgramInfoLog(program, sizeof(buf), &length, buf);
@@ -44,6 +47,8 @@ namespace octet { namespace shaders {
     }
   public:
     shader() {
+      program_ = 0;
+      instanced_ = false;
     }
 
     GLuint program() { return program_; }
@@ -92,6 +97,19 @@ namespace octet { namespace shaders {
     // use the program we have compiled in init()
     void render() {
       glUseProgram(program_);
+      if (instanced_) {
+        // without an instance buffer, modelToWorld is the identity.
+        glVertexAttrib4f(attribute_instance_matrix + 0, 1, 0, 0, 0);
+        glVertexAttrib4f(attribute_instance_matrix + 1, 0, 1, 0, 0);
+        glVertexAttrib4f(attribute_instance_matrix + 2, 0, 0, 1, 0);
+        glVertexAttrib4f(attribute_instance_matrix + 3, 0, 0, 0, 1);
+      }
+    }
+
+    /// true if the vertex shader has a "modelToWorld" attribute for instanced drawing.
+    /// When drawing instances, set modelToProjection and modelToCamera to worldToProjection and worldToCamera.
+    bool is_instanced() const {
+      return instanced_;
     }
 
     /// get the OpenGL program object.